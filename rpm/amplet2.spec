@@ -108,6 +108,7 @@ rm -rf %{buildroot}
 %config(noreplace) %{_sysconfdir}/rsyslog.d/10-amplet2.conf
 %{_initrddir}/*
 %dir %{_localstatedir}/run/%{name}/
+%dir %{_localstatedir}/spool/%{name}/
 %doc %{_docdir}/amplet2-client/examples/rabbitmq/*
 %{python2_sitelib}/ampsave-*.egg-info
 %{python2_sitelib}/ampsave/*
@@ -137,6 +138,10 @@ chown -R amplet: %{_sysconfdir}/%{name}/
 
 mkdir -p /var/log/amplet2
 
+# results waiting for the broker are spooled here, it must be writable
+mkdir -p %{_localstatedir}/spool/%{name}
+chown amplet: %{_localstatedir}/spool/%{name}
+
 CLIENTDIR=%{_sysconfdir}/%{name}/clients
 if [ `ls -lah ${CLIENTDIR} | grep -c "\.conf$"` -eq 0 ]; then
     cp ${CLIENTDIR}/client.example ${CLIENTDIR}/default.conf
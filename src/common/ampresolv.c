@@ -404,21 +404,22 @@ int amp_resolver_connect(char *path) {
  * is called by test clients.
  */
 int amp_resolve_add_new(int fd, resolve_dest_t *resolve) {
-    struct amp_resolve_query info;
-
-    info.namelen = strlen(resolve->name) + 1;
-    info.count = resolve->count;
-    info.family = resolve->family;
+    uint8_t query[sizeof(struct amp_resolve_query) + MAX_DNS_NAME_LEN];
+    struct amp_resolve_query *info = (struct amp_resolve_query*)query;
+    size_t namelen = strlen(resolve->name) + 1;
 
-    /* send the supporting metadata about name length, family etc */
-    if ( send(fd, &info, sizeof(info), 0) < 0 ) {
-        Log(LOG_WARNING, "Failed to send resolution query info: %s",
-                strerror(errno));
+    if ( namelen > MAX_DNS_NAME_LEN - 1 ) {
+        Log(LOG_WARNING, "Name too long to resolve: %s", resolve->name);
         return -1;
     }
 
-    /* send namelen bytes containing the name to resolve */
-    if ( send(fd, resolve->name, info.namelen, 0) < 0 ) {
+    info->namelen = namelen;
+    info->count = resolve->count;
+    info->family = resolve->family;
+    memcpy(query + sizeof(struct amp_resolve_query), resolve->name, namelen);
+
+    /* send the metadata and the name together, the resolver pipelines them */
+    if ( send(fd, query, sizeof(struct amp_resolve_query) + namelen, 0) < 0 ) {
         Log(LOG_WARNING, "Failed to send resolution query: %s",
                 strerror(errno));
         return -1;
@@ -453,70 +454,86 @@ int amp_resolve_flag_done(int fd) {
 
 /*
  * Get a list of addrinfo structs that is the result of all the queries
- * that were sent to this thread. This will block until all the queries
- * complete or time out.
+ * that were sent to the resolver. This will block until all the queries
+ * complete or time out. The reply is read in as few calls as possible and
+ * then unpacked.
  */
 struct addrinfo *amp_resolve_get_list(int fd) {
     struct addrinfo *addrlist = NULL;
-    struct addrinfo item;
-    char name[MAX_DNS_NAME_LEN];
-    uint8_t more;
-    uint8_t namelen;
+    struct amp_resolve_reply header;
+    uint8_t *buffer = NULL;
+    size_t space = 0, length = 0, offset = 0;
+    ssize_t bytes;
+    int complete = 0;
 
     Log(LOG_DEBUG, "Waiting for address list");
 
     /* everything we read should be the result of a name lookup */
-    while ( 1 ) {
+    while ( !complete ) {
         struct addrinfo *tmp;
-        if ( recv(fd, &item, sizeof(struct addrinfo), 0) <= 0 ) {
-            break;
-        }
 
-        tmp = calloc(1, sizeof(struct addrinfo));
-        tmp->ai_flags = item.ai_flags;
-        tmp->ai_family = item.ai_family;
-        tmp->ai_socktype = item.ai_socktype;
-        tmp->ai_protocol = item.ai_protocol;
-        tmp->ai_addrlen = item.ai_addrlen;
+        /* make sure there is a whole record available, reading more if not */
+        if ( length - offset < sizeof(header) ||
+                length - offset < sizeof(header) +
+                ((struct amp_resolve_reply*)(buffer + offset))->addrlen +
+                ((struct amp_resolve_reply*)(buffer + offset))->namelen ) {
 
-        /* there might not be an address for this name */
-        if ( tmp->ai_addrlen > 0 ) {
-            tmp->ai_addr = calloc(1, tmp->ai_addrlen);
-            if ( recv(fd, tmp->ai_addr, tmp->ai_addrlen, 0) <= 0 ) {
-                free(tmp);
+            if ( space - length < 1024 ) {
+                space = (space == 0) ? 4096 : space * 2;
+                buffer = realloc(buffer, space);
+            }
+
+            if ( (bytes = recv(fd, buffer + length, space - length, 0)) <= 0 ) {
+                if ( bytes < 0 && errno == EINTR ) {
+                    continue;
+                }
                 break;
             }
-        }
 
-        if ( recv(fd, &namelen, sizeof(namelen), 0) <= 0 ) {
-            free(tmp);
-            break;
+            length += bytes;
+            continue;
         }
 
-        assert(namelen > 1);
+        memcpy(&header, buffer + offset, sizeof(header));
+        offset += sizeof(header);
 
-        if ( recv(fd, name, namelen, 0) <= 0 ) {
-            free(tmp);
-            break;
+        /* a record with no family marks the end of the list */
+        if ( header.family == 0 ) {
+            complete = 1;
+            continue;
         }
-        tmp->ai_canonname = strdup(name);
-        assert(tmp->ai_canonname);
 
-        if ( recv(fd, &more, sizeof(more), 0) <= 0 ) {
-            free(tmp->ai_canonname);
-            free(tmp);
-            break;
+        tmp = calloc(1, sizeof(struct addrinfo));
+        tmp->ai_family = header.family;
+
+        /* there might not be an address for this name */
+        if ( header.family == AF_INET && header.addrlen ==
+                sizeof(struct in_addr) ) {
+            tmp->ai_addrlen = sizeof(struct sockaddr_in);
+            tmp->ai_addr = calloc(1, tmp->ai_addrlen);
+            tmp->ai_addr->sa_family = AF_INET;
+            memcpy(&((struct sockaddr_in*)tmp->ai_addr)->sin_addr,
+                    buffer + offset, header.addrlen);
+        } else if ( header.family == AF_INET6 && header.addrlen ==
+                sizeof(struct in6_addr) ) {
+            tmp->ai_addrlen = sizeof(struct sockaddr_in6);
+            tmp->ai_addr = calloc(1, tmp->ai_addrlen);
+            tmp->ai_addr->sa_family = AF_INET6;
+            memcpy(&((struct sockaddr_in6*)tmp->ai_addr)->sin6_addr,
+                    buffer + offset, header.addrlen);
         }
+        offset += header.addrlen;
+
+        tmp->ai_canonname = strndup((char*)buffer + offset, header.namelen);
+        assert(tmp->ai_canonname);
+        offset += header.namelen;
 
         /* add the item to the front of the list once it is complete */
         tmp->ai_next = addrlist;
         addrlist = tmp;
-
-        if ( !more ) {
-            break;
-        }
     }
 
+    free(buffer);
     close(fd); //XXX do this here or at next level up in the test?
 
     return addrlist;
@@ -75,6 +75,16 @@ struct amp_resolve_query {
     uint8_t family;             /* address family to query for or AF_UNSPEC */
 };
 
+/*
+ * Header for each address sent back to the test, followed by addrlen bytes
+ * of raw address and namelen bytes of canonical name (not terminated).
+ */
+struct amp_resolve_reply {
+    uint8_t family;             /* address family, zero marks the end */
+    uint8_t addrlen;            /* length of the address, zero if none */
+    uint8_t namelen;            /* length of the canonical name */
+};
+
 /*
  * XXX may need to rethink this, can it be reconciled with the name table
  * entry? or are they too different?
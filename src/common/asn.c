@@ -48,10 +48,12 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "debug.h"
 #include "asn.h"
 #include "iptrie.h"
+#include "asncache.h"
 
 
 
@@ -99,9 +101,7 @@ void add_parsed_line(struct iptrie *result, char *line,
 
     /* add to the global cache */
     if ( info != NULL ) {
-        pthread_mutex_lock(info->mutex);
-        iptrie_add(info->trie, (struct sockaddr*)&addr, prefix, as);
-        pthread_mutex_unlock(info->mutex);
+        amp_asn_cache_add(info->cache, (struct sockaddr*)&addr, as, time(NULL));
     }
 }
 
@@ -44,15 +44,16 @@
 #include <time.h>
 
 #include "iptrie.h"
+#include "asncache.h"
+#include "asntable.h"
 
 #define WHOIS_UNAVAILABLE -2
 
 /* data block given to each resolving thread */
 struct amp_asn_info {
     int fd;                     /* file descriptor to the test process */
-    struct iptrie *trie;        /* shared ASN data (with the cache) */
-    pthread_mutex_t *mutex;     /* protect the shared cache */
-    time_t *refresh;            /* time the cache should be refreshed */
+    struct amp_asn_cache *cache;/* shared ASN cache */
+    struct amp_asn_table *table;/* local prefix to AS table, may be NULL */
 };
 
 int connect_to_whois_server(void);
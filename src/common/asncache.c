@@ -0,0 +1,353 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "asncache.h"
+#include "debug.h"
+
+
+
+/*
+ * Fill in the cache key for an address, which is the /24 or /64 prefix
+ * that every cached value is stored as. Returns the number of bytes in the
+ * key, or -1 if the address family isn't supported.
+ */
+static int get_cache_key(struct sockaddr *address, uint8_t *key) {
+    memset(key, 0, 8);
+
+    switch ( address->sa_family ) {
+        case AF_INET:
+            memcpy(key, &((struct sockaddr_in*)address)->sin_addr, 3);
+            return 3;
+        case AF_INET6:
+            memcpy(key, &((struct sockaddr_in6*)address)->sin6_addr, 8);
+            return 8;
+        default:
+            return -1;
+    };
+}
+
+
+
+/*
+ * FNV-1a hash of the address family and key, used to pick both the shard
+ * and the bucket within the shard.
+ */
+static uint32_t hash_cache_key(uint16_t family, uint8_t *key) {
+    uint32_t hash = 2166136261u;
+    int i;
+
+    hash = (hash ^ family) * 16777619u;
+
+    for ( i = 0; i < 8; i++ ) {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+
+
+/*
+ * Find the entry for a key within a bucket. The shard lock must be held.
+ */
+static struct amp_asn_cache_entry *find_cache_entry(
+        struct amp_asn_cache_entry *entry, uint16_t family, uint8_t *key) {
+
+    for ( ; entry != NULL; entry = entry->next ) {
+        if ( entry->family == family && memcmp(entry->key, key, 8) == 0 ) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Remove and free all the expired entries in a single bucket. The shard
+ * write lock must be held.
+ */
+static int expire_cache_bucket(struct amp_asn_cache_shard *shard,
+        uint32_t bucket, time_t now) {
+
+    struct amp_asn_cache_entry **entry = &shard->buckets[bucket];
+    struct amp_asn_cache_entry *tmp;
+    int count = 0;
+
+    while ( *entry != NULL ) {
+        if ( (*entry)->expires <= now ) {
+            tmp = *entry;
+            *entry = tmp->next;
+            free(tmp);
+            shard->count--;
+            count++;
+        } else {
+            entry = &(*entry)->next;
+        }
+    }
+
+    return count;
+}
+
+
+
+/*
+ * Create a new, empty ASN cache.
+ */
+struct amp_asn_cache *amp_asn_cache_new(void) {
+    struct amp_asn_cache *cache;
+    int i;
+
+    if ( posix_memalign((void**)&cache, 64,
+                sizeof(struct amp_asn_cache)) != 0 ) {
+        Log(LOG_WARNING, "Failed to allocate memory for ASN cache");
+        return NULL;
+    }
+
+    memset(cache, 0, sizeof(struct amp_asn_cache));
+
+    for ( i = 0; i < ASN_CACHE_SHARDS; i++ ) {
+        pthread_rwlock_init(&cache->shards[i].lock, NULL);
+    }
+
+    return cache;
+}
+
+
+
+/*
+ * Free an ASN cache and all the entries in it.
+ */
+void amp_asn_cache_free(struct amp_asn_cache *cache) {
+    struct amp_asn_cache_entry *entry, *tmp;
+    int i, j;
+
+    if ( cache == NULL ) {
+        return;
+    }
+
+    for ( i = 0; i < ASN_CACHE_SHARDS; i++ ) {
+        pthread_rwlock_wrlock(&cache->shards[i].lock);
+        for ( j = 0; j < ASN_CACHE_BUCKETS; j++ ) {
+            for ( entry = cache->shards[i].buckets[j]; entry != NULL; ) {
+                tmp = entry;
+                entry = entry->next;
+                free(tmp);
+            }
+        }
+        pthread_rwlock_unlock(&cache->shards[i].lock);
+        pthread_rwlock_destroy(&cache->shards[i].lock);
+    }
+
+    free(cache);
+}
+
+
+
+/*
+ * Look up the ASN for an address. Returns 0 and fills in the AS number if it
+ * is cached, or -1 if it isn't (or has expired). If the entry is close to
+ * expiring then refresh is set to true for exactly one caller, which should
+ * look up the address again and add the new value to the cache.
+ */
+int amp_asn_cache_lookup(struct amp_asn_cache *cache,
+        struct sockaddr *address, time_t now, int64_t *as, int *refresh) {
+
+    struct amp_asn_cache_shard *shard;
+    struct amp_asn_cache_entry *entry;
+    uint8_t key[8];
+    uint32_t hash;
+    int result = -1;
+
+    assert(cache);
+    assert(as);
+
+    if ( refresh ) {
+        *refresh = 0;
+    }
+
+    if ( address == NULL || get_cache_key(address, key) < 0 ) {
+        return -1;
+    }
+
+    hash = hash_cache_key(address->sa_family, key);
+    shard = &cache->shards[hash % ASN_CACHE_SHARDS];
+
+    pthread_rwlock_rdlock(&shard->lock);
+
+    entry = find_cache_entry(
+            shard->buckets[(hash / ASN_CACHE_SHARDS) % ASN_CACHE_BUCKETS],
+            address->sa_family, key);
+
+    if ( entry != NULL && entry->expires > now ) {
+        *as = entry->as;
+        result = 0;
+
+        /*
+         * Popular entries get refreshed before they expire. Only one caller
+         * should do the refresh, so claim it with an atomic swap as other
+         * readers can be here at the same time.
+         */
+        if ( refresh && entry->expires - now <= ASN_CACHE_REFRESH_AHEAD ) {
+            time_t started = __atomic_load_n(&entry->refreshing,
+                    __ATOMIC_RELAXED);
+
+            if ( now - started > ASN_CACHE_REFRESH_RETRY &&
+                    __atomic_compare_exchange_n(&entry->refreshing, &started,
+                        now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+                *refresh = 1;
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    return result;
+}
+
+
+
+/*
+ * Add or update the ASN for an address, it will be valid for the next day
+ * (plus some jitter so entries expire gradually). Also remove any expired
+ * entries that share the bucket while we hold the write lock.
+ */
+void amp_asn_cache_add(struct amp_asn_cache *cache, struct sockaddr *address,
+        int64_t as, time_t now) {
+
+    struct amp_asn_cache_shard *shard;
+    struct amp_asn_cache_entry *entry;
+    uint8_t key[8];
+    uint32_t hash, bucket;
+    time_t expires;
+
+    assert(cache);
+
+    if ( address == NULL || get_cache_key(address, key) < 0 ) {
+        return;
+    }
+
+    hash = hash_cache_key(address->sa_family, key);
+    shard = &cache->shards[hash % ASN_CACHE_SHARDS];
+    bucket = (hash / ASN_CACHE_SHARDS) % ASN_CACHE_BUCKETS;
+    expires = now + ASN_CACHE_TTL + (rand() % ASN_CACHE_TTL_JITTER);
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    expire_cache_bucket(shard, bucket, now);
+
+    if ( (entry = find_cache_entry(shard->buckets[bucket],
+                    address->sa_family, key)) == NULL ) {
+        if ( (entry = calloc(1, sizeof(struct amp_asn_cache_entry))) == NULL ) {
+            Log(LOG_WARNING, "Failed to allocate ASN cache entry");
+            pthread_rwlock_unlock(&shard->lock);
+            return;
+        }
+        entry->family = address->sa_family;
+        memcpy(entry->key, key, 8);
+        entry->next = shard->buckets[bucket];
+        shard->buckets[bucket] = entry;
+        shard->count++;
+    }
+
+    entry->as = as;
+    entry->expires = expires;
+    entry->refreshing = 0;
+
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+
+
+/*
+ * Remove expired entries from the next shard in turn, so the whole cache is
+ * gradually tidied without ever stopping all lookups at once. Returns the
+ * number of entries that were removed.
+ */
+int amp_asn_cache_expire(struct amp_asn_cache *cache, time_t now) {
+    struct amp_asn_cache_shard *shard;
+    uint32_t i;
+    int count = 0;
+
+    assert(cache);
+
+    shard = &cache->shards[__atomic_fetch_add(&cache->sweep, 1,
+            __ATOMIC_RELAXED) % ASN_CACHE_SHARDS];
+
+    pthread_rwlock_wrlock(&shard->lock);
+    for ( i = 0; i < ASN_CACHE_BUCKETS; i++ ) {
+        count += expire_cache_bucket(shard, i, now);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    if ( count > 0 ) {
+        Log(LOG_DEBUG, "Expired %d entries from ASN cache", count);
+    }
+
+    return count;
+}
+
+
+
+/*
+ * Count the number of entries in the cache, including any that have expired
+ * but not yet been removed.
+ */
+uint32_t amp_asn_cache_count(struct amp_asn_cache *cache) {
+    uint32_t count = 0;
+    int i;
+
+    assert(cache);
+
+    for ( i = 0; i < ASN_CACHE_SHARDS; i++ ) {
+        pthread_rwlock_rdlock(&cache->shards[i].lock);
+        count += cache->shards[i].count;
+        pthread_rwlock_unlock(&cache->shards[i].lock);
+    }
+
+    return count;
+}
@@ -0,0 +1,105 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COMMON_ASNCACHE_H
+#define _COMMON_ASNCACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+/*
+ * The cache is split into shards, each with their own lock, so that many
+ * concurrent lookups (one thread per traceroute test) rarely contend. Lookups
+ * only take a shared read lock.
+ */
+#define ASN_CACHE_SHARDS 64
+#define ASN_CACHE_BUCKETS 256
+
+/*
+ * Each entry lives for a day plus up to an hour, so entries added at the
+ * same time don't all expire at the same time.
+ */
+#define ASN_CACHE_TTL 86400
+#define ASN_CACHE_TTL_JITTER 3600
+
+/*
+ * Entries that are used during the last two hours of their life are still
+ * answered from the cache, then refreshed from the whois server once the
+ * test has its results, so popular prefixes never drop out of the cache.
+ */
+#define ASN_CACHE_REFRESH_AHEAD 7200
+
+/* if a refresh hasn't completed in this time, let someone else try */
+#define ASN_CACHE_REFRESH_RETRY 300
+
+/*
+ * All cached values are /24s or /64s, so the key is the first 3 or 8 bytes
+ * of the address.
+ */
+struct amp_asn_cache_entry {
+    uint16_t family;
+    uint8_t key[8];
+    int64_t as;
+    time_t expires;
+    time_t refreshing;          /* time a refresh started, 0 if none */
+    struct amp_asn_cache_entry *next;
+};
+
+struct amp_asn_cache_shard {
+    pthread_rwlock_t lock;
+    uint32_t count;
+    struct amp_asn_cache_entry *buckets[ASN_CACHE_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct amp_asn_cache {
+    struct amp_asn_cache_shard shards[ASN_CACHE_SHARDS];
+    uint32_t sweep;             /* next shard to check for expired entries */
+};
+
+struct amp_asn_cache *amp_asn_cache_new(void);
+void amp_asn_cache_free(struct amp_asn_cache *cache);
+int amp_asn_cache_lookup(struct amp_asn_cache *cache,
+        struct sockaddr *address, time_t now, int64_t *as, int *refresh);
+void amp_asn_cache_add(struct amp_asn_cache *cache, struct sockaddr *address,
+        int64_t as, time_t now);
+int amp_asn_cache_expire(struct amp_asn_cache *cache, time_t now);
+uint32_t amp_asn_cache_count(struct amp_asn_cache *cache);
+#endif
@@ -0,0 +1,724 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "asntable.h"
+#include "debug.h"
+
+/* longest line we expect in a prefix dump */
+#define ASN_TABLE_MAX_LINE 256
+
+
+
+/*
+ * A prefix read from the text dump, with the first and last addresses it
+ * covers. IPv4 addresses only use the low 32 bits of lo.
+ */
+struct asn_prefix {
+    uint64_t start_hi, start_lo;
+    uint64_t end_hi, end_lo;
+    uint32_t as;
+    uint8_t prefix;
+};
+
+struct asn_prefix_list {
+    struct asn_prefix *prefixes;
+    uint32_t count;
+    uint32_t size;
+};
+
+/* a flattened range, before it is written out in the compact format */
+struct asn_range {
+    uint64_t start_hi, start_lo;
+    uint32_t as;
+    uint8_t prefix;
+};
+
+struct asn_range_list {
+    struct asn_range *ranges;
+    uint32_t count;
+    uint32_t size;
+};
+
+
+
+/*
+ * Compare two 128 bit keys.
+ */
+static int compare_key(uint64_t a_hi, uint64_t a_lo, uint64_t b_hi,
+        uint64_t b_lo) {
+    if ( a_hi != b_hi ) {
+        return (a_hi < b_hi) ? -1 : 1;
+    }
+
+    if ( a_lo != b_lo ) {
+        return (a_lo < b_lo) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Split an IPv6 address into two 64 bit integers in host byte order.
+ */
+static void get_ipv6_key(struct in6_addr *addr, uint64_t *hi, uint64_t *lo) {
+    int i;
+
+    *hi = 0;
+    *lo = 0;
+
+    for ( i = 0; i < 8; i++ ) {
+        *hi = (*hi << 8) | addr->s6_addr[i];
+        *lo = (*lo << 8) | addr->s6_addr[i + 8];
+    }
+}
+
+
+
+/*
+ * Get a mask with the given number of host bits set (from the right).
+ */
+static uint64_t host_mask(int bits) {
+    if ( bits <= 0 ) {
+        return 0;
+    }
+
+    if ( bits >= 64 ) {
+        return UINT64_MAX;
+    }
+
+    return (((uint64_t)1) << bits) - 1;
+}
+
+
+
+/*
+ * Parse a single line of the prefix dump, "prefix<tab>length<tab>asn" or
+ * "prefix/length asn". Multiple origin ASes ("1_2") and AS sets ("{1,2}")
+ * use the first AS listed. Returns the address family of the prefix, or -1
+ * if the line should be skipped.
+ */
+static int parse_prefix_line(char *line, struct asn_prefix *entry) {
+    char *saveptr = NULL;
+    char *addrstr, *lenstr, *asstr, *slash, *end;
+    struct in_addr addr4;
+    struct in6_addr addr6;
+    unsigned long length, as;
+    int family;
+
+    if ( (addrstr = strtok_r(line, " \t\r\n", &saveptr)) == NULL ||
+            *addrstr == '#' ) {
+        return -1;
+    }
+
+    if ( (slash = strchr(addrstr, '/')) != NULL ) {
+        *slash = '\0';
+        lenstr = slash + 1;
+    } else if ( (lenstr = strtok_r(NULL, " \t\r\n", &saveptr)) == NULL ) {
+        return -1;
+    }
+
+    if ( (asstr = strtok_r(NULL, " \t\r\n", &saveptr)) == NULL ) {
+        return -1;
+    }
+
+    length = strtoul(lenstr, &end, 10);
+    if ( *end != '\0' ) {
+        return -1;
+    }
+
+    if ( *asstr == '{' ) {
+        asstr++;
+    }
+
+    as = strtoul(asstr, &end, 10);
+    if ( end == asstr || as == 0 || as > UINT32_MAX ) {
+        return -1;
+    }
+
+    if ( inet_pton(AF_INET, addrstr, &addr4) == 1 && length <= 32 ) {
+        family = AF_INET;
+        entry->start_hi = entry->end_hi = 0;
+        entry->start_lo = ntohl(addr4.s_addr) & ~host_mask(32 - length) &
+            0xffffffff;
+        entry->end_lo = entry->start_lo | host_mask(32 - length);
+    } else if ( inet_pton(AF_INET6, addrstr, &addr6) == 1 && length <= 128 ) {
+        family = AF_INET6;
+        get_ipv6_key(&addr6, &entry->start_hi, &entry->start_lo);
+        entry->start_hi &= ~host_mask(64 - length);
+        entry->start_lo &= ~host_mask(128 - length);
+        entry->end_hi = entry->start_hi | host_mask(64 - length);
+        entry->end_lo = entry->start_lo | host_mask(128 - length);
+    } else {
+        return -1;
+    }
+
+    entry->as = as;
+    entry->prefix = length;
+
+    return family;
+}
+
+
+
+/*
+ * Add a prefix to the end of a list, growing it as required.
+ */
+static void add_prefix(struct asn_prefix_list *list,
+        struct asn_prefix *entry) {
+    if ( list->count == list->size ) {
+        list->size = list->size ? list->size * 2 : 1024;
+        list->prefixes = realloc(list->prefixes,
+                list->size * sizeof(struct asn_prefix));
+    }
+
+    list->prefixes[list->count++] = *entry;
+}
+
+
+
+/*
+ * Sort prefixes by their first address, and less specific prefixes before
+ * the more specific ones that they contain.
+ */
+static int compare_prefix(const void *a, const void *b) {
+    const struct asn_prefix *pa = (const struct asn_prefix*)a;
+    const struct asn_prefix *pb = (const struct asn_prefix*)b;
+    int cmp;
+
+    if ( (cmp = compare_key(pa->start_hi, pa->start_lo, pb->start_hi,
+                    pb->start_lo)) != 0 ) {
+        return cmp;
+    }
+
+    return (int)pa->prefix - (int)pb->prefix;
+}
+
+
+
+/*
+ * Start a new range at the given address. Ranges that start at the same
+ * address replace the previous one, and adjacent ranges with the same
+ * origin are merged.
+ */
+static void add_range(struct asn_range_list *list, uint64_t start_hi,
+        uint64_t start_lo, uint32_t as, uint8_t prefix) {
+
+    struct asn_range *last;
+
+    if ( list->count > 0 ) {
+        last = &list->ranges[list->count - 1];
+
+        if ( last->start_hi == start_hi && last->start_lo == start_lo ) {
+            /* the same range, replace it and merge with the one before */
+            last->as = as;
+            last->prefix = prefix;
+            if ( list->count > 1 && last[-1].as == as &&
+                    last[-1].prefix == prefix ) {
+                list->count--;
+            }
+            return;
+        }
+
+        if ( last->as == as && last->prefix == prefix ) {
+            /* continuing on from the current range, nothing changes */
+            return;
+        }
+    }
+
+    if ( list->count == list->size ) {
+        list->size = list->size ? list->size * 2 : 1024;
+        list->ranges = realloc(list->ranges,
+                list->size * sizeof(struct asn_range));
+    }
+
+    last = &list->ranges[list->count++];
+    last->start_hi = start_hi;
+    last->start_lo = start_lo;
+    last->as = as;
+    last->prefix = prefix;
+}
+
+
+
+/*
+ * Finish the prefix at the top of the stack, starting a new range after it
+ * that belongs to whichever prefix contains it (if any).
+ */
+static void close_prefix(struct asn_range_list *ranges,
+        struct asn_prefix **stack, int *depth, uint64_t max_hi,
+        uint64_t max_lo) {
+
+    struct asn_prefix *closed = stack[--(*depth)];
+    uint64_t next_hi, next_lo;
+
+    /* nothing can follow a prefix that runs to the end of the space */
+    if ( closed->end_hi == max_hi && closed->end_lo == max_lo ) {
+        return;
+    }
+
+    next_lo = closed->end_lo + 1;
+    next_hi = closed->end_hi + (next_lo == 0 ? 1 : 0);
+
+    if ( *depth > 0 ) {
+        add_range(ranges, next_hi, next_lo, stack[*depth - 1]->as,
+                stack[*depth - 1]->prefix);
+    } else {
+        add_range(ranges, next_hi, next_lo, 0, 0);
+    }
+}
+
+
+
+/*
+ * Flatten a list of (possibly nested) prefixes into sorted, non-overlapping
+ * ranges that each belong to the most specific prefix that covers them.
+ * Prefixes are either disjoint or nested, so once sorted a stack of the
+ * currently open prefixes is enough to know which one covers any address.
+ */
+static void flatten_prefixes(struct asn_prefix_list *prefixes,
+        struct asn_range_list *ranges, uint64_t max_hi, uint64_t max_lo) {
+
+    struct asn_prefix *stack[129];
+    struct asn_prefix *entry;
+    int depth = 0;
+    uint32_t i;
+
+    qsort(prefixes->prefixes, prefixes->count, sizeof(struct asn_prefix),
+            compare_prefix);
+
+    for ( i = 0; i < prefixes->count; i++ ) {
+        entry = &prefixes->prefixes[i];
+
+        /* close every open prefix that ends before this one starts */
+        while ( depth > 0 && compare_key(stack[depth - 1]->end_hi,
+                    stack[depth - 1]->end_lo, entry->start_hi,
+                    entry->start_lo) < 0 ) {
+            close_prefix(ranges, stack, &depth, max_hi, max_lo);
+        }
+
+        add_range(ranges, entry->start_hi, entry->start_lo, entry->as,
+                entry->prefix);
+
+        /* a duplicate prefix replaces the earlier one */
+        if ( depth > 0 && stack[depth - 1]->prefix == entry->prefix &&
+                stack[depth - 1]->start_hi == entry->start_hi &&
+                stack[depth - 1]->start_lo == entry->start_lo ) {
+            stack[depth - 1] = entry;
+        } else {
+            stack[depth++] = entry;
+        }
+    }
+
+    while ( depth > 0 ) {
+        close_prefix(ranges, stack, &depth, max_hi, max_lo);
+    }
+}
+
+
+
+/*
+ * Point the table at the range arrays that follow the header. Returns -1
+ * if the data doesn't look like a complete table.
+ */
+static int set_table_pointers(struct amp_asn_table *table) {
+    struct amp_asn_table_header *header = table->data;
+    size_t ipv4_length, ipv6_offset;
+
+    if ( table->length < sizeof(struct amp_asn_table_header) ||
+            memcmp(header->magic, ASN_TABLE_MAGIC, sizeof(header->magic)) ||
+            header->version != ASN_TABLE_VERSION ) {
+        return -1;
+    }
+
+    ipv4_length = header->ipv4_count * sizeof(struct amp_asn_range4);
+    /* the ipv6 ranges are aligned for their 64 bit values */
+    ipv6_offset = (sizeof(struct amp_asn_table_header) + ipv4_length + 7) &
+        ~((size_t)7);
+
+    if ( table->length != ipv6_offset +
+            header->ipv6_count * sizeof(struct amp_asn_range6) ) {
+        return -1;
+    }
+
+    table->ipv4_count = header->ipv4_count;
+    table->ipv6_count = header->ipv6_count;
+    table->ipv4 = (struct amp_asn_range4*)((uint8_t*)table->data +
+            sizeof(struct amp_asn_table_header));
+    table->ipv6 = (struct amp_asn_range6*)((uint8_t*)table->data +
+            ipv6_offset);
+
+    return 0;
+}
+
+
+
+/*
+ * Memory map a compiled table. Returns NULL if the file can't be opened or
+ * isn't a compiled table.
+ */
+static struct amp_asn_table *map_table(char *path) {
+    struct amp_asn_table *table;
+    struct stat statbuf;
+    void *data;
+    int fd;
+
+    if ( (fd = open(path, O_RDONLY)) < 0 ) {
+        return NULL;
+    }
+
+    if ( fstat(fd, &statbuf) < 0 || statbuf.st_size <
+            (off_t)sizeof(struct amp_asn_table_header) ) {
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if ( data == MAP_FAILED ) {
+        Log(LOG_WARNING, "Failed to map ASN table %s: %s", path,
+                strerror(errno));
+        return NULL;
+    }
+
+    table = calloc(1, sizeof(struct amp_asn_table));
+    table->data = data;
+    table->length = statbuf.st_size;
+    table->mapped = 1;
+
+    if ( set_table_pointers(table) < 0 ) {
+        amp_asn_table_close(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+
+
+/*
+ * Build the compact table in memory from the text prefix dump.
+ */
+static struct amp_asn_table *compile_table(char *path) {
+    struct asn_prefix_list prefixes4 = { NULL, 0, 0 };
+    struct asn_prefix_list prefixes6 = { NULL, 0, 0 };
+    struct asn_range_list ranges4 = { NULL, 0, 0 };
+    struct asn_range_list ranges6 = { NULL, 0, 0 };
+    struct amp_asn_table *table;
+    struct amp_asn_table_header *header;
+    struct asn_prefix entry;
+    char line[ASN_TABLE_MAX_LINE];
+    size_t ipv6_offset;
+    uint32_t skipped = 0;
+    uint32_t i;
+    FILE *file;
+
+    if ( (file = fopen(path, "r")) == NULL ) {
+        Log(LOG_WARNING, "Failed to open ASN table %s: %s", path,
+                strerror(errno));
+        return NULL;
+    }
+
+    while ( fgets(line, sizeof(line), file) != NULL ) {
+        switch ( parse_prefix_line(line, &entry) ) {
+            case AF_INET: add_prefix(&prefixes4, &entry); break;
+            case AF_INET6: add_prefix(&prefixes6, &entry); break;
+            default: skipped++; break;
+        };
+    }
+
+    fclose(file);
+
+    Log(LOG_DEBUG, "Read %u IPv4 and %u IPv6 prefixes from %s (%u skipped)",
+            prefixes4.count, prefixes6.count, path, skipped);
+
+    flatten_prefixes(&prefixes4, &ranges4, 0, 0xffffffff);
+    flatten_prefixes(&prefixes6, &ranges6, UINT64_MAX, UINT64_MAX);
+
+    free(prefixes4.prefixes);
+    free(prefixes6.prefixes);
+
+    table = calloc(1, sizeof(struct amp_asn_table));
+    ipv6_offset = (sizeof(struct amp_asn_table_header) +
+            ranges4.count * sizeof(struct amp_asn_range4) + 7) & ~((size_t)7);
+    table->length = ipv6_offset +
+        ranges6.count * sizeof(struct amp_asn_range6);
+    table->data = calloc(1, table->length);
+    table->mapped = 0;
+
+    header = table->data;
+    memcpy(header->magic, ASN_TABLE_MAGIC, sizeof(header->magic));
+    header->version = ASN_TABLE_VERSION;
+    header->ipv4_count = ranges4.count;
+    header->ipv6_count = ranges6.count;
+
+    set_table_pointers(table);
+
+    for ( i = 0; i < ranges4.count; i++ ) {
+        table->ipv4[i].start = ranges4.ranges[i].start_lo;
+        table->ipv4[i].as = ranges4.ranges[i].as;
+        table->ipv4[i].prefix = ranges4.ranges[i].prefix;
+    }
+
+    for ( i = 0; i < ranges6.count; i++ ) {
+        table->ipv6[i].start_hi = ranges6.ranges[i].start_hi;
+        table->ipv6[i].start_lo = ranges6.ranges[i].start_lo;
+        table->ipv6[i].as = ranges6.ranges[i].as;
+        table->ipv6[i].prefix = ranges6.ranges[i].prefix;
+    }
+
+    free(ranges4.ranges);
+    free(ranges6.ranges);
+
+    return table;
+}
+
+
+
+/*
+ * Write a compiled table to disk, replacing any existing one atomically so
+ * that other processes with it mapped aren't affected.
+ */
+static int write_table(struct amp_asn_table *table, char *path) {
+    char *tmpname;
+    size_t written = 0;
+    ssize_t bytes;
+    int fd;
+
+    if ( asprintf(&tmpname, "%s.XXXXXX", path) < 0 ) {
+        return -1;
+    }
+
+    if ( (fd = mkstemp(tmpname)) < 0 ) {
+        Log(LOG_DEBUG, "Can't write compiled ASN table %s: %s", path,
+                strerror(errno));
+        free(tmpname);
+        return -1;
+    }
+
+    while ( written < table->length ) {
+        if ( (bytes = write(fd, (uint8_t*)table->data + written,
+                        table->length - written)) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            Log(LOG_WARNING, "Failed to write compiled ASN table %s: %s",
+                    path, strerror(errno));
+            close(fd);
+            unlink(tmpname);
+            free(tmpname);
+            return -1;
+        }
+        written += bytes;
+    }
+
+    fchmod(fd, 0644);
+    close(fd);
+
+    if ( rename(tmpname, path) < 0 ) {
+        Log(LOG_WARNING, "Failed to rename compiled ASN table %s: %s",
+                path, strerror(errno));
+        unlink(tmpname);
+        free(tmpname);
+        return -1;
+    }
+
+    free(tmpname);
+    return 0;
+}
+
+
+
+/*
+ * Open a prefix to AS table. The path can either be a compiled table, or a
+ * text prefix dump in which case the compiled copy next to it will be used
+ * if it is newer, otherwise the text will be compiled and saved there for
+ * next time.
+ */
+struct amp_asn_table *amp_asn_table_open(char *path) {
+    struct amp_asn_table *table;
+    struct stat textstat, cachestat;
+    char *cache;
+
+    if ( path == NULL ) {
+        return NULL;
+    }
+
+    /* if given a compiled table then use it directly */
+    if ( (table = map_table(path)) != NULL ) {
+        return table;
+    }
+
+    if ( stat(path, &textstat) < 0 ) {
+        Log(LOG_WARNING, "Failed to open ASN table %s: %s", path,
+                strerror(errno));
+        return NULL;
+    }
+
+    if ( asprintf(&cache, "%s%s", path, ASN_TABLE_SUFFIX) < 0 ) {
+        return NULL;
+    }
+
+    /* use the compiled copy if it was made from this version of the text */
+    if ( stat(cache, &cachestat) == 0 &&
+            cachestat.st_mtime >= textstat.st_mtime &&
+            (table = map_table(cache)) != NULL ) {
+        free(cache);
+        return table;
+    }
+
+    if ( (table = compile_table(path)) == NULL ) {
+        free(cache);
+        return NULL;
+    }
+
+    /* save it for next time and share the pages, or just keep it in memory */
+    if ( write_table(table, cache) == 0 ) {
+        struct amp_asn_table *mapped;
+        if ( (mapped = map_table(cache)) != NULL ) {
+            amp_asn_table_close(table);
+            table = mapped;
+        }
+    }
+
+    free(cache);
+    return table;
+}
+
+
+
+/*
+ * Unmap or free the table.
+ */
+void amp_asn_table_close(struct amp_asn_table *table) {
+    if ( table == NULL ) {
+        return;
+    }
+
+    if ( table->mapped ) {
+        munmap(table->data, table->length);
+    } else {
+        free(table->data);
+    }
+
+    free(table);
+}
+
+
+
+/*
+ * Find the origin AS of the most specific prefix covering an address.
+ * Returns 0 and sets the AS and prefix length if a prefix was found, -1 if
+ * the address isn't covered by anything in the table.
+ */
+int amp_asn_table_lookup(struct amp_asn_table *table,
+        struct sockaddr *address, int64_t *as, uint8_t *prefix) {
+
+    uint32_t low, high, mid;
+
+    if ( table == NULL || address == NULL ) {
+        return -1;
+    }
+
+    low = 0;
+
+    if ( address->sa_family == AF_INET ) {
+        uint32_t key = ntohl(((struct sockaddr_in*)address)->sin_addr.s_addr);
+
+        /* find the last range that starts at or before the address */
+        high = table->ipv4_count;
+        while ( low < high ) {
+            mid = low + (high - low) / 2;
+            if ( table->ipv4[mid].start <= key ) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        if ( low == 0 || table->ipv4[low - 1].as == 0 ) {
+            return -1;
+        }
+
+        *as = table->ipv4[low - 1].as;
+        *prefix = table->ipv4[low - 1].prefix;
+        return 0;
+
+    } else if ( address->sa_family == AF_INET6 ) {
+        uint64_t key_hi, key_lo;
+
+        get_ipv6_key(&((struct sockaddr_in6*)address)->sin6_addr, &key_hi,
+                &key_lo);
+
+        high = table->ipv6_count;
+        while ( low < high ) {
+            mid = low + (high - low) / 2;
+            if ( compare_key(table->ipv6[mid].start_hi,
+                        table->ipv6[mid].start_lo, key_hi, key_lo) <= 0 ) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        if ( low == 0 || table->ipv6[low - 1].as == 0 ) {
+            return -1;
+        }
+
+        *as = table->ipv6[low - 1].as;
+        *prefix = table->ipv6[low - 1].prefix;
+        return 0;
+    }
+
+    return -1;
+}
@@ -0,0 +1,100 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COMMON_ASNTABLE_H
+#define _COMMON_ASNTABLE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * A local prefix to origin AS table, built from a text dump such as the
+ * CAIDA routeviews pfx2as files (one "prefix<tab>length<tab>asn" per line,
+ * "prefix/length asn" is also accepted). The prefixes are flattened into
+ * sorted, non-overlapping ranges that each remember the AS and length of the
+ * most specific prefix covering them, so a longest prefix match is a single
+ * binary search.
+ *
+ * The compiled table is written next to the text file and memory mapped, so
+ * that later starts don't need to parse the text again and the pages are
+ * shared with every process that has the table open.
+ */
+#define ASN_TABLE_MAGIC "AMPASNT1"
+#define ASN_TABLE_VERSION 1
+#define ASN_TABLE_SUFFIX ".amp"
+
+struct amp_asn_table_header {
+    char magic[8];
+    uint32_t version;           /* also checks the byte order matches */
+    uint32_t ipv4_count;
+    uint32_t ipv6_count;
+    uint32_t reserved;
+};
+
+/* covers from start up to the start of the next range, host byte order */
+struct amp_asn_range4 {
+    uint32_t start;
+    uint32_t as;                /* 0 if no prefix covers this range */
+    uint8_t prefix;
+    uint8_t unused[3];
+};
+
+struct amp_asn_range6 {
+    uint64_t start_hi;
+    uint64_t start_lo;
+    uint32_t as;                /* 0 if no prefix covers this range */
+    uint8_t prefix;
+    uint8_t unused[3];
+};
+
+struct amp_asn_table {
+    void *data;                 /* header followed by both range arrays */
+    size_t length;
+    int mapped;                 /* data is mmap()ed rather than malloc()ed */
+    struct amp_asn_range4 *ipv4;
+    struct amp_asn_range6 *ipv6;
+    uint32_t ipv4_count;
+    uint32_t ipv6_count;
+};
+
+struct amp_asn_table *amp_asn_table_open(char *path);
+void amp_asn_table_close(struct amp_asn_table *table);
+int amp_asn_table_lookup(struct amp_asn_table *table,
+        struct sockaddr *address, int64_t *as, uint8_t *prefix);
+#endif
@@ -6,28 +6,117 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 #include "checksum.h"
 
+/* number of 32 bit words summed in parallel in the main checksum loop */
+#define CHECKSUM_LANES 8
+
 
 
 /*
- * Calculate the icmp header checksum.
+ * Add data to a partial (unfolded) checksum. The data is summed 32 bits at a
+ * time into 64 bit accumulators, deferring the carries until the end as
+ * described in RFC 1071. Summing several independent lanes at once lets the
+ * compiler turn the main loop into vector adds for larger packets. The
+ * result can be passed back in to continue the sum over more data, so long
+ * as all but the final piece are an even number of bytes.
  */
-uint16_t checksum(uint16_t *data, int length) {
-    uint64_t sum = 0;
+uint64_t checksum_add(uint64_t sum, const void *data, int length) {
+    const uint8_t *ptr = data;
+    uint64_t lanes[CHECKSUM_LANES] = {0};
+    uint32_t words[CHECKSUM_LANES];
+    uint32_t word;
+    uint16_t half;
+    int i;
+
+    while ( length >= (int)sizeof(words) ) {
+        memcpy(words, ptr, sizeof(words));
+        for ( i = 0; i < CHECKSUM_LANES; i++ ) {
+            lanes[i] += words[i];
+        }
+        ptr += sizeof(words);
+        length -= sizeof(words);
+    }
 
-    while ( length > 1 ) {
-        sum += *data++;
-        length -= 2;
+    for ( i = 0; i < CHECKSUM_LANES; i++ ) {
+        sum += lanes[i];
+    }
+
+    while ( length >= (int)sizeof(word) ) {
+        memcpy(&word, ptr, sizeof(word));
+        sum += word;
+        ptr += sizeof(word);
+        length -= sizeof(word);
+    }
+
+    if ( length >= (int)sizeof(half) ) {
+        memcpy(&half, ptr, sizeof(half));
+        sum += half;
+        ptr += sizeof(half);
+        length -= sizeof(half);
     }
 
     if ( length > 0 ) {
-        sum += *(unsigned char *)data;
+        /* pad the odd byte with zero, keeping it in memory order */
+        half = 0;
+        memcpy(&half, ptr, 1);
+        sum += half;
     }
 
+    return sum;
+}
+
+
+
+/*
+ * Fold a partial checksum down to 16 bits and take the complement.
+ */
+uint16_t checksum_fold(uint64_t sum) {
     while ( sum >> 16 ) {
         sum = (sum & 0xffff) + (sum >> 16);
     }
 
     return (uint16_t)~sum;
 }
+
+
+
+/*
+ * Calculate the icmp header checksum.
+ */
+uint16_t checksum(uint16_t *data, int length) {
+    return checksum_fold(checksum_add(0, data, length));
+}
+
+
+
+/*
+ * Update a checksum after a 16 bit word that it covers has changed from
+ * "before" to "after", without looking at the rest of the data. Uses
+ * equation 3 from RFC 1624, HC' = ~(~HC + ~m + m'), which avoids the -0
+ * problem of the original RFC 1141 method.
+ */
+uint16_t checksum_update16(uint16_t check, uint16_t before, uint16_t after) {
+    uint32_t sum;
+
+    sum = (uint16_t)~check + (uint16_t)~before + after;
+
+    return checksum_fold(sum);
+}
+
+
+
+/*
+ * Update a checksum after a 32 bit value that it covers has changed, as
+ * above. The value must start on an even offset within the checksummed data.
+ */
+uint16_t checksum_update32(uint16_t check, uint32_t before, uint32_t after) {
+    uint64_t sum;
+
+    sum = (uint16_t)~check;
+    sum += (uint16_t)~(before >> 16) + (uint16_t)~(before & 0xffff);
+    sum += (after >> 16) + (after & 0xffff);
+
+    return checksum_fold(sum);
+}
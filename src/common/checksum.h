@@ -42,6 +42,10 @@
 
 #include <stdint.h>
 
+uint64_t checksum_add(uint64_t sum, const void *data, int length);
+uint16_t checksum_fold(uint64_t sum);
 uint16_t checksum(uint16_t *data, int length);
+uint16_t checksum_update16(uint16_t check, uint16_t before, uint16_t after);
+uint16_t checksum_update32(uint16_t check, uint32_t before, uint32_t after);
 
 #endif
@@ -59,8 +59,12 @@ struct amp_global_t {
     amp_ssl_opt_t amqp_ssl;
     char *asnsock;
     char *nssock;
+    char *reportsock;
+    char *spool;
+    char *config_file;
     int nssock_fd;
     int asnsock_fd;
+    int reportsock_fd;
     char **argv;
     int argc;
 };
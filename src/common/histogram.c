@@ -0,0 +1,226 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "histogram.h"
+
+
+/*
+ * Find the bucket that a value of the given magnitude belongs in. Small
+ * values get a bucket each, larger values share buckets that each cover a
+ * range proportional to the size of the value.
+ */
+static uint32_t get_bucket(uint32_t magnitude) {
+    int shift;
+
+    if ( magnitude < HISTOGRAM_SUB_BUCKETS ) {
+        return magnitude;
+    }
+
+    /* shift so that the value fits in the top half of the sub buckets */
+    shift = (31 - __builtin_clz(magnitude)) - (HISTOGRAM_PRECISION - 1);
+
+    return HISTOGRAM_SUB_BUCKETS + ((shift - 1) * (HISTOGRAM_SUB_BUCKETS / 2)) +
+        ((magnitude >> shift) - (HISTOGRAM_SUB_BUCKETS / 2));
+}
+
+
+
+/*
+ * Find the range of magnitudes that are stored in a bucket, returning the
+ * smallest value and setting width to the number of values covered.
+ */
+static uint32_t get_bucket_start(uint32_t bucket, uint32_t *width) {
+    uint32_t shift;
+    uint32_t offset;
+
+    if ( bucket < HISTOGRAM_SUB_BUCKETS ) {
+        *width = 1;
+        return bucket;
+    }
+
+    offset = bucket - HISTOGRAM_SUB_BUCKETS;
+    shift = (offset / (HISTOGRAM_SUB_BUCKETS / 2)) + 1;
+
+    *width = 1 << shift;
+    return ((offset % (HISTOGRAM_SUB_BUCKETS / 2)) +
+            (HISTOGRAM_SUB_BUCKETS / 2)) << shift;
+}
+
+
+
+/*
+ * Get a single value to represent everything stored in a bucket. The middle
+ * of the bucket is used, limited to the values that have actually been seen.
+ */
+static int32_t get_bucket_value(struct histogram_t *histogram,
+        uint32_t bucket, int negative) {
+    uint32_t start, width;
+    int64_t value;
+
+    start = get_bucket_start(bucket, &width);
+    value = (int64_t)start + (width / 2);
+
+    if ( negative ) {
+        value = -value;
+    }
+
+    if ( value < histogram->minimum ) {
+        return histogram->minimum;
+    }
+
+    if ( value > histogram->maximum ) {
+        return histogram->maximum;
+    }
+
+    return (int32_t)value;
+}
+
+
+
+/*
+ * Reset a histogram so that it is empty.
+ */
+void histogram_init(struct histogram_t *histogram) {
+    assert(histogram);
+
+    memset(histogram, 0, sizeof(struct histogram_t));
+    histogram->minimum = INT32_MAX;
+    histogram->maximum = INT32_MIN;
+}
+
+
+
+/*
+ * Add a single sample to the histogram.
+ */
+void histogram_add(struct histogram_t *histogram, int32_t value) {
+    assert(histogram);
+
+    if ( value < 0 ) {
+        histogram->negative[get_bucket(-(int64_t)value)]++;
+    } else {
+        histogram->positive[get_bucket(value)]++;
+    }
+
+    if ( value < histogram->minimum ) {
+        histogram->minimum = value;
+    }
+
+    if ( value > histogram->maximum ) {
+        histogram->maximum = value;
+    }
+
+    histogram->count++;
+}
+
+
+
+/*
+ * Add all the samples from one histogram into another.
+ */
+void histogram_merge(struct histogram_t *dst, struct histogram_t *src) {
+    int i;
+
+    assert(dst);
+    assert(src);
+
+    for ( i = 0; i < HISTOGRAM_BUCKETS; i++ ) {
+        dst->positive[i] += src->positive[i];
+        dst->negative[i] += src->negative[i];
+    }
+
+    if ( src->minimum < dst->minimum ) {
+        dst->minimum = src->minimum;
+    }
+
+    if ( src->maximum > dst->maximum ) {
+        dst->maximum = src->maximum;
+    }
+
+    dst->count += src->count;
+}
+
+
+
+/*
+ * Estimate the value of the sample that would be at the given position
+ * (starting from zero) if all the samples were sorted. Returns zero if the
+ * histogram is empty.
+ */
+int32_t histogram_value_at_rank(struct histogram_t *histogram, uint64_t rank) {
+    uint64_t seen = 0;
+    int i;
+
+    assert(histogram);
+
+    if ( histogram->count == 0 ) {
+        return 0;
+    }
+
+    /* the extremes are tracked exactly */
+    if ( rank == 0 ) {
+        return histogram->minimum;
+    }
+
+    if ( rank >= histogram->count - 1 ) {
+        return histogram->maximum;
+    }
+
+    /* negative values, starting from the largest magnitude */
+    for ( i = HISTOGRAM_BUCKETS - 1; i >= 0; i-- ) {
+        seen += histogram->negative[i];
+        if ( seen > rank ) {
+            return get_bucket_value(histogram, i, 1);
+        }
+    }
+
+    /* then positive values, starting from the smallest */
+    for ( i = 0; i < HISTOGRAM_BUCKETS; i++ ) {
+        seen += histogram->positive[i];
+        if ( seen > rank ) {
+            return get_bucket_value(histogram, i, 0);
+        }
+    }
+
+    return histogram->maximum;
+}
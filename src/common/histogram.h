@@ -0,0 +1,76 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COMMON_HISTOGRAM_H
+#define _COMMON_HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Number of bits of precision kept for each value. Values smaller than
+ * 2^HISTOGRAM_PRECISION are stored exactly, larger values are stored with
+ * a relative error of less than 2^-(HISTOGRAM_PRECISION - 1).
+ */
+#define HISTOGRAM_PRECISION 7
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_PRECISION)
+
+/* enough buckets to cover every possible 32 bit magnitude */
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + \
+        ((32 - HISTOGRAM_PRECISION) * (HISTOGRAM_SUB_BUCKETS / 2)))
+
+/*
+ * Log-linear histogram of signed 32 bit values, used to estimate quantiles
+ * of a stream of samples without storing every sample. Negative values are
+ * kept in their own set of buckets, indexed by magnitude. Two histograms can
+ * be merged by adding their bucket counts.
+ */
+struct histogram_t {
+    uint64_t count;
+    int32_t minimum;
+    int32_t maximum;
+    uint32_t positive[HISTOGRAM_BUCKETS];
+    uint32_t negative[HISTOGRAM_BUCKETS];
+};
+
+void histogram_init(struct histogram_t *histogram);
+void histogram_add(struct histogram_t *histogram, int32_t value);
+void histogram_merge(struct histogram_t *dst, struct histogram_t *src);
+int32_t histogram_value_at_rank(struct histogram_t *histogram, uint64_t rank);
+
+#endif
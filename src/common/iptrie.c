@@ -45,211 +45,283 @@
 #include <sys/socket.h>
 
 #include "iptrie.h"
-#include "testlib.h"
+
+/*
+ * Addresses are stored in a multibit trie (in the style of Tree Bitmap)
+ * where each level covers 8 bits of the address, so an IPv4 lookup visits
+ * at most 5 levels and an IPv6 lookup at most 17, rather than one node per
+ * bit. Each level uses bitmaps to record which of its 256 children exist and
+ * which prefixes end within it, and only stores the ones that are present.
+ * Levels, child indices and entries all live in a few contiguous arrays that
+ * are referenced by index, so there are no per-node allocations and the
+ * lookup path stays in a small number of cache lines.
+ */
+#define IPTRIE_STRIDE 8
+#define IPTRIE_FANOUT (1 << IPTRIE_STRIDE)
+#define IPTRIE_BITMAP_WORDS (IPTRIE_FANOUT / 64)
+
+/* entries are allocated in blocks so that pointers to them stay valid */
+#define IPTRIE_ENTRY_BLOCK 64
+
+struct iptrie_level {
+    /* children for each possible value of the next byte of the address */
+    uint64_t external[IPTRIE_BITMAP_WORDS];
+    /* start of the packed child and entry indices in the slots array */
+    uint32_t child_base;
+    uint32_t entry_base;
+    /*
+     * Prefixes that end within this level, indexed by their length within
+     * the level (0-7) and the bits of the address covered so far: a prefix
+     * k bits into the level is at position (1 << k) - 1 + (byte >> (8 - k)).
+     * Most levels are only passed through and have none of these.
+     */
+    uint64_t internal[IPTRIE_BITMAP_WORDS];
+};
+
+struct iptrie_table {
+    int length;                 /* address length in bytes */
+
+    struct iptrie_level *levels;
+    uint32_t level_count;
+    uint32_t level_size;
+
+    /*
+     * Packed runs of entry or level indices belonging to each level. A run
+     * holding n values has room for the next power of two, and is moved to
+     * the end when it fills up.
+     */
+    uint32_t *slots;
+    uint32_t slot_count;
+    uint32_t slot_size;
+
+    iptrie_node_t **blocks;
+    uint32_t entry_count;
+};
+
 
 
 /*
- * Get the bit in the address at the given zero-based index. Expects either
- * an IPv4 or IPv6 address in network byte order.
+ * Count the set bits in a level bitmap that are before the given position,
+ * which is the index of that position within the packed run. Counting up to
+ * IPTRIE_FANOUT gives the total number of bits set.
  */
-static int get_bit_at_index(struct sockaddr *address, int index) {
-    int offset;
+static uint32_t count_bits_before(const uint64_t *bitmap, int position) {
+    uint32_t count = 0;
+    int i;
 
-    if ( address == NULL || index < 0 ) {
-        return -1;
+    for ( i = 0; i < position / 64; i++ ) {
+        count += __builtin_popcountll(bitmap[i]);
     }
 
-    if ( address->sa_family == AF_INET ) {
-        if ( index > 31 ) {
-            return -1;
-        }
+    if ( position % 64 ) {
+        count += __builtin_popcountll(bitmap[position / 64] &
+                ((((uint64_t)1) << (position % 64)) - 1));
+    }
 
-        /* line up the one set bit with the index we want */
-        offset = ntohl(0x80000000 >> index);
-        return (((struct sockaddr_in*)address)->sin_addr.s_addr & offset)?1:0;
+    return count;
+}
 
-    } else if ( address->sa_family == AF_INET6 ) {
-        int field;
-        if ( index > 127 ) {
-            return -1;
-        }
 
-        /* determine which 32bit block of the IPv6 address we need to check */
-        field = index / 16;
 
-        /* line up the one set bit with the index we want within the block */
-        offset = ntohs(0x8000 >> (index % 16));
-        return (((struct sockaddr_in6*)
-                address)->sin6_addr.s6_addr16[field] & offset)?1:0;
+static int test_bit(const uint64_t *bitmap, int position) {
+    return (bitmap[position / 64] >> (position % 64)) & 1;
+}
 
-    }
 
-    return -1;
+
+/*
+ * Get the address bytes (network byte order) and length for an address.
+ */
+static uint8_t *get_address_bytes(struct sockaddr *address, int *length) {
+    switch ( address->sa_family ) {
+        case AF_INET:
+            *length = sizeof(struct in_addr);
+            return (uint8_t*)&((struct sockaddr_in*)address)->sin_addr;
+        case AF_INET6:
+            *length = sizeof(struct in6_addr);
+            return ((struct sockaddr_in6*)address)->sin6_addr.s6_addr;
+    };
+
+    *length = 0;
+    return NULL;
+}
+
+
+
+/*
+ * Get the position in a level's internal bitmap of a prefix that is k bits
+ * into the level, where byte is the address byte for this level.
+ */
+static int get_internal_position(int k, uint8_t byte) {
+    return (1 << k) - 1 + (k ? byte >> (IPTRIE_STRIDE - k) : 0);
 }
 
 
 
 /*
- * Count the number of initial bits that match in a pair of addresses. Accepts
- * either IPv4 or IPv6 addresses, in network byte order.
+ * Create an empty table with just the root level.
  */
-static int get_matching_prefix_length(struct sockaddr *a, struct sockaddr *b) {
-    int count = 0;
+static struct iptrie_table *iptrie_table_new(int length) {
+    struct iptrie_table *table = calloc(1, sizeof(struct iptrie_table));
 
-    if ( a == NULL || b == NULL ) {
-        return -1;
-    }
+    table->length = length;
+    table->level_size = 4;
+    table->levels = calloc(table->level_size, sizeof(struct iptrie_level));
+    table->level_count = 1;
 
-    if ( a->sa_family != b->sa_family ) {
-        return -1;
+    return table;
+}
+
+
+
+/*
+ * Add a new empty level to the table, returning the index of it.
+ */
+static uint32_t add_level(struct iptrie_table *table) {
+    if ( table->level_count == table->level_size ) {
+        table->level_size *= 2;
+        table->levels = realloc(table->levels,
+                table->level_size * sizeof(struct iptrie_level));
     }
 
-    if ( a->sa_family == AF_INET ) {
-        struct sockaddr_in *a4 = (struct sockaddr_in*)a;
-        struct sockaddr_in *b4 = (struct sockaddr_in*)b;
-        int mask = 0x80000000;
-        int maxlen = 32;
-
-        /* count bits that are the same, from the left, stop when different */
-        while ( count < maxlen &&
-                (a4->sin_addr.s_addr & ntohl(mask)) ==
-                (b4->sin_addr.s_addr & ntohl(mask)) ) {
-            count++;
-            mask = (mask >> 1) | 0x80000000;
+    memset(&table->levels[table->level_count], 0,
+            sizeof(struct iptrie_level));
+
+    return table->level_count++;
+}
+
+
+
+/*
+ * Insert a value into a packed run of count values at the given index. The
+ * run is moved to a new location twice the size if it is already full.
+ * Returns the (possibly new) start of the run.
+ */
+static uint32_t insert_slot(struct iptrie_table *table, uint32_t base,
+        uint32_t count, uint32_t index, uint32_t value) {
+
+    /* runs are full whenever they hold a power of two values */
+    if ( count == 0 || (count & (count - 1)) == 0 ) {
+        uint32_t size = count ? count * 2 : 1;
+
+        while ( table->slot_count + size > table->slot_size ) {
+            table->slot_size = table->slot_size ? table->slot_size * 2 : 64;
+            table->slots = realloc(table->slots,
+                    table->slot_size * sizeof(uint32_t));
         }
 
-    } else if ( a->sa_family == AF_INET6 ) {
-        struct sockaddr_in6 *a6 = (struct sockaddr_in6*)a;
-        struct sockaddr_in6 *b6 = (struct sockaddr_in6*)b;
-        int mask = 0x8000;
-        int maxlen = 128;
-        int i;
-
-        for ( i = 0; i < 8; i++ ) {
-            if ( a6->sin6_addr.s6_addr16[i] == b6->sin6_addr.s6_addr16[i] ) {
-                /* skip a whole block if it's the same, don't need to count */
-                count += 16;
-            } else {
-                /* count bits that are the same, from the left */
-                while ( count < maxlen &&
-                        (a6->sin6_addr.s6_addr16[i] & ntohs(mask)) ==
-                        (b6->sin6_addr.s6_addr16[i] & ntohs(mask)) ) {
-                    count++;
-                    mask = (mask >> 1) | 0x8000;
-                }
-                break;
-            }
+        if ( count > 0 ) {
+            memcpy(&table->slots[table->slot_count], &table->slots[base],
+                    count * sizeof(uint32_t));
         }
+
+        base = table->slot_count;
+        table->slot_count += size;
     }
 
-    return count;
+    memmove(&table->slots[base + index + 1], &table->slots[base + index],
+            (count - index) * sizeof(uint32_t));
+    table->slots[base + index] = value;
+
+    return base;
+}
+
+
+
+static iptrie_node_t *get_entry(struct iptrie_table *table, uint32_t index) {
+    return &table->blocks[index / IPTRIE_ENTRY_BLOCK][
+        index % IPTRIE_ENTRY_BLOCK];
 }
 
 
 
 /*
- * Add or update an address with ASN in the trie. If the address does not
- * exist then it will be added at the appropriate location, if it does exist
- * then it will be updated.
+ * Create a new entry for an address, returning the index of it.
  */
-static iptrie_node_t *iptrie_add_internal(iptrie_node_t *root,
+static uint32_t add_entry(struct iptrie_table *table,
         struct sockaddr *address, uint8_t prefix, int64_t as) {
 
-    int cmp, len;
+    iptrie_node_t *node;
 
-    /* missing address, return the trie unchanged */
-    if ( address == NULL ) {
-        return root;
+    if ( table->entry_count % IPTRIE_ENTRY_BLOCK == 0 ) {
+        uint32_t blocks = table->entry_count / IPTRIE_ENTRY_BLOCK;
+        table->blocks = realloc(table->blocks,
+                (blocks + 1) * sizeof(iptrie_node_t*));
+        table->blocks[blocks] = malloc(
+                IPTRIE_ENTRY_BLOCK * sizeof(iptrie_node_t));
     }
 
-    /* empty trie, add this address at the root */
-    if ( root == NULL ) {
-        iptrie_node_t *node = malloc(sizeof(iptrie_node_t));
-        node->as = as;
-        node->prefix = prefix;
-        if ( address->sa_family == AF_INET ) {
-            node->address = malloc(sizeof(struct sockaddr_in));
-            memcpy(node->address, address, sizeof(struct sockaddr_in));
-        } else {
-            node->address = malloc(sizeof(struct sockaddr_in6));
-            memcpy(node->address, address, sizeof(struct sockaddr_in6));
-        }
-        node->left = NULL;
-        node->right = NULL;
-        node->next = NULL;
-        return node;
+    node = get_entry(table, table->entry_count);
+    node->as = as;
+    node->prefix = prefix;
+    node->next = NULL;
+    if ( address->sa_family == AF_INET ) {
+        memcpy(&node->addr.in, address, sizeof(struct sockaddr_in));
+    } else {
+        memcpy(&node->addr.in6, address, sizeof(struct sockaddr_in6));
     }
+    node->address = (struct sockaddr*)&node->addr;
 
-    /* there is a prefix set and this address matches, update the ASN */
-    if ( prefix == root->prefix &&
-            compare_addresses(root->address, address, prefix) == 0 ) {
-        root->as = as;
-        return root;
-    }
+    return table->entry_count++;
+}
 
 
-    /*
-     * Prefix and address don't match, see how similar this node actually is.
-     * If it matches more than the node prefix, limit it... we have more
-     * nodes that we have to check below for a better match first.
-     */
-    if ( (len = get_matching_prefix_length(root->address, address)) >
-            root->prefix ) {
-        len = root->prefix;
-    }
 
-    /* get the first bit that didn't match */
-    cmp = get_bit_at_index(address, len);
+/*
+ * Add or update an address with ASN in the trie. If the prefix does not
+ * exist then it will be added at the appropriate location, if it does exist
+ * then the ASN will be updated.
+ */
+static void iptrie_add_internal(struct iptrie_table *table,
+        struct sockaddr *address, uint8_t prefix, int64_t as) {
 
-    /*
-     * If the matching prefix length is shorter than the prefix length already
-     * at this node, then we need to insert a new branching node at this
-     * location. The address we are trying to add and the node currently here
-     * will become children of this new branching node.
-     */
-    if ( len < root->prefix ) {
-        iptrie_node_t *node = malloc(sizeof(iptrie_node_t));
-        node->as = 0;
-        node->prefix = len;
-        if ( address->sa_family == AF_INET ) {
-            node->address = malloc(sizeof(struct sockaddr_in));
-            memcpy(node->address, address, sizeof(struct sockaddr_in));
-        } else {
-            node->address = malloc(sizeof(struct sockaddr_in6));
-            memcpy(node->address, address, sizeof(struct sockaddr_in6));
-        }
-        node->left = NULL;
-        node->right = NULL;
-        node->next = NULL;
-
-        if ( cmp == 0 ) {
-            /* the next bit is a zero, add it down the left branch */
-            node->left = iptrie_add_internal(node->left, address, prefix, as);
-            /* and put the existing node on the right branch */
-            node->right = root;
-        } else if ( cmp != 0 ) {
-            /* the next bit is a one, add it down the right branch */
-            node->right = iptrie_add_internal(node->right, address, prefix, as);
-            /* and put the existing node on the left branch */
-            node->left = root;
+    struct iptrie_level *level;
+    uint32_t current = 0;
+    uint32_t index, count;
+    uint8_t *bytes;
+    int length;
+    int position;
+    int depth;
+
+    if ( (bytes = get_address_bytes(address, &length)) == NULL ) {
+        return;
+    }
+
+    /* walk down a level for every whole byte in the prefix */
+    for ( depth = 0; depth < prefix / IPTRIE_STRIDE; depth++ ) {
+        level = &table->levels[current];
+        index = count_bits_before(level->external, bytes[depth]);
+
+        if ( !test_bit(level->external, bytes[depth]) ) {
+            uint32_t child = add_level(table);
+            /* adding a level may have moved them all */
+            level = &table->levels[current];
+            count = count_bits_before(level->external, IPTRIE_FANOUT);
+            level->child_base = insert_slot(table, level->child_base, count,
+                    index, child);
+            level->external[bytes[depth] / 64] |=
+                ((uint64_t)1) << (bytes[depth] % 64);
         }
 
-        return node;
+        current = table->slots[level->child_base + index];
     }
 
-    /*
-     * otherwise, we match the address here so far but it isn't the end,
-     * keep looking down the appropriate branch for where we should insert.
-     */
-    if ( cmp == 0 ) {
-        /* the next bit is a zero, go down the left branch */
-        root->left = iptrie_add_internal(root->left, address, prefix, as);
-    } else if ( cmp != 0 ) {
-        /* the next bit is a one, go down the right branch */
-        root->right = iptrie_add_internal(root->right, address, prefix, as);
+    /* the prefix ends within this level, the remaining bits pick where */
+    level = &table->levels[current];
+    position = get_internal_position(prefix % IPTRIE_STRIDE,
+            depth < length ? bytes[depth] : 0);
+    index = count_bits_before(level->internal, position);
+
+    if ( test_bit(level->internal, position) ) {
+        /* this prefix is already present, update the ASN */
+        get_entry(table, table->slots[level->entry_base + index])->as = as;
+        return;
     }
 
-    return root;
+    count = count_bits_before(level->internal, IPTRIE_FANOUT);
+    level->entry_base = insert_slot(table, level->entry_base, count, index,
+            add_entry(table, address, prefix, as));
+    level->internal[position / 64] |= ((uint64_t)1) << (position % 64);
 }
 
 
@@ -261,12 +333,29 @@ static iptrie_node_t *iptrie_add_internal(iptrie_node_t *root,
 void iptrie_add(struct iptrie *root, struct sockaddr *address,
         uint8_t prefix, int64_t as) {
 
+    /* missing address, leave the trie unchanged */
+    if ( address == NULL ) {
+        return;
+    }
+
     switch ( address->sa_family ) {
         case AF_INET:
-            root->ipv4 = iptrie_add_internal(root->ipv4, address, prefix, as);
+            if ( prefix > 32 ) {
+                return;
+            }
+            if ( root->ipv4 == NULL ) {
+                root->ipv4 = iptrie_table_new(sizeof(struct in_addr));
+            }
+            iptrie_add_internal(root->ipv4, address, prefix, as);
             break;
         case AF_INET6:
-            root->ipv6 = iptrie_add_internal(root->ipv6, address, prefix, as);
+            if ( prefix > 128 ) {
+                return;
+            }
+            if ( root->ipv6 == NULL ) {
+                root->ipv6 = iptrie_table_new(sizeof(struct in6_addr));
+            }
+            iptrie_add_internal(root->ipv6, address, prefix, as);
             break;
     };
 }
@@ -274,39 +363,56 @@ void iptrie_add(struct iptrie *root, struct sockaddr *address,
 
 
 /*
- *
+ * Find the most specific prefix that covers the address. Each level can only
+ * hold prefixes longer than those in the levels above it, so the last match
+ * found on the way down is the best one.
  */
-static int64_t iptrie_lookup_as_internal(iptrie_node_t *root,
+static int64_t iptrie_lookup_as_internal(struct iptrie_table *table,
         struct sockaddr *address) {
-    int next;
 
-    /* empty trie or missing address, can't return a useful AS number */
-    if ( root == NULL || address == NULL ) {
+    struct iptrie_level *level;
+    uint32_t current = 0;
+    int64_t as = -1;
+    uint8_t *bytes;
+    int length;
+    int depth;
+    int k;
+
+    /* empty trie, can't return a useful AS number */
+    if ( table == NULL ) {
         return -1;
     }
 
-    /* if the address doesn't match at this prefix, it isn't present */
-    if ( compare_addresses(root->address, address, root->prefix) != 0 ) {
+    if ( (bytes = get_address_bytes(address, &length)) == NULL ) {
         return -1;
     }
 
-    /* if this is a leaf node, then it matches what we were looking for */
-    if ( root->left == NULL && root->right == NULL ) {
-        return root->as;
-    }
+    for ( depth = 0; ; depth++ ) {
+        level = &table->levels[current];
+
+        /* check for the longest prefix ending in this level, if any do */
+        for ( k = (depth < length) ? IPTRIE_STRIDE - 1 : 0;
+                k >= 0 && (level->internal[0] | level->internal[1] |
+                    level->internal[2] | level->internal[3]); k-- ) {
+            int position = get_internal_position(k,
+                    depth < length ? bytes[depth] : 0);
+            if ( test_bit(level->internal, position) ) {
+                as = get_entry(table, table->slots[level->entry_base +
+                        count_bits_before(level->internal, position)])->as;
+                break;
+            }
+        }
 
-    /* compare the next bit in the address to see which branch we should take */
-    next = get_bit_at_index(address, root->prefix);
+        /* then carry on down the trie if there is anything more specific */
+        if ( depth == length || !test_bit(level->external, bytes[depth]) ) {
+            break;
+        }
 
-    /* non-leaf node, continue down the trie and try the next branch */
-    if ( next == 0 && root->left ) {
-        return iptrie_lookup_as_internal(root->left, address);
-    } else if ( next == 1 && root->right ) {
-        return iptrie_lookup_as_internal(root->right, address);
+        current = table->slots[level->child_base +
+            count_bits_before(level->external, bytes[depth])];
     }
 
-    /* no branch where expected, the ASN isn't here */
-    return -1;
+    return as;
 }
 
 
@@ -317,6 +423,11 @@ static int64_t iptrie_lookup_as_internal(iptrie_node_t *root,
  */
 int64_t iptrie_lookup_as(struct iptrie *root, struct sockaddr *address) {
 
+    /* missing address, can't return a useful AS number */
+    if ( address == NULL ) {
+        return -1;
+    }
+
     switch ( address->sa_family ) {
         case AF_INET:
             return iptrie_lookup_as_internal(root->ipv4, address);
@@ -330,18 +441,23 @@ int64_t iptrie_lookup_as(struct iptrie *root, struct sockaddr *address) {
 
 
 /*
- * Post-order traversal, free each node after freeing all the children.
+ * Free all the storage used by a table.
  */
-static void iptrie_clear_internal(iptrie_node_t *root) {
-    if ( root == NULL ) {
+static void iptrie_clear_internal(struct iptrie_table *table) {
+    uint32_t i;
+
+    if ( table == NULL ) {
         return;
     }
 
-    iptrie_clear_internal(root->left);
-    iptrie_clear_internal(root->right);
+    for ( i = 0; i * IPTRIE_ENTRY_BLOCK < table->entry_count; i++ ) {
+        free(table->blocks[i]);
+    }
 
-    free(root->address);
-    free(root);
+    free(table->blocks);
+    free(table->slots);
+    free(table->levels);
+    free(table);
 }
 
 
@@ -357,23 +473,20 @@ void iptrie_clear(struct iptrie *root) {
 
 
 /*
- * Apply the user function to each of the leaves (only the leaves contain
- * values that were added, internal nodes have been created as a by-product).
+ * Apply the user function to each of the entries, in the order they were
+ * added.
  */
-static int iptrie_on_all_leaves_internal(iptrie_node_t *root,
+static int iptrie_on_all_leaves_internal(struct iptrie_table *table,
         int (*func)(iptrie_node_t *node, void *data), void *data) {
 
-    if ( root == NULL ) {
+    uint32_t i;
+
+    if ( table == NULL ) {
         return 0;
     }
 
-    if ( root->left == NULL && root->right == NULL ) {
-        return func(root, data);
-    } else {
-        if ( iptrie_on_all_leaves_internal(root->left, func, data) < 0 ) {
-            return -1;
-        }
-        if ( iptrie_on_all_leaves_internal(root->right, func, data) < 0 ) {
+    for ( i = 0; i < table->entry_count; i++ ) {
+        if ( func(get_entry(table, i), data) < 0 ) {
             return -1;
         }
     }
@@ -384,8 +497,8 @@ static int iptrie_on_all_leaves_internal(iptrie_node_t *root,
 
 
 /*
- * Apply the user function to each of the leaves (only the leaves contain
- * values that were added, internal nodes have been created as a by-product).
+ * Apply the user function to each of the prefixes that were added (the
+ * levels of the trie only hold indices, never values of their own).
  */
 int iptrie_on_all_leaves(struct iptrie *root,
         int (*func)(iptrie_node_t*, void*), void *data) {
@@ -398,6 +511,7 @@ int iptrie_on_all_leaves(struct iptrie *root,
         return -1;
     }
 
+
     return 0;
 }
 
@@ -441,3 +555,27 @@ int iptrie_is_empty(struct iptrie *root) {
 
     return 0;
 }
+
+
+
+/*
+ * Approximate number of bytes used to store the trie, for comparison.
+ */
+static size_t iptrie_memory_internal(struct iptrie_table *table) {
+    if ( table == NULL ) {
+        return 0;
+    }
+
+    return sizeof(struct iptrie_table) +
+        table->level_size * sizeof(struct iptrie_level) +
+        table->slot_size * sizeof(uint32_t) +
+        ((table->entry_count + IPTRIE_ENTRY_BLOCK - 1) / IPTRIE_ENTRY_BLOCK) *
+        (sizeof(iptrie_node_t*) + IPTRIE_ENTRY_BLOCK * sizeof(iptrie_node_t));
+}
+
+
+
+size_t iptrie_memory(struct iptrie *root) {
+    return iptrie_memory_internal(root->ipv4) +
+        iptrie_memory_internal(root->ipv6);
+}
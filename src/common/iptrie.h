@@ -41,6 +41,7 @@
 #define _COMMON_IPTRIE_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <netinet/in.h>
 
 
@@ -50,16 +51,25 @@ struct iptrie_node {
     /* ASNs are only 32bit, but we can use the extra space as markers */
     int64_t as;
     uint8_t prefix;
-    struct sockaddr *address;
+    struct sockaddr *address;   /* points at the copy in addr below */
 
-    iptrie_node_t *left;
-    iptrie_node_t *right;
     iptrie_node_t *next;
+
+    union {
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+    } addr;
 };
 
+/*
+ * Each address family is stored in a multibit trie that consumes a byte of
+ * the address at each level. See iptrie.c for the details.
+ */
+struct iptrie_table;
+
 struct iptrie {
-    iptrie_node_t *ipv4;
-    iptrie_node_t *ipv6;
+    struct iptrie_table *ipv4;
+    struct iptrie_table *ipv6;
 };
 
 
@@ -72,4 +82,5 @@ int iptrie_on_all_leaves(struct iptrie *root,
         int (*func)(iptrie_node_t*, void*), void *data);
 iplist_t *iptrie_to_list(struct iptrie *root);
 int iptrie_is_empty(struct iptrie *root);
+size_t iptrie_memory(struct iptrie *root);
 #endif
@@ -0,0 +1,266 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include "probe.h"
+#include "checksum.h"
+
+
+
+/*
+ * Get the (non-inverted) ones complement sum of part of the probe. The
+ * regions being changed are only ever a few bytes long, so a simple loop is
+ * quicker here than setting up the wide loop in checksum_add().
+ */
+static uint16_t probe_sum(struct probe_template_t *probe, int offset,
+        int length) {
+    uint8_t *data = probe->packet + offset;
+    uint32_t sum = 0;
+    uint16_t word;
+
+    while ( length > 1 ) {
+        memcpy(&word, data, sizeof(word));
+        sum += word;
+        data += sizeof(word);
+        length -= sizeof(word);
+    }
+
+    if ( length > 0 ) {
+        word = 0;
+        memcpy(&word, data, 1);
+        sum += word;
+    }
+
+    return (uint16_t)~checksum_fold(sum);
+}
+
+
+
+/*
+ * Read the current checksum out of the packet.
+ */
+static uint16_t get_checksum(struct probe_template_t *probe) {
+    uint16_t check;
+    memcpy(&check, probe->packet + probe->checksum, sizeof(check));
+    return check;
+}
+
+
+
+/*
+ * Write a new checksum into the packet.
+ */
+static void put_checksum(struct probe_template_t *probe, uint16_t check) {
+    memcpy(probe->packet + probe->checksum, &check, sizeof(check));
+}
+
+
+
+/*
+ * Create an empty (all zero) probe template of the given length. The
+ * checksum is the offset of a 16 bit checksum field that covers the whole
+ * packet, or PROBE_NO_CHECKSUM if nothing needs to be kept up to date.
+ */
+struct probe_template_t *new_probe_template(uint16_t length, int checksum) {
+    struct probe_template_t *probe;
+
+    assert(length > 0);
+    assert(checksum == PROBE_NO_CHECKSUM ||
+            (checksum >= 0 && checksum % 2 == 0 && checksum + 2 <= length));
+
+    probe = calloc(1, sizeof(struct probe_template_t));
+    probe->packet = calloc(1, length);
+    probe->length = length;
+    probe->checksum = checksum;
+    probe->pseudo = 0;
+
+    probe_template_checksum(probe);
+
+    return probe;
+}
+
+
+
+/*
+ * Free a probe template and the packet it holds.
+ */
+void free_probe_template(struct probe_template_t *probe) {
+    if ( probe == NULL ) {
+        return;
+    }
+
+    free(probe->packet);
+    free(probe);
+}
+
+
+
+/*
+ * Calculate the checksum over the whole packet. This needs to be done after
+ * writing directly to the packet rather than using probe_template_set*(),
+ * e.g. once the headers and payload have been filled in.
+ */
+void probe_template_checksum(struct probe_template_t *probe) {
+    assert(probe);
+
+    if ( probe->checksum == PROBE_NO_CHECKSUM ) {
+        return;
+    }
+
+    put_checksum(probe, 0);
+    put_checksum(probe, checksum_fold(
+                checksum_add(probe->pseudo, probe->packet, probe->length)));
+}
+
+
+
+/*
+ * Set the pseudo header (e.g. source and destination addresses for TCP)
+ * that is covered by the checksum but isn't part of the packet. Only the sum
+ * of the header is kept, and the checksum is updated by the difference
+ * between the old and new sums.
+ */
+void probe_template_set_pseudo_header(struct probe_template_t *probe,
+        const void *header, int length) {
+    uint16_t sum;
+
+    assert(probe);
+    assert(header);
+    assert(length % 2 == 0);
+
+    sum = (uint16_t)~checksum_fold(checksum_add(0, header, length));
+
+    if ( probe->checksum != PROBE_NO_CHECKSUM ) {
+        put_checksum(probe,
+                checksum_update16(get_checksum(probe), probe->pseudo, sum));
+    }
+
+    probe->pseudo = sum;
+}
+
+
+
+/*
+ * Copy data into the probe at the given offset and patch the checksum. The
+ * data must not overlap the checksum itself. Values at odd offsets are fine,
+ * the region summed before and after is widened to 16 bit boundaries.
+ */
+void probe_template_set(struct probe_template_t *probe, int offset,
+        const void *data, int length) {
+    uint16_t before, after;
+    int start, end;
+
+    assert(probe);
+    assert(data);
+    assert(offset >= 0 && length >= 0 && offset + length <= probe->length);
+    assert(probe->checksum == PROBE_NO_CHECKSUM ||
+            offset + length <= probe->checksum ||
+            offset >= probe->checksum + 2);
+
+    if ( probe->checksum == PROBE_NO_CHECKSUM ) {
+        memcpy(probe->packet + offset, data, length);
+        return;
+    }
+
+    start = offset & ~1;
+    end = (offset + length + 1) & ~1;
+    if ( end > probe->length ) {
+        end = probe->length;
+    }
+
+    before = probe_sum(probe, start, end - start);
+    memcpy(probe->packet + offset, data, length);
+    after = probe_sum(probe, start, end - start);
+
+    put_checksum(probe, checksum_update16(get_checksum(probe), before, after));
+}
+
+
+
+/*
+ * Set a 16 bit field in the probe, the value is given in host byte order.
+ */
+void probe_template_set16(struct probe_template_t *probe, int offset,
+        uint16_t value) {
+    uint16_t before;
+
+    value = htons(value);
+
+    /* aligned fields can be updated directly, the most common case */
+    if ( probe->checksum == PROBE_NO_CHECKSUM || offset % 2 != 0 ) {
+        probe_template_set(probe, offset, &value, sizeof(value));
+        return;
+    }
+
+    assert(offset >= 0 && offset + (int)sizeof(value) <= probe->length);
+    assert(offset != probe->checksum);
+
+    memcpy(&before, probe->packet + offset, sizeof(before));
+    memcpy(probe->packet + offset, &value, sizeof(value));
+    put_checksum(probe, checksum_update16(get_checksum(probe), before, value));
+}
+
+
+
+/*
+ * Set a 32 bit field in the probe, the value is given in host byte order.
+ */
+void probe_template_set32(struct probe_template_t *probe, int offset,
+        uint32_t value) {
+    uint32_t before;
+
+    value = htonl(value);
+
+    if ( probe->checksum == PROBE_NO_CHECKSUM || offset % 2 != 0 ) {
+        probe_template_set(probe, offset, &value, sizeof(value));
+        return;
+    }
+
+    assert(offset >= 0 && offset + (int)sizeof(value) <= probe->length);
+    assert(offset + (int)sizeof(value) <= probe->checksum ||
+            offset >= probe->checksum + 2);
+
+    memcpy(&before, probe->packet + offset, sizeof(before));
+    memcpy(probe->packet + offset, &value, sizeof(value));
+    put_checksum(probe, checksum_update32(get_checksum(probe), before, value));
+}
@@ -0,0 +1,73 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COMMON_PROBE_H
+#define _COMMON_PROBE_H
+
+#include <stdint.h>
+
+/* the template has no checksum to maintain (e.g. ICMPv6, done by kernel) */
+#define PROBE_NO_CHECKSUM (-1)
+
+/*
+ * A probe packet that is built once and then sent many times, with only the
+ * fields that differ between probes (sequence numbers, idents, magic values,
+ * addresses in the pseudo header) being changed. Every change made through
+ * the probe_template_set*() functions patches the checksum incrementally
+ * (RFC 1624), so the cost of each probe doesn't depend on the packet size.
+ */
+struct probe_template_t {
+    uint8_t *packet;
+    uint16_t length;
+    int checksum;               /* offset of the checksum, if there is one */
+    uint16_t pseudo;            /* sum of the pseudo header, not inverted */
+};
+
+struct probe_template_t *new_probe_template(uint16_t length, int checksum);
+void free_probe_template(struct probe_template_t *probe);
+void probe_template_checksum(struct probe_template_t *probe);
+void probe_template_set_pseudo_header(struct probe_template_t *probe,
+        const void *header, int length);
+void probe_template_set(struct probe_template_t *probe, int offset,
+        const void *data, int length);
+void probe_template_set16(struct probe_template_t *probe, int offset,
+        uint16_t value);
+void probe_template_set32(struct probe_template_t *probe, int offset,
+        uint32_t value);
+#endif
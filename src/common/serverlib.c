@@ -506,7 +506,8 @@ BIO* listen_control_server(uint16_t port, uint16_t portmax,
         return NULL;
     }
 
-    if ( (ctrl = establish_control_socket(ssl_ctx, control_sock, 0)) == NULL ) {
+    if ( (ctrl = establish_control_socket(ssl_ctx, control_sock, 0,
+                    NULL)) == NULL ) {
         Log(LOG_WARNING, "Failed to establish control connection");
         return NULL;
     }
@@ -635,7 +636,8 @@ int connect_to_server(struct addrinfo *dest, uint16_t port,
 static BIO* upgrade_control_server_ssl(int sock, struct addrinfo *dest) {
     BIO *ctrl;
 
-    if ( (ctrl  = establish_control_socket(ssl_ctx, sock, 1)) == NULL ) {
+    if ( (ctrl  = establish_control_socket(ssl_ctx, sock, 1,
+                    dest->ai_canonname)) == NULL ) {
         Log(LOG_WARNING, "Failed to upgrade to SSL control connection");
         return NULL;
     }
@@ -41,15 +41,24 @@
 #include <openssl/err.h>
 #include <openssl/rand.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
+#include <errno.h>
+#include <inttypes.h>
 
 #include "debug.h"
 #include "ssl.h"
 #include "testlib.h"
 
 
+/* sessions and handshake statistics shared with all forked processes */
+static struct amp_ssl_shared *shared = NULL;
+
+
 /*
  * http://www.cypherpunks.to/~peter/06_random.pdf
  * https://www.cs.auckland.ac.nz/~pgut001/pubs/book.pdf
@@ -230,6 +239,206 @@ int initialise_ssl(amp_ssl_opt_t *sslopts, char *collector) {
 
 
 
+/*
+ * Lock the shared session cache, recovering it if the process holding the
+ * lock died (test processes can be killed at any time).
+ */
+static int lock_shared(void) {
+    int res = pthread_mutex_lock(&shared->lock);
+
+    if ( res == EOWNERDEAD ) {
+        pthread_mutex_consistent(&shared->lock);
+        return 0;
+    }
+
+    return res;
+}
+
+
+
+/*
+ * Find a session for the named server that is still worth trying to resume.
+ */
+static SSL_SESSION *find_session(char *host) {
+    SSL_SESSION *session = NULL;
+    const unsigned char *data;
+    time_t now = time(NULL);
+    int i;
+
+    if ( shared == NULL || host == NULL || lock_shared() != 0 ) {
+        return NULL;
+    }
+
+    for ( i = 0; i < SSL_SESSION_CACHE_SLOTS; i++ ) {
+        if ( shared->sessions[i].expires > now &&
+                strcmp(shared->sessions[i].host, host) == 0 ) {
+            data = shared->sessions[i].data;
+            session = d2i_SSL_SESSION(NULL, &data, shared->sessions[i].len);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&shared->lock);
+
+    return session;
+}
+
+
+
+/*
+ * Remember a new session for a server, replacing any older session for the
+ * same server or else the session that will expire soonest.
+ */
+static void store_session(char *host, SSL_SESSION *session) {
+    struct amp_ssl_session *slot = NULL;
+    unsigned char *data;
+    int len;
+    int i;
+
+    if ( strlen(host) >= sizeof(slot->host) ) {
+        return;
+    }
+
+    if ( (len = i2d_SSL_SESSION(session, NULL)) <= 0 ||
+            len > SSL_SESSION_MAX_LEN ) {
+        Log(LOG_DEBUG, "Not caching SSL session for %s, length %d", host, len);
+        return;
+    }
+
+    if ( lock_shared() != 0 ) {
+        return;
+    }
+
+    for ( i = 0; i < SSL_SESSION_CACHE_SLOTS; i++ ) {
+        if ( strcmp(shared->sessions[i].host, host) == 0 ) {
+            slot = &shared->sessions[i];
+            break;
+        }
+
+        if ( slot == NULL || shared->sessions[i].expires < slot->expires ) {
+            slot = &shared->sessions[i];
+        }
+    }
+
+    data = slot->data;
+    i2d_SSL_SESSION(session, &data);
+    slot->len = len;
+    slot->expires = SSL_SESSION_get_time(session) +
+        SSL_SESSION_get_timeout(session);
+    strcpy(slot->host, host);
+
+    pthread_mutex_unlock(&shared->lock);
+}
+
+
+
+/*
+ * Called by OpenSSL whenever a new session is established. Client sessions
+ * are saved so that later connections (from any process) can resume them.
+ * With TLSv1.3 this happens when the ticket arrives after the handshake.
+ */
+static int new_session_callback(SSL *ssl, SSL_SESSION *session) {
+    char *host = SSL_get_app_data(ssl);
+
+    if ( shared != NULL && host != NULL && !SSL_is_server(ssl) ) {
+        store_session(host, session);
+    }
+
+    /* we didn't keep a reference to the session */
+    return 0;
+}
+
+
+
+/*
+ * Update the handshake counters for this side of the connection.
+ */
+static void record_handshake(int client, int resumed, int failed,
+        struct timeval *start) {
+    struct amp_ssl_stats *stats;
+    struct timeval now;
+    uint64_t usec;
+
+    if ( shared == NULL ) {
+        return;
+    }
+
+    stats = client ? &shared->client : &shared->server;
+
+    if ( failed ) {
+        __atomic_add_fetch(&stats->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    gettimeofday(&now, NULL);
+    usec = (now.tv_sec - start->tv_sec) * 1000000 +
+        (now.tv_usec - start->tv_usec);
+
+    Log(LOG_DEBUG, "%s SSL handshake completed in %" PRIu64 "us",
+            resumed ? "Resumed" : "Full", usec);
+
+    if ( resumed ) {
+        __atomic_add_fetch(&stats->resumed, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->resumed_usec, usec, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&stats->full, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->full_usec, usec, __ATOMIC_RELAXED);
+    }
+}
+
+
+
+/*
+ * Create the session cache and statistics in memory that will be shared
+ * with every process forked after this. Only measured needs to do this,
+ * standalone tests make a single connection so have nothing to resume.
+ */
+int initialise_ssl_session_cache(void) {
+    pthread_mutexattr_t attr;
+
+    if ( shared != NULL ) {
+        return 0;
+    }
+
+    shared = mmap(NULL, sizeof(struct amp_ssl_shared), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if ( shared == MAP_FAILED ) {
+        Log(LOG_WARNING, "Failed to map SSL session cache: %s",
+                strerror(errno));
+        shared = NULL;
+        return -1;
+    }
+
+    memset(shared, 0, sizeof(struct amp_ssl_shared));
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    return 0;
+}
+
+
+
+/*
+ * Get a copy of the handshake counters for both sides of the connection.
+ */
+void get_ssl_stats(struct amp_ssl_stats *client, struct amp_ssl_stats *server) {
+    if ( shared == NULL ) {
+        memset(client, 0, sizeof(struct amp_ssl_stats));
+        memset(server, 0, sizeof(struct amp_ssl_stats));
+        return;
+    }
+
+    /* the counters are updated atomically, a slightly torn view is fine */
+    memcpy(client, &shared->client, sizeof(struct amp_ssl_stats));
+    memcpy(server, &shared->server, sizeof(struct amp_ssl_stats));
+}
+
+
+
 /*
  * Initialise the SSL context and load all the keys that we will be using.
  */
@@ -258,6 +467,26 @@ SSL_CTX* initialise_ssl_context(amp_ssl_opt_t *sslopts) {
     /* use server cipher list ordering as we trust ourselves more than them */
     SSL_CTX_set_options(ssl_ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
 
+    /*
+     * Allow sessions to be resumed so that the many short control connections
+     * between the same clients don't all need a full handshake. Sessions are
+     * resumed with tickets, the ticket keys are created with the context so
+     * are shared by every process that measured forks to accept a connection.
+     * Clients store their sessions in the shared cache, not the internal one.
+     * Early data is left disabled, control messages aren't safe to replay.
+     */
+    SSL_CTX_set_session_id_context(ssl_ctx,
+            (const unsigned char*)SSL_SESSION_ID_CONTEXT,
+            strlen(SSL_SESSION_ID_CONTEXT));
+    SSL_CTX_set_session_cache_mode(ssl_ctx,
+            SSL_SESS_CACHE_BOTH | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_ctx, new_session_callback);
+    SSL_CTX_set_timeout(ssl_ctx, SSL_SESSION_LIFETIME);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    /* one ticket is enough, each connection is made by a new process */
+    SSL_CTX_set_num_tickets(ssl_ctx, 1);
+#endif
+
     /* Make sure all clients provide a certificate, and that it is valid */
     SSL_CTX_set_verify(ssl_ctx,
             SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
@@ -335,9 +564,11 @@ SSL_CTX* initialise_ssl_context(amp_ssl_opt_t *sslopts) {
  * Establish a control connection across an existing, connected socket. If
  * there is an SSL context then this will perform the server/client side
  * establishment as directed, otherwise it will just wrap the file descriptor
- * in a BIO with no further action.
+ * in a BIO with no further action. Clients that give the name of the host
+ * they are connecting to will try to resume an earlier session with it.
  */
-BIO* establish_control_socket(SSL_CTX *ssl_ctx, int fd, int client) {
+BIO* establish_control_socket(SSL_CTX *ssl_ctx, int fd, int client,
+        char *host) {
     BIO *socket_bio, *top_bio;
 
     if ( (socket_bio = BIO_new_socket(fd, BIO_CLOSE)) == NULL ) {
@@ -348,6 +579,8 @@ BIO* establish_control_socket(SSL_CTX *ssl_ctx, int fd, int client) {
     if ( ssl_ctx ) {
         BIO *ssl_bio;
         SSL *ssl;
+        SSL_SESSION *session;
+        struct timeval start;
 
         Log(LOG_DEBUG, "Active SSL context, using SSL BIO");
 
@@ -358,15 +591,31 @@ BIO* establish_control_socket(SSL_CTX *ssl_ctx, int fd, int client) {
             return NULL;
         }
 
+        BIO_get_ssl(ssl_bio, &ssl);
+
+        if ( client && host ) {
+            /* remember who this is so new sessions can be cached */
+            SSL_set_app_data(ssl, host);
+
+            if ( (session = find_session(host)) != NULL ) {
+                Log(LOG_DEBUG, "Trying to resume SSL session with %s", host);
+                SSL_set_session(ssl, session);
+                SSL_SESSION_free(session);
+            }
+        }
+
         top_bio = BIO_push(ssl_bio, socket_bio);
 
+        gettimeofday(&start, NULL);
+
         if ( BIO_do_handshake(top_bio) != 1 ) {
             log_ssl("Failed to complete SSL handshake");
+            record_handshake(client, 0, 1, &start);
             BIO_free_all(top_bio);
             return NULL;
         }
 
-        BIO_get_ssl(top_bio, &ssl);
+        record_handshake(client, SSL_session_reused(ssl), 0, &start);
 
         /* Check that the cert presented is valid */
         if ( SSL_get_verify_result(ssl) != X509_V_OK ) {
@@ -394,6 +643,11 @@ void ssl_cleanup(void) {
         SSL_CTX_free(ssl_ctx);
     }
 
+    if ( shared != NULL ) {
+        munmap(shared, sizeof(struct amp_ssl_shared));
+        shared = NULL;
+    }
+
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
     /* from 1.1.0 many cleanup routines are handled via auto-deinit */
     EVP_cleanup();
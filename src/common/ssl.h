@@ -40,6 +40,9 @@
 #ifndef _COMMON_SSL_H
 #define _COMMON_SSL_H
 
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include <openssl/ssl.h>
 #include <openssl/bio.h>
 
@@ -59,6 +62,18 @@
 #define SSL_OP_MIN_TLSv1_2 (SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | \
                             SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1)
 
+/* how long a session can be resumed for after a full handshake (seconds) */
+#define SSL_SESSION_LIFETIME 3600
+
+/* number of servers that client sessions can be remembered for */
+#define SSL_SESSION_CACHE_SLOTS 128
+
+/* largest serialised session that will be cached, includes the peer cert */
+#define SSL_SESSION_MAX_LEN 4096
+
+/* context sessions are tied to, resumption requires it to be the same */
+#define SSL_SESSION_ID_CONTEXT "amplet2-control"
+
 /* default location where all keys are stored */
 #define AMP_KEYS_DIR AMP_CONFIG_DIR "/keys"
 
@@ -70,12 +85,44 @@ typedef struct amp_ssl_opt {
 } amp_ssl_opt_t;
 
 
+/* handshake counters for one side (client or server) of the connection */
+struct amp_ssl_stats {
+    uint64_t full;              /* handshakes that had to verify certs */
+    uint64_t resumed;           /* handshakes that resumed a session */
+    uint64_t failed;            /* handshakes that didn't complete */
+    uint64_t full_usec;         /* total time spent in full handshakes */
+    uint64_t resumed_usec;      /* total time spent in resumed handshakes */
+};
+
+/* a serialised client session, keyed on the name of the server */
+struct amp_ssl_session {
+    char host[256];
+    time_t expires;
+    uint32_t len;
+    unsigned char data[SSL_SESSION_MAX_LEN];
+};
+
+/*
+ * Sessions and statistics shared between measured and every process it
+ * forks to run tests or control connections, so that a session negotiated
+ * by one test can be resumed by the next one to talk to the same server.
+ */
+struct amp_ssl_shared {
+    pthread_mutex_t lock;
+    struct amp_ssl_stats client;
+    struct amp_ssl_stats server;
+    struct amp_ssl_session sessions[SSL_SESSION_CACHE_SLOTS];
+};
+
 SSL_CTX *ssl_ctx;
 
 void reseed_openssl_rng(void);
 int initialise_ssl(amp_ssl_opt_t *sslopts, char *collector);
 SSL_CTX *initialise_ssl_context(amp_ssl_opt_t *sslopts);
-BIO* establish_control_socket(SSL_CTX *ssl_ctx, int fd, int client);
+BIO* establish_control_socket(SSL_CTX *ssl_ctx, int fd, int client,
+        char *host);
+int initialise_ssl_session_cache(void);
+void get_ssl_stats(struct amp_ssl_stats *client, struct amp_ssl_stats *server);
 void ssl_cleanup(void);
 char* get_common_name(const X509 *cert);
 int matches_common_name(const char *hostname, const X509 *cert);
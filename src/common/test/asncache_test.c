@@ -0,0 +1,198 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "asncache.h"
+
+#define THREADS 8
+#define LOOKUPS 100000
+
+static struct sockaddr_in make_ipv4(char *str) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    assert(inet_pton(AF_INET, str, &addr.sin_addr) == 1);
+    return addr;
+}
+
+static struct sockaddr_in6 make_ipv6(char *str) {
+    struct sockaddr_in6 addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    assert(inet_pton(AF_INET6, str, &addr.sin6_addr) == 1);
+    return addr;
+}
+
+
+
+/*
+ * Look up the same small set of addresses over and over from many threads
+ * at once, every one of them should be a cache hit.
+ */
+static void *lookup_thread(void *data) {
+    struct amp_asn_cache *cache = (struct amp_asn_cache*)data;
+    struct sockaddr_in addr;
+    char str[INET_ADDRSTRLEN];
+    int64_t as;
+    int i;
+
+    for ( i = 0; i < LOOKUPS; i++ ) {
+        snprintf(str, sizeof(str), "10.0.%d.1", i % 256);
+        addr = make_ipv4(str);
+        assert(amp_asn_cache_lookup(cache, (struct sockaddr*)&addr, 1000,
+                    &as, NULL) == 0);
+        assert(as == 64512 + (i % 256));
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Check that ASN values are cached per /24 and /64, expire individually,
+ * are refreshed by only one caller when close to expiry, and can be looked
+ * up concurrently.
+ */
+int main(void) {
+    struct amp_asn_cache *cache;
+    struct sockaddr_in a, b, c;
+    struct sockaddr_in6 d, e;
+    pthread_t threads[THREADS];
+    char str[INET_ADDRSTRLEN];
+    time_t now = 1000;
+    int64_t as;
+    int refresh;
+    int i;
+
+    cache = amp_asn_cache_new();
+    assert(cache);
+
+    a = make_ipv4("192.0.2.1");
+    b = make_ipv4("192.0.2.200");
+    c = make_ipv4("198.51.100.1");
+    d = make_ipv6("2001:db8:1:2::1");
+    e = make_ipv6("2001:db8:1:2:ffff::1");
+
+    /* nothing is in an empty cache */
+    assert(amp_asn_cache_lookup(cache, (struct sockaddr*)&a, now, &as,
+                &refresh) < 0);
+    assert(refresh == 0);
+
+    /* addresses in the same /24 or /64 share an entry */
+    amp_asn_cache_add(cache, (struct sockaddr*)&a, 64496, now);
+    amp_asn_cache_add(cache, (struct sockaddr*)&d, 64497, now);
+    assert(amp_asn_cache_count(cache) == 2);
+
+    assert(amp_asn_cache_lookup(cache, (struct sockaddr*)&b, now, &as,
+                &refresh) == 0);
+    assert(as == 64496 && refresh == 0);
+    assert(amp_asn_cache_lookup(cache, (struct sockaddr*)&e, now, &as,
+                &refresh) == 0);
+    assert(as == 64497 && refresh == 0);
+    assert(amp_asn_cache_lookup(cache, (struct sockaddr*)&c, now, &as,
+                &refresh) < 0);
+
+    /* updating an entry replaces the value rather than adding another */
+    amp_asn_cache_add(cache, (struct sockaddr*)&b, 64498, now);
+    assert(amp_asn_cache_count(cache) == 2);
+    assert(amp_asn_cache_lookup(cache, (struct sockaddr*)&a, now, &as,
+                NULL) == 0);
+    assert(as == 64498);
+
+    /* close to expiry, exactly one caller is asked to refresh the entry */
+    now = 1000 + ASN_CACHE_TTL - ASN_CACHE_REFRESH_RETRY - 2;
+    assert(amp_asn_cache_lookup(cache, (struct sockaddr*)&a, now, &as,
+                &refresh) == 0);
+    assert(refresh == 1);
+    assert(amp_asn_cache_lookup(cache, (struct sockaddr*)&a, now, &as,
+                &refresh) == 0);
+    assert(refresh == 0);
+
+    /* but if the refresh doesn't complete then someone else can try */
+    now = 1000 + ASN_CACHE_TTL - 1;
+    assert(amp_asn_cache_lookup(cache, (struct sockaddr*)&a, now, &as,
+                &refresh) == 0);
+    assert(refresh == 1);
+
+    /* a refreshed entry gets a new lifetime, the other one expires */
+    amp_asn_cache_add(cache, (struct sockaddr*)&a, 64498, now);
+    now += ASN_CACHE_REFRESH_AHEAD + ASN_CACHE_TTL_JITTER;
+    assert(amp_asn_cache_lookup(cache, (struct sockaddr*)&a, now, &as,
+                &refresh) == 0);
+    assert(as == 64498 && refresh == 0);
+    assert(amp_asn_cache_lookup(cache, (struct sockaddr*)&d, now, &as,
+                &refresh) < 0);
+
+    /* sweeping every shard removes only the expired entry */
+    for ( i = 0; i < ASN_CACHE_SHARDS; i++ ) {
+        amp_asn_cache_expire(cache, now);
+    }
+    assert(amp_asn_cache_count(cache) == 1);
+    amp_asn_cache_free(cache);
+
+    /* many threads can look up entries at the same time */
+    cache = amp_asn_cache_new();
+    for ( i = 0; i < 256; i++ ) {
+        snprintf(str, sizeof(str), "10.0.%d.0", i);
+        a = make_ipv4(str);
+        amp_asn_cache_add(cache, (struct sockaddr*)&a, 64512 + i, 1000);
+    }
+    assert(amp_asn_cache_count(cache) == 256);
+
+    for ( i = 0; i < THREADS; i++ ) {
+        assert(pthread_create(&threads[i], NULL, lookup_thread, cache) == 0);
+    }
+
+    for ( i = 0; i < THREADS; i++ ) {
+        pthread_join(threads[i], NULL);
+    }
+
+    amp_asn_cache_free(cache);
+
+    return 0;
+}
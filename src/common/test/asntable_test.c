@@ -0,0 +1,209 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "asntable.h"
+
+static char *prefixes =
+    "# comment lines and malformed lines are ignored\n"
+    "0.0.0.0\t0\t64496\n"
+    "192.0.2.0\t24\t64497\n"
+    "192.0.2.128\t25\t64498\n"
+    "192.0.2.192\t26\t64499\n"
+    "192.0.2.0\t24\t64500\n"
+    "198.51.100.0/24 64501_64502\n"
+    "203.0.113.0\t24\t{64503,64504}\n"
+    "255.255.255.0\t24\t64505\n"
+    "bogus\t24\t64506\n"
+    "10.0.0.0\t33\t64507\n"
+    "2001:db8::\t32\t64508\n"
+    "2001:db8:1::\t48\t64509\n"
+    "2001:db8:1:2::/64 64510\n"
+    "2001:db8:ffff:ffff::\t64\t64511\n";
+
+static void check_ipv4(struct amp_asn_table *table, char *str, int64_t as,
+        uint8_t prefix) {
+    struct sockaddr_in addr;
+    int64_t found_as;
+    uint8_t found_prefix;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    assert(inet_pton(AF_INET, str, &addr.sin_addr) == 1);
+
+    if ( as == 0 ) {
+        assert(amp_asn_table_lookup(table, (struct sockaddr*)&addr,
+                    &found_as, &found_prefix) < 0);
+        return;
+    }
+
+    assert(amp_asn_table_lookup(table, (struct sockaddr*)&addr, &found_as,
+                &found_prefix) == 0);
+    assert(found_as == as);
+    assert(found_prefix == prefix);
+}
+
+static void check_ipv6(struct amp_asn_table *table, char *str, int64_t as,
+        uint8_t prefix) {
+    struct sockaddr_in6 addr;
+    int64_t found_as;
+    uint8_t found_prefix;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    assert(inet_pton(AF_INET6, str, &addr.sin6_addr) == 1);
+
+    if ( as == 0 ) {
+        assert(amp_asn_table_lookup(table, (struct sockaddr*)&addr,
+                    &found_as, &found_prefix) < 0);
+        return;
+    }
+
+    assert(amp_asn_table_lookup(table, (struct sockaddr*)&addr, &found_as,
+                &found_prefix) == 0);
+    assert(found_as == as);
+    assert(found_prefix == prefix);
+}
+
+static void check_table(struct amp_asn_table *table) {
+    assert(table);
+
+    /* the default route covers everything not more specific */
+    check_ipv4(table, "0.0.0.0", 64496, 0);
+    check_ipv4(table, "192.0.1.255", 64496, 0);
+    check_ipv4(table, "10.0.0.1", 64496, 0);
+
+    /* nested prefixes use the most specific, duplicates use the last */
+    check_ipv4(table, "192.0.2.0", 64500, 24);
+    check_ipv4(table, "192.0.2.127", 64500, 24);
+    check_ipv4(table, "192.0.2.128", 64498, 25);
+    check_ipv4(table, "192.0.2.191", 64498, 25);
+    check_ipv4(table, "192.0.2.192", 64499, 26);
+    check_ipv4(table, "192.0.2.255", 64499, 26);
+    check_ipv4(table, "192.0.3.0", 64496, 0);
+
+    /* multiple origins use the first one listed */
+    check_ipv4(table, "198.51.100.1", 64501, 24);
+    check_ipv4(table, "203.0.113.1", 64503, 24);
+
+    /* a prefix right at the end of the address space */
+    check_ipv4(table, "255.255.254.255", 64496, 0);
+    check_ipv4(table, "255.255.255.255", 64505, 24);
+
+    /* ipv6 has no default route, so there are gaps */
+    check_ipv6(table, "::1", 0, 0);
+    check_ipv6(table, "2001:db7:ffff:ffff:ffff:ffff:ffff:ffff", 0, 0);
+    check_ipv6(table, "2001:db8::1", 64508, 32);
+    check_ipv6(table, "2001:db8:1::1", 64509, 48);
+    check_ipv6(table, "2001:db8:1:2:ffff:ffff:ffff:ffff", 64510, 64);
+    check_ipv6(table, "2001:db8:1:3::", 64509, 48);
+    check_ipv6(table, "2001:db8:2::", 64508, 32);
+    check_ipv6(table, "2001:db8:ffff:ffff:ffff::", 64511, 64);
+    check_ipv6(table, "2001:db9::", 0, 0);
+    check_ipv6(table, "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff", 0, 0);
+}
+
+/*
+ * Check that a text prefix table is compiled, cached and memory mapped, and
+ * that lookups return the most specific prefix covering an address.
+ */
+int main(void) {
+    struct amp_asn_table *table;
+    char dir[] = "/tmp/asntable_test.XXXXXX";
+    char text[64], cache[64];
+    struct stat statbuf;
+    FILE *file;
+
+    assert(mkdtemp(dir));
+    snprintf(text, sizeof(text), "%s/pfx2as.txt", dir);
+    snprintf(cache, sizeof(cache), "%s%s", text, ASN_TABLE_SUFFIX);
+
+    /* a missing table fails to open, and a NULL table finds nothing */
+    assert(amp_asn_table_open(text) == NULL);
+    check_ipv4(NULL, "192.0.2.1", 0, 0);
+
+    file = fopen(text, "w");
+    assert(file);
+    fputs(prefixes, file);
+    fclose(file);
+
+    /* the first open compiles the table and saves it */
+    table = amp_asn_table_open(text);
+    check_table(table);
+    assert(table->mapped);
+    amp_asn_table_close(table);
+    assert(stat(cache, &statbuf) == 0);
+
+    /* which is used directly the next time, or if opened by name */
+    table = amp_asn_table_open(text);
+    check_table(table);
+    amp_asn_table_close(table);
+
+    table = amp_asn_table_open(cache);
+    check_table(table);
+    amp_asn_table_close(table);
+
+    /* a truncated compiled table is rebuilt */
+    assert(truncate(cache, statbuf.st_size - 1) == 0);
+    table = amp_asn_table_open(text);
+    check_table(table);
+    amp_asn_table_close(table);
+    assert(stat(cache, &statbuf) == 0);
+
+    /* if the compiled table can't be written it is kept in memory */
+    unlink(cache);
+    chmod(dir, 0555);
+    table = amp_asn_table_open(text);
+    check_table(table);
+    amp_asn_table_close(table);
+    chmod(dir, 0755);
+
+    unlink(cache);
+    unlink(text);
+    rmdir(dir);
+
+    return 0;
+}
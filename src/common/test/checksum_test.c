@@ -38,11 +38,36 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include "checksum.h"
 
 #define MAXLEN 32
+#define LONGLEN 1501
+
+/*
+ * The original scalar checksum, to compare the wider version against.
+ */
+static uint16_t reference_checksum(uint16_t *data, int length) {
+    uint64_t sum = 0;
+
+    while ( length > 1 ) {
+        sum += *data++;
+        length -= 2;
+    }
+
+    if ( length > 0 ) {
+        sum += *(unsigned char *)data;
+    }
+
+    while ( sum >> 16 ) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return (uint16_t)~sum;
+}
+
 /*
  * Check that checksums are being correctly calculated.
  *
@@ -51,6 +76,10 @@
  */
 int main(void) {
     char buffer[MAXLEN];
+    uint16_t longbuf[(LONGLEN + 1) / 2];
+    uint16_t check, word;
+    uint32_t dword, old;
+    int i;
 
     /* all zeroes */
     memset(buffer, 0, MAXLEN);
@@ -106,5 +135,38 @@ int main(void) {
     assert(checksum((uint16_t*)buffer, 16) == 0x6363);
     assert(checksum((uint16_t*)buffer, 32) == 0xc6c6);
 
+    /* random data of every length, including those longer than one lane */
+    srand(1);
+    for ( i = 0; i < (int)(sizeof(longbuf) / sizeof(uint16_t)); i++ ) {
+        longbuf[i] = rand();
+    }
+    for ( i = 0; i <= LONGLEN; i++ ) {
+        assert(checksum(longbuf, i) == reference_checksum(longbuf, i));
+    }
+
+    /* partial sums can be continued over more data */
+    assert(checksum_fold(checksum_add(checksum_add(0, longbuf, 102),
+                    (uint8_t*)longbuf + 102, LONGLEN - 102)) ==
+            checksum(longbuf, LONGLEN));
+
+    /* incremental updates match the checksum calculated from scratch */
+    for ( i = 0; i < 64; i++ ) {
+        check = checksum(longbuf, 64);
+        word = rand();
+        check = checksum_update16(check, longbuf[i % 32], word);
+        longbuf[i % 32] = word;
+        assert(check == checksum(longbuf, 64));
+
+        memcpy(&old, &longbuf[4], sizeof(old));
+        dword = rand();
+        check = checksum_update32(check, old, dword);
+        memcpy(&longbuf[4], &dword, sizeof(dword));
+        assert(check == checksum(longbuf, 64));
+    }
+
+    /* changing a word to the same value (including zero) changes nothing */
+    assert(checksum_update16(0x1234, 0, 0) == 0x1234);
+    assert(checksum_update16(0x1234, 0xabcd, 0xabcd) == 0x1234);
+
     return 0;
 }
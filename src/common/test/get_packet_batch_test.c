@@ -0,0 +1,136 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+
+#include "testlib.h"
+
+#define TEST_ROUNDS 100
+#define MAX_PACKET_LEN 512
+#define BATCH_SIZE 16
+
+/*
+ * Check that multiple packets are received correctly in a single batch by
+ * get_packets(), that the correct amount of data is received for each, and
+ * that batches larger than the space available are split correctly, on
+ * both ipv4 and ipv6 code paths.
+ */
+int main(void) {
+    int sockets[2];
+    struct socket_t amp_sockets;
+    struct packet_batch_t *batch;
+    char out_packet[MAX_PACKET_LEN];
+    int maxwait, length, count, received, bytes, i, j;
+    int sock, epfd;
+
+    /*
+     * use a pair of unix sockets to test sending data without relying on
+     * the network being present/sane/etc.
+     */
+    if ( socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) < 0 ) {
+        fprintf(stderr, "Failed to create socket pair: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /*
+     * The code under test doesn't actually care about the address family
+     * and will assume that "socket" is ipv4 and "socket6" is ipv6.
+     */
+    amp_sockets.socket = sockets[0];
+    amp_sockets.socket6 = sockets[1];
+
+    epfd = create_packet_poll(&amp_sockets);
+    assert(epfd >= 0);
+
+    batch = new_packet_batch(BATCH_SIZE, MAX_PACKET_LEN);
+    assert(batch);
+
+    for ( i = 0; i < TEST_ROUNDS; i++ ) {
+        /* send a varying number of packets, sometimes more than fit */
+        count = i % (BATCH_SIZE * 2);
+        sock = (i % 2) ? amp_sockets.socket : amp_sockets.socket6;
+
+        for ( j = 0; j < count; j++ ) {
+            /* fill the packet with some data we can check later */
+            length = (i + j) % (MAX_PACKET_LEN - 1) + 1;
+            memset(out_packet, j, length);
+            bytes = send(sock, out_packet, length, 0);
+            assert(bytes == length);
+        }
+
+        /* read until the socket is drained, checking each packet */
+        received = 0;
+        do {
+            maxwait = 1;
+            bytes = get_packets(epfd, &amp_sockets, batch, &maxwait);
+            assert(bytes == batch->count);
+            assert(batch->count <= BATCH_SIZE);
+
+            if ( batch->count > 0 ) {
+                /* data written to one socket is read from the other */
+                assert(batch->family == ((i % 2) ? AF_INET6 : AF_INET));
+            }
+
+            for ( j = 0; j < batch->count; j++, received++ ) {
+                length = (i + received) % (MAX_PACKET_LEN - 1) + 1;
+                memset(out_packet, received, length);
+                assert(batch->packets[j].length == length);
+                assert(memcmp(out_packet, batch->packets[j].data,
+                            length) == 0);
+                assert(batch->packets[j].time.tv_sec > 0);
+            }
+        } while ( batch->count > 0 );
+
+        assert(received == count);
+    }
+
+    free_packet_batch(batch);
+    close(epfd);
+    close(sockets[0]);
+    close(sockets[1]);
+
+    return 0;
+}
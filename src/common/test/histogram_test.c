@@ -0,0 +1,143 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "histogram.h"
+
+#define SAMPLES 100000
+
+/*
+ * Compare two signed 32 bit integers, used to sort the reference samples.
+ */
+static int cmp(const void *a, const void *b) {
+    int32_t x = *(int32_t*)a;
+    int32_t y = *(int32_t*)b;
+    return (x > y) - (x < y);
+}
+
+
+
+/*
+ * Check that a quantile estimate is within the error bounds of the real
+ * value - exact for small values, relative error for larger ones.
+ */
+static void check_estimate(int32_t estimate, int32_t actual) {
+    int64_t error = (int64_t)estimate - actual;
+    int64_t magnitude = actual < 0 ? -(int64_t)actual : actual;
+
+    if ( error < 0 ) {
+        error = -error;
+    }
+
+    if ( magnitude < HISTOGRAM_SUB_BUCKETS ) {
+        assert(error == 0);
+    } else {
+        assert(error <= magnitude / (HISTOGRAM_SUB_BUCKETS / 2));
+    }
+}
+
+
+
+/*
+ * Check that quantiles estimated from the histogram are close to those
+ * found by sorting all the samples, including negative samples and
+ * histograms that have been merged together.
+ */
+int main(void) {
+    struct histogram_t histogram, first, second;
+    int32_t *samples;
+    uint64_t rank;
+    int i;
+
+    samples = calloc(SAMPLES, sizeof(int32_t));
+
+    /* empty histogram has no values */
+    histogram_init(&histogram);
+    assert(histogram.count == 0);
+    assert(histogram_value_at_rank(&histogram, 0) == 0);
+
+    /* small values should be stored exactly */
+    for ( i = 0; i < HISTOGRAM_SUB_BUCKETS; i++ ) {
+        histogram_add(&histogram, i);
+    }
+    for ( i = 0; i < HISTOGRAM_SUB_BUCKETS; i++ ) {
+        assert(histogram_value_at_rank(&histogram, i) == i);
+    }
+
+    /* extreme values should be stored without overflowing */
+    histogram_init(&histogram);
+    histogram_add(&histogram, INT32_MIN);
+    histogram_add(&histogram, INT32_MAX);
+    assert(histogram_value_at_rank(&histogram, 0) == INT32_MIN);
+    assert(histogram_value_at_rank(&histogram, 1) == INT32_MAX);
+
+    /* a mix of values, half into each of two histograms that get merged */
+    histogram_init(&first);
+    histogram_init(&second);
+    srandom(1);
+    for ( i = 0; i < SAMPLES; i++ ) {
+        /* mostly positive values over a wide range, like rtt and jitter */
+        samples[i] = (random() % 2000000) - 200000;
+        histogram_add(i % 2 ? &first : &second, samples[i]);
+    }
+
+    histogram_init(&histogram);
+    histogram_merge(&histogram, &first);
+    histogram_merge(&histogram, &second);
+    assert(histogram.count == SAMPLES);
+
+    qsort(samples, SAMPLES, sizeof(int32_t), cmp);
+
+    assert(histogram.minimum == samples[0]);
+    assert(histogram.maximum == samples[SAMPLES - 1]);
+
+    for ( rank = 0; rank < SAMPLES; rank += 97 ) {
+        check_estimate(histogram_value_at_rank(&histogram, rank),
+                samples[rank]);
+    }
+    check_estimate(histogram_value_at_rank(&histogram, SAMPLES - 1),
+            samples[SAMPLES - 1]);
+
+    free(samples);
+
+    return 0;
+}
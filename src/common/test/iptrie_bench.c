@@ -0,0 +1,465 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <malloc.h>
+#include <arpa/inet.h>
+#include "iptrie.h"
+
+/* how many prefixes to store, and how many lookups to make */
+#define BENCH_IPV4_PREFIXES 100000
+#define BENCH_IPV6_PREFIXES 20000
+#define BENCH_QUERIES 65536
+#define BENCH_ROUNDS 32
+#define BENCH_LOOKUPS (BENCH_QUERIES * BENCH_ROUNDS)
+
+/*
+ * The previous pointer based binary trie, kept here for comparison. Every
+ * node (including the internal branching nodes) is a separate allocation
+ * with another allocation for the address.
+ */
+struct pointer_node {
+    int64_t as;
+    uint8_t prefix;
+    struct sockaddr *address;
+
+    struct pointer_node *left;
+    struct pointer_node *right;
+    struct pointer_node *next;
+};
+
+/*
+ * Get the bit in the address at the given zero-based index. Expects either
+ * an IPv4 or IPv6 address in network byte order.
+ */
+static int pointer_get_bit(struct sockaddr *address, int index) {
+    int offset;
+
+    if ( address == NULL || index < 0 ) {
+        return -1;
+    }
+
+    if ( address->sa_family == AF_INET ) {
+        if ( index > 31 ) {
+            return -1;
+        }
+
+        /* line up the one set bit with the index we want */
+        offset = ntohl(0x80000000 >> index);
+        return (((struct sockaddr_in*)address)->sin_addr.s_addr & offset)?1:0;
+
+    } else if ( address->sa_family == AF_INET6 ) {
+        int field;
+        if ( index > 127 ) {
+            return -1;
+        }
+
+        /* determine which 32bit block of the IPv6 address we need to check */
+        field = index / 16;
+
+        /* line up the one set bit with the index we want within the block */
+        offset = ntohs(0x8000 >> (index % 16));
+        return (((struct sockaddr_in6*)
+                address)->sin6_addr.s6_addr16[field] & offset)?1:0;
+
+    }
+
+    return -1;
+}
+
+
+
+/*
+ * Count the number of initial bits that match in a pair of addresses. Accepts
+ * either IPv4 or IPv6 addresses, in network byte order.
+ */
+static int pointer_matching_length(struct sockaddr *a, struct sockaddr *b) {
+    int count = 0;
+
+    if ( a == NULL || b == NULL ) {
+        return -1;
+    }
+
+    if ( a->sa_family != b->sa_family ) {
+        return -1;
+    }
+
+    if ( a->sa_family == AF_INET ) {
+        struct sockaddr_in *a4 = (struct sockaddr_in*)a;
+        struct sockaddr_in *b4 = (struct sockaddr_in*)b;
+        int mask = 0x80000000;
+        int maxlen = 32;
+
+        /* count bits that are the same, from the left, stop when different */
+        while ( count < maxlen &&
+                (a4->sin_addr.s_addr & ntohl(mask)) ==
+                (b4->sin_addr.s_addr & ntohl(mask)) ) {
+            count++;
+            mask = (mask >> 1) | 0x80000000;
+        }
+
+    } else if ( a->sa_family == AF_INET6 ) {
+        struct sockaddr_in6 *a6 = (struct sockaddr_in6*)a;
+        struct sockaddr_in6 *b6 = (struct sockaddr_in6*)b;
+        int mask = 0x8000;
+        int maxlen = 128;
+        int i;
+
+        for ( i = 0; i < 8; i++ ) {
+            if ( a6->sin6_addr.s6_addr16[i] == b6->sin6_addr.s6_addr16[i] ) {
+                /* skip a whole block if it's the same, don't need to count */
+                count += 16;
+            } else {
+                /* count bits that are the same, from the left */
+                while ( count < maxlen &&
+                        (a6->sin6_addr.s6_addr16[i] & ntohs(mask)) ==
+                        (b6->sin6_addr.s6_addr16[i] & ntohs(mask)) ) {
+                    count++;
+                    mask = (mask >> 1) | 0x8000;
+                }
+                break;
+            }
+        }
+    }
+
+    return count;
+}
+
+
+
+/*
+ * Check if a pair of addresses are the same for the first prefix bits.
+ */
+static int pointer_prefix_matches(struct sockaddr *a, struct sockaddr *b,
+        uint8_t prefix) {
+    return pointer_matching_length(a, b) >= prefix;
+}
+
+
+
+/*
+ * Add or update an address with ASN in the trie. If the address does not
+ * exist then it will be added at the appropriate location, if it does exist
+ * then it will be updated.
+ */
+static struct pointer_node *pointer_trie_add(struct pointer_node *root,
+        struct sockaddr *address, uint8_t prefix, int64_t as) {
+
+    int cmp, len;
+
+    /* missing address, return the trie unchanged */
+    if ( address == NULL ) {
+        return root;
+    }
+
+    /* empty trie, add this address at the root */
+    if ( root == NULL ) {
+        struct pointer_node *node = malloc(sizeof(struct pointer_node));
+        node->as = as;
+        node->prefix = prefix;
+        if ( address->sa_family == AF_INET ) {
+            node->address = malloc(sizeof(struct sockaddr_in));
+            memcpy(node->address, address, sizeof(struct sockaddr_in));
+        } else {
+            node->address = malloc(sizeof(struct sockaddr_in6));
+            memcpy(node->address, address, sizeof(struct sockaddr_in6));
+        }
+        node->left = NULL;
+        node->right = NULL;
+        node->next = NULL;
+        return node;
+    }
+
+    /* there is a prefix set and this address matches, update the ASN */
+    if ( prefix == root->prefix &&
+            pointer_prefix_matches(root->address, address, prefix) ) {
+        root->as = as;
+        return root;
+    }
+
+
+    /*
+     * Prefix and address don't match, see how similar this node actually is.
+     * If it matches more than the node prefix, limit it... we have more
+     * nodes that we have to check below for a better match first.
+     */
+    if ( (len = pointer_matching_length(root->address, address)) >
+            root->prefix ) {
+        len = root->prefix;
+    }
+
+    /* get the first bit that didn't match */
+    cmp = pointer_get_bit(address, len);
+
+    /*
+     * If the matching prefix length is shorter than the prefix length already
+     * at this node, then we need to insert a new branching node at this
+     * location. The address we are trying to add and the node currently here
+     * will become children of this new branching node.
+     */
+    if ( len < root->prefix ) {
+        struct pointer_node *node = malloc(sizeof(struct pointer_node));
+        node->as = 0;
+        node->prefix = len;
+        if ( address->sa_family == AF_INET ) {
+            node->address = malloc(sizeof(struct sockaddr_in));
+            memcpy(node->address, address, sizeof(struct sockaddr_in));
+        } else {
+            node->address = malloc(sizeof(struct sockaddr_in6));
+            memcpy(node->address, address, sizeof(struct sockaddr_in6));
+        }
+        node->left = NULL;
+        node->right = NULL;
+        node->next = NULL;
+
+        if ( cmp == 0 ) {
+            /* the next bit is a zero, add it down the left branch */
+            node->left = pointer_trie_add(node->left, address, prefix, as);
+            /* and put the existing node on the right branch */
+            node->right = root;
+        } else if ( cmp != 0 ) {
+            /* the next bit is a one, add it down the right branch */
+            node->right = pointer_trie_add(node->right, address, prefix, as);
+            /* and put the existing node on the left branch */
+            node->left = root;
+        }
+
+        return node;
+    }
+
+    /*
+     * otherwise, we match the address here so far but it isn't the end,
+     * keep looking down the appropriate branch for where we should insert.
+     */
+    if ( cmp == 0 ) {
+        /* the next bit is a zero, go down the left branch */
+        root->left = pointer_trie_add(root->left, address, prefix, as);
+    } else if ( cmp != 0 ) {
+        /* the next bit is a one, go down the right branch */
+        root->right = pointer_trie_add(root->right, address, prefix, as);
+    }
+
+    return root;
+}
+
+
+/*
+ *
+ */
+static int64_t pointer_trie_lookup(struct pointer_node *root,
+        struct sockaddr *address) {
+    int next;
+
+    /* empty trie or missing address, can't return a useful AS number */
+    if ( root == NULL || address == NULL ) {
+        return -1;
+    }
+
+    /* if the address doesn't match at this prefix, it isn't present */
+    if ( !pointer_prefix_matches(root->address, address, root->prefix) ) {
+        return -1;
+    }
+
+    /* if this is a leaf node, then it matches what we were looking for */
+    if ( root->left == NULL && root->right == NULL ) {
+        return root->as;
+    }
+
+    /* compare the next bit in the address to see which branch we should take */
+    next = pointer_get_bit(address, root->prefix);
+
+    /* non-leaf node, continue down the trie and try the next branch */
+    if ( next == 0 && root->left ) {
+        return pointer_trie_lookup(root->left, address);
+    } else if ( next == 1 && root->right ) {
+        return pointer_trie_lookup(root->right, address);
+    }
+
+    /* no branch where expected, the ASN isn't here */
+    return -1;
+}
+
+
+
+
+static void pointer_trie_clear(struct pointer_node *root) {
+    if ( root == NULL ) {
+        return;
+    }
+
+    pointer_trie_clear(root->left);
+    pointer_trie_clear(root->right);
+
+    free(root->address);
+    free(root);
+}
+
+
+
+static size_t get_allocated_bytes(void) {
+    return mallinfo2().uordblks;
+}
+
+
+
+static double get_elapsed(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) +
+        (now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+
+
+/*
+ * Build the same set of random /24 and /64 prefixes (as the traceroute test
+ * and ASN lookups use) in both tries, then compare the memory used and how
+ * quickly random addresses within them can be looked up.
+ */
+int main(void) {
+    struct iptrie trie = { NULL, NULL };
+    struct pointer_node *ipv4 = NULL, *ipv6 = NULL;
+    struct sockaddr_storage *addresses;
+    struct sockaddr_storage *queries;
+    struct timespec start;
+    size_t before, pointer_bytes, trie_bytes;
+    double pointer_time, trie_time;
+    int64_t pointer_sum = 0, trie_sum = 0;
+    int count = BENCH_IPV4_PREFIXES + BENCH_IPV6_PREFIXES;
+    int i, j;
+
+    srandom(1);
+    addresses = calloc(count, sizeof(struct sockaddr_storage));
+    queries = calloc(BENCH_QUERIES, sizeof(struct sockaddr_storage));
+
+    for ( i = 0; i < count; i++ ) {
+        if ( i < BENCH_IPV4_PREFIXES ) {
+            struct sockaddr_in *addr = (struct sockaddr_in*)&addresses[i];
+            addr->sin_family = AF_INET;
+            addr->sin_addr.s_addr = random();
+        } else {
+            struct sockaddr_in6 *addr = (struct sockaddr_in6*)&addresses[i];
+            addr->sin6_family = AF_INET6;
+            addr->sin6_addr.s6_addr32[0] = htonl(0x20010db8);
+            for ( j = 1; j < 4; j++ ) {
+                addr->sin6_addr.s6_addr32[j] = random();
+            }
+        }
+    }
+
+    /* look up other addresses in the same prefixes, with some misses */
+    for ( i = 0; i < BENCH_QUERIES; i++ ) {
+        queries[i] = addresses[random() % count];
+        if ( queries[i].ss_family == AF_INET ) {
+            struct sockaddr_in *addr = (struct sockaddr_in*)&queries[i];
+            addr->sin_addr.s_addr ^= htonl(random() % 512);
+        } else {
+            struct sockaddr_in6 *addr = (struct sockaddr_in6*)&queries[i];
+            addr->sin6_addr.s6_addr32[1] ^= htonl(random() % 2);
+            addr->sin6_addr.s6_addr32[3] = random();
+        }
+    }
+
+    before = get_allocated_bytes();
+    for ( i = 0; i < count; i++ ) {
+        if ( addresses[i].ss_family == AF_INET ) {
+            ipv4 = pointer_trie_add(ipv4, (struct sockaddr*)&addresses[i],
+                    24, i);
+        } else {
+            ipv6 = pointer_trie_add(ipv6, (struct sockaddr*)&addresses[i],
+                    64, i);
+        }
+    }
+    pointer_bytes = get_allocated_bytes() - before;
+
+    before = get_allocated_bytes();
+    for ( i = 0; i < count; i++ ) {
+        iptrie_add(&trie, (struct sockaddr*)&addresses[i],
+                addresses[i].ss_family == AF_INET ? 24 : 64, i);
+    }
+    trie_bytes = get_allocated_bytes() - before;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < BENCH_LOOKUPS; i++ ) {
+        struct sockaddr_storage *query = &queries[i % BENCH_QUERIES];
+        pointer_sum += pointer_trie_lookup(
+                query->ss_family == AF_INET ? ipv4 : ipv6,
+                (struct sockaddr*)query);
+    }
+    pointer_time = get_elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < BENCH_LOOKUPS; i++ ) {
+        trie_sum += iptrie_lookup_as(&trie,
+                (struct sockaddr*)&queries[i % BENCH_QUERIES]);
+    }
+    trie_time = get_elapsed(&start);
+
+    /* both should have found exactly the same things */
+    for ( i = 0; i < BENCH_QUERIES; i++ ) {
+        assert(pointer_trie_lookup(
+                    queries[i].ss_family == AF_INET ? ipv4 : ipv6,
+                    (struct sockaddr*)&queries[i]) ==
+                iptrie_lookup_as(&trie, (struct sockaddr*)&queries[i]));
+    }
+    assert(pointer_sum == trie_sum);
+
+    printf("%d prefixes (%d IPv4 /24, %d IPv6 /64), %d lookups\n", count,
+            BENCH_IPV4_PREFIXES, BENCH_IPV6_PREFIXES, BENCH_LOOKUPS);
+    printf("pointer trie:  %8.0f lookups/s, %9zu bytes (%.1f per prefix)\n",
+            BENCH_LOOKUPS / pointer_time, pointer_bytes,
+            (double)pointer_bytes / count);
+    printf("multibit trie: %8.0f lookups/s, %9zu bytes (%.1f per prefix)\n",
+            BENCH_LOOKUPS / trie_time, trie_bytes,
+            (double)trie_bytes / count);
+
+    pointer_trie_clear(ipv4);
+    pointer_trie_clear(ipv6);
+    iptrie_clear(&trie);
+    free(addresses);
+    free(queries);
+
+    return 0;
+}
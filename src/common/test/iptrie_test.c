@@ -0,0 +1,189 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "iptrie.h"
+
+static struct sockaddr_storage make_address(char *str) {
+    struct sockaddr_storage addr;
+
+    memset(&addr, 0, sizeof(addr));
+
+    if ( inet_pton(AF_INET, str, &((struct sockaddr_in*)&addr)->sin_addr) ) {
+        addr.ss_family = AF_INET;
+    } else {
+        assert(inet_pton(AF_INET6, str,
+                    &((struct sockaddr_in6*)&addr)->sin6_addr) == 1);
+        addr.ss_family = AF_INET6;
+    }
+
+    return addr;
+}
+
+static void add(struct iptrie *trie, char *str, uint8_t prefix, int64_t as) {
+    struct sockaddr_storage addr = make_address(str);
+    iptrie_add(trie, (struct sockaddr*)&addr, prefix, as);
+}
+
+static int64_t lookup(struct iptrie *trie, char *str) {
+    struct sockaddr_storage addr = make_address(str);
+    return iptrie_lookup_as(trie, (struct sockaddr*)&addr);
+}
+
+static int count_leaf(iptrie_node_t *node, void *data) {
+    assert(node->address == (struct sockaddr*)&node->addr);
+    (*(int*)data)++;
+    return 0;
+}
+
+static int stop_at_leaf(iptrie_node_t *node, void *data) {
+    (void)node;
+    (*(int*)data)++;
+    return -1;
+}
+
+/*
+ * Check that prefixes can be added and updated, that lookups find the most
+ * specific prefix, and that every added prefix is visited.
+ */
+int main(void) {
+    struct iptrie trie = { NULL, NULL };
+    iplist_t *list;
+    char str[INET_ADDRSTRLEN];
+    int count;
+    int i;
+
+    /* nothing is found in an empty trie */
+    assert(iptrie_is_empty(&trie));
+    assert(lookup(&trie, "192.0.2.1") == -1);
+    assert(lookup(&trie, "2001:db8::1") == -1);
+
+    /* the usual /24 and /64 prefixes, with the addresses that were added */
+    add(&trie, "192.0.2.1", 24, 64496);
+    add(&trie, "198.51.100.1", 24, 64497);
+    add(&trie, "2001:db8:1:2::1", 64, 64498);
+    assert(!iptrie_is_empty(&trie));
+
+    assert(lookup(&trie, "192.0.2.200") == 64496);
+    assert(lookup(&trie, "198.51.100.0") == 64497);
+    assert(lookup(&trie, "192.0.3.1") == -1);
+    assert(lookup(&trie, "2001:db8:1:2:ffff::1") == 64498);
+    assert(lookup(&trie, "2001:db8:1:3::1") == -1);
+
+    /* adding the same prefix again updates it rather than adding another */
+    add(&trie, "192.0.2.99", 24, 64499);
+    assert(lookup(&trie, "192.0.2.1") == 64499);
+    count = 0;
+    assert(iptrie_on_all_leaves(&trie, count_leaf, &count) == 0);
+    assert(count == 3);
+
+    /* prefixes that aren't a whole number of bytes, nested in each other */
+    add(&trie, "10.0.0.0", 8, 1);
+    add(&trie, "10.128.0.0", 9, 2);
+    add(&trie, "10.192.0.0", 11, 3);
+    add(&trie, "10.192.0.1", 32, 4);
+    assert(lookup(&trie, "10.1.2.3") == 1);
+    assert(lookup(&trie, "10.127.255.255") == 1);
+    assert(lookup(&trie, "10.128.0.0") == 2);
+    assert(lookup(&trie, "10.192.0.0") == 3);
+    assert(lookup(&trie, "10.223.255.255") == 3);
+    assert(lookup(&trie, "10.224.0.0") == 2);
+    assert(lookup(&trie, "10.192.0.1") == 4);
+    assert(lookup(&trie, "11.0.0.0") == -1);
+
+    /* a default route covers everything else */
+    add(&trie, "0.0.0.0", 0, 5);
+    assert(lookup(&trie, "11.0.0.0") == 5);
+    assert(lookup(&trie, "255.255.255.255") == 5);
+    assert(lookup(&trie, "192.0.2.1") == 64499);
+
+    add(&trie, "2001:db8::", 32, 6);
+    add(&trie, "2001:db8::1", 128, 7);
+    assert(lookup(&trie, "2001:db8::1") == 7);
+    assert(lookup(&trie, "2001:db8::2") == 6);
+    assert(lookup(&trie, "2001:db8:1:2::1") == 64498);
+
+    /* invalid prefix lengths are ignored */
+    add(&trie, "192.0.2.0", 33, 8);
+    add(&trie, "2001:db8::", 129, 8);
+
+    /* every prefix is visited, and the traversal stops on error */
+    count = 0;
+    assert(iptrie_on_all_leaves(&trie, count_leaf, &count) == 0);
+    assert(count == 10);
+    count = 0;
+    assert(iptrie_on_all_leaves(&trie, stop_at_leaf, &count) < 0);
+    assert(count == 1);
+
+    for ( count = 0, list = iptrie_to_list(&trie); list; list = list->next ) {
+        assert(iptrie_lookup_as(&trie, list->address) == list->as ||
+                list->prefix < 24);
+        count++;
+    }
+    assert(count == 10);
+
+    iptrie_clear(&trie);
+    assert(iptrie_is_empty(&trie));
+    assert(lookup(&trie, "192.0.2.1") == -1);
+
+    /* enough prefixes to fill levels and move their packed indices */
+    for ( i = 0; i < 256 * 16; i++ ) {
+        snprintf(str, sizeof(str), "10.%d.%d.1", (i * 7) % 256, i / 256);
+        add(&trie, str, 24, i);
+    }
+
+    for ( i = 0; i < 256 * 16; i++ ) {
+        snprintf(str, sizeof(str), "10.%d.%d.200", (i * 7) % 256, i / 256);
+        assert(lookup(&trie, str) == i);
+    }
+    assert(lookup(&trie, "10.0.16.1") == -1);
+
+    count = 0;
+    assert(iptrie_on_all_leaves(&trie, count_leaf, &count) == 0);
+    assert(count == 256 * 16);
+
+    iptrie_clear(&trie);
+
+    return 0;
+}
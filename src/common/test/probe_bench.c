@@ -0,0 +1,209 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/ip_icmp.h>
+#include "probe.h"
+#include "checksum.h"
+
+/* how many probes to build for each packet size */
+#define BENCH_PACKETS 2000000
+
+/*
+ * The original scalar checksum, which is what probes were built with before.
+ */
+static uint16_t scalar_checksum(uint16_t *data, int length) {
+    uint64_t sum = 0;
+
+    while ( length > 1 ) {
+        sum += *data++;
+        length -= 2;
+    }
+
+    if ( length > 0 ) {
+        sum += *(unsigned char *)data;
+    }
+
+    while ( sum >> 16 ) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return (uint16_t)~sum;
+}
+
+static double get_elapsed(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) +
+        (now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+/*
+ * Build an ICMP echo request from scratch for every probe, the way that the
+ * tests used to.
+ */
+static uint16_t rebuild(uint8_t *packet, uint16_t size, int index,
+        uint16_t ident, uint16_t magic) {
+    struct icmphdr *icmp = (struct icmphdr*)packet;
+
+    memset(packet, 0, size);
+    icmp->type = ICMP_ECHO;
+    icmp->un.echo.id = htons(ident);
+    icmp->un.echo.sequence = htons(index);
+    memcpy(packet + sizeof(struct icmphdr), &magic, sizeof(magic));
+    icmp->checksum = scalar_checksum((uint16_t*)packet, size);
+
+    return icmp->checksum;
+}
+
+/*
+ * Update a template ICMP echo request with the fields for the next probe.
+ */
+static uint16_t update(struct probe_template_t *probe, int index,
+        uint16_t magic) {
+    probe_template_set16(probe, offsetof(struct icmphdr, un.echo.sequence),
+            index);
+    probe_template_set(probe, sizeof(struct icmphdr), &magic, sizeof(magic));
+
+    return ((struct icmphdr*)probe->packet)->checksum;
+}
+
+/*
+ * Compare how quickly ICMP probes can be built from scratch and from a
+ * template, and how quickly a full checksum can be calculated by the old and
+ * new checksum functions for packets of different sizes.
+ */
+int main(void) {
+    struct probe_template_t *probe;
+    uint8_t *packet;
+    uint16_t sizes[] = {64, 512, 1500, 9000};
+    struct timespec start;
+    double rebuild_time, template_time, scalar_time, wide_time;
+    uint64_t rebuild_sum, template_sum, scalar_sum, wide_sum;
+    uint16_t ident = 0x1234;
+    unsigned int i, j;
+
+    printf("%d probes per size\n", BENCH_PACKETS);
+    printf("%5s %14s %14s %12s %12s\n", "size", "rebuild pps", "template pps",
+            "scalar MB/s", "wide MB/s");
+
+    for ( i = 0; i < sizeof(sizes) / sizeof(uint16_t); i++ ) {
+        uint16_t size = sizes[i];
+
+        packet = calloc(1, size);
+        probe = new_probe_template(size, offsetof(struct icmphdr, checksum));
+        ((struct icmphdr*)probe->packet)->type = ICMP_ECHO;
+        ((struct icmphdr*)probe->packet)->un.echo.id = htons(ident);
+        probe_template_checksum(probe);
+
+        rebuild_sum = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for ( j = 0; j < BENCH_PACKETS; j++ ) {
+            rebuild_sum += rebuild(packet, size, j, ident, j * 7);
+        }
+        rebuild_time = get_elapsed(&start);
+
+        template_sum = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for ( j = 0; j < BENCH_PACKETS; j++ ) {
+            template_sum += update(probe, j, j * 7);
+        }
+        template_time = get_elapsed(&start);
+
+        /* both methods should have produced exactly the same packets */
+        if ( rebuild_sum != template_sum ||
+                memcmp(packet, probe->packet, size) != 0 ) {
+            printf("template and rebuilt packets differ!\n");
+            return 1;
+        }
+
+        /*
+         * Fill with random data to compare the full checksum on its own. One
+         * byte is changed each time so the checksum can't be hoisted out of
+         * the loop.
+         */
+        srand(size);
+        for ( j = 0; j < size; j++ ) {
+            packet[j] = rand();
+        }
+
+        scalar_sum = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for ( j = 0; j < BENCH_PACKETS; j++ ) {
+            packet[j % size] = j;
+            scalar_sum += scalar_checksum((uint16_t*)packet, size);
+        }
+        scalar_time = get_elapsed(&start);
+
+        srand(size);
+        for ( j = 0; j < size; j++ ) {
+            packet[j] = rand();
+        }
+
+        wide_sum = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for ( j = 0; j < BENCH_PACKETS; j++ ) {
+            packet[j % size] = j;
+            wide_sum += checksum((uint16_t*)packet, size);
+        }
+        wide_time = get_elapsed(&start);
+
+        if ( scalar_sum != wide_sum ) {
+            printf("scalar and wide checksums differ!\n");
+            return 1;
+        }
+
+        printf("%5d %14.0f %14.0f %12.0f %12.0f\n", size,
+                BENCH_PACKETS / rebuild_time, BENCH_PACKETS / template_time,
+                (double)size * BENCH_PACKETS / scalar_time / 1000000,
+                (double)size * BENCH_PACKETS / wide_time / 1000000);
+
+        free_probe_template(probe);
+        free(packet);
+    }
+
+    return 0;
+}
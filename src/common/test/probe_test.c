@@ -0,0 +1,157 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "probe.h"
+#include "checksum.h"
+
+#define MAXLEN 1501
+
+/*
+ * Calculate the checksum of the probe from scratch, including any pseudo
+ * header, to compare against the incrementally updated one.
+ */
+static uint16_t full_checksum(struct probe_template_t *probe,
+        uint8_t *pseudo, int pseudolen) {
+    uint8_t buffer[pseudolen + probe->length];
+
+    if ( pseudolen > 0 ) {
+        memcpy(buffer, pseudo, pseudolen);
+    }
+    memcpy(buffer + pseudolen, probe->packet, probe->length);
+    memset(buffer + pseudolen + probe->checksum, 0, sizeof(uint16_t));
+
+    return checksum((uint16_t*)buffer, pseudolen + probe->length);
+}
+
+static uint16_t get_checksum(struct probe_template_t *probe) {
+    uint16_t check;
+    memcpy(&check, probe->packet + probe->checksum, sizeof(check));
+    return check;
+}
+
+/*
+ * Check that probe templates keep their checksum correct as fields and
+ * pseudo headers are changed, for packets of many different lengths and
+ * fields at both even and odd offsets.
+ */
+int main(void) {
+    struct probe_template_t *probe;
+    uint8_t pseudo[40];
+    uint8_t data[16];
+    uint16_t length;
+    int i, j;
+
+    srand(1);
+
+    for ( length = 4; length <= MAXLEN; length += 7 ) {
+        /* an empty template has a valid checksum straight away */
+        probe = new_probe_template(length, 2);
+        assert(get_checksum(probe) == full_checksum(probe, NULL, 0));
+
+        /* fill it directly with random data, then checksum the lot */
+        for ( i = 0; i < length; i++ ) {
+            probe->packet[i] = rand();
+        }
+        probe_template_checksum(probe);
+        assert(get_checksum(probe) == full_checksum(probe, NULL, 0));
+
+        memset(pseudo, 0, sizeof(pseudo));
+        for ( i = 0; i < 32; i++ ) {
+            int offset, size;
+
+            /*
+             * Patch fields of different sizes away from the checksum. The
+             * first field is never zero, so that the packet is never all
+             * zeroes (where the incremental update gives -0 instead of +0).
+             */
+            probe_template_set16(probe, 0, 0x0102 * (i + 1));
+            assert(probe->packet[0] == i + 1);
+            assert(probe->packet[1] == 2 * (i + 1));
+            assert(get_checksum(probe) == full_checksum(probe, pseudo, 40));
+
+            if ( length >= 8 ) {
+                uint32_t value = rand();
+                probe_template_set32(probe, 4, value);
+                assert(memcmp(probe->packet + 4, &(uint32_t){htonl(value)},
+                            sizeof(value)) == 0);
+                assert(get_checksum(probe) ==
+                        full_checksum(probe, pseudo, 40));
+            }
+
+            size = 1 + rand() % sizeof(data);
+            if ( length >= 4 + size ) {
+                offset = 4 + rand() % (length - 4 - size + 1);
+                for ( j = 0; j < size; j++ ) {
+                    data[j] = rand();
+                }
+                probe_template_set(probe, offset, data, size);
+                assert(memcmp(probe->packet + offset, data, size) == 0);
+                assert(get_checksum(probe) ==
+                        full_checksum(probe, pseudo, 40));
+            }
+
+            /* and change the pseudo header */
+            for ( j = 0; j < 40; j++ ) {
+                pseudo[j] = rand();
+            }
+            probe_template_set_pseudo_header(probe, pseudo, 40);
+            assert(get_checksum(probe) == full_checksum(probe, pseudo, 40));
+        }
+
+        /* a full recalculation still includes the pseudo header */
+        probe_template_checksum(probe);
+        assert(get_checksum(probe) == full_checksum(probe, pseudo, 40));
+
+        free_probe_template(probe);
+    }
+
+    /* templates without a checksum just have the data copied in */
+    probe = new_probe_template(64, PROBE_NO_CHECKSUM);
+    probe_template_set16(probe, 0, 0x1234);
+    probe_template_set32(probe, 2, 0x56789abc);
+    assert(memcmp(probe->packet, "\x12\x34\x56\x78\x9a\xbc\x00", 7) == 0);
+    free_probe_template(probe);
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+
+#include "testlib.h"
+
+#define TEST_ROUNDS 100
+#define MAX_PACKET_LEN 512
+
+
+/*
+ * Check that packets sent through a transmit queue arrive intact and in
+ * order, that bursts are sent in full when there is no inter-packet delay,
+ * and that the delay is enforced between paced packets, including across
+ * separate flushes of the queue.
+ */
+int main(void) {
+    struct addrinfo dest;
+    struct send_queue_t *queue;
+    struct timeval sent[SEND_QUEUE_SIZE];
+    struct timeval start, end;
+    int sockets[2];
+    char out_packet[MAX_PACKET_LEN];
+    char in_packet[MAX_PACKET_LEN];
+    int length, count, result, i, j;
+    int64_t duration;
+    int total = 0;
+
+    /*
+     * use a pair of unix sockets to test sending data without relying on
+     * the network being present/sane/etc.
+     */
+    if ( socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) < 0 ) {
+        fprintf(stderr, "Failed to create socket pair: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* we don't need a real address for testing, our socket pair is connected */
+    dest.ai_addr = NULL;
+    dest.ai_addrlen = 0;
+
+    /* unpaced queue should send the whole burst at once */
+    queue = new_send_queue(sockets[0], SEND_QUEUE_SIZE, MAX_PACKET_LEN, 0, 0);
+
+    for ( i = 0; i < TEST_ROUNDS; i++ ) {
+        count = (i % SEND_QUEUE_SIZE) + 1;
+
+        for ( j = 0; j < count; j++ ) {
+            length = (i + j) % (MAX_PACKET_LEN - 1) + 1;
+            memset(out_packet, j, length);
+            result = queue_packet(queue, out_packet, length, &dest, &sent[j]);
+            assert(result == 0);
+        }
+
+        /* the queue is full, so this one shouldn't fit */
+        if ( count == SEND_QUEUE_SIZE ) {
+            result = queue_packet(queue, out_packet, 1, &dest, NULL);
+            assert(result < 0);
+        }
+
+        result = flush_send_queue(queue);
+        assert(result == count);
+
+        for ( j = 0; j < count; j++ ) {
+            length = (i + j) % (MAX_PACKET_LEN - 1) + 1;
+            memset(out_packet, j, length);
+            result = recv(sockets[1], in_packet, MAX_PACKET_LEN, 0);
+            assert(result == length);
+            assert(memcmp(out_packet, in_packet, length) == 0);
+            assert(timerisset(&sent[j]));
+        }
+    }
+
+    free_send_queue(queue);
+
+    /* paced queue should keep packets apart, even between flushes */
+    queue = new_send_queue(sockets[0], SEND_QUEUE_SIZE, MAX_PACKET_LEN,
+            MIN_INTER_PACKET_DELAY, 0);
+
+    gettimeofday(&start, NULL);
+
+    for ( i = 0; i < TEST_ROUNDS; i++ ) {
+        count = (i % 4) + 1;
+
+        for ( j = 0; j < count; j++ ) {
+            out_packet[0] = total + j;
+            result = queue_packet(queue, out_packet, 1, &dest, NULL);
+            assert(result == 0);
+        }
+
+        result = flush_send_queue(queue);
+        assert(result == count);
+
+        for ( j = 0; j < count; j++, total++ ) {
+            result = recv(sockets[1], in_packet, MAX_PACKET_LEN, 0);
+            assert(result == 1);
+            assert(in_packet[0] == (char)total);
+        }
+    }
+
+    gettimeofday(&end, NULL);
+
+    /* the first packet goes immediately, every other one has to wait */
+    duration = DIFF_TV_US(end, start);
+    assert(duration >= ((total - 1) * MIN_INTER_PACKET_DELAY));
+
+    free_send_queue(queue);
+
+    close(sockets[0]);
+    close(sockets[1]);
+
+    return 0;
+}
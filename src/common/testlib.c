@@ -51,6 +51,8 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <getopt.h>
+#include <sys/epoll.h>
+#include <time.h>
 #include <linux/net_tstamp.h>
 #include <linux/errqueue.h>
 
@@ -62,6 +64,24 @@
 #include "global.h"
 
 
+#ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
+/*
+ * This could be associated more closely with each individual socket, but
+ * for now lets store the id of the packets we send here so that calling
+ * functions don't need to do any extra work. We make the assumption that
+ * tests will generally use file descriptors with lower numbers, so we can
+ * use a small array indexed by file descriptor to store the packet count
+ * for the values of descriptor that we expect to see, which are then used
+ * to match the correct timestamp message. The count is reset whenever
+ * timestamping is enabled on a socket, as the kernel starts counting again
+ * from zero for that socket (which may be reusing a descriptor from an
+ * earlier test run in the same process).
+ * TODO attach packet count information to the socket and pass it around.
+ */
+static uint32_t tx_packet_id[MAX_TX_TIMESTAMP_FD];
+#endif
+
+
 
 /*
  * The ELF binary layout means we should have all of the command line
@@ -267,11 +287,11 @@ inline static int retrieve_timestamp(struct cmsghdr *c, struct timeval *now) {
 
 
 /*
- * Try to get the best timestamp that is available to us,
- * in order of preference:
- * SO_TIMESTAMPING (HW then SW), SO_TIMESTAMP, SIOCGSTAMP and gettimeofday().
+ * Try to get a timestamp from the control messages attached to a received
+ * packet, using SO_TIMESTAMPING (HW then SW) or SO_TIMESTAMP. Returns 1 if
+ * a timestamp was found, otherwise 0.
  */
-static void get_timestamp(int sock, struct msghdr *msg, struct timeval *now) {
+static int get_control_timestamp(struct msghdr *msg, struct timeval *now) {
     struct cmsghdr *c;
 
     assert(msg);
@@ -285,17 +305,32 @@ static void get_timestamp(int sock, struct msghdr *msg, struct timeval *now) {
         if ( c->cmsg_level == SOL_SOCKET ) {
 #ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
             if ( retrieve_timestamping(c, now) ) {
-                return;
+                return 1;
             }
 #endif
 #ifdef SO_TIMESTAMP
             if ( retrieve_timestamp(c, now) ) {
-                return;
+                return 1;
             }
 #endif
         }
     }
 
+    return 0;
+}
+
+
+
+/*
+ * Try to get the best timestamp that is available to us,
+ * in order of preference:
+ * SO_TIMESTAMPING (HW then SW), SO_TIMESTAMP, SIOCGSTAMP and gettimeofday().
+ */
+static void get_timestamp(int sock, struct msghdr *msg, struct timeval *now) {
+    if ( get_control_timestamp(msg, now) ) {
+        return;
+    }
+
     /* next try using SIOCGSTAMP to get a timestamp */
 #ifdef SIOCGSTAMP
     if ( ioctl(sock, SIOCGSTAMP, now) < 0 ) {
@@ -553,6 +588,264 @@ int get_packet(struct socket_t *sockets, char *buf, int buflen,
 
 
 
+/*
+ * Allocate storage for a batch of up to size packets, each up to buflen
+ * bytes long, that can be filled by a single call to get_packet_batch().
+ */
+struct packet_batch_t *new_packet_batch(int size, int buflen) {
+    struct packet_batch_t *batch;
+    int i;
+
+    assert(size > 0);
+    assert(buflen > 0);
+
+    batch = calloc(1, sizeof(struct packet_batch_t));
+    batch->size = size;
+    batch->buflen = buflen;
+    batch->packets = calloc(size, sizeof(struct packet_t));
+    batch->msgs = calloc(size, sizeof(struct mmsghdr));
+    batch->iov = calloc(size, sizeof(struct iovec));
+    batch->buffers = calloc(size, buflen);
+    batch->control = calloc(size, PACKET_BATCH_CONTROL_LEN);
+
+    for ( i = 0; i < size; i++ ) {
+        batch->packets[i].data = batch->buffers + (i * buflen);
+        batch->iov[i].iov_base = batch->packets[i].data;
+        batch->iov[i].iov_len = buflen;
+    }
+
+    return batch;
+}
+
+
+
+/*
+ * Free a packet batch and all the packet storage belonging to it.
+ */
+void free_packet_batch(struct packet_batch_t *batch) {
+    if ( batch == NULL ) {
+        return;
+    }
+
+    free(batch->packets);
+    free(batch->msgs);
+    free(batch->iov);
+    free(batch->buffers);
+    free(batch->control);
+    free(batch);
+}
+
+
+
+/*
+ * Read as many packets as are immediately available on the socket (up to
+ * the size of the batch) using a single recvmmsg() call. Doesn't block, so
+ * should only be called once the socket is known to be readable. Returns
+ * the number of packets read, or -1 on error.
+ */
+int get_packet_batch(int sock, struct packet_batch_t *batch) {
+    struct timeval now;
+    int count;
+    int i;
+
+    assert(sock >= 0);
+    assert(batch);
+
+    batch->count = 0;
+
+    /* the message headers are modified by recvmmsg(), so reset them */
+    for ( i = 0; i < batch->size; i++ ) {
+        struct msghdr *msg = &batch->msgs[i].msg_hdr;
+        msg->msg_name = &batch->packets[i].from;
+        msg->msg_namelen = sizeof(struct sockaddr_storage);
+        msg->msg_iov = &batch->iov[i];
+        msg->msg_iovlen = 1;
+        msg->msg_control = batch->control + (i * PACKET_BATCH_CONTROL_LEN);
+        msg->msg_controllen = PACKET_BATCH_CONTROL_LEN;
+        msg->msg_flags = 0;
+    }
+
+    do {
+        count = recvmmsg(sock, batch->msgs, batch->size, MSG_DONTWAIT, NULL);
+    } while ( count < 0 && errno == EINTR );
+
+    if ( count < 0 ) {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            return 0;
+        }
+        Log(LOG_WARNING, "Failed to recvmmsg(): %s", strerror(errno));
+        return -1;
+    }
+
+    /*
+     * Packets without a kernel timestamp get the time they were read, rather
+     * than using SIOCGSTAMP which only knows about the most recent packet.
+     */
+    gettimeofday(&now, NULL);
+
+    for ( i = 0; i < count; i++ ) {
+        batch->packets[i].length = batch->msgs[i].msg_len;
+        if ( !get_control_timestamp(&batch->msgs[i].msg_hdr,
+                    &batch->packets[i].time) ) {
+            batch->packets[i].time = now;
+        }
+    }
+
+    batch->count = count;
+
+    return count;
+}
+
+
+
+/*
+ * Create an epoll instance watching for data to arrive on the given pair
+ * of sockets (ipv4 and ipv6). The descriptor is reused across every call
+ * to wait_for_packets()/get_packets(), so the set of sockets doesn't need
+ * to be rebuilt each time like it does with select(). Returns the epoll
+ * file descriptor, or -1 on error.
+ */
+int create_packet_poll(struct socket_t *sockets) {
+    struct epoll_event event;
+    int epfd;
+
+    assert(sockets);
+    assert(sockets->socket > 0 || sockets->socket6 > 0);
+
+    if ( (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) {
+        Log(LOG_WARNING, "Failed to create epoll instance: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+
+    if ( sockets->socket > 0 ) {
+        event.data.u32 = AF_INET;
+        if ( epoll_ctl(epfd, EPOLL_CTL_ADD, sockets->socket, &event) < 0 ) {
+            Log(LOG_WARNING, "Failed to add IPv4 socket to epoll: %s",
+                    strerror(errno));
+            close(epfd);
+            return -1;
+        }
+    }
+
+    if ( sockets->socket6 > 0 ) {
+        event.data.u32 = AF_INET6;
+        if ( epoll_ctl(epfd, EPOLL_CTL_ADD, sockets->socket6, &event) < 0 ) {
+            Log(LOG_WARNING, "Failed to add IPv6 socket to epoll: %s",
+                    strerror(errno));
+            close(epfd);
+            return -1;
+        }
+    }
+
+    return epfd;
+}
+
+
+
+/*
+ * Wait up to maxwait microseconds for data to arrive on either of the
+ * sockets registered with the epoll descriptor. Like wait_for_data(), this
+ * returns which family of socket received data (or -1 on timeout/error)
+ * and updates maxwait with the time remaining.
+ */
+int wait_for_packets(int epfd, int *maxwait) {
+    struct timeval start_time, end_time;
+    struct epoll_event event;
+    int delay;
+    int ready;
+
+    assert(epfd >= 0);
+    assert(maxwait);
+
+    gettimeofday(&start_time, NULL);
+
+    delay = 0;
+
+    do {
+        int remaining = (*maxwait > delay) ? *maxwait - delay : 0;
+#ifdef HAVE_EPOLL_PWAIT2
+        struct timespec timeout;
+        timeout.tv_sec = S_FROM_US(remaining);
+        timeout.tv_nsec = US_FROM_US(remaining) * 1000;
+        ready = epoll_pwait2(epfd, &event, 1, &timeout, NULL);
+#else
+        /*
+         * epoll_wait() only has millisecond precision, so round down and
+         * poll without sleeping for any sub-millisecond remainder.
+         */
+        ready = epoll_wait(epfd, &event, 1, remaining / 1000);
+#endif
+
+        gettimeofday(&end_time, NULL);
+        delay = DIFF_TV_US(end_time, start_time);
+
+        /* if delay is less than zero then maybe the clock was adjusted */
+        if ( delay < 0 ) {
+            delay = 0;
+        }
+
+        /* continue until data arrives, time runs out or a non EINTR error */
+    } while ( (ready == 0 && delay < *maxwait) ||
+            (ready < 0 && errno == EINTR) );
+
+    /* remove the time waited so far from maxwait */
+    *maxwait -= delay;
+    if ( *maxwait < 0 ) {
+        *maxwait = 0;
+    }
+
+    if ( ready < 0 ) {
+        Log(LOG_WARNING, "epoll_wait() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if ( ready == 0 ) {
+        return -1;
+    }
+
+    return event.data.u32;
+}
+
+
+
+/*
+ * Wait for up to timeout microseconds for packets to arrive on the given
+ * sockets, then read as many as are available into the batch. Returns the
+ * number of packets read, with the family of the socket they arrived on
+ * stored in the batch.
+ */
+int get_packets(int epfd, struct socket_t *sockets,
+        struct packet_batch_t *batch, int *timeout) {
+    int family;
+    int sock;
+
+    assert(sockets);
+    assert(batch);
+    assert(timeout);
+
+    batch->count = 0;
+
+    if ( (family = wait_for_packets(epfd, timeout)) <= 0 ) {
+        return 0;
+    }
+
+    switch ( family ) {
+        case AF_INET: sock = sockets->socket; break;
+        case AF_INET6: sock = sockets->socket6; break;
+        default: return 0;
+    };
+
+    batch->family = family;
+
+    return get_packet_batch(sock, batch);
+}
+
+
+
 /*
  * Enforce a minimum inter-packet delay for test traffic. Try to send a packet
  * but if it is too soon for the test to be sending again then return a delay
@@ -562,21 +855,6 @@ int delay_send_packet(int sock, char *packet, int size, struct addrinfo *dest,
         uint32_t inter_packet_delay, struct timeval *sent) {
 
     static struct timeval last = {0, 0};
-#ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
-    /*
-     * This could be associated more closely with each individual socket, but
-     * for now lets store the id of the packets we send here so that calling
-     * functions don't need to do any extra work. We make the assumption that
-     * tests will generally use file descriptors with lower numbers, so we can
-     * use a small array indexed by file descriptor to store the packet count
-     * for the values of descriptor that we expect to see, which are then used
-     * to match the correct timestamp message. We also make the assumption that
-     * the same file descriptor always refers to the same socket, and they
-     * aren't being reused.
-     * TODO attach packet count information to the socket and pass it around.
-     */
-    static uint32_t packet_id[MAX_TX_TIMESTAMP_FD] = {0};
-#endif
     int bytes_sent;
     struct timeval now;
     int delay, diff;
@@ -621,7 +899,7 @@ int delay_send_packet(int sock, char *packet, int size, struct addrinfo *dest,
 #ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
     /* get timestamp if TIMESTAMPING is available and we know the packet id */
     if ( sock < MAX_TX_TIMESTAMP_FD ) {
-        get_tx_timestamping(sock, packet_id[sock]++, sent);
+        get_tx_timestamping(sock, tx_packet_id[sock]++, sent);
     } else {
         Log(LOG_WARNING,
                 "Transmit timestamps only supported for file descriptors < %d",
@@ -640,6 +918,402 @@ int delay_send_packet(int sock, char *packet, int size, struct addrinfo *dest,
 
 
 
+/*
+ * Get the current value of the monotonic clock in nanoseconds, used to
+ * schedule packet transmission independently of any wall clock changes.
+ */
+uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+
+
+/*
+ * Wait until the monotonic clock reaches the given deadline. Most of the
+ * wait is spent asleep, but the final SEND_QUEUE_SPIN_US microseconds are
+ * spent spinning so that the deadline isn't overshot by timer slack.
+ */
+void wait_until(uint64_t deadline) {
+    uint64_t now = monotonic_ns();
+
+    if ( deadline > now + (SEND_QUEUE_SPIN_US * 1000) ) {
+        struct timespec wake;
+        uint64_t target = deadline - (SEND_QUEUE_SPIN_US * 1000);
+        wake.tv_sec = target / 1000000000;
+        wake.tv_nsec = target % 1000000000;
+        while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake,
+                    NULL) == EINTR ) {
+            /* keep sleeping until the wake time is reached */
+        }
+    }
+
+    while ( monotonic_ns() < deadline ) {
+        /* spin for the remainder */
+    }
+}
+
+
+
+/*
+ * Create a transmit queue for a socket, which will pace all packets sent
+ * through it so they are at least inter_packet_delay microseconds apart.
+ * Packets are copied into buffers of buflen bytes, and up to size packets
+ * can be queued before they must be flushed. Setting SEND_QUEUE_TXTIME in
+ * flags will hand the send times to the kernel using SO_TXTIME rather than
+ * waiting for them here; this needs a qdisc that supports it (e.g. fq).
+ */
+struct send_queue_t *new_send_queue(int sock, int size, int buflen,
+        uint32_t inter_packet_delay, int flags) {
+    struct send_queue_t *queue;
+    int i;
+
+    assert(sock > 0);
+    assert(size > 0);
+    assert(buflen > 0);
+
+    queue = calloc(1, sizeof(struct send_queue_t));
+    queue->sock = sock;
+    queue->size = size;
+    queue->buflen = buflen;
+    queue->inter_packet_delay = inter_packet_delay;
+    queue->items = calloc(size, sizeof(struct send_item_t));
+    queue->msgs = calloc(size, sizeof(struct mmsghdr));
+    queue->iov = calloc(size, sizeof(struct iovec));
+    queue->buffers = calloc(size, buflen);
+    queue->pending = calloc(SEND_QUEUE_PENDING, sizeof(struct send_pending_t));
+
+    for ( i = 0; i < size; i++ ) {
+        queue->items[i].data = queue->buffers + (i * buflen);
+    }
+
+#ifdef HAVE_SO_TXTIME
+    if ( flags & SEND_QUEUE_TXTIME ) {
+        struct sock_txtime txtime;
+        memset(&txtime, 0, sizeof(txtime));
+        txtime.clockid = CLOCK_MONOTONIC;
+        if ( setsockopt(sock, SOL_SOCKET, SO_TXTIME, &txtime,
+                    sizeof(txtime)) < 0 ) {
+            Log(LOG_WARNING, "Failed to set SO_TXTIME, pacing in userspace");
+        } else {
+            queue->flags |= SEND_QUEUE_TXTIME;
+            queue->control = calloc(size, CMSG_SPACE(sizeof(uint64_t)));
+        }
+    }
+#else
+    if ( flags & SEND_QUEUE_TXTIME ) {
+        Log(LOG_WARNING, "No SO_TXTIME support, pacing in userspace");
+    }
+#endif
+
+    return queue;
+}
+
+
+
+/*
+ * Free a transmit queue. Any packets still queued are not sent.
+ */
+void free_send_queue(struct send_queue_t *queue) {
+    if ( queue == NULL ) {
+        return;
+    }
+
+    free(queue->items);
+    free(queue->msgs);
+    free(queue->iov);
+    free(queue->buffers);
+    free(queue->control);
+    free(queue->pending);
+    free(queue);
+}
+
+
+
+/*
+ * Add a copy of a packet to the transmit queue, to be sent to the given
+ * destination when the queue is next flushed. If sent is not NULL then it
+ * will be updated with the time the packet was sent, and later with the
+ * transmit timestamp if one is collected by harvest_tx_timestamps(). Returns
+ * 0 if the packet was queued, or -1 if the queue is full.
+ */
+int queue_packet(struct send_queue_t *queue, char *packet, int length,
+        struct addrinfo *dest, struct timeval *sent) {
+    struct send_item_t *item;
+
+    assert(queue);
+    assert(packet);
+    assert(dest);
+
+    if ( queue->count >= queue->size ) {
+        Log(LOG_WARNING, "Transmit queue full, not queueing packet");
+        return -1;
+    }
+
+    if ( length > queue->buflen ) {
+        Log(LOG_WARNING, "Packet too large for transmit queue (%d > %d)",
+                length, queue->buflen);
+        return -1;
+    }
+
+    item = &queue->items[queue->count++];
+    memcpy(item->data, packet, length);
+    item->length = length;
+    item->dest = dest;
+    item->sent = sent;
+
+    return 0;
+}
+
+
+
+/*
+ * Return the number of microseconds until the next packet on this queue is
+ * allowed to be sent, so that callers can do other work until then.
+ */
+uint32_t send_queue_delay(struct send_queue_t *queue) {
+    uint64_t now;
+
+    assert(queue);
+
+    now = monotonic_ns();
+
+    if ( queue->next <= now ) {
+        return 0;
+    }
+
+    return (queue->next - now) / 1000;
+}
+
+
+
+/*
+ * Send some of the messages in the transmit queue with a single sendmmsg()
+ * call, recording the time they were sent and where their transmit
+ * timestamps should go. Returns the number of packets sent.
+ */
+static int send_queued_packets(struct send_queue_t *queue, int first, int num,
+        uint64_t deadline) {
+    struct timeval now;
+    uint64_t mono;
+    int sent;
+    int i;
+
+    do {
+        sent = sendmmsg(queue->sock, &queue->msgs[first], num, 0);
+    } while ( sent < 0 && errno == EINTR );
+
+    if ( sent < 0 ) {
+        Log(LOG_DEBUG, "Failed to send queued packets: %s", strerror(errno));
+        return 0;
+    }
+
+    gettimeofday(&now, NULL);
+    mono = monotonic_ns();
+
+    for ( i = first; i < first + sent; i++ ) {
+        struct send_item_t *item = &queue->items[i];
+
+        if ( item->sent ) {
+            /* populate sent timestamp (might get overwritten by a better one) */
+            *item->sent = now;
+            if ( item->deadline > mono ) {
+                /* the kernel is holding this one until its SO_TXTIME */
+                uint64_t offset = (item->deadline - mono) / 1000;
+                item->sent->tv_sec += S_FROM_US(offset + item->sent->tv_usec);
+                item->sent->tv_usec = US_FROM_US(offset + item->sent->tv_usec);
+            }
+        }
+
+        if ( queue->msgs[i].msg_len != (unsigned int)item->length ) {
+            Log(LOG_DEBUG, "Only sent %d of %d bytes", queue->msgs[i].msg_len,
+                    item->length);
+        }
+
+        /* remember where the transmit timestamp for this packet belongs */
+        queue->pending[queue->packet_id % SEND_QUEUE_PENDING].id =
+            queue->packet_id;
+        queue->pending[queue->packet_id % SEND_QUEUE_PENDING].sent =
+            item->sent;
+        queue->packet_id++;
+    }
+
+    if ( sent > 0 ) {
+        queue->next = deadline + (queue->inter_packet_delay * 1000ULL);
+    }
+
+    return sent;
+}
+
+
+
+/*
+ * Send every packet in the transmit queue, maintaining at least the inter
+ * packet delay between each. If the delay is zero the whole queue is sent
+ * immediately with a single sendmmsg() call. Otherwise each packet is held
+ * until its send time (or the send times are handed to the kernel if using
+ * SO_TXTIME). Returns the number of packets sent successfully; any packets
+ * that failed to send have their sent time cleared.
+ */
+int flush_send_queue(struct send_queue_t *queue) {
+    uint64_t deadline;
+    int total = 0;
+    int sent;
+    int i;
+
+    assert(queue);
+
+    if ( queue->count == 0 ) {
+        return 0;
+    }
+
+    deadline = monotonic_ns();
+    if ( queue->next > deadline ) {
+        deadline = queue->next;
+    }
+
+    for ( i = 0; i < queue->count; i++ ) {
+        struct send_item_t *item = &queue->items[i];
+        struct msghdr *msg = &queue->msgs[i].msg_hdr;
+
+        queue->iov[i].iov_base = item->data;
+        queue->iov[i].iov_len = item->length;
+
+        memset(msg, 0, sizeof(struct msghdr));
+        msg->msg_name = item->dest->ai_addr;
+        msg->msg_namelen = item->dest->ai_addrlen;
+        msg->msg_iov = &queue->iov[i];
+        msg->msg_iovlen = 1;
+
+        item->deadline = deadline +
+            (uint64_t)i * queue->inter_packet_delay * 1000;
+
+#ifdef HAVE_SO_TXTIME
+        if ( queue->flags & SEND_QUEUE_TXTIME ) {
+            struct cmsghdr *c;
+            msg->msg_control =
+                queue->control + (i * CMSG_SPACE(sizeof(uint64_t)));
+            msg->msg_controllen = CMSG_SPACE(sizeof(uint64_t));
+            c = CMSG_FIRSTHDR(msg);
+            c->cmsg_level = SOL_SOCKET;
+            c->cmsg_type = SCM_TXTIME;
+            c->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+            memcpy(CMSG_DATA(c), &item->deadline, sizeof(uint64_t));
+        }
+#endif
+    }
+
+    if ( queue->inter_packet_delay == 0 ||
+            (queue->flags & SEND_QUEUE_TXTIME) ) {
+        /* everything can be given to the kernel at once */
+        total = send_queued_packets(queue, 0, queue->count,
+                queue->items[queue->count - 1].deadline);
+    } else {
+        /* otherwise send each packet at the time it is due */
+        for ( i = 0; i < queue->count; i++ ) {
+            deadline = queue->items[i].deadline;
+            if ( queue->next > deadline ) {
+                deadline = queue->next;
+            }
+            wait_until(deadline);
+            if ( (sent = send_queued_packets(queue, i, 1, deadline)) < 1 ) {
+                break;
+            }
+            total += sent;
+        }
+    }
+
+    /* clear the sent time of anything that didn't go */
+    for ( i = total; i < queue->count; i++ ) {
+        if ( queue->items[i].sent ) {
+            memset(queue->items[i].sent, 0, sizeof(struct timeval));
+        }
+    }
+
+    queue->count = 0;
+
+    return total;
+}
+
+
+
+/*
+ * Collect any transmit timestamps waiting on the socket error queue and use
+ * them to update the sent times of the packets they belong to. This doesn't
+ * block, and reads many messages per system call, so it should be called
+ * before processing responses to make sure their sent times are accurate.
+ * Returns the number of timestamps collected.
+ */
+int harvest_tx_timestamps(struct send_queue_t *queue) {
+#ifdef HAVE_SOF_TIMESTAMPING_OPT_ID
+    struct mmsghdr msgs[SEND_QUEUE_HARVEST];
+    char control[SEND_QUEUE_HARVEST][CMSG_SPACE(sizeof(struct timespec) * 10)];
+    struct cmsghdr *c;
+    int collected = 0;
+    int count;
+    int i;
+
+    if ( queue == NULL ) {
+        return 0;
+    }
+
+    do {
+        memset(msgs, 0, sizeof(msgs));
+        for ( i = 0; i < SEND_QUEUE_HARVEST; i++ ) {
+            msgs[i].msg_hdr.msg_control = control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+
+        count = recvmmsg(queue->sock, msgs, SEND_QUEUE_HARVEST,
+                MSG_ERRQUEUE | MSG_DONTWAIT, NULL);
+
+        for ( i = 0; i < count; i++ ) {
+            struct msghdr *msg = &msgs[i].msg_hdr;
+            struct cmsghdr *tsmsg = NULL;
+            struct sock_extended_err *serr = NULL;
+            struct send_pending_t *pending;
+
+            for ( c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c) ) {
+                if ( c->cmsg_level == SOL_SOCKET &&
+                        c->cmsg_type == SO_TIMESTAMPING ) {
+                    tsmsg = c;
+                } else if ( (c->cmsg_level == SOL_IP &&
+                            c->cmsg_type == IP_RECVERR) ||
+                            (c->cmsg_level == SOL_IPV6 &&
+                            c->cmsg_type == IPV6_RECVERR) ) {
+                    serr = (void *)CMSG_DATA(c);
+                    if ( serr->ee_errno != ENOMSG ||
+                            serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ) {
+                        serr = NULL;
+                    }
+                }
+            }
+
+            if ( tsmsg == NULL || serr == NULL ) {
+                continue;
+            }
+
+            /* only use it if the packet is still waiting for a timestamp */
+            pending = &queue->pending[serr->ee_data % SEND_QUEUE_PENDING];
+            if ( pending->id == serr->ee_data && pending->sent != NULL ) {
+                if ( retrieve_timestamping(tsmsg, pending->sent) ) {
+                    collected++;
+                }
+                pending->sent = NULL;
+            }
+        }
+    } while ( count == SEND_QUEUE_HARVEST );
+
+    return collected;
+#else
+    (void)queue;
+    return 0;
+#endif
+}
+
+
+
 /*
  * Determine the name for a given address structure. Currently the name is
  * stored using the ai_canonname field in the struct addrinfo, which is
@@ -898,6 +1572,9 @@ static void set_timestamp_socket_option(int sock) {
         if ( setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &optval,
                     sizeof(optval)) >= 0 ) {
             Log(LOG_DEBUG, "Using SOF_TIMESTAMPING_SOFTWARE");
+            if ( sock < MAX_TX_TIMESTAMP_FD ) {
+                tx_packet_id[sock] = 0;
+            }
             return;
         }
     }
@@ -43,6 +43,7 @@
 #include <stdint.h>
 #include <netdb.h>
 #include <sys/time.h>
+#include <sys/socket.h>
 #include <google/protobuf-c/protobuf-c.h>
 
 
@@ -81,6 +82,97 @@ struct socket_t {
     int socket6;                /* ipv6 socket, if available */
 };
 
+/* number of packets to try to read with a single call to get_packets() */
+#define PACKET_BATCH_SIZE 64
+
+/* ancillary data space for each packet in a batch, enough for timestamps */
+#define PACKET_BATCH_CONTROL_LEN 256
+
+/*
+ * A single packet read as part of a batch, including where it came from
+ * and the best timestamp available for when it arrived.
+ */
+struct packet_t {
+    char *data;                         /* packet contents */
+    int length;                         /* number of bytes in the packet */
+    struct sockaddr_storage from;       /* address the packet came from */
+    struct timeval time;                /* time the packet was received */
+};
+
+/*
+ * Storage for a group of packets read using a single recvmmsg() call. The
+ * message headers, buffers and ancillary data are allocated once and reused
+ * for every batch.
+ */
+struct packet_batch_t {
+    int count;                          /* number of packets in this batch */
+    int size;                           /* maximum number of packets */
+    int buflen;                         /* maximum length of each packet */
+    int family;                         /* family of socket packets came from */
+    struct packet_t *packets;
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    char *buffers;
+    char *control;
+};
+
+/* maximum number of packets that can be queued for a single flush */
+#define SEND_QUEUE_SIZE 64
+
+/* time before a packet is due to stop sleeping and start spinning */
+#define SEND_QUEUE_SPIN_US 50
+
+/* number of sent packets that can be waiting for a transmit timestamp */
+#define SEND_QUEUE_PENDING 1024
+
+/* number of transmit timestamps to read from the error queue at once */
+#define SEND_QUEUE_HARVEST 32
+
+/* let the kernel pace packets using SO_TXTIME rather than doing it here */
+#define SEND_QUEUE_TXTIME 0x01
+
+/*
+ * A packet waiting in a transmit queue to be sent.
+ */
+struct send_item_t {
+    char *data;                         /* copy of the packet to send */
+    int length;                         /* length of the packet */
+    struct addrinfo *dest;              /* where to send the packet */
+    struct timeval *sent;               /* where to record the send time */
+    uint64_t deadline;                  /* monotonic time to send (ns) */
+};
+
+/*
+ * A sent packet that is waiting on a transmit timestamp to be collected.
+ */
+struct send_pending_t {
+    uint32_t id;                        /* SOF_TIMESTAMPING_OPT_ID value */
+    struct timeval *sent;               /* where to store the timestamp */
+};
+
+/*
+ * Per-socket transmit scheduler. Packets are queued then sent in bursts
+ * with sendmmsg(), paced so they are at least inter_packet_delay apart.
+ * Transmit timestamps are collected later in bulk from the error queue,
+ * rather than waiting for them after every packet.
+ */
+struct send_queue_t {
+    int sock;
+    int flags;
+    uint32_t inter_packet_delay;        /* minimum gap between packets (us) */
+    uint64_t next;                      /* earliest time for next packet */
+    int count;                          /* number of packets queued */
+    int size;                           /* maximum number of packets */
+    int buflen;                         /* maximum length of each packet */
+    uint32_t packet_id;                 /* id of the next packet sent */
+    struct send_item_t *items;
+    struct send_pending_t *pending;
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    char *buffers;
+    char *control;
+};
+
 /* Structure representing the SO_TIMESTAMPING return value within CMSG. */
 struct timestamping_t {
     struct timespec software;   /* software timestamp, if avaliabe */
@@ -94,6 +186,23 @@ int unblock_signals(void);
 int wait_for_data(struct socket_t *sockets, int *maxwait);
 int get_packet(struct socket_t *sockets, char *buf, int buflen,
 	struct sockaddr *saddr, int *timeout, struct timeval *now);
+struct packet_batch_t *new_packet_batch(int size, int buflen);
+void free_packet_batch(struct packet_batch_t *batch);
+int get_packet_batch(int sock, struct packet_batch_t *batch);
+int create_packet_poll(struct socket_t *sockets);
+int wait_for_packets(int epfd, int *maxwait);
+int get_packets(int epfd, struct socket_t *sockets,
+        struct packet_batch_t *batch, int *timeout);
+struct send_queue_t *new_send_queue(int sock, int size, int buflen,
+        uint32_t inter_packet_delay, int flags);
+void free_send_queue(struct send_queue_t *queue);
+int queue_packet(struct send_queue_t *queue, char *packet, int length,
+        struct addrinfo *dest, struct timeval *sent);
+uint32_t send_queue_delay(struct send_queue_t *queue);
+int flush_send_queue(struct send_queue_t *queue);
+int harvest_tx_timestamps(struct send_queue_t *queue);
+uint64_t monotonic_ns(void);
+void wait_until(uint64_t deadline);
 int delay_send_packet(int sock, char *packet, int size, struct addrinfo *dest,
         uint32_t inter_packet_delay, struct timeval *sent);
 char *address_to_name(struct addrinfo *address);
@@ -155,6 +155,14 @@ typedef struct test {
      */
      int sigint;
 
+    /*
+     * true if the test can be run many times within the same process, i.e.
+     * it doesn't keep any global state between runs. Only tests that set
+     * this can be run by a pool of long lived worker processes, others are
+     * always run in a newly forked process.
+     */
+    int reentrant;
+
     /*
      * Each client can have default parameters applied to all tests of a type.
      * Store the default parameters here so they can be accessed when the test
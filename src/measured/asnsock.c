@@ -47,9 +47,12 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <sys/time.h>
+#include <time.h>
+#include <inttypes.h>
 
 #include "asn.h"
 #include "asnsock.h"
+#include "asncache.h"
 #include "ampresolv.h"
 #include "debug.h"
 
@@ -194,39 +197,23 @@ static int check_whois_connection(int *whois_fd) {
 
 
 /*
- * TODO be smarter about this, we don't need to dump the whole thing
- */
-static void check_refresh_cache(struct amp_asn_info *info) {
-    pthread_mutex_lock(info->mutex);
-    if ( time(NULL) > *info->refresh ) {
-        Log(LOG_DEBUG, "Clearing ASN cache");
-        iptrie_clear(info->trie);
-        *info->refresh = time(NULL) + MIN_ASN_CACHE_REFRESH +
-            (rand() % MAX_ASN_CACHE_REFRESH_OFFSET);
-        Log(LOG_DEBUG, "Next refresh at %d", *info->refresh);
-    }
-    pthread_mutex_unlock(info->mutex);
-}
-
-
-
-/*
- * Try to look up the ASN for an address in the local cache.
+ * Try to look up the ASN for an address in the local cache. Returns 0 if it
+ * was found, 1 if it was found but should also be refreshed from the whois
+ * server, or -1 if it wasn't found.
  */
 static int check_asn_cache(struct amp_asn_info *info, struct iptrie *result,
         struct sockaddr *address) {
-    int asn;
+    int64_t asn;
     int prefix;
+    int refresh;
 
     Log(LOG_DEBUG, "Checking ASN cache for address");
 
-    pthread_mutex_lock(info->mutex);
-    if ( (asn = iptrie_lookup_as(info->trie, address)) < 0 ) {
-        pthread_mutex_unlock(info->mutex);
+    if ( amp_asn_cache_lookup(info->cache, address, time(NULL), &asn,
+                &refresh) < 0 ) {
         Log(LOG_DEBUG, "Address not found in ASN cache");
         return -1;
     }
-    pthread_mutex_unlock(info->mutex);
 
     Log(LOG_DEBUG, "Address found in ASN cache");
 
@@ -238,6 +225,29 @@ static int check_asn_cache(struct amp_asn_info *info, struct iptrie *result,
 
     /* add the values to our result trie */
     iptrie_add(result, address, prefix, asn);
+    return refresh ? 1 : 0;
+}
+
+
+
+/*
+ * Try to look up the ASN for an address in the local prefix table. Returns
+ * 0 if it was found, or -1 if it wasn't.
+ */
+static int check_asn_table(struct amp_asn_info *info, struct iptrie *result,
+        struct sockaddr *address) {
+    int64_t asn;
+    uint8_t prefix;
+
+    if ( amp_asn_table_lookup(info->table, address, &asn, &prefix) < 0 ) {
+        return -1;
+    }
+
+    Log(LOG_DEBUG, "Address found in ASN table (AS%" PRId64 ", /%d)", asn,
+            prefix);
+
+    /* answer with the covering prefix, the test does a longest match */
+    iptrie_add(result, address, prefix, asn);
     return 0;
 }
 
@@ -328,10 +338,16 @@ static int fill_request_trie(int fd, struct iptrie *requests) {
 
 
 
-static void *amp_asn_worker_thread(void *thread_data) {
-    struct amp_asn_info *info = (struct amp_asn_info*)thread_data;
-    struct iptrie result = { NULL, NULL };
-    struct iptrie requests = { NULL, NULL };
+/*
+ * Look up the ASN for every address in the list, adding the answers to the
+ * result trie. If refresh is set then the local table and cache are checked
+ * first, and only addresses that aren't in either are sent to the whois
+ * server - cached answers that are due to be refreshed are answered from
+ * the cache and added to the refresh trie to be looked up later. If refresh
+ * isn't set then every address is sent to the whois server.
+ */
+static void resolve_asn_list(struct amp_asn_info *info, iplist_t *list,
+        struct iptrie *result, struct iptrie *refresh) {
 
     fd_set readset, writeset;
     int whois_fd = -1;
@@ -341,28 +357,40 @@ static void *amp_asn_worker_thread(void *thread_data) {
     char *buffer = calloc(1, buflen);
     int outstanding = 0;
     struct timeval timeout;
-    iplist_t *list;
-
-    Log(LOG_DEBUG, "Starting new asn resolution thread");
-
-    /* periodically clear out the cache */
-    check_refresh_cache(info);
 
-    /* read all the addresses from the socket and build a trie from them */
-    if ( fill_request_trie(info->fd, &requests) < 0 ) {
-        Log(LOG_WARNING, "asn resolution thread failed to create request trie");
-        goto end;
+    if ( buffer == NULL ) {
+        Log(LOG_WARNING, "Failed to allocate ASN response buffer");
+        return;
     }
 
     /* look up all the addresses in the cache or the whois server */
-    for ( list = iptrie_to_list(&requests), outstanding = 0;
-            list != NULL || outstanding > 0; /* no increment statement*/ ) {
+    for ( outstanding = 0; list != NULL || outstanding > 0;
+            /* no increment statement*/ ) {
 
         if ( list ) {
-            /* first try to find address in cache */
-            if ( check_asn_cache(info, &result, list->address) == 0 ) {
-                list = list->next;
-                continue;
+            if ( refresh ) {
+                /* the local table is authoritative if we have one */
+                if ( check_asn_table(info, result, list->address) == 0 ) {
+                    list = list->next;
+                    continue;
+                }
+
+                /*
+                 * Then try to find address in cache. If the cached value is
+                 * about to expire then answer with it anyway, and ask the
+                 * whois server for a fresh value once the test has its
+                 * results.
+                 */
+                switch ( check_asn_cache(info, result, list->address) ) {
+                    case 1:
+                        iptrie_add(refresh, list->address,
+                                list->address->sa_family == AF_INET ? 24 : 64,
+                                0);
+                        /* fall through */
+                    case 0:
+                        list = list->next;
+                        continue;
+                };
             }
 
             /* if not in cache, check if can connect to the whois server */
@@ -440,25 +468,68 @@ static void *amp_asn_worker_thread(void *thread_data) {
             }
 
             /* try to read any completed ASN results from the buffer */
-            process_buffer(&result, buffer, buflen, &offset, info,&outstanding);
+            process_buffer(result, buffer, buflen, &offset, info,&outstanding);
         }
     }
 
-    if ( whois_fd != -1 ) {
+    if ( whois_fd >= 0 ) {
         close(whois_fd);
     }
+
+    free(buffer);
+}
+
+
+
+static void *amp_asn_worker_thread(void *thread_data) {
+    struct amp_asn_info *info = (struct amp_asn_info*)thread_data;
+    struct iptrie result = { NULL, NULL };
+    struct iptrie requests = { NULL, NULL };
+    struct iptrie refresh = { NULL, NULL };
+    struct iptrie refreshed = { NULL, NULL };
+
+    Log(LOG_DEBUG, "Starting new asn resolution thread");
+
+    /* remove expired entries from part of the cache */
+    amp_asn_cache_expire(info->cache, time(NULL));
+
+    /* read all the addresses from the socket and build a trie from them */
+    if ( fill_request_trie(info->fd, &requests) < 0 ) {
+        Log(LOG_WARNING, "asn resolution thread failed to create request trie");
+        goto end;
+    }
+
+    resolve_asn_list(info, iptrie_to_list(&requests), &result, &refresh);
+
     Log(LOG_DEBUG, "Got all responses, sending them back");
 
     iptrie_on_all_leaves(&result, return_asn_list, &info->fd);
 
+    /* closing the socket tells the test that it has all the results */
+    close(info->fd);
+    info->fd = -1;
+
+    /*
+     * Now that the test isn't waiting, fetch new values for any cached
+     * entries that are about to expire. Processing the responses puts them
+     * in the cache, the results themselves aren't needed.
+     */
+    if ( !iptrie_is_empty(&refresh) ) {
+        Log(LOG_DEBUG, "Refreshing ASN cache entries");
+        resolve_asn_list(info, iptrie_to_list(&refresh), &refreshed, NULL);
+    }
+
 end:
     Log(LOG_DEBUG, "Tidying up after asn resolution thread");
 
-    close(info->fd);
+    if ( info->fd >= 0 ) {
+        close(info->fd);
+    }
     iptrie_clear(&requests);
     iptrie_clear(&result);
+    iptrie_clear(&refresh);
+    iptrie_clear(&refreshed);
     free(thread_data);
-    free(buffer);
 
     Log(LOG_DEBUG, "asn resolution thread completed, exiting");
 
@@ -489,9 +560,8 @@ void asn_socket_event_callback(evutil_socket_t evsock,
     Log(LOG_DEBUG, "Accepted new asn connection on fd %d", fd);
 
     info = calloc(1, sizeof(struct amp_asn_info));
-    info->trie = ((struct amp_asn_info*)evdata)->trie;
-    info->mutex = ((struct amp_asn_info*)evdata)->mutex;
-    info->refresh = ((struct amp_asn_info*)evdata)->refresh;
+    info->cache = ((struct amp_asn_info*)evdata)->cache;
+    info->table = ((struct amp_asn_info*)evdata)->table;
     info->fd = fd;
 
     /* create the thread and detach, we don't need to look after it */
@@ -504,25 +574,25 @@ void asn_socket_event_callback(evutil_socket_t evsock,
 /*
  *
  */
-struct amp_asn_info* initialise_asn_info(void) {
+struct amp_asn_info* initialise_asn_info(char *asntable) {
     struct amp_asn_info *info;
 
     info = (struct amp_asn_info *) malloc(sizeof(struct amp_asn_info));
 
     info->fd = -1;
+    info->cache = amp_asn_cache_new();
+    info->table = NULL;
 
-    info->refresh = malloc(sizeof(time_t));
-    *info->refresh = time(NULL) + MIN_ASN_CACHE_REFRESH +
-        (rand() % MAX_ASN_CACHE_REFRESH_OFFSET);
-
-    Log(LOG_DEBUG, "ASN cache will be refreshed at %d", *info->refresh);
-
-    info->trie = malloc(sizeof(struct iptrie));
-    info->trie->ipv4 = NULL;
-    info->trie->ipv6 = NULL;
-
-    info->mutex = malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(info->mutex, NULL);
+    if ( asntable != NULL ) {
+        if ( (info->table = amp_asn_table_open(asntable)) == NULL ) {
+            Log(LOG_WARNING, "Failed to load ASN table %s, using whois",
+                    asntable);
+        } else {
+            Log(LOG_INFO, "Loaded ASN table %s (%u IPv4, %u IPv6 ranges)",
+                    asntable, info->table->ipv4_count,
+                    info->table->ipv6_count);
+        }
+    }
 
     return info;
 }
@@ -537,14 +607,7 @@ void amp_asn_info_delete(struct amp_asn_info *info) {
         return;
     }
 
-    pthread_mutex_lock(info->mutex);
-    iptrie_clear(info->trie);
-    pthread_mutex_unlock(info->mutex);
-    pthread_mutex_destroy(info->mutex);
-
-    if ( info->mutex ) free(info->mutex);
-    if ( info->refresh ) free(info->refresh);
-    if ( info->trie ) free(info->trie);
-
+    amp_asn_cache_free(info->cache);
+    amp_asn_table_close(info->table);
     free(info);
 }
@@ -45,17 +45,9 @@
 #include "iptrie.h"
 #include "asn.h"
 
-/*
- * Ideally the cache could refresh individual items and expunge those
- * that haven't been used for a while. In the meantime, lets just empty
- * the whole cache and start again every 24 hours + 0-60 minutes.
- */
-#define MIN_ASN_CACHE_REFRESH 86400
-#define MAX_ASN_CACHE_REFRESH_OFFSET 3600
-
 void asn_socket_event_callback(evutil_socket_t evsock,
         __attribute__((unused))short flags, void *evdata);
 
-struct amp_asn_info* initialise_asn_info(void);
+struct amp_asn_info* initialise_asn_info(char *asntable);
 void amp_asn_info_delete(struct amp_asn_info *info);
 #endif
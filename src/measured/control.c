@@ -69,6 +69,7 @@
 #include "schedule.h"
 #include "run.h"
 #include "acl.h"
+#include "messaging.h"
 
 
 
@@ -349,7 +350,7 @@ static void process_control_message(int fd, struct acl_root *acl) {
 
     /* Open up the ssl channel and validate the cert against our CA cert */
     /* TODO CRL or OCSP to deal with revocation of certificates */
-    if ( (ctrl = establish_control_socket(ssl_ctx, fd, 0)) == NULL ) {
+    if ( (ctrl = establish_control_socket(ssl_ctx, fd, 0, NULL)) == NULL ) {
         close(fd);
         exit(EXIT_FAILURE);
     }
@@ -468,6 +469,10 @@ static void control_read_callback(evutil_socket_t evsock,
          */
         close(vars.asnsock_fd);
         close(vars.nssock_fd);
+        close(vars.reportsock_fd);
+
+        /* the broker connection belongs to the parent, leave it alone */
+        forget_broker_connection();
 
         /* unblock signals and remove handlers that the parent process added */
         if ( unblock_signals() < 0 ) {
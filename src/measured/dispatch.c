@@ -0,0 +1,532 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <event2/event.h>
+
+#include "config.h"
+#include "dispatch.h"
+#include "run.h"
+#include "debug.h"
+#include "modules.h"
+
+
+/*
+ * Scheduled tests tend to line up on the same boundaries (e.g. the start of
+ * every minute), and starting them all in the same instant means they compete
+ * for CPU and the network and disturb each other's measurements. Rather than
+ * forking every test as soon as its timer fires, tests are admitted here:
+ *
+ *  - consecutive test starts are spaced at least "spacing" ms apart,
+ *  - at most "max_running" tests can be running at once (0 for no limit),
+ *  - each test type can have its own limit on how many run at once.
+ *
+ * A test that can't start immediately is queued and started as soon as the
+ * limits allow, in the order they were due. A test is only held back for a
+ * limited window (its scheduling interval, up to MAX_TEST_START_DELAY) and
+ * that run is skipped if it can't start within the window. Every test type
+ * keeps counters of how often tests were queued or skipped and how long they
+ * spent waiting, which are written out with the debug schedule dump.
+ */
+static struct dispatch_stats *stats = NULL;
+static struct dispatch_job *queue = NULL;
+static struct dispatch_child *children = NULL;
+static struct event *dispatch_event = NULL;
+static uint32_t max_running = DEFAULT_MAX_RUNNING_TESTS;
+static uint32_t spacing = DEFAULT_TEST_START_SPACING;
+static uint32_t running = 0;
+static uint64_t last_start = 0;
+
+
+
+/*
+ * Get the current value of the monotonic clock in microseconds, used to
+ * space test starts independently of any wall clock changes.
+ */
+static uint64_t monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+
+
+/*
+ * Find the counters for the given type of test, optionally creating them
+ * if they don't already exist.
+ */
+static struct dispatch_stats *get_dispatch_stats(uint64_t test_id,
+        int create) {
+    struct dispatch_stats *current;
+
+    for ( current = stats; current != NULL; current = current->next ) {
+        if ( current->test_id == test_id ) {
+            return current;
+        }
+    }
+
+    if ( !create ) {
+        return NULL;
+    }
+
+    current = calloc(1, sizeof(struct dispatch_stats));
+    current->test_id = test_id;
+    current->next = stats;
+    stats = current;
+
+    return current;
+}
+
+
+
+/*
+ * Check if the limits allow a test of the given type to start right now.
+ * Returns 1 if it can start, 0 if it is limited by the number or type of
+ * tests running, and -1 if it is too soon after the previous test started.
+ */
+static int can_start_test(struct dispatch_stats *test_stats, uint64_t now) {
+    assert(test_stats);
+
+    if ( spacing > 0 && last_start > 0 &&
+            now < last_start + (spacing * 1000) ) {
+        return -1;
+    }
+
+    if ( max_running > 0 && running >= max_running ) {
+        return 0;
+    }
+
+    if ( test_stats->limit > 0 && test_stats->running >= test_stats->limit ) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Start a test and count it against the limits until it finishes. The due
+ * time is when the test should have started, and is used to track how long
+ * the test was delayed by waiting for the limits to allow it to start.
+ */
+static int launch_test(test_schedule_item_t *item,
+        struct dispatch_stats *test_stats, struct timeval *due) {
+    struct dispatch_child *child;
+    struct timeval now, delay;
+    uint64_t delay_usec = 0;
+    pid_t pid;
+
+    assert(item);
+    assert(test_stats);
+    assert(due);
+
+    if ( (pid = start_test(item)) < 0 ) {
+        return 0;
+    }
+
+    gettimeofday(&now, NULL);
+    if ( timercmp(&now, due, >) ) {
+        timersub(&now, due, &delay);
+        delay_usec = US_FROM_TV(delay);
+    }
+
+    last_start = monotonic_us();
+    running++;
+    test_stats->running++;
+    test_stats->started++;
+    test_stats->delay_usec += delay_usec;
+    if ( delay_usec > test_stats->max_delay_usec ) {
+        test_stats->max_delay_usec = delay_usec;
+    }
+
+    Log(LOG_DEBUG, "Started %s test %" PRIu64 "us after it was due, "
+            "%u tests running", item->test->name, delay_usec, running);
+
+    /* pooled workers report back themselves, forked tests are reaped */
+    if ( pid > 0 ) {
+        child = calloc(1, sizeof(struct dispatch_child));
+        child->pid = pid;
+        child->test_id = item->test->id;
+        child->next = children;
+        children = child;
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Remove a job from the queue, returning the job that followed it.
+ */
+static struct dispatch_job *remove_job(struct dispatch_job **prev,
+        struct dispatch_job *job) {
+    struct dispatch_job *next = job->next;
+
+    *prev = next;
+    free(job);
+
+    return next;
+}
+
+
+
+/*
+ * Start as many queued tests as the limits will allow, skip any that have
+ * waited too long, and set a timer to try again if any are still waiting.
+ */
+static void run_dispatch_queue(void) {
+    struct dispatch_job **prev = &queue;
+    struct dispatch_job *job = queue;
+    struct dispatch_stats *test_stats;
+    struct timeval now, next, wait;
+    uint64_t mono;
+    int status;
+
+    gettimeofday(&now, NULL);
+    timerclear(&next);
+
+    while ( job != NULL ) {
+        test_stats = get_dispatch_stats(job->item->test->id, 1);
+
+        /* this run has waited too long, wait for the next scheduled one */
+        if ( timercmp(&now, &job->deadline, >=) ) {
+            Log(LOG_WARNING, "%s test couldn't start within %ds, skipping",
+                    job->item->test->name,
+                    (int)(job->deadline.tv_sec - job->due.tv_sec));
+            test_stats->skipped++;
+            job = remove_job(prev, job);
+            continue;
+        }
+
+        mono = monotonic_us();
+        if ( (status = can_start_test(test_stats, mono)) < 0 ) {
+            /* wait for the spacing since the last test started */
+            mono = last_start + (spacing * 1000) - mono;
+            next.tv_sec = mono / 1000000;
+            next.tv_usec = mono % 1000000;
+            break;
+        }
+
+        if ( status > 0 && launch_test(job->item, test_stats, &job->due) ) {
+            job = remove_job(prev, job);
+            continue;
+        }
+
+        /* limited by the number of tests, a later job might still start */
+        prev = &job->next;
+        job = job->next;
+    }
+
+    if ( queue == NULL ) {
+        if ( dispatch_event ) {
+            evtimer_del(dispatch_event);
+        }
+        return;
+    }
+
+    /*
+     * Wake up for the spacing or the earliest deadline, whichever is first.
+     * Jobs are queued in order, but the deadlines depend on the interval.
+     */
+    for ( job = queue; job != NULL; job = job->next ) {
+        if ( timercmp(&job->deadline, &now, <) ) {
+            timerclear(&wait);
+        } else {
+            timersub(&job->deadline, &now, &wait);
+        }
+        if ( !timerisset(&next) || timercmp(&wait, &next, <) ) {
+            next = wait;
+        }
+    }
+
+    if ( dispatch_event ) {
+        evtimer_add(dispatch_event, &next);
+    }
+}
+
+
+
+/*
+ * Timer callback to try starting queued tests again.
+ */
+static void dispatch_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        __attribute__((unused))void *evdata) {
+    run_dispatch_queue();
+}
+
+
+
+/*
+ * Set the global limits that apply across all tests: the maximum number of
+ * tests that can be running at once (0 for no limit) and the minimum gap in
+ * milliseconds between starting tests.
+ */
+void configure_dispatch(uint32_t max, uint32_t gap) {
+    if ( gap > MAX_TEST_START_SPACING ) {
+        Log(LOG_WARNING, "Limiting test start spacing to %dms",
+                MAX_TEST_START_SPACING);
+        gap = MAX_TEST_START_SPACING;
+    }
+
+    max_running = max;
+    spacing = gap;
+}
+
+
+
+/*
+ * Set the maximum number of tests of the given type that can run at once.
+ */
+int configure_test_dispatch(uint64_t test_id, uint32_t max) {
+    get_dispatch_stats(test_id, 1)->limit = max;
+    return 0;
+}
+
+
+
+/*
+ * Create the timer used to start queued tests, on the main event base.
+ */
+void start_dispatch(struct event_base *base) {
+    assert(base);
+    assert(dispatch_event == NULL);
+
+    dispatch_event = evtimer_new(base, dispatch_callback, NULL);
+}
+
+
+
+/*
+ * Free everything used for admission control, when measured is exiting.
+ */
+void stop_dispatch(void) {
+    struct dispatch_child *child;
+    struct dispatch_stats *current;
+
+    clear_dispatch_queue();
+
+    while ( children != NULL ) {
+        child = children;
+        children = children->next;
+        free(child);
+    }
+
+    while ( stats != NULL ) {
+        current = stats;
+        stats = stats->next;
+        free(current);
+    }
+
+    if ( dispatch_event ) {
+        event_free(dispatch_event);
+        dispatch_event = NULL;
+    }
+
+    running = 0;
+    last_start = 0;
+}
+
+
+
+/*
+ * Start the test now if the limits allow it, otherwise queue it to start as
+ * soon as possible. Returns 1 if the test was started or queued, 0 if it
+ * failed to start (and should be rescheduled).
+ */
+int dispatch_test(test_schedule_item_t *item) {
+    struct dispatch_stats *test_stats;
+    struct dispatch_job **prev;
+    struct dispatch_job *job;
+    struct timeval window;
+
+    assert(item);
+    assert(item->test);
+
+    test_stats = get_dispatch_stats(item->test->id, 1);
+
+    /* only start immediately if nothing else is already waiting */
+    if ( queue == NULL && can_start_test(test_stats, monotonic_us()) > 0 ) {
+        return launch_test(item, test_stats, &item->abstime);
+    }
+
+    /* if the previous run of this test is still waiting then drop it */
+    for ( prev = &queue, job = queue; job != NULL; ) {
+        if ( job->item == item ) {
+            Log(LOG_WARNING, "Previous %s test still waiting, skipping it",
+                    item->test->name);
+            test_stats->skipped++;
+            job = remove_job(prev, job);
+            continue;
+        }
+        prev = &job->next;
+        job = job->next;
+    }
+
+    /* a test can be held back until its next run, up to a maximum */
+    window.tv_sec = MAX_TEST_START_DELAY;
+    window.tv_usec = 0;
+    if ( timerisset(&item->interval) &&
+            timercmp(&item->interval, &window, <) ) {
+        window = item->interval;
+    }
+
+    job = calloc(1, sizeof(struct dispatch_job));
+    job->item = item;
+    job->due = item->abstime;
+    timeradd(&job->due, &window, &job->deadline);
+
+    /* add to the end of the queue so tests start in the order they were due */
+    *prev = job;
+    test_stats->queued++;
+
+    Log(LOG_DEBUG, "Queued %s test, %u tests running", item->test->name,
+            running);
+
+    run_dispatch_queue();
+
+    return 1;
+}
+
+
+
+/*
+ * A child process has exited. If it was a test that we started, then remove
+ * it from the count of running tests and see if a queued test can now start.
+ */
+void dispatch_child_exited(pid_t pid) {
+    struct dispatch_child **prev;
+    struct dispatch_child *child;
+    uint64_t test_id;
+
+    for ( prev = &children; *prev != NULL; prev = &(*prev)->next ) {
+        if ( (*prev)->pid == pid ) {
+            child = *prev;
+            test_id = child->test_id;
+            *prev = child->next;
+            free(child);
+            dispatch_test_finished(test_id);
+            return;
+        }
+    }
+}
+
+
+
+/*
+ * A test of the given type has finished (either a forked test that exited,
+ * or a pooled worker that has completed a test). Try to start any tests that
+ * were waiting for it.
+ */
+void dispatch_test_finished(uint64_t test_id) {
+    struct dispatch_stats *test_stats;
+
+    if ( running > 0 ) {
+        running--;
+    }
+
+    if ( (test_stats = get_dispatch_stats(test_id, 0)) != NULL &&
+            test_stats->running > 0 ) {
+        test_stats->running--;
+    }
+
+    if ( queue != NULL ) {
+        run_dispatch_queue();
+    }
+}
+
+
+
+/*
+ * Remove all the queued tests without running them, used when the schedule
+ * is about to be replaced and the queued schedule items may be freed.
+ */
+void clear_dispatch_queue(void) {
+    struct dispatch_job *job;
+    struct dispatch_stats *test_stats;
+
+    while ( queue != NULL ) {
+        job = queue;
+        queue = queue->next;
+        Log(LOG_DEBUG, "Removing queued %s test", job->item->test->name);
+        if ( (test_stats = get_dispatch_stats(job->item->test->id, 0)) ) {
+            test_stats->skipped++;
+        }
+        free(job);
+    }
+
+    if ( dispatch_event ) {
+        evtimer_del(dispatch_event);
+    }
+}
+
+
+
+/*
+ * Write the admission counters for every type of test that has been run.
+ */
+void dump_dispatch_stats(FILE *out) {
+    struct dispatch_stats *current;
+    test_t *test;
+
+    fprintf(out, "Tests running: %u (limit %u), start spacing %ums\n",
+            running, max_running, spacing);
+
+    for ( current = stats; current != NULL; current = current->next ) {
+        test = get_test_by_id(current->test_id);
+        fprintf(out, "%s: %u running (limit %u), %" PRIu64 " started, "
+                "%" PRIu64 " queued, %" PRIu64 " skipped, queue delay "
+                "avg %" PRIu64 "us max %" PRIu64 "us\n",
+                test ? test->name : "unknown", current->running,
+                current->limit, current->started, current->queued,
+                current->skipped,
+                current->started ? current->delay_usec / current->started : 0,
+                current->max_delay_usec);
+    }
+}
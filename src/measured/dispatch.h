@@ -0,0 +1,108 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_DISPATCH_H
+#define _MEASURED_DISPATCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <event2/event.h>
+
+#include "schedule.h"
+
+/* no limit on the number of tests running at once unless configured */
+#define DEFAULT_MAX_RUNNING_TESTS 0
+
+/* minimum gap (ms) between starting tests, spreads out tests due together */
+#define DEFAULT_TEST_START_SPACING 10
+
+/* upper limit on the start spacing (ms), so tests aren't starved */
+#define MAX_TEST_START_SPACING 1000
+
+/* longest (seconds) a test can be held back before that run is skipped */
+#define MAX_TEST_START_DELAY 60
+
+/*
+ * Admission counters for a single type of test, and the limit on how many
+ * tests of that type can be running at once (0 for no limit).
+ */
+struct dispatch_stats {
+    uint64_t test_id;           /* id of the test these counters are for */
+    uint32_t limit;             /* maximum tests of this type running at once */
+    uint32_t running;           /* tests of this type currently running */
+    uint64_t started;           /* total tests started */
+    uint64_t queued;            /* tests that had to wait before starting */
+    uint64_t skipped;           /* tests that waited too long and didn't run */
+    uint64_t delay_usec;        /* total time started tests spent waiting */
+    uint64_t max_delay_usec;    /* longest time a started test spent waiting */
+    struct dispatch_stats *next;
+};
+
+/*
+ * A scheduled test that is due to run but is waiting for a free slot.
+ */
+struct dispatch_job {
+    test_schedule_item_t *item;
+    struct timeval due;         /* time the test was scheduled to start */
+    struct timeval deadline;    /* give up on this run if not started by now */
+    struct dispatch_job *next;
+};
+
+/*
+ * A forked test process that is counted against the limits until it exits.
+ */
+struct dispatch_child {
+    pid_t pid;
+    uint64_t test_id;
+    struct dispatch_child *next;
+};
+
+void configure_dispatch(uint32_t max_running, uint32_t spacing);
+int configure_test_dispatch(uint64_t test_id, uint32_t max_running);
+void start_dispatch(struct event_base *base);
+void stop_dispatch(void);
+int dispatch_test(test_schedule_item_t *item);
+void dispatch_child_exited(pid_t pid);
+void dispatch_test_finished(uint64_t test_id);
+void clear_dispatch_queue(void);
+void dump_dispatch_stats(FILE *out);
+
+#endif
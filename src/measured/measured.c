@@ -70,6 +70,10 @@
 #include "certs.h"
 #include "parseconfig.h"
 #include "users.h"
+#include "messaging.h"
+#include "workers.h"
+#include "dispatch.h"
+#include "spool.h"
 
 #define AMP_CLIENT_CONFIG_DIR AMP_CONFIG_DIR "/clients"
 
@@ -208,8 +212,10 @@ static void stop_running(
 
 /*
  * If measured gets sent a SIGHUP or SIGUSR1 then it should reload all the
- * available test modules and re-read the schedule file taking into account
- * the new list of available tests.
+ * available test modules, re-read the global test limits, and re-read the
+ * schedule file taking into account the new list of available tests. Tests
+ * that haven't changed keep their existing timers, only new or modified
+ * tests are rescheduled.
  */
 static void reload(
         __attribute__((unused))evutil_socket_t evsock,
@@ -217,16 +223,34 @@ static void reload(
         void *evdata) {
     char schedule[PATH_MAX];
     amp_test_meta_t *meta = (amp_test_meta_t*)evdata;
+    struct event_base *base = meta->base;
+    struct schedule_index *current = NULL;
+    struct timeval start, end;
+    schedule_diff_t diff;
+    cfg_t *cfg;
 
     /* signal > 0 is a real signal meaning "reload", signal == 0 is "load" */
     if ( evsock > 0 ) {
         Log(LOG_INFO, "Received signal %d, reloading all configuration",evsock);
+        gettimeofday(&start, NULL);
+
+        /*
+         * Remember what is currently scheduled (leaving it scheduled) so
+         * that only tests that have changed need to be replaced.
+         */
+        current = index_test_schedule(meta->base);
+
+        /* pooled workers hold the old schedule, replace them once idle */
+        retire_test_workers();
 
-        /* cancel all scheduled tests (let running ones finish) */
-        clear_test_schedule(meta->base, 0);
+        /* queued tests belong to the old schedule, they will be run again */
+        clear_dispatch_queue();
 
         /* unload all the test modules */
         unregister_tests();
+
+        /* load the new schedule to the side so it can be compared */
+        base = event_base_new();
     }
 
     /* load all test modules again, they may have changed */
@@ -235,10 +259,35 @@ static void reload(
 	exit(EXIT_FAILURE);
     }
 
+    /* the global test limits may have changed, re-read them */
+    if ( evsock > 0 ) {
+        if ( (cfg = read_config(vars.config_file)) != NULL ) {
+            get_dispatch_config(cfg);
+            cfg_free(cfg);
+        } else {
+            Log(LOG_WARNING, "Keeping current test limits");
+        }
+    }
+
     /* re-read schedule files from the global and client specific dirs */
-    read_schedule_dir(meta->base, SCHEDULE_DIR, meta);
+    read_schedule_dir(base, SCHEDULE_DIR, meta);
     snprintf((char*)&schedule, PATH_MAX, "%s/%s", SCHEDULE_DIR, meta->ampname);
-    read_schedule_dir(meta->base, schedule, meta);
+    read_schedule_dir(base, schedule, meta);
+
+    if ( current != NULL ) {
+        /* keep unchanged tests, replace the rest with the staged schedule */
+        update_test_schedule(meta->base, base, current, &diff);
+        event_base_free(base);
+
+        gettimeofday(&end, NULL);
+        timersub(&end, &start, &end);
+        Log(LOG_INFO, "Reloaded schedule in %d.%06ds: %u unchanged, "
+                "%u added, %u removed", (int)end.tv_sec, (int)end.tv_usec,
+                diff.kept, diff.added, diff.removed);
+    }
+
+    /* fork any pooled test workers now they can see the new schedule */
+    start_test_workers(meta->base);
 }
 
 
@@ -253,6 +302,35 @@ static void load_tests_and_schedules(amp_test_meta_t *meta) {
 
 
 
+/*
+ * Write the SSL handshake counters for one side of control connections.
+ */
+static void dump_ssl_side(FILE *out, char *side, struct amp_ssl_stats *stats) {
+    fprintf(out, "SSL %s handshakes: %" PRIu64 " full (avg %" PRIu64 "us), "
+            "%" PRIu64 " resumed (avg %" PRIu64 "us), %" PRIu64 " failed\n",
+            side, stats->full,
+            stats->full ? stats->full_usec / stats->full : 0,
+            stats->resumed,
+            stats->resumed ? stats->resumed_usec / stats->resumed : 0,
+            stats->failed);
+}
+
+
+
+/*
+ * Write how many control connections needed a full SSL handshake compared
+ * to those that could resume an earlier session, and how long each took.
+ */
+static void dump_ssl_stats(FILE *out) {
+    struct amp_ssl_stats client, server;
+
+    get_ssl_stats(&client, &server);
+    dump_ssl_side(out, "client", &client);
+    dump_ssl_side(out, "server", &server);
+}
+
+
+
 /*
  * Dump internal scheduling information to a file for later analysis. We need
  * to be able to see the current state of the schedule to diagnose scheduling
@@ -281,6 +359,9 @@ static void debug_dump(evutil_socket_t evsock,
     }
 
     dump_schedule(base, out);
+    dump_ssl_stats(out);
+    dump_dispatch_stats(out);
+    dump_spool_stats(out);
 
     fclose(out);
     free(filename);
@@ -326,6 +407,9 @@ static void free_global_vars(struct amp_global_t *vars) {
     if ( vars->amqp_ssl.key ) free(vars->amqp_ssl.key);
     if ( vars->asnsock ) free(vars->asnsock);
     if ( vars->nssock ) free(vars->nssock);
+    if ( vars->reportsock ) free(vars->reportsock);
+    if ( vars->spool ) free(vars->spool);
+    if ( vars->config_file ) free(vars->config_file);
 }
 
 
@@ -356,6 +440,7 @@ int main(int argc, char *argv[]) {
     struct event *signal_tmax = NULL;
     const char *event_noepoll = "1";
     struct ub_ctx *dns_ctx;
+    struct amp_resolver *resolver;
     char nametable[PATH_MAX];
 
     memset(&meta, 0, sizeof(meta));
@@ -465,6 +550,9 @@ int main(int argc, char *argv[]) {
 	exit(EXIT_FAILURE);
     }
 
+    /* remember where the config came from so it can be read on reload */
+    vars.config_file = strdup(config_file);
+
     /* use the configured log level if it isn't set on the command line */
     if ( !log_level_override ) {
         log_level = get_loglevel_config(cfg);
@@ -537,6 +625,9 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    /* share SSL sessions between all the tests and control connections */
+    initialise_ssl_session_cache();
+
     /*
      * Try to configure the local rabbitmq broker. The easiest way to deal
      * with this at the moment is to check every time we run - this could be
@@ -607,6 +698,10 @@ int main(int argc, char *argv[]) {
     meta.base = event_base_new();
     assert(meta.base);
 
+    /* limit how many tests can run at once, and how close together */
+    get_dispatch_config(cfg);
+    start_dispatch(meta.base);
+
     /* construct our custom, per-client nameserver socket */
     if ( asprintf(&vars.nssock, "%s/%s.sock", AMP_RUN_DIR, vars.ampname) < 0 ) {
         Log(LOG_ALERT, "Failed to build local resolve socket path");
@@ -621,6 +716,23 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    /* construct our custom, per-client result reporting socket */
+    if ( asprintf(&vars.reportsock, "%s/%s.report", AMP_RUN_DIR,
+                vars.ampname) < 0 ) {
+        Log(LOG_ALERT, "Failed to build local report socket path");
+	cfg_free(cfg);
+        exit(EXIT_FAILURE);
+    }
+
+    /* construct our custom, per-client spool for unpublished results */
+    if ( asprintf(&vars.spool, "%s/%s.spool", AMP_SPOOL_DIR,
+                vars.ampname) < 0 ) {
+        Log(LOG_ALERT, "Failed to build result spool path");
+	cfg_free(cfg);
+        exit(EXIT_FAILURE);
+    }
+    get_spool_config(cfg);
+
     /* if remote fetching is enabled, try to get the config for it */
     if ( fetch_remote && (fetch = get_remote_schedule_config(cfg)) ) {
         /* TODO fetch gets leaked, has lots of parts needing to be freed */
@@ -661,8 +773,10 @@ int main(int argc, char *argv[]) {
         cfg_free(cfg);
         exit(EXIT_FAILURE);
     }
+    resolver = amp_resolver_new(meta.base, dns_ctx,
+            cfg_getbool(cfg, "dnscache"));
     resolver_socket_event = event_new(meta.base, vars.nssock_fd,
-            EV_READ|EV_PERSIST, resolver_socket_event_callback, dns_ctx);
+            EV_READ|EV_PERSIST, resolver_socket_event_callback, resolver);
     event_add(resolver_socket_event, NULL);
 
     /* create the asn lookup unix socket and add event listener for it */
@@ -673,12 +787,21 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    asn_info = initialise_asn_info();
+    asn_info = initialise_asn_info(cfg_getstr(cfg, "asntable"));
     //XXX can we move this and socket creation off into the function too?
     asn_socket_event = event_new(meta.base, vars.asnsock_fd,
             EV_READ|EV_PERSIST, asn_socket_event_callback, asn_info);
     event_add(asn_socket_event, NULL);
 
+    /* create the result reporting unix socket and start the reporter */
+    Log(LOG_DEBUG, "Creating local socket for reporting results");
+    if ( (vars.reportsock_fd = initialise_local_socket(vars.reportsock)) < 0 ||
+            initialise_reporting(meta.base) < 0 ) {
+        Log(LOG_ALERT, "Failed to initialise local reporting, aborting");
+	cfg_free(cfg);
+        exit(EXIT_FAILURE);
+    }
+
     /* save the port, tests need to know where to connect */
     control = get_control_config(cfg, &meta);
 
@@ -708,6 +831,9 @@ int main(int argc, char *argv[]) {
     /* get the default arguments that should be applied to each test */
     get_default_test_args(cfg);
 
+    /* start any pooled test workers that were configured in the defaults */
+    start_test_workers(meta.base);
+
     /* configuration is done, free the object */
     cfg_free(cfg);
 
@@ -738,6 +864,12 @@ int main(int argc, char *argv[]) {
     Log(LOG_INFO, "Shutting down");
 
     /* if we get control back then it's time to tidy up */
+    Log(LOG_DEBUG, "Stopping test workers");
+    stop_test_workers();
+
+    Log(LOG_DEBUG, "Stopping test dispatch");
+    stop_dispatch();
+
     Log(LOG_DEBUG, "Clearing test schedules");
     clear_test_schedule(meta.base, 1);
 
@@ -755,10 +887,16 @@ int main(int argc, char *argv[]) {
     if ( signal_chld ) event_free(signal_chld);
     if ( resolver_socket_event ) event_free(resolver_socket_event);
     if ( asn_socket_event ) event_free(asn_socket_event);
+    amp_resolver_free(resolver);
     if ( signal_hup ) event_free(signal_hup);
     if ( signal_usr1 ) event_free(signal_usr1);
     if ( signal_tmax ) event_free(signal_tmax);
 
+    /* publish any outstanding results and close the broker connection */
+    Log(LOG_DEBUG, "Shutting down result reporting");
+    close(vars.reportsock_fd);
+    shutdown_reporting();
+
     Log(LOG_DEBUG, "Clearing libevent");
     event_base_free(meta.base);
 
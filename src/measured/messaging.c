@@ -38,31 +38,112 @@
  */
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <inttypes.h>
 #include <amqp_ssl_socket.h>
 #include <amqp_tcp_socket.h>
+#include <amqp_framing.h>
 
 #include "messaging.h"
+#include "spool.h"
 #include "debug.h"
 #include "modules.h"
 #include "global.h"
+#include "testlib.h"
+#include "ampresolv.h" /* for UNIX_PATH_MAX */
+
+
+/* a single result waiting to be published by the reporter process */
+struct amp_report {
+    char *name;
+    uint64_t timestamp;
+    uint32_t len;
+    void *data;
+    struct amp_report *next;
+};
+
+/* read state for a test process connected to the local report socket */
+struct amp_report_client {
+    int fd;
+    struct event *event;
+    struct amp_report_header header;
+    uint32_t offset;
+    char *buffer;
+};
+
+/*
+ * Shared memory ring that test processes write their results into, so they
+ * can exit as soon as the test is complete. It is created by the main
+ * process before any tests are forked, so every test process inherits it.
+ * Records are only made visible (by moving head) once completely written,
+ * so a test dying part way through can't leave a partial record behind.
+ */
+struct amp_report_ring {
+    pthread_mutex_t lock;
+    uint64_t head; /* total bytes ever written by test processes */
+    uint64_t tail; /* total bytes ever consumed by the reporter process */
+    uint32_t size; /* size of the data area that follows */
+    char data[];
+};
+
+/* records are kept 8 byte aligned so the headers can be read in place */
+#define REPORT_RECORD_LEN(namelen, datalen) \
+    ((sizeof(struct amp_report_header) + (namelen) + (datalen) + 7) & ~7ULL)
+
+static struct amp_report_ring *ring = NULL;
+static int ring_notify = -1;
+
+/* state belonging to the long lived broker connection in the reporter */
+static struct {
+    struct event_base *base;
+    struct event *flush;
+    struct event *ring;
+    struct event *replay;
+    struct amp_report *head;
+    struct amp_report *tail;
+    int count;
+    uint64_t next_tag;
+    time_t next_connect;
+} reports;
+
+/* state used by the main process to look after the reporter process */
+static struct {
+    struct event_base *parent;
+    struct event *restart;
+    pid_t pid;
+} reporter;
+
+static amqp_connection_state_t conn = NULL;
 
 
 
 /*
  * Create a connection to the broker (local or remote) that measured can use
- * to report data from tests. Each test *should* use a different channel within
- * this connection but they currently all create their own individual
- * connections as sharing connections/channels becomes tricky when multiple
- * processes are involved.
- * TODO create a connection that persists for the lifetime of the main process
- * that allocates channels within it for each test process.
+ * to report data from tests. The reporter process keeps one of these open
+ * for as long as it can, test processes only create their own if they are
+ * unable to pass their results to the reporter.
  */
 static int connect_to_broker(void) {
     amqp_socket_t *sock;
     char *collector = vars.vialocal ? vars.local : vars.collector;
     int port = vars.vialocal ? AMQP_PORT : vars.port;
     char *vhost = vars.vialocal ? vars.ampname : vars.vhost;
+    struct timeval timeout = { AMQP_CONNECT_TIMEOUT, 0 };
 
     Log(LOG_DEBUG, "Opening new connection to broker %s:%d\n", collector, port);
 
@@ -93,7 +174,7 @@ static int connect_to_broker(void) {
         amqp_ssl_socket_set_verify(sock, 1);
 #endif
 
-        if ( amqp_socket_open(sock, collector, port) != 0 ) {
+        if ( amqp_socket_open_noblock(sock, collector, port, &timeout) != 0 ) {
             Log(LOG_ERR, "Failed to open connection to %s:%d", collector, port);
             return -1;
         }
@@ -116,7 +197,7 @@ static int connect_to_broker(void) {
             return -1;
         }
 
-        if ( amqp_socket_open(sock, collector, port) != 0 ) {
+        if ( amqp_socket_open_noblock(sock, collector, port, &timeout) != 0 ) {
             Log(LOG_ERR, "Failed to open connection to %s:%d", collector, port);
             return -1;
         }
@@ -140,24 +221,47 @@ static int connect_to_broker(void) {
 
 
 /*
- * Close the connection to the local broker. Should only be called when
- * measured is terminating.
+ * Close the connection to the broker, politely if it still appears to be
+ * working.
  */
 static void close_broker_connection(void) {
+    if ( conn == NULL ) {
+        return;
+    }
+
     amqp_connection_close(conn, AMQP_REPLY_SUCCESS);
     amqp_destroy_connection(conn);
+    conn = NULL;
+}
+
+
+
+/*
+ * Throw away a broker connection that has stopped working, without trying
+ * to exchange any more messages over it.
+ */
+static void abandon_broker_connection(void) {
+    if ( conn == NULL ) {
+        return;
+    }
+
+    amqp_destroy_connection(conn);
+    conn = NULL;
 }
 
 
 
 /*
- * Report results for a single test to the broker.
+ * Publish a single result on the given channel. The properties are the same
+ * regardless of whether it is the test process or the reporter process that
+ * is doing the publishing.
  *
  * example amqp_table_t stuff:
  * https://groups.google.com/forum/?fromgroups=#!topic/rabbitmq-discuss/M_8I12gWxbQ
  * rabbitmq-c/tests/test_tables.c
  */
-int report_to_broker(test_t *test, amp_test_result_t *result) {
+static int publish_result(amqp_channel_t channel, char *name,
+        uint64_t timestamp, void *bytes, uint32_t len) {
 
     amqp_basic_properties_t props;
     amqp_bytes_t data;
@@ -166,37 +270,10 @@ int report_to_broker(test_t *test, amp_test_result_t *result) {
     char *exchange = vars.vialocal ? AMQP_LOCAL_EXCHANGE : vars.exchange;
     char *routingkey = vars.vialocal ? AMQP_LOCAL_ROUTING_KEY : vars.routingkey;
 
-    /*
-     * Ideally this would only happen once and the same connection would be
-     * reused for all tests, but with their own channel. A connection can't
-     * be shared by multiple processes/threads however, so they can't just
-     * create themselves a new channel using the single connection object -
-     * they need to make their own connection, or the master parent process
-     * needs to create the channel and somehow tell the child which channel
-     * to use.
-     * TODO how to make this work with a single connection, multiple channels.
-     */
-    if ( connect_to_broker() < 0 ) {
-	return -1;
-    }
-
-    /*
-     * open a new channel for every reporting process, there may be multiple
-     * of these going on at once so they need individual channels
-     */
-    Log(LOG_DEBUG, "Opening new channel %d to broker\n", getpid());
-    amqp_channel_open(conn, getpid());
-
-    if ( (amqp_get_rpc_reply(conn).reply_type) != AMQP_RESPONSE_NORMAL ) {
-	Log(LOG_ERR, "Failed to open channel");
-	close_broker_connection();
-	return -1;
-    }
-
     /* The name of the test data is being reported for */
     table_entries.key = amqp_cstring_bytes("x-amp-test-type");
     table_entries.value.kind = AMQP_FIELD_KIND_UTF8;
-    table_entries.value.value.bytes = amqp_cstring_bytes(test->name);
+    table_entries.value.value.bytes = amqp_cstring_bytes(name);
 
     /* Add all the individual headers to the header table - only test type */
     headers.num_entries = 1;
@@ -213,7 +290,7 @@ int report_to_broker(test_t *test, amp_test_result_t *result) {
     props.content_type = amqp_cstring_bytes("application/octet-stream");
     props.delivery_mode = 2; /* persistent delivery mode */
     props.headers = headers;
-    props.timestamp = result->timestamp;
+    props.timestamp = timestamp;
     /*
      * If the userid is set, it must match the authenticated username or the
      * message will be rejected by the rabbitmq broker. If it is not set then
@@ -222,15 +299,15 @@ int report_to_broker(test_t *test, amp_test_result_t *result) {
     props.user_id = amqp_cstring_bytes(vars.ampname);
 
     /* Add the binary blob, the other end will know how to unpack it */
-    data.len = result->len;
-    data.bytes = result->data;
+    data.len = len;
+    data.bytes = bytes;
 
     /* publish the message */
     Log(LOG_DEBUG, "Publishing message to exchange '%s', routingkey '%s'\n",
             exchange, routingkey);
 
     if ( amqp_basic_publish(conn,
-	    getpid(),				    /* channel, our pid */
+	    channel,				    /* channel */
 	    amqp_cstring_bytes(exchange),           /* exchange name */
 	    amqp_cstring_bytes(routingkey),         /* routing key */
 	    0,					    /* mandatory */
@@ -239,6 +316,41 @@ int report_to_broker(test_t *test, amp_test_result_t *result) {
 	    data) < 0 ) {			    /* body */
 
 	Log(LOG_ERR, "Failed to publish message");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Report results for a single test directly to the broker, using a new
+ * connection. This is only used if the reporter process can't be reached
+ * through the local report socket.
+ */
+static int report_directly_to_broker(test_t *test, amp_test_result_t *result) {
+
+    if ( connect_to_broker() < 0 ) {
+        abandon_broker_connection();
+	return -1;
+    }
+
+    /*
+     * open a new channel for every reporting process, there may be multiple
+     * of these going on at once so they need individual channels
+     */
+    Log(LOG_DEBUG, "Opening new channel %d to broker\n", getpid());
+    amqp_channel_open(conn, getpid());
+
+    if ( (amqp_get_rpc_reply(conn).reply_type) != AMQP_RESPONSE_NORMAL ) {
+	Log(LOG_ERR, "Failed to open channel");
+	close_broker_connection();
+	return -1;
+    }
+
+    if ( publish_result(getpid(), test->name, result->timestamp,
+                result->data, result->len) < 0 ) {
 	amqp_channel_close(conn, getpid(), AMQP_REPLY_SUCCESS);
 	close_broker_connection();
 	return -1;
@@ -250,3 +362,1155 @@ int report_to_broker(test_t *test, amp_test_result_t *result) {
     close_broker_connection();
     return 0;
 }
+
+
+
+/*
+ * Hand the results of a single test to the reporter process over the
+ * local report socket. The whole result is written in one go, after which
+ * the test process is free to exit.
+ */
+static int report_to_local_socket(test_t *test, amp_test_result_t *result) {
+    int fd;
+    struct sockaddr_un addr;
+    struct amp_report_header header;
+    struct iovec iov[3];
+    int iovcnt = 3;
+    ssize_t bytes;
+
+    if ( vars.reportsock == NULL ) {
+        return -1;
+    }
+
+    if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ) {
+        Log(LOG_WARNING, "Failed to create report socket: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, UNIX_PATH_MAX, "%s", vars.reportsock);
+
+    if ( connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ) {
+        Log(LOG_WARNING, "Failed to connect to report socket %s: %s",
+                vars.reportsock, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    header.timestamp = result->timestamp;
+    header.namelen = strlen(test->name);
+    header.datalen = result->len;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = test->name;
+    iov[1].iov_len = header.namelen;
+    iov[2].iov_base = result->data;
+    iov[2].iov_len = result->len;
+
+    /* deal with partial writes, making sure the whole result gets sent */
+    while ( iovcnt > 0 ) {
+        if ( (bytes = writev(fd, iov + (3 - iovcnt), iovcnt)) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            Log(LOG_WARNING, "Failed to write result to report socket: %s",
+                    strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        while ( iovcnt > 0 && (size_t)bytes >= iov[3 - iovcnt].iov_len ) {
+            bytes -= iov[3 - iovcnt].iov_len;
+            iovcnt--;
+        }
+
+        if ( iovcnt > 0 ) {
+            iov[3 - iovcnt].iov_base = (char*)iov[3 - iovcnt].iov_base + bytes;
+            iov[3 - iovcnt].iov_len -= bytes;
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+
+
+/*
+ * Lock the report ring. The lock is robust, so if a test process died while
+ * holding it then we take it over - head only moves once a record has been
+ * completely written so the contents of the ring are still consistent.
+ */
+static int lock_report_ring(void) {
+    int res = pthread_mutex_lock(&ring->lock);
+
+    if ( res == EOWNERDEAD ) {
+        Log(LOG_WARNING, "Process died holding report ring lock, recovering");
+        pthread_mutex_consistent(&ring->lock);
+        return 0;
+    }
+
+    if ( res != 0 ) {
+        Log(LOG_WARNING, "Failed to lock report ring: %s", strerror(res));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Copy data into the report ring at the given position, wrapping around to
+ * the start of the ring if need be.
+ */
+static void copy_to_report_ring(uint64_t position, const void *src,
+        uint32_t len) {
+    uint32_t offset = position % ring->size;
+    uint32_t first = len < ring->size - offset ? len : ring->size - offset;
+
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const char*)src + first, len - first);
+}
+
+
+
+/*
+ * Copy data out of the report ring from the given position, wrapping around
+ * to the start of the ring if need be.
+ */
+static void copy_from_report_ring(uint64_t position, void *dst, uint32_t len) {
+    uint32_t offset = position % ring->size;
+    uint32_t first = len < ring->size - offset ? len : ring->size - offset;
+
+    memcpy(dst, ring->data + offset, first);
+    memcpy((char*)dst + first, ring->data, len - first);
+}
+
+
+
+/*
+ * Hand the results of a single test to the reporter process by writing
+ * them into the shared memory report ring. This costs a single copy and a
+ * wakeup, after which the test process is free to exit.
+ */
+static int report_to_report_ring(test_t *test, amp_test_result_t *result) {
+    struct amp_report_header header;
+    uint64_t length;
+    uint64_t one = 1;
+
+    if ( ring == NULL ) {
+        return -1;
+    }
+
+    header.timestamp = result->timestamp;
+    header.namelen = strlen(test->name);
+    header.datalen = result->len;
+    length = REPORT_RECORD_LEN(header.namelen, header.datalen);
+
+    if ( length > ring->size ) {
+        return -1;
+    }
+
+    if ( lock_report_ring() < 0 ) {
+        return -1;
+    }
+
+    if ( ring->head - ring->tail + length > ring->size ) {
+        pthread_mutex_unlock(&ring->lock);
+        Log(LOG_DEBUG, "Report ring full, can't add %s result", test->name);
+        return -1;
+    }
+
+    copy_to_report_ring(ring->head, &header, sizeof(header));
+    copy_to_report_ring(ring->head + sizeof(header), test->name,
+            header.namelen);
+    copy_to_report_ring(ring->head + sizeof(header) + header.namelen,
+            result->data, header.datalen);
+    ring->head += length;
+
+    pthread_mutex_unlock(&ring->lock);
+
+    /* the result is safely in the ring even if the wakeup gets lost */
+    if ( write(ring_notify, &one, sizeof(one)) < 0 ) {
+        Log(LOG_DEBUG, "Failed to wake reporter process: %s", strerror(errno));
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Report results for a single test to the broker. Normally this is done by
+ * passing them to the reporter process, which holds a persistent
+ * connection to the broker and can publish many results at once.
+ */
+int report_to_broker(test_t *test, amp_test_result_t *result) {
+    if ( report_to_report_ring(test, result) == 0 ) {
+        return 0;
+    }
+
+    /* too big for the ring, or the ring is full, try the report socket */
+    if ( report_to_local_socket(test, result) == 0 ) {
+        return 0;
+    }
+
+    Log(LOG_WARNING, "Falling back to reporting %s result directly",
+            test->name);
+
+    if ( report_directly_to_broker(test, result) == 0 ) {
+        return 0;
+    }
+
+    /* the reporter will publish it once the broker is back */
+    if ( spool_report(test->name, result->timestamp, result->data,
+                result->len) == 0 ) {
+        Log(LOG_WARNING, "Broker unavailable, spooled %s result", test->name);
+        return 0;
+    }
+
+    return -1;
+}
+
+
+
+/*
+ * Free a single queued result.
+ */
+static void free_report(struct amp_report *report) {
+    free(report->name);
+    free(report->data);
+    free(report);
+}
+
+
+
+/*
+ * Move queued results into the spool while the broker is unavailable, so
+ * they survive a restart and don't have to be dropped if the outage is a
+ * long one. Anything that can't be spooled stays in the queue.
+ */
+static void spill_reports(void) {
+    struct amp_report *report;
+    int count = 0;
+
+    while ( reports.head != NULL ) {
+        report = reports.head;
+        if ( spool_report(report->name, report->timestamp, report->data,
+                    report->len) < 0 ) {
+            break;
+        }
+        reports.head = report->next;
+        reports.count--;
+        free_report(report);
+        count++;
+    }
+
+    if ( reports.head == NULL ) {
+        reports.tail = NULL;
+    }
+
+    if ( count > 0 ) {
+        sync_spool();
+        Log(LOG_DEBUG, "Moved %d queued results to the spool", count);
+    }
+}
+
+
+
+/*
+ * Make sure the reporter process has a working connection to the
+ * broker, with publisher confirms enabled on the reporting channel.
+ */
+static int check_broker_connection(void) {
+    if ( conn != NULL ) {
+        return 0;
+    }
+
+    /* don't hammer the broker if it has recently been unavailable */
+    if ( time(NULL) < reports.next_connect ) {
+        return -1;
+    }
+
+    if ( connect_to_broker() < 0 ) {
+        goto fail;
+    }
+
+    amqp_channel_open(conn, AMQP_REPORT_CHANNEL);
+    if ( amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL ) {
+        Log(LOG_ERR, "Failed to open reporting channel");
+        goto fail;
+    }
+
+    amqp_confirm_select(conn, AMQP_REPORT_CHANNEL);
+    if ( amqp_get_rpc_reply(conn).reply_type != AMQP_RESPONSE_NORMAL ) {
+        Log(LOG_ERR, "Failed to enable publisher confirms");
+        goto fail;
+    }
+
+    /* delivery tags start from 1 on a new channel in confirm mode */
+    reports.next_tag = 1;
+
+    Log(LOG_DEBUG, "Persistent broker connection established");
+    return 0;
+
+fail:
+    abandon_broker_connection();
+    reports.next_connect = time(NULL) + AMQP_RECONNECT_DELAY;
+    return -1;
+}
+
+
+
+/*
+ * Wait for the broker to acknowledge every message in the batch that was
+ * just published. Each message is marked as acknowledged (1), rejected (-1)
+ * or still unconfirmed (0). The whole batch shares one timeout, so other
+ * traffic on the connection can't keep us waiting indefinitely.
+ */
+static int wait_for_confirms(uint64_t first, int count, int *confirmed) {
+    amqp_frame_t frame;
+    struct timespec deadline, now;
+    struct timeval timeout;
+    int64_t remaining;
+    uint64_t last = first + count - 1;
+    uint64_t tag, lowest;
+    int multiple, status;
+    int outstanding = count;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += AMQP_CONFIRM_TIMEOUT;
+
+    while ( outstanding > 0 ) {
+        /* once the deadline passes, only frames already received are read */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining = ((int64_t)(deadline.tv_sec - now.tv_sec) * 1000000) +
+            ((deadline.tv_nsec - now.tv_nsec) / 1000);
+        if ( remaining < 0 ) {
+            remaining = 0;
+        }
+        timeout.tv_sec = remaining / 1000000;
+        timeout.tv_usec = remaining % 1000000;
+
+        if ( amqp_simple_wait_frame_noblock(conn, &frame, &timeout) !=
+                AMQP_STATUS_OK ) {
+            Log(LOG_WARNING, "Failed to get confirms for %d/%d results",
+                    outstanding, count);
+            return -1;
+        }
+
+        if ( frame.frame_type != AMQP_FRAME_METHOD ||
+                frame.channel != AMQP_REPORT_CHANNEL ) {
+            continue;
+        }
+
+        switch ( frame.payload.method.id ) {
+            case AMQP_BASIC_ACK_METHOD: {
+                amqp_basic_ack_t *ack = frame.payload.method.decoded;
+                tag = ack->delivery_tag;
+                multiple = ack->multiple;
+                status = 1;
+                break;
+            }
+            case AMQP_BASIC_NACK_METHOD: {
+                amqp_basic_nack_t *nack = frame.payload.method.decoded;
+                tag = nack->delivery_tag;
+                multiple = nack->multiple;
+                status = -1;
+                break;
+            }
+            case AMQP_CHANNEL_CLOSE_METHOD:
+            case AMQP_CONNECTION_CLOSE_METHOD:
+                Log(LOG_WARNING, "Broker closed the reporting channel");
+                return -1;
+            default:
+                continue;
+        };
+
+        if ( tag < first || tag > last ) {
+            continue;
+        }
+
+        lowest = multiple ? first : tag;
+        for ( i = lowest - first; i <= (int)(tag - first); i++ ) {
+            if ( confirmed[i] == 0 ) {
+                confirmed[i] = status;
+                outstanding--;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Publish as many queued results as possible, in batches. Every result in
+ * a batch is published before waiting for any of the confirms, so the
+ * broker only costs us one round trip per batch. Anything that isn't
+ * confirmed stays at the front of the queue to be tried again later.
+ */
+static void flush_reports(void) {
+    struct amp_report *batch[AMQP_REPORT_BATCH_SIZE];
+    int confirmed[AMQP_REPORT_BATCH_SIZE];
+    struct amp_report *report, *retry, *retry_tail;
+    uint64_t first;
+    int count, sent, i;
+
+    while ( reports.head != NULL ) {
+        if ( check_broker_connection() < 0 ) {
+            spill_reports();
+            Log(LOG_WARNING, "Broker unavailable, %d results queued, "
+                    "%" PRIu64 " spooled", reports.count,
+                    spooled_report_count());
+            return;
+        }
+
+        first = reports.next_tag;
+
+        /* publish the whole batch without waiting for any replies */
+        for ( report = reports.head, count = 0, sent = 0;
+                report != NULL && count < AMQP_REPORT_BATCH_SIZE;
+                report = report->next, count++ ) {
+            batch[count] = report;
+            confirmed[count] = 0;
+            if ( sent == count && publish_result(AMQP_REPORT_CHANNEL,
+                        report->name, report->timestamp, report->data,
+                        report->len) == 0 ) {
+                sent++;
+            }
+        }
+
+        reports.next_tag += sent;
+
+        if ( sent == 0 || wait_for_confirms(first, sent, confirmed) < 0 ) {
+            /* we don't know what got through, it will all be resent */
+            abandon_broker_connection();
+            reports.next_connect = time(NULL) + AMQP_RECONNECT_DELAY;
+            spill_reports();
+            Log(LOG_WARNING, "Lost broker connection, %d results queued, "
+                    "%" PRIu64 " spooled", reports.count,
+                    spooled_report_count());
+            return;
+        }
+
+        /* remove confirmed results, keep the rest in order to try again */
+        retry = retry_tail = NULL;
+        for ( i = 0; i < count; i++ ) {
+            if ( confirmed[i] > 0 ) {
+                free_report(batch[i]);
+                reports.count--;
+                continue;
+            }
+
+            if ( confirmed[i] < 0 ) {
+                Log(LOG_WARNING, "Broker rejected %s result, will retry",
+                        batch[i]->name);
+            }
+
+            if ( retry_tail ) {
+                retry_tail->next = batch[i];
+            } else {
+                retry = batch[i];
+            }
+            retry_tail = batch[i];
+        }
+
+        if ( retry_tail ) {
+            retry_tail->next = report;
+            reports.head = retry;
+            if ( report == NULL ) {
+                reports.tail = retry_tail;
+            }
+            /* give the broker a break before retrying rejected messages */
+            return;
+        }
+
+        reports.head = report;
+        if ( reports.head == NULL ) {
+            reports.tail = NULL;
+        }
+    }
+}
+
+
+
+/*
+ * Timer callback to publish whatever results have been queued up.
+ */
+static void flush_reports_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        __attribute__((unused))void *evdata) {
+
+    struct timeval retry = { AMQP_RECONNECT_DELAY, 0 };
+    struct timeval now = { 0, 0 };
+
+    flush_reports();
+
+    /* if there is anything still queued then try again a bit later */
+    if ( reports.head != NULL ) {
+        evtimer_add(reports.flush, &retry);
+    } else if ( spooled_report_count() > 0 ) {
+        /* the broker is keeping up, start on anything that was spooled */
+        evtimer_add(reports.replay, &now);
+    }
+}
+
+
+
+/*
+ * Publish results from the spool in batches, the same way that queued
+ * results are published. Only a limited number of batches are sent before
+ * checking for newly arrived results, and replay pauses while there are new
+ * results queued so they aren't held up behind a long backlog. Returns 1 if
+ * there are more spooled results that should be sent as soon as possible.
+ */
+static int replay_spool(void) {
+    struct amp_spool_entry batch[AMQP_REPORT_BATCH_SIZE];
+    int confirmed[AMQP_REPORT_BATCH_SIZE];
+    uint64_t first;
+    int batches, count, sent, done, i;
+
+    for ( batches = 0; batches < AMQP_SPOOL_REPLAY_BATCHES; batches++ ) {
+        if ( reports.head != NULL || spooled_report_count() == 0 ||
+                check_broker_connection() < 0 ) {
+            return 0;
+        }
+
+        if ( (count = read_spool(batch, AMQP_REPORT_BATCH_SIZE)) == 0 ) {
+            return 0;
+        }
+
+        first = reports.next_tag;
+
+        /* publish the whole batch without waiting for any replies */
+        for ( i = 0, sent = 0; i < count; i++ ) {
+            confirmed[i] = 0;
+            if ( sent == i && publish_result(AMQP_REPORT_CHANNEL,
+                        batch[i].name, batch[i].timestamp, batch[i].data,
+                        batch[i].len) == 0 ) {
+                sent++;
+            }
+        }
+
+        reports.next_tag += sent;
+
+        if ( sent == 0 || wait_for_confirms(first, sent, confirmed) < 0 ) {
+            /* everything is still in the spool, it will all be resent */
+            free_spool_entries(batch, count);
+            abandon_broker_connection();
+            reports.next_connect = time(NULL) + AMQP_RECONNECT_DELAY;
+            Log(LOG_WARNING, "Lost broker connection, %" PRIu64
+                    " results spooled", spooled_report_count());
+            return 0;
+        }
+
+        /* the spool is kept in order, only the confirmed prefix can go */
+        for ( done = 0; done < count && confirmed[done] > 0; done++ ) {
+            /* nothing */;
+        }
+
+        if ( done > 0 ) {
+            release_spool(batch[done - 1].end);
+        }
+
+        Log(LOG_DEBUG, "Replayed %d spooled results, %" PRIu64 " remaining",
+                done, spooled_report_count());
+
+        if ( done < count ) {
+            Log(LOG_WARNING, "Broker rejected spooled %s result, will retry",
+                    batch[done].name);
+            free_spool_entries(batch, count);
+            return 0;
+        }
+
+        free_spool_entries(batch, count);
+    }
+
+    return spooled_report_count() > 0;
+}
+
+
+
+/*
+ * Timer callback to publish results that have been spooled. It stays armed,
+ * so results spooled by test processes get noticed.
+ */
+static void replay_spool_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        __attribute__((unused))void *evdata) {
+
+    struct timeval retry = { AMQP_RECONNECT_DELAY, 0 };
+    struct timeval now = { 0, 0 };
+
+    evtimer_add(reports.replay, replay_spool() ? &now : &retry);
+}
+
+
+
+/*
+ * Add a result to the queue of those waiting to be published. Small bursts
+ * of results (e.g. tests scheduled at the same time) are gathered together
+ * and published as a single batch.
+ */
+static void queue_report(struct amp_report *report) {
+    struct timeval delay = { 0, AMQP_REPORT_BATCH_DELAY_US };
+    struct amp_report *old;
+
+    /* if the queue is too long then spool (or drop) the oldest results */
+    if ( reports.count >= AMQP_MAX_QUEUED_REPORTS ) {
+        old = reports.head;
+        reports.head = old->next;
+        if ( reports.head == NULL ) {
+            reports.tail = NULL;
+        }
+        reports.count--;
+        if ( spool_report(old->name, old->timestamp, old->data,
+                    old->len) < 0 ) {
+            Log(LOG_WARNING, "Report queue full, dropping %s result",
+                    old->name);
+        }
+        free_report(old);
+    }
+
+    report->next = NULL;
+    if ( reports.tail ) {
+        reports.tail->next = report;
+    } else {
+        reports.head = report;
+    }
+    reports.tail = report;
+    reports.count++;
+
+    if ( reports.count >= AMQP_REPORT_BATCH_SIZE && conn != NULL ) {
+        /* got a full batch, don't wait for the timer */
+        flush_reports();
+    }
+
+    /* measured itself has no timer, it only queues while shutting down */
+    if ( reports.flush != NULL && reports.head != NULL &&
+            !evtimer_pending(reports.flush, NULL) ) {
+        evtimer_add(reports.flush, &delay);
+    }
+}
+
+
+
+/*
+ * Close a connection from a test process and free the read state.
+ */
+static void free_report_client(struct amp_report_client *client) {
+    event_free(client->event);
+    close(client->fd);
+    free(client->buffer);
+    free(client);
+}
+
+
+
+/*
+ * Read the result being sent by a test process. It may arrive over multiple
+ * reads, so keep track of how much has been seen until the header and body
+ * have both been completely read.
+ */
+static void report_client_read_callback(evutil_socket_t evsock,
+        __attribute__((unused))short flags, void *evdata) {
+
+    struct amp_report_client *client = evdata;
+    struct amp_report *report;
+    ssize_t bytes;
+    uint32_t want;
+    char *target;
+
+    if ( client->offset < sizeof(client->header) ) {
+        target = (char*)&client->header + client->offset;
+        want = sizeof(client->header) - client->offset;
+    } else {
+        target = client->buffer + (client->offset - sizeof(client->header));
+        want = sizeof(client->header) + client->header.namelen +
+            client->header.datalen - client->offset;
+    }
+
+    if ( (bytes = read(evsock, target, want)) <= 0 ) {
+        if ( bytes < 0 && (errno == EAGAIN || errno == EINTR) ) {
+            return;
+        }
+        Log(LOG_WARNING, "Incomplete result on report socket");
+        free_report_client(client);
+        return;
+    }
+
+    client->offset += bytes;
+
+    /* once the header is complete we know how much more data there is */
+    if ( client->offset == sizeof(client->header) ) {
+        if ( client->header.namelen == 0 ||
+                client->header.namelen > AMQP_MAX_REPORT_NAME_LEN ||
+                client->header.datalen > AMQP_MAX_REPORT_LEN ) {
+            Log(LOG_WARNING, "Bad result header on report socket");
+            free_report_client(client);
+            return;
+        }
+
+        client->buffer = malloc(client->header.namelen +
+                client->header.datalen + 1);
+    }
+
+    if ( client->offset < sizeof(client->header) + client->header.namelen +
+            client->header.datalen || client->buffer == NULL ) {
+        return;
+    }
+
+    /* the whole result has arrived, queue it up to be published */
+    report = calloc(1, sizeof(struct amp_report));
+    report->name = strndup(client->buffer, client->header.namelen);
+    report->timestamp = client->header.timestamp;
+    report->len = client->header.datalen;
+    report->data = malloc(report->len);
+    memcpy(report->data, client->buffer + client->header.namelen, report->len);
+
+    Log(LOG_DEBUG, "Received %s result (%d bytes) on report socket",
+            report->name, report->len);
+
+    free_report_client(client);
+    queue_report(report);
+}
+
+
+
+/*
+ * Accept a new connection on the local report socket from a test process
+ * that has results to publish.
+ */
+static void report_socket_event_callback(evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        __attribute__((unused))void *evdata) {
+
+    int fd;
+    struct amp_report_client *client;
+
+    if ( (fd = accept4(evsock, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) < 0 ) {
+        Log(LOG_WARNING, "Failed to accept for reporting: %s",
+                strerror(errno));
+        return;
+    }
+
+    client = calloc(1, sizeof(struct amp_report_client));
+    client->fd = fd;
+    client->event = event_new(reports.base, fd, EV_READ|EV_PERSIST,
+            report_client_read_callback, client);
+    event_add(client->event, NULL);
+}
+
+
+
+/*
+ * Move every complete result out of the report ring and into the queue of
+ * results waiting to be published. The lock is only held while copying, so
+ * test processes aren't kept waiting while we talk to the broker.
+ */
+static void drain_report_ring(void) {
+    struct amp_report_header header;
+    struct amp_report *report, *head = NULL, *tail = NULL;
+    uint64_t length;
+
+    if ( lock_report_ring() < 0 ) {
+        return;
+    }
+
+    while ( ring->tail < ring->head ) {
+        copy_from_report_ring(ring->tail, &header, sizeof(header));
+        length = REPORT_RECORD_LEN(header.namelen, header.datalen);
+
+        if ( header.namelen == 0 ||
+                header.namelen > AMQP_MAX_REPORT_NAME_LEN ||
+                length > ring->head - ring->tail ) {
+            /* this shouldn't happen, but don't trust anything after it */
+            Log(LOG_WARNING, "Bad result header in report ring, discarding "
+                    "%" PRIu64 " bytes", ring->head - ring->tail);
+            ring->tail = ring->head;
+            break;
+        }
+
+        report = calloc(1, sizeof(struct amp_report));
+        report->name = calloc(1, header.namelen + 1);
+        report->timestamp = header.timestamp;
+        report->len = header.datalen;
+        report->data = malloc(report->len);
+
+        copy_from_report_ring(ring->tail + sizeof(header), report->name,
+                header.namelen);
+        copy_from_report_ring(ring->tail + sizeof(header) + header.namelen,
+                report->data, report->len);
+        ring->tail += length;
+
+        if ( tail ) {
+            tail->next = report;
+        } else {
+            head = report;
+        }
+        tail = report;
+    }
+
+    pthread_mutex_unlock(&ring->lock);
+
+    while ( head != NULL ) {
+        report = head;
+        head = head->next;
+        Log(LOG_DEBUG, "Received %s result (%d bytes) in report ring",
+                report->name, report->len);
+        queue_report(report);
+    }
+}
+
+
+
+/*
+ * A test process has put at least one result into the report ring.
+ */
+static void report_ring_event_callback(evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        __attribute__((unused))void *evdata) {
+
+    uint64_t count;
+
+    /* reset the eventfd counter, the ring itself says how much is there */
+    if ( read(evsock, &count, sizeof(count)) < 0 && errno != EAGAIN ) {
+        Log(LOG_WARNING, "Failed to read report ring notification: %s",
+                strerror(errno));
+    }
+
+    drain_report_ring();
+}
+
+
+
+/*
+ * Create the shared memory ring that test processes will write their
+ * results into, protected by a lock that is shared between processes.
+ */
+static int initialise_report_ring(void) {
+    pthread_mutexattr_t attr;
+    size_t size = sizeof(struct amp_report_ring) + AMP_REPORT_RING_SIZE;
+
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if ( ring == MAP_FAILED ) {
+        Log(LOG_WARNING, "Failed to map report ring: %s", strerror(errno));
+        ring = NULL;
+        return -1;
+    }
+
+    ring->size = AMP_REPORT_RING_SIZE;
+    ring->head = 0;
+    ring->tail = 0;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&ring->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    if ( (ring_notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ) {
+        Log(LOG_WARNING, "Failed to create report ring eventfd: %s",
+                strerror(errno));
+        pthread_mutex_destroy(&ring->lock);
+        munmap(ring, size);
+        ring = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Stop the reporter event loop when measured asks it to terminate.
+ */
+static void stop_reporter_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        __attribute__((unused))void *evdata) {
+
+    Log(LOG_DEBUG, "Result reporter received signal, exiting event loop");
+    event_base_loopbreak(reports.base);
+}
+
+
+
+/*
+ * Free everything that was queued but couldn't be published or spooled.
+ */
+static void discard_reports(void) {
+    struct amp_report *report;
+
+    if ( reports.count > 0 ) {
+        Log(LOG_WARNING, "Discarding %d unpublished results", reports.count);
+    }
+
+    while ( reports.head != NULL ) {
+        report = reports.head;
+        reports.head = report->next;
+        free_report(report);
+    }
+    reports.tail = NULL;
+    reports.count = 0;
+}
+
+
+
+/*
+ * Main loop of the reporter process. All of the broker I/O happens here,
+ * so waiting on a slow or unavailable broker (connecting, publisher
+ * confirms, replaying the spool) never holds up the main measured event
+ * loop and the timing of scheduled tests. Results arrive through the
+ * report ring and the local report socket, and are published in batches.
+ * Does not return.
+ */
+static void run_reporter(void) {
+    struct event *signal_int, *signal_term, *accept_event = NULL;
+    struct timeval now = { 0, 0 };
+
+    /* reset the signals that the main process was handling */
+    if ( unblock_signals() < 0 ) {
+        Log(LOG_WARNING, "Failed to unblock signals, exiting");
+        exit(EXIT_FAILURE);
+    }
+
+    /* don't outlive measured, it will start a new reporter when it runs */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    set_proc_name("reporter");
+
+    memset(&reports, 0, sizeof(reports));
+
+    if ( (reports.base = event_base_new()) == NULL ) {
+        Log(LOG_WARNING, "Failed to create reporter event base");
+        exit(EXIT_FAILURE);
+    }
+
+    reports.flush = evtimer_new(reports.base, flush_reports_callback, NULL);
+    reports.replay = evtimer_new(reports.base, replay_spool_callback, NULL);
+    signal_int = event_new(reports.base, SIGINT, EV_SIGNAL|EV_PERSIST,
+            stop_reporter_callback, NULL);
+    signal_term = event_new(reports.base, SIGTERM, EV_SIGNAL|EV_PERSIST,
+            stop_reporter_callback, NULL);
+
+    if ( reports.flush == NULL || reports.replay == NULL ||
+            signal_int == NULL || signal_term == NULL ||
+            event_add(signal_int, NULL) < 0 ||
+            event_add(signal_term, NULL) < 0 ) {
+        Log(LOG_WARNING, "Failed to create reporter events");
+        exit(EXIT_FAILURE);
+    }
+
+    if ( vars.reportsock_fd >= 0 ) {
+        accept_event = event_new(reports.base, vars.reportsock_fd,
+                EV_READ|EV_PERSIST, report_socket_event_callback, NULL);
+        event_add(accept_event, NULL);
+    }
+
+    if ( ring != NULL ) {
+        reports.ring = event_new(reports.base, ring_notify, EV_READ|EV_PERSIST,
+                report_ring_event_callback, NULL);
+        event_add(reports.ring, NULL);
+
+        /* results may have arrived while there was no reporter running */
+        drain_report_ring();
+    }
+
+    /* publish anything that was left in the spool by a previous run */
+    evtimer_add(reports.replay, &now);
+
+    event_base_dispatch(reports.base);
+
+    /* collect anything tests have left in the ring */
+    if ( ring != NULL ) {
+        drain_report_ring();
+    }
+
+    /* make one last attempt, even if the broker was recently unavailable */
+    reports.next_connect = 0;
+    flush_reports();
+    spill_reports();
+    discard_reports();
+
+    close_broker_connection();
+    sync_spool();
+
+    if ( reports.ring ) event_free(reports.ring);
+    if ( accept_event ) event_free(accept_event);
+    event_free(reports.flush);
+    event_free(reports.replay);
+    event_free(signal_int);
+    event_free(signal_term);
+    event_base_free(reports.base);
+
+    Log(LOG_DEBUG, "Result reporter exiting");
+    exit(EXIT_SUCCESS);
+}
+
+
+
+/*
+ * Fork the reporter process that will publish results on behalf of the
+ * test processes. It inherits the report ring, report socket and spool.
+ */
+static int start_reporter(void) {
+    pid_t pid;
+
+    if ( (pid = fork()) < 0 ) {
+        Log(LOG_WARNING, "Failed to fork result reporter: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    if ( pid == 0 ) {
+        /* close sockets belonging to the main process that we don't need */
+        close(vars.asnsock_fd);
+        close(vars.nssock_fd);
+
+        /* the main process event base is of no use to the reporter */
+        event_base_free(reporter.parent);
+
+        run_reporter();
+        /* not reached */
+    }
+
+    Log(LOG_DEBUG, "Started result reporter with pid %d", pid);
+    reporter.pid = pid;
+    return 0;
+}
+
+
+
+/*
+ * Timer callback to replace a reporter process that has exited.
+ */
+static void restart_reporter_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        __attribute__((unused))void *evdata) {
+
+    struct timeval delay = { AMQP_REPORTER_RESTART_DELAY, 0 };
+
+    if ( start_reporter() < 0 ) {
+        evtimer_add(reporter.restart, &delay);
+    }
+}
+
+
+
+/*
+ * Called by the main process whenever a child exits. If it was the reporter
+ * then start a new one shortly, results will wait in the ring and spool
+ * until it is running again.
+ */
+void reporting_child_exited(pid_t pid) {
+    struct timeval delay = { AMQP_REPORTER_RESTART_DELAY, 0 };
+
+    if ( reporter.pid <= 0 || pid != reporter.pid ) {
+        return;
+    }
+
+    Log(LOG_WARNING, "Result reporter %d exited, restarting", pid);
+    reporter.pid = -1;
+
+    if ( reporter.restart != NULL ) {
+        evtimer_add(reporter.restart, &delay);
+    }
+}
+
+
+
+/*
+ * Set up the report ring and spool that tests use to pass results to the
+ * reporter, then start the reporter process. The report socket should
+ * already be listening. The broker connection is created on first use.
+ */
+int initialise_reporting(struct event_base *base) {
+    assert(base);
+
+    memset(&reports, 0, sizeof(reports));
+    reporter.parent = base;
+    reporter.pid = -1;
+    reporter.restart = evtimer_new(base, restart_reporter_callback, NULL);
+
+    if ( reporter.restart == NULL ) {
+        Log(LOG_WARNING, "Failed to create reporter restart timer");
+        return -1;
+    }
+
+    /* results are lost if the broker is unavailable and this isn't open */
+    if ( open_spool(vars.spool) < 0 ) {
+        Log(LOG_WARNING, "Unpublished results will not be spooled");
+    }
+
+    /* tests can still use the report socket if this isn't available */
+    if ( initialise_report_ring() < 0 ) {
+        Log(LOG_WARNING, "Test results will be reported over socket only");
+    }
+
+    return start_reporter();
+}
+
+
+
+/*
+ * Stop the reporter process, which will publish anything still waiting in
+ * the queue and close the broker connection. Should only be called when
+ * measured is terminating.
+ */
+void shutdown_reporting(void) {
+    if ( reporter.restart ) {
+        event_free(reporter.restart);
+        reporter.restart = NULL;
+    }
+
+    if ( reporter.pid > 0 ) {
+        Log(LOG_DEBUG, "Waiting for result reporter %d to exit", reporter.pid);
+        kill(reporter.pid, SIGTERM);
+        while ( waitpid(reporter.pid, NULL, 0) < 0 && errno == EINTR ) {
+            /* nothing */;
+        }
+        reporter.pid = -1;
+    }
+
+    /* spool anything the reporter didn't get to, then stop using the ring */
+    if ( ring != NULL ) {
+        drain_report_ring();
+        spill_reports();
+        discard_reports();
+        close(ring_notify);
+        ring_notify = -1;
+        pthread_mutex_destroy(&ring->lock);
+        munmap(ring, sizeof(struct amp_report_ring) + AMP_REPORT_RING_SIZE);
+        ring = NULL;
+    }
+
+    close_spool();
+}
+
+
+
+/*
+ * A forked test process shouldn't touch the broker connection belonging to
+ * the reporter process - closing it properly would close it for the
+ * reporter too. Just close our copy of the socket and forget about it.
+ */
+void forget_broker_connection(void) {
+    if ( conn == NULL ) {
+        return;
+    }
+
+    close(amqp_get_sockfd(conn));
+    conn = NULL;
+}
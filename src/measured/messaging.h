@@ -41,6 +41,9 @@
 #define _MEASURED_MESSAGING_H
 
 #include <amqp.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <event2/event.h>
 #include "tests.h"
 
 
@@ -60,12 +63,55 @@
 #define AMQP_LOCAL_EXCHANGE ""
 #define AMQP_LOCAL_ROUTING_KEY "report"
 
+/* channel used by the reporter process to publish results */
+#define AMQP_REPORT_CHANNEL 1
+
+/* maximum number of results to publish before waiting for confirms */
+#define AMQP_REPORT_BATCH_SIZE 64
+
+/* time to wait for more results to arrive before publishing a batch */
+#define AMQP_REPORT_BATCH_DELAY_US 100000
+
+/* maximum number of results to hold while the broker is unavailable */
+#define AMQP_MAX_QUEUED_REPORTS 10000
+
+/* batches of spooled results to publish before letting other events run */
+#define AMQP_SPOOL_REPLAY_BATCHES 16
+
+/* seconds to wait for the broker to confirm a batch of results */
+#define AMQP_CONFIRM_TIMEOUT 10
+
+/* seconds to wait for a connection to the broker to be established */
+#define AMQP_CONNECT_TIMEOUT 10
+
+/* seconds to wait before trying to reconnect to an unavailable broker */
+#define AMQP_RECONNECT_DELAY 10
+
+/* seconds to wait before replacing a reporter process that has exited */
+#define AMQP_REPORTER_RESTART_DELAY 1
+
+/* sanity limits on the size of results received on the report socket */
+#define AMQP_MAX_REPORT_NAME_LEN 255
+#define AMQP_MAX_REPORT_LEN (64 * 1024 * 1024)
+
+/* size of the shared memory ring that test processes write results into */
+#define AMP_REPORT_RING_SIZE (4 * 1024 * 1024)
+
 /*
- * TODO: this should be maintained for the lifetime of the main process, but
- * is currently just created and set by the individual test processes.
+ * Header sent by a test process on the local report socket, followed by
+ * the test name (without null terminator) and the packed result data. The
+ * same format is used for records in the shared memory report ring.
  */
-amqp_connection_state_t conn;
+struct amp_report_header {
+    uint64_t timestamp;
+    uint32_t namelen;
+    uint32_t datalen;
+};
 
 int report_to_broker(test_t *test, amp_test_result_t *result);
+void reporting_child_exited(pid_t pid);
+int initialise_reporting(struct event_base *base);
+void shutdown_reporting(void);
+void forget_broker_connection(void);
 
 #endif
@@ -36,127 +36,720 @@
  * You should have received a copy of the GNU General Public License
  * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
  */
-
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
 #include <unbound.h>
-#include <pthread.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
 
 #include "nssock.h"
 #include "ampresolv.h"
+#include "testlib.h"
 #include "debug.h"
 
+/* DNS query types used when resolving addresses */
+#define QTYPE_A 0x01
+#define QTYPE_AAAA 0x1c
+
+
+
+static void resolver_conn_write_callback(evutil_socket_t evsock,
+        short flags, void *evdata);
+
 
 
 /*
- * Receive all the queries from the local socket and wait for them to resolve
- * before sending them back to the test process.
+ * Hash a name and query type to find the cache bucket it belongs in.
  */
-static void *amp_resolver_worker_thread(void *thread_data) {
-    struct amp_resolve_info *data = (struct amp_resolve_info *)thread_data;
-    struct addrinfo *addrlist = NULL, *item;
-    char name[MAX_DNS_NAME_LEN];
-    struct amp_resolve_query info;
-    uint8_t more;
-    uint8_t namelen;
-    int bytes;
-    pthread_mutex_t addrlist_lock;
+static uint32_t hash_name(char *name, int qtype) {
+    uint32_t hash = 2166136261u;
+    unsigned char *byte;
 
-    Log(LOG_DEBUG, "Starting new name resolution thread");
+    for ( byte = (unsigned char*)name; *byte != '\0'; byte++ ) {
+        hash = (hash ^ *byte) * 16777619u;
+    }
 
-    pthread_mutex_init(&addrlist_lock, NULL);
+    hash = (hash ^ qtype) * 16777619u;
 
-    /* everything we read should be a name to lookup */
-    while ( 1 ) {
+    return hash & (RESOLVER_CACHE_BUCKETS - 1);
+}
 
-        /* read name length, address count, family etc */
-        if ( recv(data->fd, &info, sizeof(info), 0) <= 0 ) {
-            Log(LOG_WARNING, "Error reading name info, aborting");
-            break;
-        }
 
-        /* zero here is a marker - no more names need to be resolved */
-        if ( info.namelen == 0 ) {
-            break;
+
+/*
+ * Free a cache entry that has no outstanding query.
+ */
+static void free_entry(struct amp_resolver_entry *entry) {
+    assert(!entry->inflight);
+    assert(entry->waiters == NULL);
+
+    free(entry->name);
+    free(entry->addrs);
+    free(entry);
+}
+
+
+
+/*
+ * Unlink a cache entry from its bucket and free it.
+ */
+static void remove_entry(struct amp_resolver *resolver,
+        struct amp_resolver_entry *entry) {
+
+    struct amp_resolver_entry **current;
+
+    for ( current = &resolver->buckets[hash_name(entry->name, entry->qtype)];
+            *current != NULL; current = &(*current)->next ) {
+        if ( *current == entry ) {
+            *current = entry->next;
+            free_entry(entry);
+            return;
         }
+    }
+}
 
-        if ( (bytes = recv(data->fd, name, info.namelen, 0)) <= 0 ) {
-            Log(LOG_WARNING, "Error reading name, aborting");
-            break;
+
+
+/*
+ * Free a connection once the reply has been sent or the client has gone.
+ */
+static void free_conn(struct amp_resolver_conn *conn) {
+    if ( conn->event ) {
+        event_free(conn->event);
+    }
+
+    close(conn->fd);
+    free(conn->reply);
+    free(conn);
+}
+
+
+
+/*
+ * Add a single address record to the reply that will be sent to the test.
+ */
+static void append_reply(struct amp_resolver_conn *conn, uint8_t family,
+        uint8_t *addr, uint8_t addrlen, char *name) {
+
+    struct amp_resolve_reply header;
+    uint32_t length;
+
+    header.family = family;
+    header.addrlen = addrlen;
+    header.namelen = (name == NULL) ? 0 : strlen(name);
+
+    length = sizeof(header) + header.addrlen + header.namelen;
+
+    if ( conn->replylen + length > conn->replyspace ) {
+        while ( conn->replylen + length > conn->replyspace ) {
+            conn->replyspace = (conn->replyspace < 256) ?
+                256 : conn->replyspace * 2;
         }
+        conn->reply = realloc(conn->reply, conn->replyspace);
+    }
 
-        Log(LOG_DEBUG, "Read %d bytes for name '%s'", bytes, name);
+    memcpy(conn->reply + conn->replylen, &header, sizeof(header));
+    conn->replylen += sizeof(header);
 
-        /* add it to the list of names to resolve and go back for more */
-        amp_resolve_add(data->ctx, &addrlist, &addrlist_lock, name,
-                info.family, info.count);
+    if ( header.addrlen > 0 ) {
+        memcpy(conn->reply + conn->replylen, addr, header.addrlen);
+        conn->replylen += header.addrlen;
     }
 
-    Log(LOG_DEBUG, "Got all requests, waiting for responses");
+    if ( header.namelen > 0 ) {
+        memcpy(conn->reply + conn->replylen, name, header.namelen);
+        conn->replylen += header.namelen;
+    }
+}
 
-    /* when the remote end has finished sending names, wait for resolution */
-    ub_wait(data->ctx);
 
-    /* once we have all the responses then we don't need the addrlist lock */
-    pthread_mutex_lock(&addrlist_lock);
 
-    Log(LOG_DEBUG, "Got all responses, sending them back");
+/*
+ * Send as much of the reply as possible. Returns 1 when the whole reply has
+ * been sent, 0 if there is more to send, -1 on error.
+ */
+static int send_reply(struct amp_resolver_conn *conn) {
+    ssize_t bytes;
+
+    while ( conn->sent < conn->replylen ) {
+        bytes = send(conn->fd, conn->reply + conn->sent,
+                conn->replylen - conn->sent, MSG_NOSIGNAL);
 
-    /* send back all the results of name resolution */
-    for ( item = addrlist; item != NULL; item = item->ai_next) {
-        if ( send(data->fd, item, sizeof(*item), MSG_NOSIGNAL) < 0 ) {
-            Log(LOG_WARNING, "Failed to send resolved address info: %s",
+        if ( bytes < 0 ) {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return 0;
+            }
+            if ( errno == EINTR ) {
+                continue;
+            }
+            Log(LOG_WARNING, "Failed to send resolved addresses: %s",
                     strerror(errno));
-            goto end;
+            return -1;
+        }
+
+        conn->sent += bytes;
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Once every query on a connection has been answered and the client has
+ * told us there are no more to come, send all of the answers in one go.
+ */
+static void check_conn_complete(struct amp_resolver_conn *conn) {
+    int result;
+
+    if ( conn->outstanding > 0 ) {
+        return;
+    }
+
+    if ( conn->closed ) {
+        free_conn(conn);
+        return;
+    }
+
+    if ( !conn->finished ) {
+        return;
+    }
+
+    Log(LOG_DEBUG, "Got all responses for fd %d, sending them back",
+            conn->fd);
+
+    /* a record with no family marks the end of the list */
+    append_reply(conn, 0, NULL, 0, NULL);
+
+    if ( (result = send_reply(conn)) != 0 ) {
+        free_conn(conn);
+        return;
+    }
+
+    /* socket is full, wait until the test has read some of the answers */
+    if ( conn->event ) {
+        event_free(conn->event);
+    }
+    conn->event = event_new(conn->resolver->base, conn->fd,
+            EV_WRITE | EV_PERSIST, resolver_conn_write_callback, conn);
+    event_add(conn->event, NULL);
+}
+
+
+
+/*
+ * Finish a request once both query types (if required) have been answered.
+ */
+static void finish_request(struct amp_resolver_request *request) {
+    struct amp_resolver_conn *conn = request->conn;
+
+    /* make sure the test gets some sort of result for every name */
+    if ( !request->found && !conn->closed ) {
+        Log(LOG_DEBUG, "No results for %s, creating dummy entries",
+                request->name);
+
+        if ( request->family == AF_INET || request->family == AF_UNSPEC ) {
+            append_reply(conn, AF_INET, NULL, 0, request->name);
         }
 
-        /* there might not be an address for this name */
-        if ( item->ai_addrlen > 0 ) {
-            if ( send(data->fd, item->ai_addr, item->ai_addrlen,
-                        MSG_NOSIGNAL) < 0 ) {
-                Log(LOG_WARNING, "Failed to send resolved address: %s",
-                        strerror(errno));
-                goto end;
+        if ( request->family == AF_INET6 || request->family == AF_UNSPEC ) {
+            append_reply(conn, AF_INET6, NULL, 0, request->name);
+        }
+    }
+
+    free(request->name);
+    free(request);
+
+    conn->outstanding--;
+    check_conn_complete(conn);
+}
+
+
+
+/*
+ * Answer part of a request using a cache entry. The maximum number of
+ * addresses is shared between the A and AAAA queries for the same name.
+ */
+static void answer_request(struct amp_resolver_request *request,
+        struct amp_resolver_entry *entry) {
+
+    uint16_t i;
+    uint8_t family = (entry->qtype == QTYPE_A) ? AF_INET : AF_INET6;
+
+    for ( i = 0; i < entry->count && request->max != 0; i++ ) {
+        if ( !request->conn->closed ) {
+            append_reply(request->conn, family,
+                    entry->addrs + (i * entry->addrlen), entry->addrlen,
+                    entry->name);
+        }
+
+        request->found = 1;
+
+        if ( request->max > 0 ) {
+            request->max--;
+        }
+    }
+
+    assert(request->pending > 0);
+    if ( --request->pending == 0 ) {
+        finish_request(request);
+    }
+}
+
+
+
+/*
+ * Deal with a DNS response, store it in the cache entry and use it to answer
+ * every request that was waiting on it.
+ */
+static void resolver_query_callback(void *data, int err,
+        struct ub_result *result) {
+
+    struct amp_resolver_entry *entry = (struct amp_resolver_entry*)data;
+    struct amp_resolver_waiter *waiter;
+    struct timeval now;
+    int count;
+    int ttl;
+
+    assert(entry->inflight);
+
+    gettimeofday(&now, NULL);
+
+    if ( err != 0 || result == NULL || !result->havedata ) {
+        Log(LOG_DEBUG, "Failed query %s (%x): %s", entry->name, entry->qtype,
+                (err != 0) ? ub_strerror(err) : "No results returned");
+
+        /*
+         * A failed refresh shouldn't throw away an answer that is still
+         * valid, only cache the failure if there is nothing better.
+         */
+        if ( entry->count > 0 && entry->expires > now.tv_sec ) {
+            ttl = entry->expires - now.tv_sec;
+        } else {
+            free(entry->addrs);
+            entry->addrs = NULL;
+            entry->count = 0;
+            ttl = RESOLVER_NEGATIVE_TTL;
+        }
+    } else {
+        Log(LOG_DEBUG, "Got a DNS response for %s (%x)", entry->name,
+                entry->qtype);
+
+        free(entry->addrs);
+        entry->count = 0;
+        entry->addrlen = (entry->qtype == QTYPE_A) ? 4 : 16;
+
+        for ( count = 0; result->data[count] != NULL; count++ ) {
+            /* nothing, just counting */
+        }
+
+        entry->addrs = malloc(count * entry->addrlen);
+        for ( count = 0; result->data[count] != NULL; count++ ) {
+            if ( result->len[count] != entry->addrlen ) {
+                continue;
             }
+            memcpy(entry->addrs + (entry->count * entry->addrlen),
+                    result->data[count], entry->addrlen);
+            entry->count++;
         }
 
-        namelen = strlen(item->ai_canonname) + 1;
-        assert(namelen > 1);
-        if ( send(data->fd, &namelen, sizeof(namelen), MSG_NOSIGNAL) < 0 ) {
-            Log(LOG_WARNING, "Failed to send resolved canonical name: %s",
-                    strerror(errno));
-            goto end;
+        ttl = (result->ttl < 0) ? 0 : result->ttl;
+        if ( ttl > RESOLVER_MAX_TTL ) {
+            ttl = RESOLVER_MAX_TTL;
         }
+    }
 
-        assert(item->ai_canonname);
-        if ( send(data->fd, item->ai_canonname, namelen, MSG_NOSIGNAL) < 0 ) {
-            Log(LOG_WARNING, "Failed to send resolved canonical name: %s",
-                    strerror(errno));
-            goto end;
+    entry->expires = now.tv_sec + ttl;
+    entry->inflight = 0;
+
+    while ( (waiter = entry->waiters) != NULL ) {
+        entry->waiters = waiter->next;
+        answer_request(waiter->request, entry);
+        free(waiter);
+    }
+
+    if ( result ) {
+        ub_resolve_free(result);
+    }
+
+    /* without a cache the entry is only needed while the query is active */
+    if ( !entry->resolver->cache ) {
+        remove_entry(entry->resolver, entry);
+    }
+}
+
+
+
+/*
+ * Send the query for a cache entry to unbound.
+ */
+static void query_entry(struct amp_resolver_entry *entry) {
+    int err;
+
+    entry->inflight = 1;
+    entry->used = 0;
+
+    if ( (err = ub_resolve_async(entry->resolver->ctx, entry->name,
+                    entry->qtype, 0x01, entry, resolver_query_callback,
+                    NULL)) != 0 ) {
+        Log(LOG_WARNING, "Failed to query for %s: %s", entry->name,
+                ub_strerror(err));
+        /* treat it like any other failed query, answer all the waiters */
+        resolver_query_callback(entry, err, NULL);
+    }
+}
+
+
+
+/*
+ * Answer one query type for a request from the cache if there is a fresh
+ * answer, otherwise wait on a query for it (starting one if need be).
+ */
+static void lookup_request(struct amp_resolver *resolver,
+        struct amp_resolver_request *request, int qtype) {
+
+    struct amp_resolver_entry *entry;
+    struct amp_resolver_waiter *waiter;
+    struct timeval now;
+    uint32_t bucket = hash_name(request->name, qtype);
+
+    for ( entry = resolver->buckets[bucket]; entry != NULL;
+            entry = entry->next ) {
+        if ( entry->qtype == qtype && strcmp(entry->name, request->name) == 0 ) {
+            break;
         }
+    }
+
+    gettimeofday(&now, NULL);
+
+    /* a fresh answer can be used even if it is being refreshed */
+    if ( entry != NULL && entry->expires > now.tv_sec ) {
+        entry->used = 1;
+        answer_request(request, entry);
+        return;
+    }
+
+    if ( entry == NULL ) {
+        entry = calloc(1, sizeof(struct amp_resolver_entry));
+        entry->name = strdup(request->name);
+        entry->qtype = qtype;
+        entry->resolver = resolver;
+        entry->next = resolver->buckets[bucket];
+        resolver->buckets[bucket] = entry;
+    }
+
+    /* wait for the answer, there may already be a query for it */
+    waiter = malloc(sizeof(struct amp_resolver_waiter));
+    waiter->request = request;
+    waiter->next = entry->waiters;
+    entry->waiters = waiter;
+
+    if ( !entry->inflight ) {
+        query_entry(entry);
+    }
+}
+
 
-        more = (item->ai_next) ? 1 : 0;
-        if ( send(data->fd, &more, sizeof(uint8_t), MSG_NOSIGNAL) < 0 ) {
-            Log(LOG_WARNING, "Failed to send more flag: %s", strerror(errno));
-            goto end;
+
+/*
+ * Start resolving a name that a test has asked for.
+ */
+static void start_request(struct amp_resolver_conn *conn, char *name,
+        int family, int count) {
+
+    struct amp_resolver_request *request;
+    struct addrinfo *addr;
+
+    Log(LOG_DEBUG, "Adding resolve request for %s", name);
+
+    /* check if this is a numeric address already and doesn't need resolving */
+    if ( (addr = get_numeric_address(name, NULL)) ) {
+        if ( addr->ai_family == AF_INET ) {
+            append_reply(conn, AF_INET,
+                    (uint8_t*)&((struct sockaddr_in*)addr->ai_addr)->sin_addr,
+                    sizeof(struct in_addr), name);
+        } else if ( addr->ai_family == AF_INET6 ) {
+            append_reply(conn, AF_INET6,
+                    (uint8_t*)&((struct sockaddr_in6*)addr->ai_addr)->sin6_addr,
+                    sizeof(struct in6_addr), name);
         }
+        freeaddrinfo(addr);
+        return;
     }
 
-    Log(LOG_DEBUG, "Name resolution thread completed, exiting");
+    request = calloc(1, sizeof(struct amp_resolver_request));
+    request->conn = conn;
+    request->name = strdup(name);
+    request->family = family;
+    request->max = (count > 0) ? count : -1;
 
-end:
-    close(data->fd);
-    amp_resolve_freeaddr(addrlist);
-    pthread_mutex_unlock(&addrlist_lock);
-    pthread_mutex_destroy(&addrlist_lock);
-    free(data);
+    /* count both query types before starting either, so neither finishes */
+    if ( family == AF_UNSPEC || family == AF_INET ) {
+        request->pending++;
+    }
 
-    pthread_exit(NULL);
+    if ( family == AF_UNSPEC || family == AF_INET6 ) {
+        request->pending++;
+    }
+
+    if ( request->pending == 0 ) {
+        Log(LOG_WARNING, "Unknown address family %d for %s", family, name);
+        free(request->name);
+        free(request);
+        return;
+    }
+
+    conn->outstanding++;
+
+    if ( family == AF_UNSPEC || family == AF_INET ) {
+        lookup_request(conn->resolver, request, QTYPE_A);
+    }
+
+    if ( family == AF_UNSPEC || family == AF_INET6 ) {
+        lookup_request(conn->resolver, request, QTYPE_AAAA);
+    }
+}
+
+
+
+/*
+ * Read as many queries as are available from the test. Queries are a short
+ * header followed by the name, with a zero length name marking the end.
+ */
+static void resolver_conn_read_callback(evutil_socket_t evsock,
+        __attribute__((unused))short flags, void *evdata) {
+
+    struct amp_resolver_conn *conn = (struct amp_resolver_conn*)evdata;
+    struct amp_resolve_query *info;
+    uint8_t buffer[4096];
+    ssize_t bytes;
+    ssize_t offset = 0;
+    uint16_t needed;
+
+    if ( (bytes = recv(evsock, buffer, sizeof(buffer), 0)) <= 0 ) {
+        if ( bytes < 0 && (errno == EAGAIN || errno == EINTR) ) {
+            return;
+        }
+        Log(LOG_WARNING, "Error reading name info, aborting");
+        event_free(conn->event);
+        conn->event = NULL;
+        conn->closed = 1;
+        check_conn_complete(conn);
+        return;
+    }
+
+    while ( offset < bytes ) {
+        /* accumulate the header, then the name that follows it */
+        if ( conn->querylen < sizeof(struct amp_resolve_query) ) {
+            needed = sizeof(struct amp_resolve_query) - conn->querylen;
+        } else {
+            info = (struct amp_resolve_query*)conn->query;
+            needed = sizeof(struct amp_resolve_query) + info->namelen -
+                conn->querylen;
+        }
+
+        if ( needed > bytes - offset ) {
+            needed = bytes - offset;
+        }
+
+        memcpy(conn->query + conn->querylen, buffer + offset, needed);
+        conn->querylen += needed;
+        offset += needed;
+
+        if ( conn->querylen < sizeof(struct amp_resolve_query) ) {
+            break;
+        }
+
+        info = (struct amp_resolve_query*)conn->query;
+
+        /* zero here is a marker - no more names need to be resolved */
+        if ( info->namelen == 0 ) {
+            Log(LOG_DEBUG, "Got all requests on fd %d", conn->fd);
+            event_free(conn->event);
+            conn->event = NULL;
+            conn->finished = 1;
+            check_conn_complete(conn);
+            return;
+        }
+
+        if ( conn->querylen < sizeof(struct amp_resolve_query) + info->namelen ) {
+            continue;
+        }
+
+        /* make sure the name is terminated, whatever the test sent */
+        conn->query[conn->querylen - 1] = '\0';
+        start_request(conn,
+                (char*)conn->query + sizeof(struct amp_resolve_query),
+                info->family, info->count);
+        conn->querylen = 0;
+    }
+}
+
+
+
+/*
+ * Continue sending a reply that didn't fit in the socket buffer.
+ */
+static void resolver_conn_write_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags, void *evdata) {
+
+    struct amp_resolver_conn *conn = (struct amp_resolver_conn*)evdata;
+
+    if ( send_reply(conn) != 0 ) {
+        free_conn(conn);
+    }
+}
+
+
+
+/*
+ * Unbound has answers ready, process them and fire the callbacks.
+ */
+static void resolver_ub_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags, void *evdata) {
+
+    struct amp_resolver *resolver = (struct amp_resolver*)evdata;
+    int err;
+
+    if ( (err = ub_process(resolver->ctx)) != 0 ) {
+        Log(LOG_WARNING, "Failed to process DNS responses: %s",
+                ub_strerror(err));
+    }
+}
+
+
+
+/*
+ * Periodically refresh cache entries that tests have been using before they
+ * expire, so that scheduled tests find fresh answers waiting for them. Any
+ * entries that have expired and aren't being used are removed.
+ */
+static void resolver_prefetch_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags, void *evdata) {
+
+    struct amp_resolver *resolver = (struct amp_resolver*)evdata;
+    struct amp_resolver_entry **current, *entry;
+    struct timeval now;
+    int refreshed = 0;
+    int removed = 0;
+    int i;
+
+    gettimeofday(&now, NULL);
+
+    for ( i = 0; i < RESOLVER_CACHE_BUCKETS; i++ ) {
+        for ( current = &resolver->buckets[i]; *current != NULL;
+                /* no increment statement */ ) {
+            entry = *current;
+
+            if ( entry->inflight ) {
+                current = &entry->next;
+                continue;
+            }
+
+            if ( entry->used &&
+                    entry->expires <= now.tv_sec + RESOLVER_PREFETCH_AHEAD ) {
+                query_entry(entry);
+                refreshed++;
+                current = &entry->next;
+                continue;
+            }
+
+            if ( entry->expires <= now.tv_sec ) {
+                *current = entry->next;
+                free_entry(entry);
+                removed++;
+                continue;
+            }
+
+            current = &entry->next;
+        }
+    }
+
+    if ( refreshed > 0 || removed > 0 ) {
+        Log(LOG_DEBUG, "Refreshed %d and removed %d cached DNS answers",
+                refreshed, removed);
+    }
+}
+
+
+
+/*
+ * Create the resolver service that answers queries from tests using the
+ * given unbound context, driven entirely by the main event loop.
+ */
+struct amp_resolver *amp_resolver_new(struct event_base *base,
+        struct ub_ctx *ctx, int cache) {
+
+    struct amp_resolver *resolver;
+    struct timeval interval = {RESOLVER_PREFETCH_INTERVAL, 0};
+
+    assert(base);
+    assert(ctx);
+
+    resolver = calloc(1, sizeof(struct amp_resolver));
+    resolver->ctx = ctx;
+    resolver->base = base;
+    resolver->cache = cache;
+
+    resolver->ub_event = event_new(base, ub_fd(ctx), EV_READ | EV_PERSIST,
+            resolver_ub_callback, resolver);
+    event_add(resolver->ub_event, NULL);
+
+    if ( cache ) {
+        resolver->prefetch = event_new(base, -1, EV_PERSIST,
+                resolver_prefetch_callback, resolver);
+        event_add(resolver->prefetch, &interval);
+    }
+
+    return resolver;
+}
+
+
+
+/*
+ * Free the resolver service and all the cached answers. This should be done
+ * before the unbound context is deleted.
+ */
+void amp_resolver_free(struct amp_resolver *resolver) {
+    struct amp_resolver_entry *entry;
+    struct amp_resolver_waiter *waiter;
+    int i;
+
+    if ( resolver == NULL ) {
+        return;
+    }
+
+    if ( resolver->ub_event ) {
+        event_free(resolver->ub_event);
+    }
+
+    if ( resolver->prefetch ) {
+        event_free(resolver->prefetch);
+    }
+
+    for ( i = 0; i < RESOLVER_CACHE_BUCKETS; i++ ) {
+        while ( (entry = resolver->buckets[i]) != NULL ) {
+            resolver->buckets[i] = entry->next;
+            /* outstanding queries are abandoned along with the context */
+            while ( (waiter = entry->waiters) != NULL ) {
+                entry->waiters = waiter->next;
+                free(waiter);
+            }
+            entry->inflight = 0;
+            free_entry(entry);
+        }
+    }
+
+    free(resolver);
 }
 
 
@@ -172,15 +765,16 @@ void amp_resolver_context_delete(struct ub_ctx *ctx) {
 
 
 /*
- * Accept a new connection on the local name resolution socket and spawn
- * a new thread to deal with the queries from the test process.
+ * Accept a new connection on the local name resolution socket and add it to
+ * the event loop, so that queries from many tests can be handled at once
+ * without needing a thread for each.
  */
 void resolver_socket_event_callback(evutil_socket_t evsock,
     __attribute__((unused))short flags, void *evdata) {
 
+    struct amp_resolver *resolver = (struct amp_resolver*)evdata;
+    struct amp_resolver_conn *conn;
     int fd;
-    pthread_t thread;
-    struct amp_resolve_info *info;
 
     Log(LOG_DEBUG, "Accepting for new resolver connection");
 
@@ -192,11 +786,35 @@ void resolver_socket_event_callback(evutil_socket_t evsock,
 
     Log(LOG_DEBUG, "Accepted new resolver connection on fd %d", fd);
 
-    info = calloc(1, sizeof(struct amp_resolve_info));
-    info->ctx = evdata;
-    info->fd = fd;
+    if ( fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ) {
+        Log(LOG_WARNING, "Failed to make resolver connection non-blocking: %s",
+                strerror(errno));
+        close(fd);
+        return;
+    }
+
+    conn = calloc(1, sizeof(struct amp_resolver_conn));
+    conn->fd = fd;
+    conn->resolver = resolver;
+    conn->event = event_new(resolver->base, fd, EV_READ | EV_PERSIST,
+            resolver_conn_read_callback, conn);
+    event_add(conn->event, NULL);
+}
+
+
+
+#if UNIT_TEST
+void amp_test_append_reply(struct amp_resolver_conn *conn, uint8_t family,
+        uint8_t *addr, uint8_t addrlen, char *name) {
+    append_reply(conn, family, addr, addrlen, name);
+}
+
+int amp_test_send_reply(struct amp_resolver_conn *conn) {
+    return send_reply(conn);
+}
 
-    /* create the thread and detach, we don't need to look after it */
-    pthread_create(&thread, NULL, amp_resolver_worker_thread, info);
-    pthread_detach(thread);
+void amp_test_resolver_query_callback(void *data, int err,
+        struct ub_result *result) {
+    resolver_query_callback(data, err, result);
 }
+#endif
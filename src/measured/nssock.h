@@ -36,21 +36,108 @@
  * You should have received a copy of the GNU General Public License
  * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
  */
-
 #ifndef _MEASURED_NSSOCK_H
 #define _MEASURED_NSSOCK_H
 
+#include <stdint.h>
+#include <time.h>
 #include <unbound.h>
 #include <event2/event.h>
 
+#include "ampresolv.h"
 
-/* data block given to each resolving thread */
-struct amp_resolve_info {
-    int fd;                     /* file descriptor to the test process */
+
+/* number of buckets in the resolver answer cache, must be a power of two */
+#define RESOLVER_CACHE_BUCKETS 1024
+
+/* how long to remember that a name didn't resolve to anything (seconds) */
+#define RESOLVER_NEGATIVE_TTL 60
+
+/* upper limit on how long to cache any answer, regardless of the DNS TTL */
+#define RESOLVER_MAX_TTL 86400
+
+/* how often to look for cache entries that should be refreshed (seconds) */
+#define RESOLVER_PREFETCH_INTERVAL 60
+
+/* refresh names that have been used if they expire within this many seconds */
+#define RESOLVER_PREFETCH_AHEAD 120
+
+/* a single query is at most the header followed by a 255 byte name */
+#define RESOLVER_MAX_QUERY_LEN (sizeof(struct amp_resolve_query) + 255)
+
+/* a test (or tests) waiting on the answer to a cached query */
+struct amp_resolver_waiter {
+    struct amp_resolver_request *request;
+    struct amp_resolver_waiter *next;
+};
+
+/*
+ * Answer cache entry for one query type (A or AAAA) for a name. The entry
+ * also acts as the point where clients asking for the same name at the same
+ * time wait for a single outstanding query.
+ */
+struct amp_resolver_entry {
+    char *name;
+    int qtype;
+    time_t expires;             /* answers are fresh until this time */
+    uint16_t count;             /* number of addresses in the answer */
+    uint8_t addrlen;            /* length of each address (4 or 16) */
+    uint8_t *addrs;             /* count * addrlen bytes of raw addresses */
+    uint8_t used;               /* used since the last prefetch check */
+    uint8_t inflight;           /* a query for this entry is outstanding */
+    struct amp_resolver *resolver;  /* resolver that owns this entry */
+    struct amp_resolver_waiter *waiters;
+    struct amp_resolver_entry *next;
+};
+
+/* the resolver service shared by all test connections */
+struct amp_resolver {
     struct ub_ctx *ctx;         /* shared unbound context (with the cache) */
+    struct event_base *base;
+    struct event *ub_event;     /* unbound has answers ready to process */
+    struct event *prefetch;     /* timer to refresh popular cache entries */
+    int cache;                  /* keep answers after they are delivered */
+    struct amp_resolver_entry *buckets[RESOLVER_CACHE_BUCKETS];
 };
 
+/* one connection from a test process, which may make many queries */
+struct amp_resolver_conn {
+    int fd;                     /* file descriptor to the test process */
+    struct amp_resolver *resolver;
+    struct event *event;
+    uint8_t query[RESOLVER_MAX_QUERY_LEN]; /* partially received query */
+    uint16_t querylen;
+    uint8_t finished;           /* client has sent the end of list marker */
+    uint8_t closed;             /* client went away before we replied */
+    uint32_t outstanding;       /* requests waiting on answers */
+    uint8_t *reply;             /* packed reply records */
+    uint32_t replylen;
+    uint32_t replyspace;
+    uint32_t sent;
+};
+
+/* one name that a test wants resolved */
+struct amp_resolver_request {
+    struct amp_resolver_conn *conn;
+    char *name;
+    int family;                 /* family the test asked for */
+    int max;                    /* addresses still wanted, -1 is unlimited */
+    uint8_t pending;            /* query types still to be answered */
+    uint8_t found;              /* if any address was found for the name */
+};
+
+struct amp_resolver *amp_resolver_new(struct event_base *base,
+        struct ub_ctx *ctx, int cache);
+void amp_resolver_free(struct amp_resolver *resolver);
 void resolver_socket_event_callback(evutil_socket_t evsock,
         __attribute__((unused))short flags, void *evdata);
 
+#if UNIT_TEST
+void amp_test_append_reply(struct amp_resolver_conn *conn, uint8_t family,
+        uint8_t *addr, uint8_t addrlen, char *name);
+int amp_test_send_reply(struct amp_resolver_conn *conn);
+void amp_test_resolver_query_callback(void *data, int err,
+        struct ub_result *result);
+#endif
+
 #endif
@@ -57,6 +57,9 @@
 #include "dscp.h"
 #include "rabbitcfg.h"
 #include "modules.h"
+#include "workers.h"
+#include "dispatch.h"
+#include "spool.h"
 
 
 
@@ -113,6 +116,58 @@ static int callback_verify_packet_delay(cfg_t *cfg, cfg_opt_t *opt) {
 
 
 
+/*
+ * Ensure that the number of pooled test workers, and the number of tests each
+ * will run, are not negative. Zero workers disables the pool for that test.
+ */
+static int callback_verify_workers(cfg_t *cfg, cfg_opt_t *opt) {
+    int value = cfg_opt_getnint(opt, cfg_opt_size(opt) - 1);
+
+    if ( value < 0 || value > MAX_TEST_WORKERS ) {
+        cfg_error(cfg, "Invalid value for option %s: %d\n"
+                "Workers must be between 0 and %d\n",
+                opt->name, value, MAX_TEST_WORKERS);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/*
+ * Ensure that limits on the number of tests running at once, and the gap
+ * between starting tests, are not negative. Zero disables the limit.
+ */
+static int callback_verify_dispatch(cfg_t *cfg, cfg_opt_t *opt) {
+    int value = cfg_opt_getnint(opt, cfg_opt_size(opt) - 1);
+
+    if ( value < 0 ) {
+        cfg_error(cfg, "Invalid value for option %s: %d\n"
+                "Value must not be negative\n", opt->name, value);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/*
+ * Callback to verify that the result spool size (MB) is sensible.
+ */
+static int callback_verify_spool(cfg_t *cfg, cfg_opt_t *opt) {
+    int value = cfg_opt_getnint(opt, cfg_opt_size(opt) - 1);
+
+    if ( value < 0 || value > MAX_SPOOL_SIZE ) {
+        cfg_error(cfg, "Invalid value for option %s: %d\n"
+                "Value must be between 0 and %d\n", opt->name, value,
+                MAX_SPOOL_SIZE);
+        return -1;
+    }
+    return 0;
+}
+
+
+
 /*
  * Callback to verify that the DSCP value given in the configuration is a
  * valid name of a differentiated services code point, or a numeric value
@@ -576,23 +631,49 @@ void get_default_test_args(cfg_t *cfg) {
 
         test->client_params =
             parse_param_string(cfg_getstr(cfg_defaults, "client"));
+
+        /* keep a pool of workers to run this test if configured */
+        configure_test_workers(test->id, cfg_getint(cfg_defaults, "workers"),
+                cfg_getint(cfg_defaults, "workerruns"));
+
+        /* limit how many of this test can run at once if configured */
+        configure_test_dispatch(test->id,
+                cfg_getint(cfg_defaults, "maxrunning"));
     }
 }
 
 
 
 /*
- * Parse the config and set the generic options that we know are always
- * required. These options to into the global vars structure, which is slowly
- * being phased out as I figure out how to place the variables in the
- * appropriate locations.
+ * Set the limits on how many tests can run at once and how far apart test
+ * starts should be spread.
  */
-cfg_t* parse_config(char *filename, struct amp_global_t *vars) {
+void get_dispatch_config(cfg_t *cfg) {
+    configure_dispatch(cfg_getint(cfg, "maxtests"),
+            cfg_getint(cfg, "testspacing"));
+}
+
+
+
+/*
+ * Set the size of the spool used to hold results while the broker is
+ * unavailable.
+ */
+void get_spool_config(cfg_t *cfg) {
+    configure_spool(cfg_getint(cfg, "spoolsize"));
+}
+
+
+
+/*
+ * Read and validate the config file without applying any of it, so that
+ * options can be re-read when measured is told to reload.
+ */
+cfg_t* read_config(char *filename) {
 
     int ret;
-    cfg_t *cfg, *cfg_sub;
+    cfg_t *cfg;
     cfg_bool_t default_vialocal;
-    int set_ssl;
 
     /* if rabbitmq exists on the system, then default to using it */
     if ( check_exists(RABBITMQCTL, 0) == 0 ) {
@@ -662,6 +743,9 @@ cfg_t* parse_config(char *filename, struct amp_global_t *vars) {
     cfg_opt_t opt_defaults[] = {
         CFG_STR("client", NULL, CFGF_NONE),
         CFG_STR("server", NULL, CFGF_NONE),
+        CFG_INT("workers", DEFAULT_TEST_WORKERS, CFGF_NONE),
+        CFG_INT("workerruns", DEFAULT_TEST_WORKER_RUNS, CFGF_NONE),
+        CFG_INT("maxrunning", 0, CFGF_NONE),
         CFG_END()
     };
 
@@ -671,9 +755,14 @@ cfg_t* parse_config(char *filename, struct amp_global_t *vars) {
 	CFG_STR("ipv4", NULL, CFGF_NONE),
 	CFG_STR("ipv6", NULL, CFGF_NONE),
         CFG_INT("packetdelay", MIN_INTER_PACKET_DELAY, CFGF_NONE),
+        CFG_INT("maxtests", DEFAULT_MAX_RUNNING_TESTS, CFGF_NONE),
+        CFG_INT("testspacing", DEFAULT_TEST_START_SPACING, CFGF_NONE),
+        CFG_INT("spoolsize", DEFAULT_SPOOL_SIZE, CFGF_NONE),
         CFG_INT_CB("loglevel", LOG_INFO, CFGF_NONE, &callback_verify_loglevel),
         CFG_INT_CB("dscp", DEFAULT_DSCP_VALUE, CFGF_NONE,&callback_verify_dscp),
         CFG_STR_LIST("nameservers", NULL, CFGF_NONE),
+        CFG_BOOL("dnscache", cfg_true, CFGF_NONE),
+        CFG_STR("asntable", NULL, CFGF_NONE),
 	CFG_SEC("ssl", opt_ssl, CFGF_NONE),
 	CFG_SEC("collector", opt_collector, CFGF_NONE),
         CFG_SEC("remotesched", opt_remotesched, CFGF_NONE),
@@ -687,6 +776,12 @@ cfg_t* parse_config(char *filename, struct amp_global_t *vars) {
 
     cfg = cfg_init(measured_opts, CFGF_NONE);
     cfg_set_validate_func(cfg, "packetdelay", callback_verify_packet_delay);
+    cfg_set_validate_func(cfg, "defaults|workers", callback_verify_workers);
+    cfg_set_validate_func(cfg, "maxtests", callback_verify_dispatch);
+    cfg_set_validate_func(cfg, "testspacing", callback_verify_dispatch);
+    cfg_set_validate_func(cfg, "defaults|maxrunning",
+            callback_verify_dispatch);
+    cfg_set_validate_func(cfg, "spoolsize", callback_verify_spool);
 
     ret = cfg_parse(cfg, filename);
 
@@ -702,6 +797,25 @@ cfg_t* parse_config(char *filename, struct amp_global_t *vars) {
 	return NULL;
     }
 
+    return cfg;
+}
+
+
+
+/*
+ * Parse the config and set the generic options that we know are always
+ * required. These options to into the global vars structure, which is slowly
+ * being phased out as I figure out how to place the variables in the
+ * appropriate locations.
+ */
+cfg_t* parse_config(char *filename, struct amp_global_t *vars) {
+    cfg_t *cfg, *cfg_sub;
+    int set_ssl;
+
+    if ( (cfg = read_config(filename)) == NULL ) {
+        return NULL;
+    }
+
     if ( cfg_getstr(cfg, "ampname") != NULL ) {
         /* ampname has been set by the user, use it as is */
         vars->ampname = strdup(cfg_getstr(cfg, "ampname"));
@@ -55,6 +55,8 @@
 #include "schedule.h"
 #include "watchdog.h"
 #include "run.h"
+#include "workers.h"
+#include "dispatch.h"
 #include "control.h"
 #include "debug.h"
 #include "nametable.h"
@@ -70,9 +72,11 @@
 /*
  * Combine the test parameters with any from the test set up function and
  * apply them to the proper test binary as provided by the test registration.
- * Run the test callback function and let it do its thing.
+ * Run the test callback function and let it do its thing. Returns once the
+ * test has completed so that pooled workers can run another test in the same
+ * process, see run_test() for the fork-per-run version.
  */
-void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
+int execute_test(const test_schedule_item_t * const item, BIO *ctrl) {
     char *argv[MAX_TEST_ARGS];
     uint32_t argc = 0;
     uint32_t offset;
@@ -86,6 +90,7 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
     char *port_str = NULL;
     int forcev4 = 0;
     int forcev6 = 0;
+    struct timeval now;
 
     assert(item);
     assert(item->test);
@@ -95,18 +100,18 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
     /* XXX should this start before or after DNS resolution, maybe after? */
     if ( start_test_watchdog(item->test, &watchdog) < 0 ) {
         Log(LOG_WARNING, "Aborting %s test run", item->test->name);
-        return;
+        return -1;
     }
 
-    /* update process name so we can tell what is running */
-    set_proc_name(item->test->name);
-
     /*
      * seed the random number generator, has to be after the fork() or each
      * new process inherits exactly the same one and always returns the first
-     * element in the sequence
+     * element in the sequence. Pooled workers run many tests in the one
+     * process, so also mix in the sub-second time to avoid repeating the
+     * sequence for tests run within the same second.
      */
-    srandom(time(NULL) + getpid());
+    gettimeofday(&now, NULL);
+    srandom(now.tv_sec + now.tv_usec + getpid());
     reseed_openssl_rng();
 
     /*
@@ -122,8 +127,7 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
                     item->meta->inter_packet_delay) < 0 ) {
             Log(LOG_WARNING, "Failed to build packet delay string, aborting");
             stop_watchdog(watchdog);
-            free_duped_environ();
-            return;
+            return -1;
         }
 
         argv[argc++] = packet_delay_str;
@@ -138,8 +142,7 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
         if ( asprintf(&port_str, "%u", vars.control_port) < 0 ) {
             Log(LOG_WARNING, "Failed to build control port string, aborting");
             stop_watchdog(watchdog);
-            free_duped_environ();
-            return;
+            return -1;
         }
 
         argv[argc++] = port_str;
@@ -151,8 +154,7 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
         if ( asprintf(&dscp_str, "%u", item->meta->dscp) < 0 ) {
             Log(LOG_WARNING, "Failed to build DSCP string, aborting");
             stop_watchdog(watchdog);
-            free_duped_environ();
-            return;
+            return -1;
         }
 
         argv[argc++] = dscp_str;
@@ -270,22 +272,28 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
 
         /* add all the names that we need to resolve */
         for ( resolve=item->resolve; resolve != NULL; resolve=resolve->next ) {
+            /*
+             * Work on a copy, pooled workers reuse the same schedule item
+             * and the available address families can change between runs.
+             */
+            resolve_dest_t query = *resolve;
+
             /* remove any address families that we can't use */
-            if ( seen_ipv4 == 0 && resolve->family != AF_INET6 ) {
-                if ( resolve->family == AF_INET ) {
+            if ( seen_ipv4 == 0 && query.family != AF_INET6 ) {
+                if ( query.family == AF_INET ) {
                     continue;
                 }
-                resolve->family = AF_INET6;
+                query.family = AF_INET6;
             }
 
-            if ( seen_ipv6 == 0 && resolve->family != AF_INET ) {
-                if ( resolve->family == AF_INET6 ) {
+            if ( seen_ipv6 == 0 && query.family != AF_INET ) {
+                if ( query.family == AF_INET6 ) {
                     continue;
                 }
-                resolve->family = AF_INET;
+                query.family = AF_INET;
             }
 
-            amp_resolve_add_new(resolver_fd, resolve);
+            amp_resolve_add_new(resolver_fd, &query);
         }
 
         /* send the flag to mark the end of the list */
@@ -380,6 +388,28 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
         free(port_str);
     }
 
+    return 0;
+}
+
+
+
+/*
+ * Run a single test in a freshly forked process (or the control process for
+ * tests run remotely) and exit once it is complete.
+ */
+void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
+    assert(item);
+    assert(item->test);
+
+    /* update process name so we can tell what is running */
+    set_proc_name(item->test->name);
+
+    if ( execute_test(item, ctrl) < 0 ) {
+        /* free the environment duped by set_proc_name() */
+        free_duped_environ();
+        return;
+    }
+
     /* free the environment duped by set_proc_name() */
     free_duped_environ();
 
@@ -389,35 +419,21 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
 
 
 /*
- * Test function to investigate forking, rescheduling, setting maximum
- * execution timers etc.
- * TODO maybe just move the contents of this into run_scheduled_test()?
+ * Start a test running, either by handing it to an idle pooled worker or by
+ * forking a new process for it. Returns the process id of the new process,
+ * 0 if a pooled worker is running the test, or -1 if it couldn't be started.
  */
-static int fork_test(test_schedule_item_t *item) {
-    struct timeval now;
+pid_t start_test(test_schedule_item_t *item) {
     pid_t pid;
 
     assert(item);
     assert(item->test);
 
-    /*
-     * Make sure this isn't being run too soon - the monotonic clock and
-     * the system time don't generally keep in sync very well (and the system
-     * time can get updated from other sources). If we are too early, return
-     * without running the test (which will be rescheduled).
-     */
-    gettimeofday(&now, NULL);
-    if ( timercmp(&now, &item->abstime, <) ) {
-        timersub(&item->abstime, &now, &now);
-        /* run too soon, don't run it now - let it get rescheduled */
-        if ( now.tv_sec != 0 || now.tv_usec > SCHEDULE_CLOCK_FUDGE ) {
-            Log(LOG_DEBUG, "%s test triggered early, will reschedule",
-                    item->test->name);
-            return 0;
-        }
+    /* hand the test to an idle pooled worker if this test has a pool */
+    if ( dispatch_to_test_worker(item) > 0 ) {
+        return 0;
     }
 
-
     /*
      * man fork:
      * "Under Linux, fork() is implemented using copy-on-write pages..."
@@ -427,7 +443,7 @@ static int fork_test(test_schedule_item_t *item) {
      */
     if ( (pid = fork()) < 0 ) {
         perror("fork");
-        return 0;
+        return -1;
     } else if ( pid == 0 ) {
         /*
          * close the unix domain sockets the parent had, if we keep them open
@@ -436,6 +452,10 @@ static int fork_test(test_schedule_item_t *item) {
          */
         close(vars.asnsock_fd);
         close(vars.nssock_fd);
+        close(vars.reportsock_fd);
+
+        /* the broker connection belongs to the parent, leave it alone */
+        forget_broker_connection();
 
         /* unblock signals and remove handlers that the parent process added */
         if ( unblock_signals() < 0 ) {
@@ -456,7 +476,44 @@ static int fork_test(test_schedule_item_t *item) {
         exit(EXIT_FAILURE);
     }
 
-    return 1;
+    return pid;
+}
+
+
+
+/*
+ * Test function to investigate forking, rescheduling, setting maximum
+ * execution timers etc.
+ * TODO maybe just move the contents of this into run_scheduled_test()?
+ */
+static int fork_test(test_schedule_item_t *item) {
+    struct timeval now;
+
+    assert(item);
+    assert(item->test);
+
+    /*
+     * Make sure this isn't being run too soon - the monotonic clock and
+     * the system time don't generally keep in sync very well (and the system
+     * time can get updated from other sources). If we are too early, return
+     * without running the test (which will be rescheduled).
+     */
+    gettimeofday(&now, NULL);
+    if ( timercmp(&now, &item->abstime, <) ) {
+        timersub(&item->abstime, &now, &now);
+        /* run too soon, don't run it now - let it get rescheduled */
+        if ( now.tv_sec != 0 || now.tv_usec > SCHEDULE_CLOCK_FUDGE ) {
+            Log(LOG_DEBUG, "%s test triggered early, will reschedule",
+                    item->test->name);
+            return 0;
+        }
+    }
+
+    /*
+     * Start the test now if there is room, otherwise it will wait in the
+     * queue until other tests finish (see dispatch.c).
+     */
+    return dispatch_test(item);
 }
 
 
@@ -40,12 +40,15 @@
 #ifndef _MEASURED_RUN_H
 #define _MEASURED_RUN_H
 
+#include <sys/types.h>
 #include <openssl/bio.h>
 #include <event2/event.h>
 
 #include "schedule.h"
 
+int execute_test(const test_schedule_item_t * const item, BIO *ctrl);
 void run_test(const test_schedule_item_t * const item, BIO *ctrl);
+pid_t start_test(test_schedule_item_t *item);
 void run_scheduled_test(evutil_socket_t evsock, short flags, void *evdata);
 
 #endif
@@ -726,13 +726,11 @@ struct timeval get_next_schedule_time(struct event_base *base,
 
 
 /*
- * Compare two test schedule items to see if they are similar enough to
- * merge together to make one scheduled test with multiple destinations.
+ * Compare everything about two test schedule items except the test module
+ * itself, which may have been reloaded between creating them.
  */
-static int compare_test_items(test_schedule_item_t *a, test_schedule_item_t *b){
-
-    if ( a->test != b->test )
-	return 0;
+static int compare_test_timing(test_schedule_item_t *a,
+        test_schedule_item_t *b) {
 
     if ( timercmp(&(a->interval), &(b->interval), !=) )
 	return 0;
@@ -770,18 +768,184 @@ static int compare_test_items(test_schedule_item_t *a, test_schedule_item_t *b){
 
 
 /*
- * Callback that is used to find the first matching timer event, once a valid
- * event is found the event is stored at the address pointed to by evdata
+ * Compare two test schedule items to see if they are similar enough to
+ * merge together to make one scheduled test with multiple destinations.
+ */
+static int compare_test_items(test_schedule_item_t *a, test_schedule_item_t *b){
+
+    if ( a->test != b->test )
+	return 0;
+
+    return compare_test_timing(a, b);
+}
+
+
+
+/*
+ * Hash everything that compare_test_items() checks, so that tests that could
+ * be merged will always end up in the same bucket of the schedule index.
+ */
+static uint32_t hash_test_item(test_schedule_item_t *item) {
+    uint32_t hash = 2166136261u;
+    uint64_t values[6];
+    unsigned char *byte;
+    unsigned int i;
+    char **param;
+
+    values[0] = item->test->id;
+    values[1] = (uint64_t)item->interval.tv_sec;
+    values[2] = (uint64_t)item->interval.tv_usec;
+    values[3] = (uint64_t)item->period;
+    values[4] = item->start;
+    values[5] = item->end;
+
+    /* FNV-1a over the fixed values and then every parameter string */
+    for ( byte = (unsigned char*)values, i = 0; i < sizeof(values); i++ ) {
+        hash = (hash ^ byte[i]) * 16777619u;
+    }
+
+    if ( item->params != NULL ) {
+        for ( param = item->params; *param != NULL; param++ ) {
+            for ( byte = (unsigned char*)*param; *byte != '\0'; byte++ ) {
+                hash = (hash ^ *byte) * 16777619u;
+            }
+            /* separate parameters so "ab","c" differs from "a","bc" */
+            hash = (hash ^ 0xff) * 16777619u;
+        }
+    }
+
+    return hash;
+}
+
+
+
+/*
+ * Check if a scheduled test has room for the given number of extra targets.
+ */
+static int has_room_for_targets(test_schedule_item_t *item, uint32_t count) {
+    return item->test->max_targets == 0 ||
+        (item->dest_count + item->resolve_count + count) <=
+        item->test->max_targets;
+}
+
+
+
+/*
+ * Double the number of buckets in the schedule index once it is full, to
+ * keep the chains short.
+ */
+static void grow_schedule_index(struct schedule_index *index) {
+    struct schedule_index_entry **buckets;
+    struct schedule_index_entry *entry, *next;
+    uint32_t size = index->size * 2;
+    uint32_t i;
+
+    buckets = calloc(size, sizeof(struct schedule_index_entry*));
+
+    for ( i = 0; i < index->size; i++ ) {
+        for ( entry = index->buckets[i]; entry != NULL; entry = next ) {
+            next = entry->next;
+            entry->next = buckets[entry->hash & (size - 1)];
+            buckets[entry->hash & (size - 1)] = entry;
+        }
+    }
+
+    free(index->buckets);
+    index->buckets = buckets;
+    index->size = size;
+}
+
+
+
+/*
+ * Insert a scheduled test into the index, whether it has room or not.
  */
-static int check_test_compare_callback(
+static void insert_schedule_index(struct schedule_index *index,
+        test_schedule_item_t *item, schedule_item_t *sched) {
+
+    struct schedule_index_entry *entry;
+
+    if ( index->count >= index->size ) {
+        grow_schedule_index(index);
+    }
+
+    entry = malloc(sizeof(struct schedule_index_entry));
+    entry->hash = hash_test_item(item);
+    entry->test_id = item->test->id;
+    entry->item = item;
+    entry->sched = sched;
+    entry->next = index->buckets[entry->hash & (index->size - 1)];
+    index->buckets[entry->hash & (index->size - 1)] = entry;
+    index->count++;
+}
+
+
+
+/*
+ * Add a scheduled test to the index so later tests can be merged with it.
+ */
+static void add_to_schedule_index(struct schedule_index *index,
+        test_schedule_item_t *item) {
+
+    assert(index);
+    assert(item);
+
+    /* tests that can't accept any more targets are never merge candidates */
+    if ( item->test->max_targets == 1 || !has_room_for_targets(item, 1) ) {
+        return;
+    }
+
+    insert_schedule_index(index, item, NULL);
+}
+
+
+
+/*
+ * Find a scheduled test that the given test can be merged with, removing
+ * any tests that have become full from the index as they are found.
+ */
+static test_schedule_item_t *find_in_schedule_index(
+        struct schedule_index *index, test_schedule_item_t *test) {
+
+    struct schedule_index_entry **entry, *tmp;
+    uint32_t hash = hash_test_item(test);
+
+    for ( entry = &index->buckets[hash & (index->size - 1)]; *entry != NULL;
+            /* no increment statement */ ) {
+
+        if ( !has_room_for_targets((*entry)->item, 1) ) {
+            /* full, it will never take any more targets */
+            tmp = *entry;
+            *entry = tmp->next;
+            free(tmp);
+            index->count--;
+            continue;
+        }
+
+        if ( (*entry)->hash == hash &&
+                compare_test_items((*entry)->item, test) &&
+                has_room_for_targets((*entry)->item,
+                    test->dest_count + test->resolve_count) ) {
+            return (*entry)->item;
+        }
+
+        entry = &(*entry)->next;
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Callback used to add every test that is already scheduled to the index.
+ */
+static int add_event_to_index_callback(
         __attribute__((unused))const struct event_base *base,
         const struct event *ev,
         void *evdata) {
 
     schedule_item_t *sched_item;
-    test_schedule_item_t *sched_test;
-    test_schedule_item_t *test;
-    test_schedule_item_t **return_value = evdata;
 
     /*
      * test if event callback matches test callback
@@ -794,27 +958,72 @@ static int check_test_compare_callback(
     sched_item = event_get_callback_arg(ev);
 
     assert(sched_item->data.test);
-    sched_test = sched_item->data.test;
+    add_to_schedule_index((struct schedule_index*)evdata,
+            sched_item->data.test);
 
-    assert(*return_value);
-    test = (*return_value);
+    return 0;
+}
 
-    /* check if these tests are the same */
-    if ( compare_test_items(sched_test, test) ) {
 
-        /* check if there is room for more destinations */
-        if ( test->test->max_targets == 0 ||
-                (sched_test->dest_count + sched_test->resolve_count) <
-                test->test->max_targets ) {
 
-            /* valid matching sched_item was found */
-            *return_value = sched_test;
-            return 1;
+/*
+ * Build an index of all the tests that are currently scheduled. This walks
+ * the event list once, rather than once per new test.
+ */
+static struct schedule_index *new_schedule_index(struct event_base *base) {
+    struct schedule_index *index;
+
+    index = malloc(sizeof(struct schedule_index));
+    index->size = 64;
+    index->count = 0;
+    index->buckets = calloc(index->size, sizeof(struct schedule_index_entry*));
+
+    event_base_foreach_event(base, add_event_to_index_callback, index);
+
+    return index;
+}
+
+
+
+/*
+ * Free the schedule index, the scheduled tests themselves are left alone.
+ */
+static void free_schedule_index(struct schedule_index *index) {
+    struct schedule_index_entry *entry, *tmp;
+    uint32_t i;
+
+    if ( index == NULL ) {
+        return;
+    }
+
+    for ( i = 0; i < index->size; i++ ) {
+        for ( entry = index->buckets[i]; entry != NULL; /* */ ) {
+            tmp = entry;
+            entry = entry->next;
+            free(tmp);
         }
     }
 
-    /* No match was found, move on to next item */
-    return 0;
+    free(index->buckets);
+    free(index);
+}
+
+
+
+/*
+ * Add a pre-resolved destination to a scheduled test, growing the array
+ * geometrically so that building large tests isn't quadratic.
+ */
+static void add_test_destination(test_schedule_item_t *test,
+        struct addrinfo *addr) {
+
+    if ( test->dest_count >= test->dest_space ) {
+        test->dest_space = (test->dest_space < 4) ? 4 : test->dest_space * 2;
+        test->dests = (struct addrinfo **)realloc(test->dests,
+                sizeof(struct addrinfo*) * test->dest_space);
+    }
+
+    test->dests[test->dest_count++] = addr;
 }
 
 
@@ -825,36 +1034,60 @@ static int check_test_compare_callback(
  * destinations. If the tests can be merged that helps to limit the number of
  * active timers and tests that need to be run.
  */
-static int merge_scheduled_tests(
-        struct event_base *base,
+static int merge_scheduled_tests(struct schedule_index *index,
         test_schedule_item_t *test) {
 
-    test_schedule_item_t * sched_test = test;
+    test_schedule_item_t *sched_test;
+    resolve_dest_t *resolve;
+    uint32_t i;
+
+    if ( (sched_test = find_in_schedule_index(index, test)) == NULL ) {
+        return 0;
+    }
+
+    assert(sched_test != test);
 
-    /* if entire events list was searched without returning then result is 0 */
-    if ( event_base_foreach_event(base,
-            check_test_compare_callback, &sched_test) ) {
+    /* add all the new pre-resolved addresses */
+    for ( i = 0; i < test->dest_count; i++ ) {
+        add_test_destination(sched_test, test->dests[i]);
+    }
 
-        /* if status is non zero sched_test must contain a matching test */
-        assert(sched_test != test);
+    /* add all the new addresses we will need to resolve later */
+    while ( test->resolve != NULL ) {
+        resolve = test->resolve;
+        test->resolve = resolve->next;
+        resolve->next = sched_test->resolve;
+        sched_test->resolve = resolve;
+        sched_test->resolve_count++;
+    }
 
-        if ( test->dest_count > 0 ) {
-            /* add a new pre-resolved address */
-            sched_test->dests = realloc(sched_test->dests,
-                    (sched_test->dest_count+1) *
-                    sizeof(struct addrinfo *));
-            sched_test->dests[sched_test->dest_count++] = test->dests[0];
-        } else {
-            /* add a new address we will need to resolve later */
-            test->resolve->next = sched_test->resolve;
-            sched_test->resolve = test->resolve;
-            sched_test->resolve_count++;
-        }
+    return 1;
+}
+
+
+
+/*
+ * Duplicate a NULL terminated parameter list.
+ */
+static char **copy_params(char **params) {
+    char **copy;
+    int count;
 
-        return 1;
+    if ( params == NULL ) {
+        return NULL;
     }
 
-    return 0;
+    for ( count = 0; params[count] != NULL; count++ ) {
+        /* nothing, just counting */
+    }
+
+    copy = malloc(sizeof(char*) * (count + 1));
+    for ( count = 0; params[count] != NULL; count++ ) {
+        copy[count] = strdup(params[count]);
+    }
+    copy[count] = NULL;
+
+    return copy;
 }
 
 
@@ -918,6 +1151,7 @@ char **populate_target_lists(test_schedule_item_t *test, char **targets) {
     test->resolve = NULL;
     test->resolve_count = 0;
     test->dest_count = 0;
+    test->dest_space = 0;
 
     /* for every address in the list, find it in nametable or set to resolve */
     for ( ; targets != NULL && *targets != NULL && (max_targets == 0 ||
@@ -958,10 +1192,7 @@ char **populate_target_lists(test_schedule_item_t *test, char **targets) {
                 }
 
                 if ( family == AF_UNSPEC || family == addr->ai_family ) {
-                    test->dests = (struct addrinfo **)realloc(test->dests,
-                            sizeof(struct addrinfo*) * (test->dest_count + 1));
-                    test->dests[test->dest_count] = addr;
-                    test->dest_count++;
+                    add_test_destination(test, addr);
                 }
             }
 
@@ -997,8 +1228,9 @@ char **populate_target_lists(test_schedule_item_t *test, char **targets) {
  * because it makes scheduling easier.
  */
 static test_schedule_item_t *create_and_schedule_test(
-        struct event_base *base, yaml_document_t *document,
-        yaml_node_item_t index, amp_test_meta_t *meta) {
+        struct event_base *base, struct schedule_index *schedule,
+        yaml_document_t *document, yaml_node_item_t index,
+        amp_test_meta_t *meta) {
 
     test_schedule_item_t *test = NULL;
     schedule_item_t *sched;
@@ -1146,7 +1378,8 @@ static test_schedule_item_t *create_and_schedule_test(
         test->start = start;
         test->end = end;
         test->test = test_definition;
-        test->params = params;
+        /* every instance owns its parameters, they are freed separately */
+        test->params = (remaining == targets) ? params : copy_params(params);
         test->meta = meta;
         /*
          * Convert the list of targets into actual dests and ones to resolve.
@@ -1172,7 +1405,7 @@ static test_schedule_item_t *create_and_schedule_test(
         if ( remaining != NULL && *remaining == NULL &&
                 test_definition->max_targets != 1 ) {
             /* check if this test at this time already exists */
-            if ( merge_scheduled_tests(base, test) ) {
+            if ( merge_scheduled_tests(schedule, test) ) {
                 /* remove pointer to names, merged test owns it */
                 test->resolve = NULL;
                 /* free this test, it has now merged */
@@ -1196,6 +1429,9 @@ static test_schedule_item_t *create_and_schedule_test(
             Log(LOG_ALERT, "Failed to schedule %s test", testname);
         }
 
+        /* later tests with the same schedule may be able to merge with it */
+        add_to_schedule_index(schedule, test);
+
     } while ( remaining != NULL && *remaining != NULL );
 
 end:
@@ -1211,7 +1447,8 @@ end:
 /*
  * Read in the schedule file and create events for each test.
  */
-static void read_schedule_file(struct event_base *base, char *filename,
+static void read_schedule_file(struct event_base *base,
+        struct schedule_index *schedule, char *filename,
         amp_test_meta_t *meta) {
 
     FILE *in;
@@ -1269,7 +1506,8 @@ static void read_schedule_file(struct event_base *base, char *filename,
             yaml_node_item_t *item;
             for ( item = value->data.sequence.items.start;
                     item != value->data.sequence.items.top; item++ ) {
-                create_and_schedule_test(base, &document, *item, meta);
+                create_and_schedule_test(base, schedule, &document, *item,
+                        meta);
             }
         }
      }
@@ -1294,6 +1532,7 @@ void read_schedule_dir(struct event_base *base, char *directory,
     glob_t glob_buf;
     unsigned int i;
     char full_loc[MAX_PATH_LENGTH];
+    struct schedule_index *schedule;
 
     assert(base);
     assert(directory);
@@ -1312,16 +1551,214 @@ void read_schedule_dir(struct event_base *base, char *directory,
     Log(LOG_INFO, "Loading schedule from %s (found %zd candidates)",
             directory, glob_buf.gl_pathc);
 
+    /* index the existing tests so new ones can quickly be merged */
+    schedule = new_schedule_index(base);
+
     for ( i = 0; i < glob_buf.gl_pathc; i++ ) {
-        read_schedule_file(base, glob_buf.gl_pathv[i], meta);
+        read_schedule_file(base, schedule, glob_buf.gl_pathv[i], meta);
     }
 
+    free_schedule_index(schedule);
     globfree(&glob_buf);
     return;
 }
 
 
 
+/*
+ * Check that two tests have exactly the same destinations, in the same order.
+ * Pre-resolved destinations point into the name table, which is not reloaded
+ * along with the schedule, so comparing the pointers is enough.
+ */
+static int compare_test_destinations(test_schedule_item_t *a,
+        test_schedule_item_t *b) {
+
+    resolve_dest_t *ra, *rb;
+
+    if ( a->dest_count != b->dest_count ||
+            a->resolve_count != b->resolve_count ) {
+        return 0;
+    }
+
+    if ( a->dest_count > 0 &&
+            memcmp(a->dests, b->dests,
+                sizeof(struct addrinfo*) * a->dest_count) != 0 ) {
+        return 0;
+    }
+
+    for ( ra = a->resolve, rb = b->resolve; ra != NULL && rb != NULL;
+            ra = ra->next, rb = rb->next ) {
+        if ( ra->family != rb->family || ra->count != rb->count ||
+                strcmp(ra->name, rb->name) != 0 ) {
+            return 0;
+        }
+    }
+
+    return ra == NULL && rb == NULL;
+}
+
+
+
+/*
+ * Callback used to add every scheduled test to the index, full or not.
+ */
+static int add_event_to_reload_index_callback(
+        __attribute__((unused))const struct event_base *base,
+        const struct event *ev,
+        void *evdata) {
+
+    schedule_item_t *sched_item;
+
+    if ( event_get_callback(ev) != run_scheduled_test ) {
+        return 0;
+    }
+
+    sched_item = event_get_callback_arg(ev);
+
+    assert(sched_item->data.test);
+    insert_schedule_index((struct schedule_index*)evdata,
+            sched_item->data.test, sched_item);
+
+    return 0;
+}
+
+
+
+/*
+ * Index every currently scheduled test so that a reloaded schedule can be
+ * compared against it. This must be done before the test modules are
+ * unloaded, as it records the test id while the test definition is valid.
+ */
+struct schedule_index *index_test_schedule(struct event_base *base) {
+    struct schedule_index *index;
+
+    assert(base);
+
+    index = malloc(sizeof(struct schedule_index));
+    index->size = 64;
+    index->count = 0;
+    index->buckets = calloc(index->size, sizeof(struct schedule_index_entry*));
+
+    event_base_foreach_event(base, add_event_to_reload_index_callback, index);
+
+    return index;
+}
+
+
+
+/*
+ * Find and remove an indexed test that is identical to the given test. The
+ * indexed test definitions may have been unloaded, so only compare test ids.
+ */
+static struct schedule_index_entry *find_unchanged_test(
+        struct schedule_index *index, test_schedule_item_t *test) {
+
+    struct schedule_index_entry **entry, *found;
+    uint32_t hash = hash_test_item(test);
+
+    for ( entry = &index->buckets[hash & (index->size - 1)]; *entry != NULL;
+            entry = &(*entry)->next ) {
+
+        if ( (*entry)->hash == hash && (*entry)->test_id == test->test->id &&
+                compare_test_timing((*entry)->item, test) &&
+                compare_test_destinations((*entry)->item, test) ) {
+            found = *entry;
+            *entry = found->next;
+            index->count--;
+            return found;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Replace the current test schedule with the one that has been loaded into
+ * the staging event base. Tests that are unchanged keep their existing timer
+ * and destinations (only pointing at the reloaded test definition), new tests
+ * are moved onto the main event base and any tests that are left over in the
+ * index of the current schedule are removed. The index is freed.
+ */
+void update_test_schedule(struct event_base *base, struct event_base *staging,
+        struct schedule_index *current, schedule_diff_t *diff) {
+
+    struct tmp_event_list *list = NULL;
+    struct tmp_event_list *item;
+    struct schedule_index_entry *entry;
+    struct timeval next;
+    uint32_t i;
+
+    assert(base);
+    assert(staging);
+    assert(current);
+    assert(diff);
+
+    memset(diff, 0, sizeof(schedule_diff_t));
+
+    /* can't make changes during foreach(), so first get all the events */
+    event_base_foreach_event(staging, add_events_list_callback, &list);
+
+    while ( list != NULL ) {
+        struct event *staged_event = list->event;
+        schedule_item_t *sched = event_get_callback_arg(staged_event);
+
+        item = list;
+        list = list->next;
+        free(item);
+
+        if ( event_get_callback(staged_event) != run_scheduled_test ) {
+            continue;
+        }
+
+        event_free(staged_event);
+
+        if ( (entry = find_unchanged_test(current, sched->data.test)) ) {
+            /* keep the running timer, but use the new test definition */
+            entry->item->test = sched->data.test->test;
+            free_test_schedule_item(sched->data.test);
+            free(sched);
+            free(entry);
+            diff->kept++;
+            continue;
+        }
+
+        /* new or modified test, schedule it with the main event base */
+        sched->base = base;
+        next = get_next_schedule_time(base, sched->data.test->period,
+                sched->data.test->start, sched->data.test->end,
+                US_FROM_TV(sched->data.test->interval), 0,
+                &sched->data.test->abstime);
+
+        sched->event = event_new(base, -1, 0, run_scheduled_test, sched);
+
+        if ( event_add(sched->event, &next) != 0 ) {
+            Log(LOG_ALERT, "Failed to schedule %s test",
+                    sched->data.test->test->name);
+        }
+
+        diff->added++;
+    }
+
+    /* anything left over is no longer in the schedule, remove it */
+    for ( i = 0; i < current->size; i++ ) {
+        while ( (entry = current->buckets[i]) != NULL ) {
+            current->buckets[i] = entry->next;
+            event_free(entry->sched->event);
+            free_test_schedule_item(entry->item);
+            free(entry->sched);
+            free(entry);
+            diff->removed++;
+        }
+    }
+
+    free(current->buckets);
+    free(current);
+}
+
+
+
 /*
  * Try to fetch a schedule file from a remote server if there is a fresher one
  * available, replacing any existing one that has been previously fetched.
@@ -127,6 +127,7 @@ typedef struct test_schedule_item {
     schedule_period_t period;	    /* repeat cycle: Hourly, Daily, Weekly */
     test_t *test;	            /* test definition of test to run */
     uint32_t dest_count;	    /* number of current destinations */
+    uint32_t dest_space;	    /* allocated size of the dests array */
     uint32_t resolve_count;	    /* max possible count of dests to resolve */
     struct addrinfo **dests;	    /* all current destinations */
     resolve_dest_t *resolve;	    /* list of destination names to resolve */
@@ -138,6 +139,38 @@ typedef struct test_schedule_item {
 
 
 
+/*
+ * Index of scheduled tests that still have room for more destinations, keyed
+ * on everything that compare_test_items() looks at, so that new tests can be
+ * merged with existing ones without searching the whole schedule.
+ */
+struct schedule_index_entry {
+    uint32_t hash;
+    uint64_t test_id;               /* test id, valid after modules reload */
+    test_schedule_item_t *item;
+    struct schedule_item *sched;    /* event data, only set when reloading */
+    struct schedule_index_entry *next;
+};
+
+struct schedule_index {
+    uint32_t size;                  /* number of buckets, a power of two */
+    uint32_t count;                 /* number of indexed tests */
+    struct schedule_index_entry **buckets;
+};
+
+
+
+/*
+ * Counts of what changed in the schedule after it was reloaded.
+ */
+typedef struct schedule_diff {
+    uint32_t kept;                  /* unchanged tests, timers left alone */
+    uint32_t added;                 /* new or modified tests */
+    uint32_t removed;               /* tests no longer in the schedule */
+} schedule_diff_t;
+
+
+
 /*
  * Data block for fetching remote schedule files.
  */
@@ -178,6 +211,9 @@ void dump_schedule(struct event_base *base, FILE *out);
 void clear_test_schedule(struct event_base *base, int all);
 void read_schedule_dir(struct event_base *base, char *directory,
         amp_test_meta_t *meta);
+struct schedule_index *index_test_schedule(struct event_base *base);
+void update_test_schedule(struct event_base *base, struct event_base *staging,
+        struct schedule_index *current, schedule_diff_t *diff);
 struct timeval get_next_schedule_time(struct event_base *base,
         schedule_period_t period, uint64_t start, uint64_t end,
         uint64_t frequency, int run, struct timeval *abstime);
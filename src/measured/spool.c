@@ -0,0 +1,590 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spool.h"
+#include "debug.h"
+
+
+/*
+ * Results that can't be published because the broker is unavailable are
+ * written to a fixed size, memory mapped file so that they survive long
+ * outages and restarts without growing without bound. It is used as a
+ * circular log: results are appended at the head, and the oldest results
+ * are dropped from the tail to make room if the spool fills up. Results
+ * are only removed from the tail once the broker has confirmed them, so
+ * if measured stops part way through a replay they will be sent again.
+ *
+ * The file is mapped by the main process before any tests are forked, so
+ * test processes that can't reach the main process or the broker can add
+ * their results too. Every change is made while holding the lock, and head
+ * only moves once a record is completely written.
+ */
+static struct amp_spool_header *spool = NULL;
+static char *spool_data = NULL;
+static uint32_t spool_size = DEFAULT_SPOOL_SIZE;
+
+
+
+/*
+ * Update a 32 bit FNV-1a hash with more data.
+ */
+static uint32_t fnv1a(uint32_t hash, const void *buf, uint32_t len) {
+    const unsigned char *bytes = buf;
+    uint32_t i;
+
+    for ( i = 0; i < len; i++ ) {
+        hash ^= bytes[i];
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+
+
+/*
+ * Checksum the contents of a record, so that one only partially written to
+ * disk (e.g. after a power failure) can be detected.
+ */
+static uint32_t spool_checksum(const char *name, uint32_t namelen,
+        const void *data, uint32_t datalen) {
+    return fnv1a(fnv1a(2166136261U, name, namelen), data, datalen);
+}
+
+
+
+/*
+ * Lock the spool. The lock is robust, so if a test process died while
+ * holding it then we take it over - head only moves once a record has been
+ * completely written so the contents of the spool are still consistent.
+ */
+static int lock_spool(void) {
+    int res = pthread_mutex_lock(&spool->lock);
+
+    if ( res == EOWNERDEAD ) {
+        Log(LOG_WARNING, "Process died holding spool lock, recovering");
+        pthread_mutex_consistent(&spool->lock);
+        return 0;
+    }
+
+    if ( res != 0 ) {
+        Log(LOG_WARNING, "Failed to lock spool: %s", strerror(res));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Check the record at the given position in the spool. Returns the number
+ * of bytes it occupies, or 0 if it is damaged. A marker for the unused space
+ * at the end of the data area occupies the rest of the data area, and sets
+ * is_record to 0. The checksum is only verified if asked, when the contents
+ * are going to be used.
+ */
+static uint64_t check_spool_record(uint64_t position, int verify,
+        int *is_record) {
+    uint64_t offset = position % spool->size;
+    uint64_t available = spool->head - position;
+    struct amp_spool_record *record;
+    char *name;
+    uint64_t length;
+
+    record = (struct amp_spool_record*)(spool_data + offset);
+
+    if ( record->magic == AMP_SPOOL_WRAP_MAGIC ) {
+        *is_record = 0;
+        length = spool->size - offset;
+        return length < available ? length : 0;
+    }
+
+    if ( record->magic != AMP_SPOOL_RECORD_MAGIC ||
+            spool->size - offset < sizeof(struct amp_spool_record) ||
+            record->namelen == 0 ||
+            record->namelen > AMP_SPOOL_MAX_NAME_LEN ) {
+        return 0;
+    }
+
+    length = SPOOL_RECORD_LEN(record->namelen, record->datalen);
+    if ( length > spool->size - offset || length > available ) {
+        return 0;
+    }
+
+    name = (char*)(record + 1);
+    if ( name[record->namelen] != '\0' ) {
+        return 0;
+    }
+
+    if ( verify && record->checksum != spool_checksum(name, record->namelen,
+                name + record->namelen + 1, record->datalen) ) {
+        return 0;
+    }
+
+    *is_record = 1;
+    return length;
+}
+
+
+
+/*
+ * Throw away every record from the given position onwards, because the one
+ * at that position is damaged and nothing after it can be trusted.
+ */
+static void truncate_spool(uint64_t position, uint64_t kept) {
+    uint64_t lost = spool->records > kept ? spool->records - kept : 0;
+
+    Log(LOG_WARNING, "Damaged record in spool, discarding %" PRIu64
+            " results", lost);
+
+    spool->head = position;
+    spool->records = kept;
+    spool->discarded += lost;
+}
+
+
+
+/*
+ * Drop the oldest record in the spool to make room for a new one.
+ */
+static void drop_oldest_spool_record(void) {
+    uint64_t length;
+    int is_record;
+
+    if ( (length = check_spool_record(spool->tail, 0, &is_record)) == 0 ) {
+        truncate_spool(spool->tail, 0);
+        return;
+    }
+
+    spool->tail += length;
+
+    if ( is_record ) {
+        spool->records--;
+        spool->dropped++;
+    }
+}
+
+
+
+/*
+ * Walk every record left in the spool by a previous run, making sure they
+ * are all intact. Anything after the first damaged record is discarded.
+ */
+static void recover_spool(void) {
+    uint64_t position, length;
+    uint64_t count = 0;
+    int is_record;
+
+    if ( spool->head < spool->tail ||
+            spool->head - spool->tail > spool->size ||
+            (spool->head | spool->tail) & 7 ) {
+        truncate_spool(spool->tail, 0);
+        return;
+    }
+
+    for ( position = spool->tail; position < spool->head;
+            position += length ) {
+        if ( (length = check_spool_record(position, 1, &is_record)) == 0 ) {
+            truncate_spool(position, count);
+            return;
+        }
+        count += is_record;
+    }
+
+    spool->records = count;
+
+    if ( count > 0 ) {
+        Log(LOG_INFO, "Recovered %" PRIu64 " unpublished results from spool",
+                count);
+    }
+}
+
+
+
+/*
+ * Set the size of the spool (in MB), taking effect the next time the spool
+ * is opened. A size of 0 disables the spool.
+ */
+void configure_spool(uint32_t size) {
+    spool_size = size < MAX_SPOOL_SIZE ? size : MAX_SPOOL_SIZE;
+}
+
+
+
+/*
+ * Open and map the spool file, creating it if it doesn't exist and
+ * reserving its space on disk. Results left from a previous run are kept,
+ * and a spool that still has results in it keeps its old size until it is
+ * next empty when measured starts.
+ */
+int open_spool(char *path) {
+    pthread_mutexattr_t attr;
+    struct amp_spool_header header;
+    struct stat statbuf;
+    uint64_t size = (uint64_t)spool_size * 1024 * 1024;
+    int fd;
+    int err;
+    int valid = 0;
+
+    if ( spool != NULL ) {
+        close_spool();
+    }
+
+    if ( size == 0 ) {
+        Log(LOG_DEBUG, "Result spool is disabled");
+        return 0;
+    }
+
+    if ( path == NULL ) {
+        return -1;
+    }
+
+    if ( (fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 ||
+            fstat(fd, &statbuf) < 0 ) {
+        Log(LOG_WARNING, "Failed to open spool %s: %s", path,
+                strerror(errno));
+        if ( fd >= 0 ) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    /* check if there is an existing spool in the file that we can use */
+    if ( pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+            header.magic == AMP_SPOOL_MAGIC &&
+            header.version == AMP_SPOOL_VERSION &&
+            header.size > 0 && (header.size & 7) == 0 &&
+            (uint64_t)statbuf.st_size == AMP_SPOOL_DATA_OFFSET + header.size &&
+            (header.size == size || header.records > 0) ) {
+        if ( header.size != size ) {
+            Log(LOG_INFO, "Spool %s holds results, keeping current size",
+                    path);
+            size = header.size;
+        }
+        valid = 1;
+    }
+
+    if ( !valid && ftruncate(fd, AMP_SPOOL_DATA_OFFSET + size) < 0 ) {
+        Log(LOG_WARNING, "Failed to size spool %s: %s", path,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /*
+     * Reserve the disk space now, otherwise writing into a hole in the
+     * mapping when the filesystem is full raises SIGBUS.
+     */
+    if ( (err = posix_fallocate(fd, 0, AMP_SPOOL_DATA_OFFSET + size)) != 0 ) {
+        Log(LOG_WARNING, "Failed to reserve space for spool %s: %s", path,
+                strerror(err));
+        /* don't leave a large empty file behind if it wasn't in use */
+        if ( !valid && ftruncate(fd, 0) < 0 ) {
+            Log(LOG_DEBUG, "Failed to truncate spool %s: %s", path,
+                    strerror(errno));
+        }
+        close(fd);
+        return -1;
+    }
+
+    spool = mmap(NULL, AMP_SPOOL_DATA_OFFSET + size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+
+    if ( spool == MAP_FAILED ) {
+        Log(LOG_WARNING, "Failed to map spool %s: %s", path, strerror(errno));
+        spool = NULL;
+        return -1;
+    }
+
+    spool_data = (char*)spool + AMP_SPOOL_DATA_OFFSET;
+
+    if ( valid ) {
+        recover_spool();
+    } else {
+        memset(spool, 0, sizeof(struct amp_spool_header));
+        spool->magic = AMP_SPOOL_MAGIC;
+        spool->version = AMP_SPOOL_VERSION;
+        spool->size = size;
+    }
+
+    /* the lock in the file belonged to the previous run, create a new one */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&spool->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    Log(LOG_DEBUG, "Using %" PRIu64 " byte result spool %s", size, path);
+
+    return 0;
+}
+
+
+
+/*
+ * Write everything in the spool to disk and unmap it.
+ */
+void close_spool(void) {
+    size_t length;
+
+    if ( spool == NULL ) {
+        return;
+    }
+
+    length = AMP_SPOOL_DATA_OFFSET + spool->size;
+    msync(spool, length, MS_SYNC);
+    munmap(spool, length);
+    spool = NULL;
+    spool_data = NULL;
+}
+
+
+
+/*
+ * Start writing any modified parts of the spool to disk, without waiting
+ * for it to complete.
+ */
+void sync_spool(void) {
+    if ( spool == NULL ) {
+        return;
+    }
+
+    msync(spool, AMP_SPOOL_DATA_OFFSET + spool->size, MS_ASYNC);
+}
+
+
+
+/*
+ * Append a result to the spool, dropping the oldest results if there isn't
+ * enough space for it. Records don't wrap around the end of the data area,
+ * if one doesn't fit then the rest of the data area is marked as unused and
+ * it is written at the start instead.
+ */
+int spool_report(char *name, uint64_t timestamp, void *data, uint32_t len) {
+    struct amp_spool_record *record;
+    uint64_t length, offset, padding;
+    uint32_t namelen;
+
+    if ( spool == NULL ) {
+        return -1;
+    }
+
+    namelen = strlen(name);
+    length = SPOOL_RECORD_LEN(namelen, len);
+
+    if ( namelen == 0 || namelen > AMP_SPOOL_MAX_NAME_LEN ||
+            length > spool->size ) {
+        Log(LOG_WARNING, "Can't fit %s result (%d bytes) in spool", name, len);
+        return -1;
+    }
+
+    if ( lock_spool() < 0 ) {
+        return -1;
+    }
+
+    offset = spool->head % spool->size;
+    padding = length > spool->size - offset ? spool->size - offset : 0;
+
+    while ( spool->head + padding + length - spool->tail > spool->size ) {
+        if ( spool->tail == spool->head ) {
+            /* nothing left to drop, start again at the front of the spool */
+            spool->head += padding;
+            spool->tail = spool->head;
+            padding = 0;
+            break;
+        }
+        drop_oldest_spool_record();
+    }
+
+    if ( padding > 0 ) {
+        *(uint32_t*)(spool_data + offset) = AMP_SPOOL_WRAP_MAGIC;
+        spool->head += padding;
+    }
+
+    record = (struct amp_spool_record*)(spool_data + spool->head % spool->size);
+    record->timestamp = timestamp;
+    record->namelen = namelen;
+    record->datalen = len;
+    record->checksum = spool_checksum(name, namelen, data, len);
+    memcpy(record + 1, name, namelen + 1);
+    memcpy((char*)(record + 1) + namelen + 1, data, len);
+    record->magic = AMP_SPOOL_RECORD_MAGIC;
+
+    spool->head += length;
+    spool->records++;
+    spool->written++;
+
+    pthread_mutex_unlock(&spool->lock);
+
+    return 0;
+}
+
+
+
+/*
+ * Copy up to max of the oldest results out of the spool so that they can be
+ * published. They stay in the spool until released once the broker has
+ * confirmed them. Returns the number of results copied.
+ */
+int read_spool(struct amp_spool_entry *entries, int max) {
+    struct amp_spool_record *record;
+    uint64_t position, length;
+    int count = 0;
+    int is_record;
+
+    if ( spool == NULL || lock_spool() < 0 ) {
+        return 0;
+    }
+
+    for ( position = spool->tail; count < max && position < spool->head;
+            position += length ) {
+        if ( (length = check_spool_record(position, 1, &is_record)) == 0 ) {
+            truncate_spool(position, count);
+            break;
+        }
+
+        if ( !is_record ) {
+            continue;
+        }
+
+        record = (struct amp_spool_record*)(spool_data +
+                position % spool->size);
+        entries[count].name = strdup((char*)(record + 1));
+        entries[count].timestamp = record->timestamp;
+        entries[count].len = record->datalen;
+        entries[count].data = malloc(record->datalen);
+        memcpy(entries[count].data, (char*)(record + 1) + record->namelen + 1,
+                record->datalen);
+        entries[count].end = position + length;
+        count++;
+    }
+
+    pthread_mutex_unlock(&spool->lock);
+
+    return count;
+}
+
+
+
+/*
+ * Remove every result before the given position from the spool, they have
+ * been published. Anything that was dropped in the meantime to make room
+ * for newer results is already gone.
+ */
+void release_spool(uint64_t end) {
+    uint64_t length;
+    int is_record;
+
+    if ( spool == NULL || lock_spool() < 0 ) {
+        return;
+    }
+
+    while ( spool->tail < end && spool->tail < spool->head ) {
+        if ( (length = check_spool_record(spool->tail, 0, &is_record)) == 0 ) {
+            truncate_spool(spool->tail, 0);
+            break;
+        }
+
+        spool->tail += length;
+
+        if ( is_record ) {
+            spool->records--;
+            spool->replayed++;
+        }
+    }
+
+    pthread_mutex_unlock(&spool->lock);
+}
+
+
+
+/*
+ * Free results that were copied out of the spool.
+ */
+void free_spool_entries(struct amp_spool_entry *entries, int count) {
+    int i;
+
+    for ( i = 0; i < count; i++ ) {
+        free(entries[i].name);
+        free(entries[i].data);
+    }
+}
+
+
+
+/*
+ * Get the number of results waiting in the spool.
+ */
+uint64_t spooled_report_count(void) {
+    return spool ? spool->records : 0;
+}
+
+
+
+/*
+ * Write the spool counters to the given file, for debugging.
+ */
+void dump_spool_stats(FILE *out) {
+    if ( spool == NULL ) {
+        fprintf(out, "Result spool disabled\n");
+        return;
+    }
+
+    fprintf(out, "Result spool: %" PRIu64 " results, %" PRIu64 "/%" PRIu64
+            " bytes used, %" PRIu64 " written, %" PRIu64 " replayed, "
+            "%" PRIu64 " dropped, %" PRIu64 " discarded\n",
+            spool->records, spool->head - spool->tail, spool->size,
+            spool->written, spool->replayed, spool->dropped,
+            spool->discarded);
+}
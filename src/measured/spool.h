@@ -0,0 +1,126 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_SPOOL_H
+#define _MEASURED_SPOOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* size (MB) of the on-disk spool for results the broker can't take, 0 = off */
+#define DEFAULT_SPOOL_SIZE 64
+
+/* upper limit on the spool size (MB) */
+#define MAX_SPOOL_SIZE 4096
+
+/* identifies a spool file, and the version of the layout it uses */
+#define AMP_SPOOL_MAGIC 0x414d5053
+#define AMP_SPOOL_VERSION 1
+
+/* marks a result record, or the unused space at the end of the data area */
+#define AMP_SPOOL_RECORD_MAGIC 0x52455355
+#define AMP_SPOOL_WRAP_MAGIC 0x57524150
+
+/* sanity limit on the length of test names read back from the spool */
+#define AMP_SPOOL_MAX_NAME_LEN 255
+
+/* the data area starts on its own page, after the spool header */
+#define AMP_SPOOL_DATA_OFFSET 4096
+
+/*
+ * Header at the start of the spool file. Head and tail are the total bytes
+ * ever written and consumed (like the report ring), so they only increase
+ * and the position in the data area is found modulo the size. The counters
+ * are kept in the file so they persist across restarts.
+ */
+struct amp_spool_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;          /* size of the data area that follows */
+    uint64_t head;          /* total bytes ever written */
+    uint64_t tail;          /* total bytes ever consumed or dropped */
+    uint64_t records;       /* results currently in the spool */
+    uint64_t written;       /* total results written to the spool */
+    uint64_t replayed;      /* total results published from the spool */
+    uint64_t dropped;       /* oldest results overwritten when full */
+    uint64_t discarded;     /* results found to be damaged */
+    pthread_mutex_t lock;   /* shared with test processes, recreated on open */
+};
+
+/*
+ * Header on every result in the spool, followed by the test name (with null
+ * terminator) and the packed result data. Records are 8 byte aligned and
+ * never wrap around the end of the data area.
+ */
+struct amp_spool_record {
+    uint32_t magic;
+    uint32_t checksum;      /* over the name and result data */
+    uint64_t timestamp;
+    uint32_t namelen;       /* not including the null terminator */
+    uint32_t datalen;
+};
+
+#define SPOOL_RECORD_LEN(namelen, datalen) \
+    ((sizeof(struct amp_spool_record) + (namelen) + 1 + (datalen) + 7) & ~7ULL)
+
+/*
+ * A result copied out of the spool to be published. It stays in the spool
+ * until released, using the position just past the end of its record.
+ */
+struct amp_spool_entry {
+    char *name;
+    uint64_t timestamp;
+    uint32_t len;
+    void *data;
+    uint64_t end;
+};
+
+void configure_spool(uint32_t size);
+int open_spool(char *path);
+void close_spool(void);
+void sync_spool(void);
+int spool_report(char *name, uint64_t timestamp, void *data, uint32_t len);
+int read_spool(struct amp_spool_entry *entries, int max);
+void release_spool(uint64_t end);
+void free_spool_entries(struct amp_spool_entry *entries, int count);
+uint64_t spooled_report_count(void);
+void dump_spool_stats(FILE *out);
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/time.h>
+#include <event2/event.h>
+#include "dispatch.h"
+#include "run.h"
+
+#define MAX_STARTED 16
+
+/* record of every test that the dispatcher started */
+static test_schedule_item_t *started[MAX_STARTED];
+static struct timeval started_at[MAX_STARTED];
+static int started_count = 0;
+
+
+
+/*
+ * Replace the real start_test() so that nothing is forked, just remember
+ * which tests were started and when. Each gets a fake process id.
+ */
+pid_t start_test(test_schedule_item_t *item) {
+    assert(started_count < MAX_STARTED);
+    started[started_count] = item;
+    gettimeofday(&started_at[started_count], NULL);
+    started_count++;
+    return 1000 + started_count;
+}
+
+
+
+/*
+ * Create a schedule item for a test that is due right now.
+ */
+static void init_item(test_schedule_item_t *item, test_t *test,
+        int interval_ms) {
+    memset(item, 0, sizeof(*item));
+    item->test = test;
+    item->interval.tv_sec = interval_ms / 1000;
+    item->interval.tv_usec = (interval_ms % 1000) * 1000;
+    gettimeofday(&item->abstime, NULL);
+}
+
+
+
+/*
+ * Reset the dispatcher with new global limits.
+ */
+static void reset(struct event_base *base, uint32_t max, uint32_t spacing) {
+    stop_dispatch();
+    configure_dispatch(max, spacing);
+    start_dispatch(base);
+    started_count = 0;
+}
+
+
+
+/*
+ * Check that tests are started, queued, spaced apart and skipped according
+ * to the global and per-test limits.
+ */
+int main(void) {
+    struct event_base *base;
+    test_t icmp, dns;
+    test_schedule_item_t a, b, c, d;
+    struct timeval gap;
+    int i;
+
+    base = event_base_new();
+    assert(base);
+
+    memset(&icmp, 0, sizeof(icmp));
+    icmp.name = "icmp";
+    icmp.id = 1;
+    memset(&dns, 0, sizeof(dns));
+    dns.name = "dns";
+    dns.id = 2;
+
+    /* with no limits every test starts straight away */
+    reset(base, 0, 0);
+    init_item(&a, &icmp, 60000);
+    init_item(&b, &icmp, 60000);
+    init_item(&c, &dns, 60000);
+    assert(dispatch_test(&a) == 1);
+    assert(dispatch_test(&b) == 1);
+    assert(dispatch_test(&c) == 1);
+    assert(started_count == 3);
+
+    /* only two tests at once, the third waits for one to finish */
+    reset(base, 2, 0);
+    assert(dispatch_test(&a) == 1);
+    assert(dispatch_test(&b) == 1);
+    assert(dispatch_test(&c) == 1);
+    assert(started_count == 2);
+    dispatch_child_exited(9999);
+    assert(started_count == 2);
+    dispatch_child_exited(1001);
+    assert(started_count == 3);
+    assert(started[2] == &c);
+
+    /* one icmp test at once, a queued icmp test doesn't block dns */
+    reset(base, 0, 0);
+    configure_test_dispatch(icmp.id, 1);
+    assert(dispatch_test(&a) == 1);
+    assert(dispatch_test(&b) == 1);
+    assert(dispatch_test(&c) == 1);
+    assert(started_count == 2);
+    assert(started[0] == &a && started[1] == &c);
+    /* a pooled worker finishing is counted the same as a child exiting */
+    dispatch_test_finished(icmp.id);
+    assert(started_count == 3);
+    assert(started[2] == &b);
+
+    /* tests due at the same time are spread out by the spacing */
+    reset(base, 0, 20);
+    init_item(&d, &dns, 60000);
+    assert(dispatch_test(&a) == 1);
+    assert(dispatch_test(&c) == 1);
+    assert(dispatch_test(&d) == 1);
+    assert(started_count == 1);
+    event_base_dispatch(base);
+    assert(started_count == 3);
+    for ( i = 1; i < started_count; i++ ) {
+        timersub(&started_at[i], &started_at[i-1], &gap);
+        assert(gap.tv_sec > 0 || gap.tv_usec >= 20000);
+    }
+
+    /* a test that can't start within its interval is skipped */
+    reset(base, 1, 0);
+    init_item(&a, &dns, 50);
+    init_item(&b, &dns, 50);
+    assert(dispatch_test(&a) == 1);
+    assert(dispatch_test(&b) == 1);
+    assert(started_count == 1);
+    event_base_dispatch(base);
+    assert(started_count == 1);
+    dispatch_child_exited(1001);
+    assert(started_count == 1);
+
+    /* clearing the queue throws away waiting tests */
+    reset(base, 1, 0);
+    init_item(&a, &dns, 60000);
+    init_item(&b, &dns, 60000);
+    assert(dispatch_test(&a) == 1);
+    assert(dispatch_test(&b) == 1);
+    clear_dispatch_queue();
+    dispatch_child_exited(1001);
+    assert(started_count == 1);
+
+    stop_dispatch();
+    event_base_free(base);
+
+    return 0;
+}
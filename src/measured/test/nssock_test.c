@@ -0,0 +1,218 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "nssock.h"
+#include "ampresolv.h"
+
+#define QTYPE_A 0x01
+
+
+
+/*
+ * Build an unbound result holding the given IPv4 addresses, allocated the
+ * same way unbound does so that it can be freed with ub_resolve_free().
+ */
+static struct ub_result *build_result(char *addrs[], int count, int ttl) {
+    struct ub_result *result = calloc(1, sizeof(struct ub_result));
+    int i;
+
+    result->data = calloc(count + 1, sizeof(char*));
+    result->len = calloc(count + 1, sizeof(int));
+
+    for ( i = 0; i < count; i++ ) {
+        result->data[i] = malloc(sizeof(struct in_addr));
+        result->len[i] = sizeof(struct in_addr);
+        assert(inet_pton(AF_INET, addrs[i], result->data[i]) == 1);
+    }
+
+    result->havedata = (count > 0);
+    result->ttl = ttl;
+
+    return result;
+}
+
+
+
+/*
+ * Check that failed queries only replace cached answers that have expired.
+ */
+static void test_query_failure(void) {
+    struct amp_resolver *resolver = calloc(1, sizeof(struct amp_resolver));
+    struct amp_resolver_entry *entry = calloc(1,
+            sizeof(struct amp_resolver_entry));
+    char *addrs[] = { "192.0.2.1", "192.0.2.2" };
+    struct in_addr expected;
+    struct timeval now;
+    time_t expires;
+
+    resolver->cache = 1;
+    entry->name = strdup("www.example.com");
+    entry->qtype = QTYPE_A;
+    entry->resolver = resolver;
+
+    /* a failure with nothing cached is remembered for a short while */
+    gettimeofday(&now, NULL);
+    entry->inflight = 1;
+    amp_test_resolver_query_callback(entry, 1, NULL);
+    assert(entry->count == 0);
+    assert(entry->addrs == NULL);
+    assert(entry->expires >= now.tv_sec + RESOLVER_NEGATIVE_TTL);
+    assert(!entry->inflight);
+
+    /* a successful answer replaces the negative one */
+    gettimeofday(&now, NULL);
+    entry->inflight = 1;
+    amp_test_resolver_query_callback(entry, 0, build_result(addrs, 2, 300));
+    assert(entry->count == 2);
+    assert(entry->addrlen == sizeof(struct in_addr));
+    assert(entry->expires >= now.tv_sec + 300);
+    inet_pton(AF_INET, "192.0.2.2", &expected);
+    assert(memcmp(entry->addrs + 4, &expected, sizeof(expected)) == 0);
+
+    /* a failed refresh keeps the answer that is still valid */
+    expires = entry->expires;
+    entry->inflight = 1;
+    amp_test_resolver_query_callback(entry, 1, NULL);
+    assert(entry->count == 2);
+    assert(entry->addrs != NULL);
+    assert(entry->expires == expires);
+    assert(memcmp(entry->addrs + 4, &expected, sizeof(expected)) == 0);
+
+    /* an empty answer also keeps the valid one */
+    entry->inflight = 1;
+    amp_test_resolver_query_callback(entry, 0, build_result(addrs, 0, 300));
+    assert(entry->count == 2);
+    assert(entry->expires == expires);
+
+    /* but once the old answer has expired the failure is cached instead */
+    gettimeofday(&now, NULL);
+    entry->expires = now.tv_sec - 1;
+    entry->inflight = 1;
+    amp_test_resolver_query_callback(entry, 1, NULL);
+    assert(entry->count == 0);
+    assert(entry->addrs == NULL);
+    assert(entry->expires >= now.tv_sec + RESOLVER_NEGATIVE_TTL);
+
+    free(entry->name);
+    free(entry);
+    free(resolver);
+}
+
+
+
+/*
+ * Check that replies packed by the resolver are unpacked by the test side
+ * into the same addresses and names.
+ */
+static void test_reply_round_trip(void) {
+    struct amp_resolver_conn *conn = calloc(1,
+            sizeof(struct amp_resolver_conn));
+    struct addrinfo *list, *item;
+    struct in_addr addr4;
+    struct in6_addr addr6;
+    int sockets[2];
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    conn->fd = sockets[0];
+
+    inet_pton(AF_INET, "192.0.2.1", &addr4);
+    inet_pton(AF_INET6, "2001:db8::1", &addr6);
+
+    amp_test_append_reply(conn, AF_INET, (uint8_t*)&addr4, sizeof(addr4),
+            "www.example.com");
+    amp_test_append_reply(conn, AF_INET6, (uint8_t*)&addr6, sizeof(addr6),
+            "www.example.com");
+    /* a name with no addresses still gets a record */
+    amp_test_append_reply(conn, AF_INET, NULL, 0, "missing.example.com");
+    /* a record with no family marks the end of the list */
+    amp_test_append_reply(conn, 0, NULL, 0, NULL);
+
+    assert(amp_test_send_reply(conn) == 1);
+
+    /* records are added to the front of the list as they are read */
+    list = amp_resolve_get_list(sockets[1]);
+
+    item = list;
+    assert(item != NULL);
+    assert(item->ai_family == AF_INET);
+    assert(item->ai_addr == NULL);
+    assert(strcmp(item->ai_canonname, "missing.example.com") == 0);
+
+    item = item->ai_next;
+    assert(item != NULL);
+    assert(item->ai_family == AF_INET6);
+    assert(item->ai_addrlen == sizeof(struct sockaddr_in6));
+    assert(memcmp(&((struct sockaddr_in6*)item->ai_addr)->sin6_addr, &addr6,
+                sizeof(addr6)) == 0);
+    assert(strcmp(item->ai_canonname, "www.example.com") == 0);
+
+    item = item->ai_next;
+    assert(item != NULL);
+    assert(item->ai_family == AF_INET);
+    assert(item->ai_addrlen == sizeof(struct sockaddr_in));
+    assert(memcmp(&((struct sockaddr_in*)item->ai_addr)->sin_addr, &addr4,
+                sizeof(addr4)) == 0);
+    assert(strcmp(item->ai_canonname, "www.example.com") == 0);
+
+    assert(item->ai_next == NULL);
+
+    amp_resolve_freeaddr(list);
+    close(sockets[0]);
+    free(conn->reply);
+    free(conn);
+}
+
+
+
+/*
+ * Test the resolver cache behaviour and the reply format sent to tests.
+ */
+int main(void) {
+    test_query_failure();
+    test_reply_round_trip();
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2018 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include "schedule_fixture.h"
+#include "modules.h"
+
+static test_t skeleton;
+static test_t *tests[2];
+
+
+
+/*
+ * Register a skeleton test that can have up to max_targets targets, and
+ * create an empty schedule directory and event base to load schedules into.
+ */
+void setup_schedule_fixture(struct schedule_fixture *fixture,
+        uint16_t max_targets) {
+
+    memset(&skeleton, 0, sizeof(skeleton));
+    skeleton.id = AMP_TEST_SKELETON;
+    skeleton.name = "skeleton";
+    skeleton.max_targets = max_targets;
+    skeleton.min_targets = 1;
+    tests[0] = &skeleton;
+    tests[1] = NULL;
+    amp_tests = tests;
+
+    memset(fixture, 0, sizeof(*fixture));
+    strcpy(fixture->dir, "/tmp/amp-schedule-test-XXXXXX");
+    assert(mkdtemp(fixture->dir) != NULL);
+    snprintf(fixture->filename, sizeof(fixture->filename), "%s/test.sched",
+            fixture->dir);
+
+    fixture->base = event_base_new();
+    assert(fixture->base);
+    fixture->meta.base = fixture->base;
+}
+
+
+
+/*
+ * Remove everything that was scheduled along with the schedule directory.
+ */
+void teardown_schedule_fixture(struct schedule_fixture *fixture) {
+    clear_test_schedule(fixture->base, 1);
+    event_base_free(fixture->base);
+
+    unlink(fixture->filename);
+    rmdir(fixture->dir);
+
+    amp_tests = NULL;
+}
@@ -0,0 +1,124 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2018 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <event2/event.h>
+#include "schedule.h"
+#include "run.h"
+#include "schedule_fixture.h"
+
+#define MERGE_TARGETS 5000
+#define OTHER_TARGETS 10
+#define MAX_TARGETS 1000
+
+struct merge_count {
+    int tests;
+    int targets;
+};
+
+
+
+/*
+ * Count the number of scheduled tests and the total number of targets.
+ */
+static int count_tests_callback(
+        __attribute__((unused))const struct event_base *base,
+        const struct event *ev, void *evdata) {
+
+    struct merge_count *count = (struct merge_count*)evdata;
+    schedule_item_t *item;
+
+    if ( event_get_callback(ev) != run_scheduled_test ) {
+        return 0;
+    }
+
+    item = event_get_callback_arg(ev);
+    count->tests++;
+    count->targets += item->data.test->dest_count +
+        item->data.test->resolve_count;
+
+    /* merged tests should never go over the test target limit */
+    assert(item->data.test->dest_count + item->data.test->resolve_count <=
+            MAX_TARGETS);
+
+    return 0;
+}
+
+
+
+/*
+ * Load a schedule with thousands of identical tests to different targets,
+ * and make sure they are merged into as few tests as the target limit
+ * allows, while tests with different arguments are kept separate.
+ */
+int main(void) {
+    struct schedule_fixture fixture;
+    struct merge_count count = {0, 0};
+    FILE *out;
+    int i;
+
+    setup_schedule_fixture(&fixture, MAX_TARGETS);
+
+    assert((out = fopen(fixture.filename, "w")) != NULL);
+
+    fprintf(out, "tests:\n");
+    for ( i = 0; i < MERGE_TARGETS; i++ ) {
+        fprintf(out, "  - test: skeleton\n    target: host%d.example.com\n"
+                "    frequency: 60\n    args: -a -b\n", i);
+    }
+    for ( i = 0; i < OTHER_TARGETS; i++ ) {
+        fprintf(out, "  - test: skeleton\n    target: other%d.example.com\n"
+                "    frequency: 60\n    args: -a -c\n", i);
+    }
+    fclose(out);
+
+    read_schedule_dir(fixture.base, fixture.dir, &fixture.meta);
+
+    event_base_foreach_event(fixture.base, count_tests_callback, &count);
+    assert(count.targets == MERGE_TARGETS + OTHER_TARGETS);
+    assert(count.tests == (MERGE_TARGETS / MAX_TARGETS) + 1);
+
+    teardown_schedule_fixture(&fixture);
+
+    return 0;
+}
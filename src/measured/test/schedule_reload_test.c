@@ -0,0 +1,153 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2018 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <event2/event.h>
+#include "schedule.h"
+#include "run.h"
+#include "schedule_fixture.h"
+
+struct find_target {
+    char *name;
+    schedule_item_t *item;
+};
+
+
+
+/*
+ * Find the scheduled test that has the given target name.
+ */
+static int find_target_callback(
+        __attribute__((unused))const struct event_base *base,
+        const struct event *ev, void *evdata) {
+
+    struct find_target *find = (struct find_target*)evdata;
+    schedule_item_t *item;
+
+    if ( event_get_callback(ev) != run_scheduled_test ) {
+        return 0;
+    }
+
+    item = event_get_callback_arg(ev);
+    if ( item->data.test->resolve != NULL &&
+            strcmp(item->data.test->resolve->name, find->name) == 0 ) {
+        find->item = item;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Write a schedule file with one test per target, each with a frequency.
+ */
+static void write_schedule(char *filename, char *targets[], int frequency[],
+        int count) {
+    FILE *out;
+    int i;
+
+    assert((out = fopen(filename, "w")) != NULL);
+    fprintf(out, "tests:\n");
+    for ( i = 0; i < count; i++ ) {
+        fprintf(out, "  - test: skeleton\n    target: %s\n"
+                "    frequency: %d\n", targets[i], frequency[i]);
+    }
+    fclose(out);
+}
+
+
+
+/*
+ * Load a schedule, then reload a modified version of it and make sure that
+ * only the tests that changed are replaced while the unchanged test keeps
+ * the same event.
+ */
+int main(void) {
+    char *before[] = {"host0.example.com", "host1.example.com",
+        "host2.example.com"};
+    int before_freq[] = {60, 60, 60};
+    char *after[] = {"host0.example.com", "host1.example.com",
+        "host3.example.com"};
+    int after_freq[] = {60, 120, 60};
+    struct schedule_fixture fixture;
+    struct event_base *staging;
+    struct schedule_index *current;
+    struct find_target find = {"host0.example.com", NULL};
+    schedule_item_t *unchanged;
+    schedule_diff_t diff;
+
+    setup_schedule_fixture(&fixture, 1);
+
+    write_schedule(fixture.filename, before, before_freq, 3);
+    read_schedule_dir(fixture.base, fixture.dir, &fixture.meta);
+
+    event_base_foreach_event(fixture.base, find_target_callback, &find);
+    assert(find.item != NULL);
+    unchanged = find.item;
+
+    /* host1 changes frequency, host2 is removed and host3 is added */
+    current = index_test_schedule(fixture.base);
+    write_schedule(fixture.filename, after, after_freq, 3);
+    staging = event_base_new();
+    read_schedule_dir(staging, fixture.dir, &fixture.meta);
+    update_test_schedule(fixture.base, staging, current, &diff);
+    event_base_free(staging);
+
+    assert(diff.kept == 1);
+    assert(diff.added == 2);
+    assert(diff.removed == 2);
+
+    /* the unchanged test should still be using the original event */
+    find.item = NULL;
+    event_base_foreach_event(fixture.base, find_target_callback, &find);
+    assert(find.item == unchanged);
+
+    find.name = "host2.example.com";
+    find.item = NULL;
+    event_base_foreach_event(fixture.base, find_target_callback, &find);
+    assert(find.item == NULL);
+
+    teardown_schedule_fixture(&fixture);
+
+    return 0;
+}
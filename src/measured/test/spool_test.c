@@ -0,0 +1,211 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "spool.h"
+
+#define RESULT_LEN 100000
+
+
+
+/*
+ * Spool a result where every byte is derived from the timestamp, so that
+ * results read back can be checked.
+ */
+static int spool_result(char *name, uint64_t timestamp) {
+    unsigned char data[RESULT_LEN];
+    int i;
+
+    for ( i = 0; i < RESULT_LEN; i++ ) {
+        data[i] = (timestamp + i) & 0xff;
+    }
+
+    return spool_report(name, timestamp, data, RESULT_LEN);
+}
+
+
+
+/*
+ * Check a result read back from the spool is intact.
+ */
+static void check_entry(struct amp_spool_entry *entry, char *name,
+        uint64_t timestamp) {
+    unsigned char *data = entry->data;
+    int i;
+
+    assert(strcmp(entry->name, name) == 0);
+    assert(entry->timestamp == timestamp);
+    assert(entry->len == RESULT_LEN);
+
+    for ( i = 0; i < RESULT_LEN; i++ ) {
+        assert(data[i] == ((timestamp + i) & 0xff));
+    }
+}
+
+
+
+/*
+ * Check that results are spooled and read back in order, that the oldest
+ * are dropped when the spool is full, that results persist when the spool
+ * is reopened, and that damaged results are discarded.
+ */
+int main(void) {
+    struct amp_spool_entry entries[16];
+    char path[] = "/tmp/amp-spool-test-XXXXXX";
+    uint64_t first, next;
+    uint32_t corrupt = 0xdeadbeef;
+    struct stat statbuf;
+    int fd, count, i;
+
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    /* with no size set the spool is disabled and won't take results */
+    configure_spool(0);
+    assert(open_spool(path) == 0);
+    assert(spool_result("icmp", 1) < 0);
+    assert(spooled_report_count() == 0);
+
+    /* 1MB spool holds 10 of these results */
+    configure_spool(1);
+    assert(open_spool(path) == 0);
+    assert(spooled_report_count() == 0);
+
+    /* the space for the whole spool is reserved on disk */
+    assert(stat(path, &statbuf) == 0);
+    assert((uint64_t)statbuf.st_blocks * 512 >=
+            AMP_SPOOL_DATA_OFFSET + 1024 * 1024);
+
+    for ( i = 0; i < 4; i++ ) {
+        assert(spool_result("icmp", i) == 0);
+    }
+    assert(spooled_report_count() == 4);
+
+    /* reading doesn't remove anything until the results are released */
+    count = read_spool(entries, 3);
+    assert(count == 3);
+    for ( i = 0; i < count; i++ ) {
+        check_entry(&entries[i], "icmp", i);
+    }
+    assert(spooled_report_count() == 4);
+    release_spool(entries[1].end);
+    free_spool_entries(entries, count);
+    assert(spooled_report_count() == 2);
+
+    count = read_spool(entries, 16);
+    assert(count == 2);
+    check_entry(&entries[0], "icmp", 2);
+    check_entry(&entries[1], "icmp", 3);
+    free_spool_entries(entries, count);
+
+    /* keep writing past the end, the oldest results should be dropped */
+    for ( i = 4; i < 30; i++ ) {
+        assert(spool_result("dns", i) == 0);
+    }
+
+    count = read_spool(entries, 16);
+    assert(count > 0 && (uint64_t)count == spooled_report_count());
+    first = entries[0].timestamp;
+    assert(first + count == 30);
+    for ( i = 0; i < count; i++ ) {
+        check_entry(&entries[i], "dns", first + i);
+    }
+
+    /* releasing after the oldest were dropped must not release too much */
+    next = entries[0].end;
+    free_spool_entries(entries, count);
+    assert(spool_result("dns", 30) == 0);
+    count = spooled_report_count();
+    release_spool(next);
+    assert(spooled_report_count() == (uint64_t)count);
+    assert(read_spool(entries, 16) == count);
+    assert(entries[0].timestamp > first);
+    for ( i = 0; i < count; i++ ) {
+        check_entry(&entries[i], "dns", 31 - count + i);
+    }
+    free_spool_entries(entries, count);
+
+    /* too big to ever fit in the spool */
+    assert(spool_report("dns", 31, entries, 2 * 1024 * 1024) < 0);
+
+    /* results are still there after reopening the spool */
+    count = spooled_report_count();
+    close_spool();
+    assert(open_spool(path) == 0);
+    assert(spooled_report_count() == (uint64_t)count);
+
+    /* damage the newest result, it (and only it) should be discarded */
+    count = read_spool(entries, 16);
+    next = entries[count - 1].end - SPOOL_RECORD_LEN(3, RESULT_LEN);
+    free_spool_entries(entries, count);
+    close_spool();
+
+    fd = open(path, O_WRONLY);
+    assert(fd >= 0);
+    assert(pwrite(fd, &corrupt, sizeof(corrupt), AMP_SPOOL_DATA_OFFSET +
+                (next % (1024 * 1024)) + sizeof(struct amp_spool_record) +
+                100) == sizeof(corrupt));
+    close(fd);
+
+    assert(open_spool(path) == 0);
+    assert(spooled_report_count() == (uint64_t)count - 1);
+    count = read_spool(entries, 16);
+    assert(entries[count - 1].timestamp == 29);
+    free_spool_entries(entries, count);
+
+    /* new results carry on after the damaged one was removed */
+    assert(spool_result("icmp", 40) == 0);
+    count = read_spool(entries, 16);
+    check_entry(&entries[count - 1], "icmp", 40);
+    release_spool(entries[count - 1].end);
+    free_spool_entries(entries, count);
+    assert(spooled_report_count() == 0);
+
+    close_spool();
+    unlink(path);
+
+    return 0;
+}
@@ -47,6 +47,8 @@
 #include <sys/time.h>
 
 #include "watchdog.h"
+#include "dispatch.h"
+#include "messaging.h"
 #include "debug.h"
 
 
@@ -160,6 +162,12 @@ void child_reaper(
 
         Log(LOG_DEBUG, "child terminated, pid: %d\n", infop.si_pid);
 
+        /* a running test has finished, a queued test might be able to start */
+        dispatch_child_exited(infop.si_pid);
+
+        /* the reporter should always be running, replace it if it stops */
+        reporting_child_exited(infop.si_pid);
+
         switch ( infop.si_code ) {
             case CLD_EXITED:
                 /* exited, status is the exit code */
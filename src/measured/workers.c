@@ -0,0 +1,496 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+
+#include "config.h"
+#include "workers.h"
+#include "dispatch.h"
+#include "run.h"
+#include "debug.h"
+#include "modules.h"
+#include "global.h"
+#include "testlib.h"
+#include "messaging.h"
+
+
+/*
+ * Pooled test workers are forked once and then run many tests of the same
+ * type, avoiding the cost of a fork (and the page faults as the copy-on-write
+ * memory is touched) for every test run. Each worker is still a separate
+ * process that is killed by the usual watchdog if a test runs too long, and
+ * a worker that crashes or is killed is simply replaced.
+ *
+ * Workers are given pointers to schedule items, which are only valid if the
+ * worker was forked after the schedule was loaded. Every time the schedule
+ * is reloaded the generation number is incremented and older workers are
+ * retired as soon as they are idle.
+ */
+static struct test_pool *pools = NULL;
+static uint32_t generation = 0;
+static struct event_base *pool_base = NULL;
+
+
+
+/*
+ * Find the pool that runs tests of the given type.
+ */
+static struct test_pool *get_test_pool(uint64_t test_id) {
+    struct test_pool *pool;
+
+    for ( pool = pools; pool != NULL; pool = pool->next ) {
+        if ( pool->test_id == test_id ) {
+            return pool;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Close our end of the socket to a worker, which will cause an idle worker
+ * to exit. The worker process itself is reaped by child_reaper().
+ */
+static void close_test_worker(struct test_worker *worker) {
+    assert(worker);
+
+    if ( worker->event ) {
+        event_free(worker->event);
+        worker->event = NULL;
+    }
+
+    if ( worker->fd >= 0 ) {
+        close(worker->fd);
+        worker->fd = -1;
+    }
+
+    worker->pid = 0;
+    worker->busy = 0;
+    worker->runs = 0;
+}
+
+
+
+/*
+ * Main loop of a worker process. Wait for a test to be sent from the parent,
+ * run it and then let the parent know it has finished. Exits when the parent
+ * closes the socket or the worker is sent a test from a different schedule.
+ */
+static void run_test_worker(int fd) {
+    struct test_worker_job job;
+    uint8_t done = 1;
+    ssize_t bytes;
+
+    while ( 1 ) {
+        if ( (bytes = recv(fd, &job, sizeof(job), 0)) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            Log(LOG_WARNING, "Failed to read job in test worker: %s",
+                    strerror(errno));
+            break;
+        }
+
+        /* parent has closed the socket, this worker has been retired */
+        if ( bytes == 0 ) {
+            break;
+        }
+
+        if ( bytes != sizeof(job) || job.item == NULL ) {
+            Log(LOG_WARNING, "Test worker received malformed job, exiting");
+            break;
+        }
+
+        /* the schedule item is only valid if it is from our generation */
+        if ( job.generation != generation ) {
+            Log(LOG_WARNING, "Test worker received job from generation %u, "
+                    "expected %u, exiting", job.generation, generation);
+            break;
+        }
+
+        /* tests parse their arguments with getopt, fully reset it each time */
+        optind = 0;
+
+        execute_test(job.item, NULL);
+
+        if ( send(fd, &done, sizeof(done), MSG_NOSIGNAL) < 0 ) {
+            break;
+        }
+    }
+
+    /* free the environment duped by set_proc_name() */
+    free_duped_environ();
+    close(fd);
+    exit(EXIT_SUCCESS);
+}
+
+
+
+/*
+ * A worker has finished running a test, or the socket was closed because
+ * the worker has exited (including being killed by the watchdog). Mark the
+ * worker as available or remove it from the pool as appropriate.
+ */
+static void test_worker_callback(evutil_socket_t evsock,
+        __attribute__((unused))short flags, void *evdata) {
+
+    struct test_pool *pool = (struct test_pool*)evdata;
+    struct test_worker *worker = NULL;
+    uint8_t done;
+    ssize_t bytes;
+    uint32_t i;
+    int busy;
+
+    for ( i = 0; i < pool->size; i++ ) {
+        if ( pool->workers[i].fd == evsock ) {
+            worker = &pool->workers[i];
+            break;
+        }
+    }
+
+    if ( worker == NULL ) {
+        Log(LOG_WARNING, "Event for unknown test worker on fd %d", evsock);
+        return;
+    }
+
+    if ( (bytes = recv(evsock, &done, sizeof(done), 0)) <= 0 ) {
+        if ( bytes < 0 && errno == EINTR ) {
+            return;
+        }
+        /* the test might have crashed, exited or been killed by watchdog */
+        Log(worker->busy ? LOG_WARNING : LOG_DEBUG,
+                "Test worker %d exited%s", worker->pid,
+                worker->busy ? " while running a test" : "");
+        busy = worker->busy;
+        close_test_worker(worker);
+        /* the test it was running is over, let any waiting tests start */
+        if ( busy ) {
+            dispatch_test_finished(pool->test_id);
+        }
+        return;
+    }
+
+    worker->busy = 0;
+
+    /* retire workers that are too old, or forked with an old schedule */
+    if ( worker->runs >= pool->max_runs || worker->generation != generation ) {
+        Log(LOG_DEBUG, "Retiring test worker %d after %u runs", worker->pid,
+                worker->runs);
+        close_test_worker(worker);
+    }
+
+    /* let any tests waiting for this one to finish start */
+    dispatch_test_finished(pool->test_id);
+}
+
+
+
+/*
+ * Fork a new worker process for a pool, it will wait for tests to be sent
+ * to it by dispatch_to_test_worker().
+ */
+static int spawn_test_worker(struct test_pool *pool,
+        struct test_worker *worker) {
+
+    struct test_pool *other;
+    test_t *test;
+    int sv[2];
+    pid_t pid;
+    uint32_t i;
+
+    assert(pool);
+    assert(worker);
+    assert(pool_base);
+
+    if ( (test = get_test_by_id(pool->test_id)) == NULL ) {
+        return -1;
+    }
+
+    if ( socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0 ) {
+        Log(LOG_WARNING, "Failed to create test worker socket: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    if ( (pid = fork()) < 0 ) {
+        Log(LOG_WARNING, "Failed to fork test worker: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    } else if ( pid == 0 ) {
+        close(sv[0]);
+
+        /* close the sockets to every other worker, they belong to measured */
+        for ( other = pools; other != NULL; other = other->next ) {
+            for ( i = 0; i < other->size; i++ ) {
+                if ( other->workers[i].fd >= 0 ) {
+                    close(other->workers[i].fd);
+                }
+            }
+        }
+
+        /* same as fork_test(), tidy up everything belonging to the parent */
+        close(vars.asnsock_fd);
+        close(vars.nssock_fd);
+        close(vars.reportsock_fd);
+
+        forget_broker_connection();
+
+        if ( unblock_signals() < 0 ) {
+            Log(LOG_WARNING, "Failed to unblock signals, aborting");
+            exit(EXIT_FAILURE);
+        }
+
+        /*
+         * Free the event base but leave the schedule intact, the worker
+         * needs the schedule items that it will be given to run.
+         */
+        event_base_free(pool_base);
+
+        set_proc_name(test->name);
+        run_test_worker(sv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    close(sv[1]);
+
+    worker->pid = pid;
+    worker->fd = sv[0];
+    worker->busy = 0;
+    worker->runs = 0;
+    worker->generation = generation;
+    worker->event = event_new(pool_base, worker->fd, EV_READ|EV_PERSIST,
+            test_worker_callback, pool);
+    event_add(worker->event, NULL);
+
+    Log(LOG_DEBUG, "Started %s test worker %d", test->name, pid);
+
+    return 0;
+}
+
+
+
+/*
+ * Set the number of workers that should be kept to run tests of the given
+ * type, and how many tests each should run before being replaced. Only
+ * tests that don't keep state between runs can use workers.
+ */
+int configure_test_workers(uint64_t test_id, uint32_t size, uint32_t max_runs){
+    struct test_pool *pool;
+    test_t *test;
+    uint32_t i;
+
+    if ( size == 0 ) {
+        return 0;
+    }
+
+    if ( (test = get_test_by_id(test_id)) == NULL || !test->reentrant ) {
+        Log(LOG_WARNING, "Test %s can't be run by workers, ignoring",
+                test ? test->name : "unknown");
+        return -1;
+    }
+
+    if ( get_test_pool(test_id) != NULL ) {
+        Log(LOG_WARNING, "Duplicate worker configuration for test %" PRIu64,
+                test_id);
+        return -1;
+    }
+
+    if ( size > MAX_TEST_WORKERS ) {
+        Log(LOG_WARNING, "Limiting test %" PRIu64 " to %d workers", test_id,
+                MAX_TEST_WORKERS);
+        size = MAX_TEST_WORKERS;
+    }
+
+    pool = calloc(1, sizeof(struct test_pool));
+    pool->test_id = test_id;
+    pool->size = size;
+    pool->max_runs = (max_runs > 0) ? max_runs : DEFAULT_TEST_WORKER_RUNS;
+    pool->workers = calloc(size, sizeof(struct test_worker));
+
+    for ( i = 0; i < size; i++ ) {
+        pool->workers[i].fd = -1;
+    }
+
+    pool->next = pools;
+    pools = pool;
+
+    return 0;
+}
+
+
+
+/*
+ * Fill every empty slot in every pool with a new worker. Should be called
+ * after the schedule has been loaded, so that the workers get a copy of it.
+ */
+void start_test_workers(struct event_base *base) {
+    struct test_pool *pool;
+    uint32_t i;
+
+    pool_base = base;
+
+    for ( pool = pools; pool != NULL; pool = pool->next ) {
+        for ( i = 0; i < pool->size; i++ ) {
+            if ( pool->workers[i].fd < 0 &&
+                    spawn_test_worker(pool, &pool->workers[i]) < 0 ) {
+                break;
+            }
+        }
+    }
+}
+
+
+
+/*
+ * The schedule is about to be replaced, so any existing workers have stale
+ * schedule items. Close the idle ones now, busy ones will be closed when
+ * their current test completes.
+ */
+void retire_test_workers(void) {
+    struct test_pool *pool;
+    uint32_t i;
+
+    generation++;
+
+    for ( pool = pools; pool != NULL; pool = pool->next ) {
+        for ( i = 0; i < pool->size; i++ ) {
+            if ( pool->workers[i].fd >= 0 && !pool->workers[i].busy ) {
+                close_test_worker(&pool->workers[i]);
+            }
+        }
+    }
+}
+
+
+
+/*
+ * Close all the workers and free the pools, used when measured is exiting.
+ */
+void stop_test_workers(void) {
+    struct test_pool *pool;
+    uint32_t i;
+
+    while ( pools != NULL ) {
+        pool = pools;
+        pools = pools->next;
+
+        for ( i = 0; i < pool->size; i++ ) {
+            close_test_worker(&pool->workers[i]);
+        }
+
+        free(pool->workers);
+        free(pool);
+    }
+}
+
+
+
+/*
+ * Send a test to an idle worker in the pool for that test type, starting a
+ * new worker if there is space in the pool. Returns 1 if the test was given
+ * to a worker, 0 if the caller should fork a new process to run the test.
+ */
+int dispatch_to_test_worker(const test_schedule_item_t *item) {
+    struct test_pool *pool;
+    struct test_worker *worker = NULL;
+    struct test_worker_job job;
+    uint32_t i;
+
+    assert(item);
+    assert(item->test);
+
+    if ( pool_base == NULL || (pool = get_test_pool(item->test->id)) == NULL ) {
+        return 0;
+    }
+
+    /* prefer an idle worker that already exists */
+    for ( i = 0; i < pool->size; i++ ) {
+        if ( pool->workers[i].fd >= 0 && !pool->workers[i].busy &&
+                pool->workers[i].generation == generation ) {
+            worker = &pool->workers[i];
+            break;
+        }
+    }
+
+    /* otherwise replace one that has exited or been retired */
+    if ( worker == NULL ) {
+        for ( i = 0; i < pool->size; i++ ) {
+            if ( pool->workers[i].fd < 0 ) {
+                if ( spawn_test_worker(pool, &pool->workers[i]) == 0 ) {
+                    worker = &pool->workers[i];
+                }
+                break;
+            }
+        }
+    }
+
+    if ( worker == NULL ) {
+        Log(LOG_DEBUG, "No idle %s test worker, forking a new process",
+                item->test->name);
+        return 0;
+    }
+
+    job.item = item;
+    job.generation = generation;
+
+    if ( send(worker->fd, &job, sizeof(job), MSG_NOSIGNAL) < 0 ) {
+        Log(LOG_WARNING, "Failed to send test to worker %d: %s", worker->pid,
+                strerror(errno));
+        close_test_worker(worker);
+        return 0;
+    }
+
+    worker->busy = 1;
+    worker->runs++;
+
+    return 1;
+}
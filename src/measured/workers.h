@@ -0,0 +1,98 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_WORKERS_H
+#define _MEASURED_WORKERS_H
+
+#include <stdint.h>
+#include <event2/event.h>
+
+#include "schedule.h"
+
+/* pooled workers are disabled unless configured for a test */
+#define DEFAULT_TEST_WORKERS 0
+
+/* number of tests a worker will run before being replaced with a new one */
+#define DEFAULT_TEST_WORKER_RUNS 100
+
+/* upper limit on the number of workers for a single test */
+#define MAX_TEST_WORKERS 64
+
+/*
+ * A single pre-forked worker process that runs tests of one type. The parent
+ * keeps one end of a socketpair to hand it tests and to learn when it has
+ * finished (or died).
+ */
+struct test_worker {
+    pid_t pid;                  /* process id of the worker */
+    int fd;                     /* parent end of the socketpair, -1 if empty */
+    int busy;                   /* true while the worker is running a test */
+    uint32_t runs;              /* number of tests started by this worker */
+    uint32_t generation;        /* schedule generation the worker forked in */
+    struct event *event;        /* fires when the worker replies or dies */
+};
+
+/*
+ * All the workers that are configured to run a single type of test.
+ */
+struct test_pool {
+    uint64_t test_id;           /* id of the test this pool runs */
+    uint32_t size;              /* maximum number of workers */
+    uint32_t max_runs;          /* tests to run before recycling a worker */
+    struct test_worker *workers;
+    struct test_pool *next;
+};
+
+/*
+ * The message sent to a worker to run a test. The schedule item pointer is
+ * valid in the worker as long as the schedule hasn't been reloaded since the
+ * worker was forked, which is checked using the generation number.
+ */
+struct test_worker_job {
+    const test_schedule_item_t *item;
+    uint32_t generation;
+};
+
+int configure_test_workers(uint64_t test_id, uint32_t size, uint32_t max_runs);
+void start_test_workers(struct event_base *base);
+void retire_test_workers(void);
+void stop_test_workers(void);
+int dispatch_to_test_worker(const test_schedule_item_t *item);
+
+#endif
@@ -129,16 +129,27 @@ static void halt_test(
  * represented in two bytes (magic number + offset) describing a previously
  * used label rather than having to write it out in full.
  * See section 4.1.4 of http://www.ietf.org/rfc/rfc1035.txt
+ *
+ * Every byte read is checked against the end of the packet, and compression
+ * pointers must always point further back than the last one followed so
+ * that a malicious packet can't send us around in circles. Returns a
+ * pointer to the byte after the name, or NULL if the name is malformed.
  */
-static char *decode(char *result, char *data, char *start) {
+static char *decode(char *result, char *data, char *start, char *end) {
     int index = 0;
     uint8_t length;
     char *current = NULL;
+    char *limit = start;
 
     assert(data);
     assert(start);
+    assert(end);
 
     do {
+	if ( start < data || start >= end ) {
+	    return NULL;
+	}
+
 	/* rdata length is the first byte */
 	length = (uint8_t)*start;
 
@@ -149,26 +160,52 @@ static char *decode(char *result, char *data, char *start) {
 	 * possible, so we can't just carry on here, have to keep checking.
 	 */
 	if ( (length & 0xc0) == 0xc0 ) {
+	    char *target;
+
+	    if ( start + 1 >= end ) {
+		return NULL;
+	    }
+
+	    /* offset is 14 bits wide, ignore the first 2 that are set */
+	    target = data + ( (length & 0x3f) << 8 | ((uint8_t)*(start+1)) );
+
+	    /* only ever jump backwards, or we might never finish */
+	    if ( target >= limit ) {
+		return NULL;
+	    }
+
 	    /* if going back into the packet, save where we are up to */
 	    if ( current == NULL ) {
 		current = start + 2; /* skip the 2 bytes of compression data */
 	    }
-	    /* offset is 14 bits wide, ignore the first 2 that are set */
-	    start = data + ( ((*start) & 0x3f) << 8 | ((*(start+1)) & 0xff) );
+
+	    start = limit = target;
 	    continue;
 	}
 
+	/* the other label types (0x40, 0x80) are obsolete or reserved */
+	if ( length & 0xc0 ) {
+	    return NULL;
+	}
+
 	/* found a normally encoded length-value pair, add to the full name */
 	if ( length > 0 ) {
-	    /* save the name if space has been allocated for it */
-	    if ( result != NULL ) {
-		/* name parts should have dots between them */
-		if ( index > 0 ) {
+	    if ( end - start <= length ||
+		    index + (index > 0) + length >= MAX_DNS_NAME_LEN ) {
+		return NULL;
+	    }
+
+	    /* name parts should have dots between them */
+	    if ( index > 0 ) {
+		if ( result != NULL ) {
 		    result[index] = '.';
-		    index++;
 		}
-		/* append the newest name part */
-		strncpy(result+index, (char*)(start+1), length);
+		index++;
+	    }
+
+	    /* save the name if space has been allocated for it */
+	    if ( result != NULL ) {
+		memcpy(result+index, start+1, length);
 	    }
 	    index += length;
 	    start += length + 1;
@@ -238,34 +275,144 @@ static char *encode(char *query) {
 
 /*
  * Decode an OPT resource record. Currently the only one that we look for
- * is the NSID OPT RR.
+ * is the NSID OPT RR. Returns -1 if the options overrun the record.
  */
-static void process_opt_rr(void *rr, uint16_t rrlen, struct info_t *info) {
+static int process_opt_rr(void *rr, uint16_t rrlen, struct info_t *info) {
     char *option = rr;
-    struct dns_opt_rdata_t *rdata;
+    struct dns_opt_rdata_t rdata;
+    uint16_t length;
 
     /* check every option record for ones that we understand */
-    do {
-        rdata = (struct dns_opt_rdata_t*)option;
-        switch ( ntohs(rdata->code) ) {
+    while ( rrlen >= sizeof(struct dns_opt_rdata_t) ) {
+        /* options aren't aligned, so copy the header out */
+        memcpy(&rdata, option, sizeof(struct dns_opt_rdata_t));
+        option += sizeof(struct dns_opt_rdata_t);
+        rrlen -= sizeof(struct dns_opt_rdata_t);
+        length = ntohs(rdata.length);
+
+        if ( length > rrlen ) {
+            Log(LOG_DEBUG, "OPT RR option length %d exceeds record", length);
+            return -1;
+        }
+
+        switch ( ntohs(rdata.code) ) {
             case 3: /* NSID */
-                info->nsid_length = ntohs(rdata->length);
+                /* only keep the first one, this is what gets reported */
+                if ( info->nsid_payload != NULL || length == 0 ) {
+                    break;
+                }
+                info->nsid_length = length;
                 info->nsid_payload = malloc(info->nsid_length);
                 Log(LOG_DEBUG, "Got NSID response of length %d",
                         info->nsid_length);
-                memcpy(info->nsid_payload,
-                        option + sizeof(struct dns_opt_rdata_t),
-                        info->nsid_length);
+                memcpy(info->nsid_payload, option, info->nsid_length);
                 break;
             default: break;
         };
 
-        option += ntohs(rdata->length) + sizeof(struct dns_opt_rdata_t);
-        rrlen -= sizeof(struct dns_opt_rdata_t);
-        rrlen -= ntohs(rdata->length);
+        option += length;
+        rrlen -= length;
+    }
 
-    } while ( rrlen > 0 );
-    assert(rrlen == 0);
+    return (rrlen == 0) ? 0 : -1;
+}
+
+
+
+/*
+ * Walk the question and resource records in a response in a single pass,
+ * recording anything that we report on. No memory is allocated (beyond
+ * saving the NSID) and every record is checked to fit inside the packet.
+ * Returns the number of bytes used by the response, or -1 if it is
+ * malformed.
+ */
+static int process_records(char *packet, uint32_t bytes,
+        struct info_t *info) {
+
+    struct dns_t *header;
+    struct dns_opt_rr_t rr_data;
+    char name[MAX_DNS_NAME_LEN];
+    char *result;
+    char *rr_start;
+    char *end;
+    uint16_t rdlen;
+    int response_count;
+    int i;
+
+    if ( bytes < sizeof(struct dns_t) ) {
+        return -1;
+    }
+
+    header = (struct dns_t *)packet;
+    end = packet + bytes;
+    rr_start = packet + sizeof(struct dns_t);
+
+    /* the names are only needed to print, don't decode them otherwise */
+    result = (log_level >= LOG_DEBUG) ? name : NULL;
+
+    response_count = ntohs(header->an_count) + ntohs(header->ns_count) +
+        ntohs(header->ar_count);
+
+    /* skip over all the question RRs, we aren't really interested */
+    for ( i=0; i<ntohs(header->qd_count); i++ ) {
+        rr_start = decode(NULL, packet, rr_start, end);
+        if ( rr_start == NULL ||
+                end - rr_start < (int)sizeof(struct dns_query_t) ) {
+            Log(LOG_DEBUG, "Truncated question RR %d/%d", i+1,
+                    ntohs(header->qd_count));
+            return -1;
+        }
+        rr_start += sizeof(struct dns_query_t);
+    }
+
+    for ( i=0; i<response_count; i++ ) {
+        /* decode will update rr_start to the next byte after the name */
+        rr_start = decode(result, packet, rr_start, end);
+        if ( rr_start == NULL ||
+                end - rr_start < (int)sizeof(struct dns_opt_rr_t) ) {
+            Log(LOG_DEBUG, "Truncated RR %d/%d", i+1, response_count);
+            return -1;
+        }
+
+        /* the fixed part of the RR is unaligned, so copy it out */
+        memcpy(&rr_data, rr_start, sizeof(struct dns_opt_rr_t));
+        rr_start += sizeof(struct dns_opt_rr_t);
+        rdlen = ntohs(rr_data.rdlen);
+
+        if ( end - rr_start < rdlen ) {
+            Log(LOG_DEBUG, "RR %d/%d rdata length %d exceeds packet", i+1,
+                    response_count, rdlen);
+            return -1;
+        }
+
+        if ( result != NULL ) {
+            Log(LOG_DEBUG, "RR: '%s' type=0x%.2x class=0x%.2x rdlen=%d\n",
+                    name, ntohs(rr_data.type), ntohs(rr_data.payload), rdlen);
+        }
+
+        /* deal with any record types that we are interested in */
+        switch ( ntohs(rr_data.type) ) {
+            case 41: /* OPT RR */
+                /* ensure there is enough data for a RR to be present */
+                if ( rdlen >= sizeof(struct dns_opt_rdata_t) &&
+                        process_opt_rr(rr_start, rdlen, info) < 0 ) {
+                    return -1;
+                }
+                break;
+
+            case 46: /* RRSIG */
+                info->rrsig = 1;
+                break;
+
+            default:
+                break;
+        };
+
+        /* carry on to the next RR */
+        rr_start += rdlen;
+    }
+
+    return rr_start - packet;
 }
 
 
@@ -273,37 +420,43 @@ static void process_opt_rr(void *rr, uint16_t rrlen, struct info_t *info) {
 /*
  * Process a received DNS packet to make sure it is a proper response to our
  * query, and if so, record details on the response.
- *
- * TODO what if the packet isn't long enough for the amount of data that it
- * claims to have?
  */
 static void process_packet(struct dnsglobals_t *globals, char *packet,
-        __attribute__((unused))uint32_t bytes, struct timeval *now) {
+        uint32_t bytes, struct timeval *now) {
 
     struct dns_t *header;
     uint16_t recv_ident;
     int index;
-    char *rr_start = NULL;
-    struct dns_opt_rr_t *rr_data;
-    char *name;
-    int i;
+    int length;
     int response_count;
     struct info_t *info;
     int64_t delay;
 
     info = globals->info;
 
+    if ( bytes < sizeof(struct dns_t) ) {
+        Log(LOG_DEBUG, "Incoming DNS packet too short for header");
+        return;
+    }
+
     header = (struct dns_t *)packet;
     recv_ident = ntohs(header->id);
 
     /* make sure the id field in this packet matches our request */
     if ( recv_ident < globals->ident ||
-            (recv_ident - globals->ident) > globals->count ) {
+            (recv_ident - globals->ident) >= globals->count ) {
 	Log(LOG_DEBUG, "Incoming DNS packet with invalid ID number");
 	return;
     }
 
     index = recv_ident - globals->ident;
+
+    /* only the first response to each query is counted */
+    if ( info[index].reply ) {
+        Log(LOG_DEBUG, "Ignoring duplicate DNS response to query %d", index);
+        return;
+    }
+
     info[index].reply = 1;
     info[index].flags.bytes = header->flags.bytes;
     info[index].total_answer = ntohs(header->an_count);
@@ -312,8 +465,8 @@ static void process_packet(struct dnsglobals_t *globals, char *packet,
     info[index].response_code = RESPONSEOK;
     /* info[index].ttl = */
 
-    response_count = ntohs(header->an_count + header->ns_count +
-	    header->ar_count);
+    response_count = info[index].total_answer + info[index].total_authority +
+        info[index].total_additional;
 
     /* check it for errors */
     if ( ! header->flags.fields.qr ) {
@@ -333,70 +486,21 @@ static void process_packet(struct dnsglobals_t *globals, char *packet,
     /* if it's a response to our query then check its contents */
     if ( info[index].response_code == RESPONSEOK ||
             info[index].response_code == NOTFOUND ) {
-
-	rr_start = packet + sizeof(struct dns_t);
-
-	/* skip over all the question RRs, we aren't really interested */
-	for ( i=0; i<ntohs(header->qd_count); i++ ) {
-	    Log(LOG_DEBUG, "Skipping question RR %d/%d\n", i+1,
-		    ntohs(header->qd_count));
-	    rr_start = decode(NULL, packet, rr_start);
-	    rr_start += sizeof(struct dns_query_t);
-	}
-
-	for ( i=0; i<response_count; i++ ) {
-
-	    name = malloc(MAX_DNS_NAME_LEN * sizeof(char));
-
-	    /* decode will update rr_start to the next byte after the name */
-	    rr_start = decode(name, packet, rr_start);
-	    rr_data = (struct dns_opt_rr_t *)rr_start;
-
-	    Log(LOG_DEBUG, "RR: '%s' type=0x%.2x class=0x%.2x rdlen=%d\n",
-		    name, htons(rr_data->type), htons(rr_data->payload),
-		    htons(rr_data->rdlen));
-
-	    /* deal with any record types that we are interested in */
-	    switch ( ntohs(rr_data->type) ) {
-		case 1: /* A record, nothing to do? */
-		    break;
-
-		case 28: /* AAAA record, nothing to do? */
-		    break;
-
-		case 41: /* OPT RR */
-		    /* ensure there is enough data for a RR to be present */
-		    if ( ntohs(rr_data->rdlen) >=
-			    sizeof(struct dns_opt_rdata_t) ) {
-			/* skip fixed part of RR header to variable rdata */
-			process_opt_rr((void*)(rr_data + 1),
-                                ntohs(rr_data->rdlen), &info[index]);
-		    }
-		    break;
-
-		case 46: /* RRSIG */
-		    info[index].rrsig = 1;
-		    break;
-
-		default:
-		    break;
-	    };
-
-	    /* carry on to the next RR */
-	    rr_start += sizeof(struct dns_opt_rr_t);
-	    rr_start += ntohs(rr_data->rdlen);
-	    free(name);
-	}
-    }
-
-    /*
-     * This catches the case where the response is invalid. Is this the sort
-     * of behaviour we want here, or should we still investigate the packet?
-     */
-    if ( rr_start == NULL ) {
-        info[index].bytes = 0;
+        length = process_records(packet, bytes, &info[index]);
+        if ( length < 0 ) {
+            Log(LOG_DEBUG, "Malformed DNS response to query %d", index);
+            info[index].response_code = INVALID;
+            info[index].bytes = bytes;
+        } else {
+            info[index].bytes = length;
+        }
     } else {
-        info[index].bytes = rr_start - packet;
+        /*
+         * This catches the case where the response is invalid. Is this the
+         * sort of behaviour we want here, or should we still investigate
+         * the packet?
+         */
+        info[index].bytes = 0;
     }
 
     delay = DIFF_TV_US(*now, info[index].time_sent);
@@ -417,31 +521,23 @@ static void process_packet(struct dnsglobals_t *globals, char *packet,
 static void receive_probe_callback(evutil_socket_t evsock,
         short flags, void *evdata) {
 
-    char *packet;
-    int buflen;
-    ssize_t bytes;
-    int wait;
-    struct timeval now;
-    struct socket_t sockets;
+    struct packet_t *packet;
     struct dnsglobals_t *globals = (struct dnsglobals_t*)evdata;
+    int i;
 
     assert(evsock > 0);
     assert(flags == EV_READ);
 
-    if ( globals->options.udp_payload_size > 0 ) {
-        buflen = globals->options.udp_payload_size;
-    } else {
-        buflen = DEFAULT_UDP_PAYLOAD_SIZE;
-    }
-
-    wait = 0;
-    sockets.socket = evsock;
-    sockets.socket6 = -1;
+    /* make sure sent times are as accurate as possible before using them */
+    harvest_tx_timestamps(globals->queue);
+    harvest_tx_timestamps(globals->queue6);
 
-    packet = calloc(1, buflen);
+    /* read every response that has arrived so far, not just the first */
+    get_packet_batch(evsock, globals->batch);
 
-    if ( (bytes=get_packet(&sockets, packet, buflen, NULL, &wait, &now)) > 0 ) {
-        process_packet(globals, packet, bytes, &now);
+    for ( i = 0; i < globals->batch->count; i++ ) {
+        packet = &globals->batch->packets[i];
+        process_packet(globals, packet->data, packet->length, &packet->time);
     }
 
     if ( globals->outstanding == 0 && globals->index == globals->count ) {
@@ -449,8 +545,6 @@ static void receive_probe_callback(evutil_socket_t evsock,
         Log(LOG_DEBUG, "All expected DNS responses received");
         event_base_loopbreak(globals->base);
     }
-
-    free(packet);
 }
 
 
@@ -554,8 +648,7 @@ static void send_packet(
         __attribute__((unused))short flags,
         void *evdata) {
 
-    int sock;
-    int delay;
+    struct send_queue_t *queue;
     char *qbuf;
     int seq;
     uint16_t ident;
@@ -589,11 +682,11 @@ static void send_packet(
     /* determine the appropriate socket to use and port field to set */
     switch ( dest->ai_family ) {
 	case AF_INET:
-	    sock = globals->sockets.socket;
+	    queue = globals->queue;
 	    ((struct sockaddr_in*)dest->ai_addr)->sin_port = htons(53);
 	    break;
 	case AF_INET6:
-	    sock = globals->sockets.socket6;
+	    queue = globals->queue6;
 	    ((struct sockaddr_in6*)dest->ai_addr)->sin6_port = htons(53);
 	    break;
 	default:
@@ -601,7 +694,7 @@ static void send_packet(
 	    goto next;
     };
 
-    if ( sock < 0 ) {
+    if ( queue == NULL ) {
 	Log(LOG_WARNING, "Unable to test to %s, socket wasn't opened",
                 dest->ai_canonname);
 	goto next;
@@ -610,13 +703,9 @@ static void send_packet(
     //XXX pass in buffer, return useful length like icmp test?
     qbuf = create_dns_query(seq + ident, &(info[seq].query_length), opt);
 
-    while ( (delay = delay_send_packet(sock, qbuf, info[seq].query_length,
-                    dest, opt->inter_packet_delay,
-                    &(info[seq].time_sent))) > 0 ) {
-        usleep(delay);
-    }
-
-    if ( delay < 0 ) {
+    if ( queue_packet(queue, qbuf, info[seq].query_length, dest,
+                &(info[seq].time_sent)) < 0 ||
+            flush_send_queue(queue) < 1 ) {
         /* mark this as done if the packet failed to send properly */
         info[seq].reply = 1;
         memset(&(info[seq].time_sent), 0, sizeof(struct timeval));
@@ -1208,6 +1297,22 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
     globals->info = (struct info_t *)malloc(sizeof(struct info_t) * count);
     memset(globals->info, 0, sizeof(struct info_t) * count);
 
+    /* allocate space to receive multiple responses at once */
+    globals->batch = new_packet_batch(PACKET_BATCH_SIZE,
+            options->udp_payload_size > 0 ?
+            options->udp_payload_size : DEFAULT_UDP_PAYLOAD_SIZE);
+
+    /* pace queries on each socket independently of the other */
+    globals->queue = globals->queue6 = NULL;
+    if ( globals->sockets.socket > 0 ) {
+        globals->queue = new_send_queue(globals->sockets.socket, 1,
+                MAX_DNS_QUERY_LEN, options->inter_packet_delay, 0);
+    }
+    if ( globals->sockets.socket6 > 0 ) {
+        globals->queue6 = new_send_queue(globals->sockets.socket6, 1,
+                MAX_DNS_QUERY_LEN, options->inter_packet_delay, 0);
+    }
+
     globals->index = 0;
     globals->outstanding = 0;
     globals->count = count;
@@ -1279,6 +1384,9 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
     result = report_results(&start_time, count, globals->info, options);
 
     free(options->query_string);
+    free_send_queue(globals->queue);
+    free_send_queue(globals->queue6);
+    free_packet_batch(globals->batch);
     free(globals->info);
     free(globals);
 
@@ -1451,6 +1559,9 @@ test_t *register_test() {
     /* don't give the DNS test a SIGINT warning, it should not take long! */
     new_test->sigint = 0;
 
+    /* no state is kept between runs, so it can run in a pooled worker */
+    new_test->reentrant = 1;
+
     return new_test;
 }
 
@@ -1461,8 +1572,19 @@ char *amp_test_dns_encode(char *query) {
     return encode(query);
 }
 
-char *amp_test_dns_decode(char *result, char *data, char *start) {
-    return decode(result, data, start);
+char *amp_test_dns_decode(char *result, char *data, char *start,
+        char *end) {
+    return decode(result, data, start, end);
+}
+
+int amp_test_dns_process_records(char *packet, uint32_t bytes,
+        struct info_t *info) {
+    return process_records(packet, bytes, info);
+}
+
+int amp_test_dns_process_opt_rr(void *rr, uint16_t rrlen,
+        struct info_t *info) {
+    return process_opt_rr(rr, rrlen, info);
 }
 
 amp_test_result_t* amp_test_report_results(struct timeval *start_time,
@@ -55,6 +55,9 @@
 /* maximum size in bytes of a DNS name */
 #define MAX_DNS_NAME_LEN 255
 
+/* largest query we will build, always fits in the minimum payload size */
+#define MAX_DNS_QUERY_LEN MIN_UDP_PAYLOAD_SIZE
+
 /* Apparently BIND has a limit of 256 characters per line in /etc/resolv.conf */
 #define MAX_RESOLV_CONF_LINE 256
 
@@ -209,6 +212,9 @@ struct dnsglobals_t {
     struct socket_t sockets;
     struct addrinfo **dests;
     struct info_t *info;
+    struct packet_batch_t *batch;
+    struct send_queue_t *queue;
+    struct send_queue_t *queue6;
     uint16_t ident;
     int index;
     int count;
@@ -228,7 +234,12 @@ test_t *register_test(void);
 
 #if UNIT_TEST
 char *amp_test_dns_encode(char *query);
-char *amp_test_dns_decode(char *result, char *data, char *start);
+char *amp_test_dns_decode(char *result, char *data, char *start,
+        char *end);
+int amp_test_dns_process_records(char *packet, uint32_t bytes,
+        struct info_t *info);
+int amp_test_dns_process_opt_rr(void *rr, uint16_t rrlen,
+        struct info_t *info);
 amp_test_result_t* amp_test_report_results(struct timeval *start_time,
         int count, struct info_t info[], struct opt_t *opt);
 #endif
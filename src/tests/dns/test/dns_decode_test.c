@@ -84,6 +84,29 @@ int main(void) {
     /* if compression is used, offset to the start of the name we want */
     int offsets[] = { 0, 0, 0, 0, 0, 0, 0, 17, 24};
 
+    /* length of the encoded data, up to the end of the name we want */
+    int lengths[] = { 17, 25, 27, 17, 21, 25, 40, 23, 30};
+
+    /*
+     * Malformed names that should be rejected: truncated labels, pointers
+     * that go forwards or loop, truncated pointers, reserved label types
+     * and names that are too long once decoded.
+     */
+    char *invalid[] = {
+        "\x03www\x07""example\x03org",
+        "\x03www\xc0\x00",
+        "\x03www\xc0\x04\x00",
+        "\x03www\x00\x03""foo\xc0\x06",
+        "\x03www\x00\x03""foo\xc0\x40",
+        "\x03www\xc0\x06\xc0\x00",
+        "\x03www\x40\x00",
+        "\xc0",
+        NULL,
+    };
+    int invalid_offsets[] = { 0, 0, 0, 5, 5, 6, 0, 0, 0};
+    int invalid_lengths[] = { 15, 6, 7, 11, 11, 8, 6, 1, 0};
+    char *toolong;
+
     name = malloc(MAX_DNS_NAME_LEN * sizeof(char));
     memset(name, 0, MAX_DNS_NAME_LEN * sizeof(char));
 
@@ -92,10 +115,34 @@ int main(void) {
 
     count = sizeof(queries) / sizeof(char*);
     for ( i = 0; i < count; i++ ) {
-        amp_test_dns_decode(name, queries[i], queries[i] + offsets[i]);
+        assert(amp_test_dns_decode(name, queries[i], queries[i] + offsets[i],
+                    queries[i] + lengths[i]));
         assert(strcmp(name, responses[i]) == 0);
+
+        /* every name should be rejected if the last byte is cut off */
+        assert(amp_test_dns_decode(name, queries[i], queries[i] + offsets[i],
+                    queries[i] + lengths[i] - 1) == NULL);
     }
 
+    /* 64 labels of 3 characters is longer than any name can be */
+    toolong = malloc(64 * 4 + 1);
+    for ( i = 0; i < 64; i++ ) {
+        memcpy(toolong + (i * 4), "\x03""abc", 4);
+    }
+    toolong[64 * 4] = '\0';
+
+    count = sizeof(invalid) / sizeof(char*);
+    invalid[count - 1] = toolong;
+    invalid_lengths[count - 1] = 64 * 4 + 1;
+
+    for ( i = 0; i < count; i++ ) {
+        assert(amp_test_dns_decode(name, invalid[i],
+                    invalid[i] + invalid_offsets[i],
+                    invalid[i] + invalid_lengths[i]) == NULL);
+    }
+
+    free(toolong);
+
     free(name);
 
     return 0;
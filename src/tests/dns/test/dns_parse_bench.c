@@ -0,0 +1,200 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "tests.h"
+#include "dns.h"
+
+/* how many times to parse each response */
+#define BENCH_ITERATIONS 200000
+
+/* a large DNSSEC response with many signed records */
+#define BENCH_RRSETS 16
+#define BENCH_SIG_LEN 256
+
+#define BENCH_MAX_PACKET 65536
+
+
+
+/*
+ * Append a resource record whose name is a new label in front of a pointer
+ * back to the question, as most servers will compress them.
+ */
+static int add_rr(char *packet, int offset, uint16_t type, uint16_t rdlen) {
+    struct dns_opt_rr_t rr;
+
+    memcpy(packet + offset, "\x04host", 5);
+    offset += 5;
+    packet[offset++] = (char)0xc0;
+    packet[offset++] = sizeof(struct dns_t);
+
+    memset(&rr, 0, sizeof(rr));
+    rr.type = htons(type);
+    rr.payload = htons(1);
+    rr.rdlen = htons(rdlen);
+    memcpy(packet + offset, &rr, sizeof(rr));
+    offset += sizeof(rr);
+
+    memset(packet + offset, 0x5a, rdlen);
+
+    return offset + rdlen;
+}
+
+
+
+/*
+ * Build a response similar to a large DNSSEC signed answer, with an A
+ * record and RRSIG for every RRset, and an OPT RR with an NSID.
+ */
+static int build_response(char *packet) {
+    struct dns_t *header = (struct dns_t *)packet;
+    struct dns_opt_rdata_t opt;
+    char *name = "\x03www\x07""example\x03org";
+    int offset;
+    int i;
+
+    memset(packet, 0, sizeof(struct dns_t));
+    header->id = htons(1);
+    header->qd_count = htons(1);
+    header->an_count = htons(BENCH_RRSETS * 2);
+    header->ar_count = htons(1);
+    offset = sizeof(struct dns_t);
+
+    memcpy(packet + offset, name, strlen(name) + 1);
+    offset += strlen(name) + 1;
+    memset(packet + offset, 0, sizeof(struct dns_query_t));
+    offset += sizeof(struct dns_query_t);
+
+    for ( i = 0; i < BENCH_RRSETS; i++ ) {
+        offset = add_rr(packet, offset, 1, 4);
+        offset = add_rr(packet, offset, 46, BENCH_SIG_LEN);
+    }
+
+    /* OPT RR has an empty name rather than a pointer */
+    packet[offset++] = 0;
+    memset(packet + offset, 0, sizeof(struct dns_opt_rr_t));
+    ((struct dns_opt_rr_t *)(packet + offset))->type = htons(41);
+    ((struct dns_opt_rr_t *)(packet + offset))->rdlen = htons(8);
+    offset += sizeof(struct dns_opt_rr_t);
+    opt.code = htons(3);
+    opt.length = htons(4);
+    memcpy(packet + offset, &opt, sizeof(opt));
+    memcpy(packet + offset + sizeof(opt), "ns01", 4);
+
+    return offset + 8;
+}
+
+
+
+/*
+ * Read a captured DNS response (just the UDP payload) from a file.
+ */
+static int read_response(char *filename, char *packet) {
+    FILE *file;
+    size_t length;
+
+    if ( (file = fopen(filename, "r")) == NULL ) {
+        perror(filename);
+        return -1;
+    }
+
+    length = fread(packet, 1, BENCH_MAX_PACKET, file);
+    fclose(file);
+
+    return length;
+}
+
+
+
+/*
+ * Time how long it takes to parse a response.
+ */
+static void benchmark(char *label, char *packet, int length) {
+    struct timespec start, end;
+    struct info_t info;
+    double elapsed;
+    int result = 0;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < BENCH_ITERATIONS; i++ ) {
+        memset(&info, 0, sizeof(info));
+        result = amp_test_dns_process_records(packet, length, &info);
+        free(info.nsid_payload);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) * 1e9 +
+        (end.tv_nsec - start.tv_nsec);
+
+    printf("%-32s %6d bytes %s %8.1f ns/response %8.1f MB/s\n", label,
+            length, result == length ? "ok " : "bad",
+            elapsed / BENCH_ITERATIONS,
+            (length * (double)BENCH_ITERATIONS) / (elapsed / 1e9) / 1e6);
+}
+
+
+
+/*
+ * Benchmark parsing a synthetic DNSSEC response, and any captured responses
+ * given on the command line (raw DNS payloads, one per file).
+ */
+int main(int argc, char *argv[]) {
+    char *packet = malloc(BENCH_MAX_PACKET);
+    int length;
+    int i;
+
+    length = build_response(packet);
+    benchmark("synthetic dnssec response", packet, length);
+
+    for ( i = 1; i < argc; i++ ) {
+        if ( (length = read_response(argv[i], packet)) > 0 ) {
+            benchmark(argv[i], packet, length);
+        }
+    }
+
+    free(packet);
+
+    return 0;
+}
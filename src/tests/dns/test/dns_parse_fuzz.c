@@ -0,0 +1,82 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "dns.h"
+
+/*
+ * libFuzzer target for the DNS response parser. The input is treated as a
+ * response to parse as a whole, as a single name, and as OPT RR rdata.
+ * Build with --enable-fuzzing (using clang) and run as:
+ *   ./dns_parse_fuzz corpus/
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    struct info_t info;
+    char name[MAX_DNS_NAME_LEN];
+    char *packet;
+
+    if ( size == 0 ) {
+        return 0;
+    }
+
+    /*
+     * Copy the input into a buffer of exactly the same size so that any
+     * overread is caught by the sanitiser.
+     */
+    packet = malloc(size);
+    memcpy(packet, data, size);
+
+    memset(&info, 0, sizeof(info));
+    amp_test_dns_process_records(packet, size, &info);
+    free(info.nsid_payload);
+
+    amp_test_dns_decode(name, packet, packet, packet + size);
+
+    memset(&info, 0, sizeof(info));
+    amp_test_dns_process_opt_rr(packet, size > UINT16_MAX ? UINT16_MAX : size,
+            &info);
+    free(info.nsid_payload);
+
+    free(packet);
+
+    return 0;
+}
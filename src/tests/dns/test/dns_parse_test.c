@@ -0,0 +1,163 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "tests.h"
+#include "dns.h"
+
+#define TEST_NSID "ns1.example.org"
+
+/*
+ * Append a resource record with a compressed name pointing back to the
+ * question, returning the new length of the packet.
+ */
+static int add_rr(char *packet, int offset, uint16_t type, char *rdata,
+        uint16_t rdlen) {
+    struct dns_opt_rr_t rr;
+
+    /* pointer to the name in the question */
+    packet[offset++] = (char)0xc0;
+    packet[offset++] = sizeof(struct dns_t);
+
+    memset(&rr, 0, sizeof(rr));
+    rr.type = htons(type);
+    rr.payload = htons(1);
+    rr.rdlen = htons(rdlen);
+    memcpy(packet + offset, &rr, sizeof(rr));
+    offset += sizeof(rr);
+
+    memcpy(packet + offset, rdata, rdlen);
+
+    return offset + rdlen;
+}
+
+
+
+/*
+ * Build a response with an A record, an RRSIG and an OPT RR containing an
+ * NSID, returning the length of the packet.
+ */
+static int build_response(char *packet) {
+    struct dns_t *header = (struct dns_t *)packet;
+    struct dns_opt_rdata_t opt;
+    char rdata[512];
+    char *name = "\x03www\x07""example\x03org";
+    int offset;
+
+    memset(packet, 0, sizeof(struct dns_t));
+    header->id = htons(1);
+    header->qd_count = htons(1);
+    header->an_count = htons(2);
+    header->ar_count = htons(1);
+    offset = sizeof(struct dns_t);
+
+    /* question, including the zero length label at the end of the name */
+    memcpy(packet + offset, name, strlen(name) + 1);
+    offset += strlen(name) + 1;
+    memset(packet + offset, 0, sizeof(struct dns_query_t));
+    offset += sizeof(struct dns_query_t);
+
+    memset(rdata, 0x5a, sizeof(rdata));
+    offset = add_rr(packet, offset, 1, rdata, 4);
+    offset = add_rr(packet, offset, 46, rdata, 300);
+
+    /* an unknown option followed by the NSID */
+    opt.code = htons(10);
+    opt.length = htons(8);
+    memcpy(rdata, &opt, sizeof(opt));
+    opt.code = htons(3);
+    opt.length = htons(strlen(TEST_NSID));
+    memcpy(rdata + 12, &opt, sizeof(opt));
+    memcpy(rdata + 16, TEST_NSID, strlen(TEST_NSID));
+    offset = add_rr(packet, offset, 41, rdata, 16 + strlen(TEST_NSID));
+
+    return offset;
+}
+
+
+
+/*
+ * Check that resource records are walked correctly, and that any packet
+ * that is cut short or has lengths that overrun the packet is rejected
+ * without reading outside of it.
+ */
+int main(void) {
+    struct info_t info;
+    char packet[1024];
+    char *copy;
+    int length;
+    int i;
+
+    length = build_response(packet);
+
+    /* a complete packet should be entirely consumed */
+    memset(&info, 0, sizeof(info));
+    assert(amp_test_dns_process_records(packet, length, &info) == length);
+    assert(info.rrsig == 1);
+    assert(info.nsid_length == strlen(TEST_NSID));
+    assert(memcmp(info.nsid_payload, TEST_NSID, strlen(TEST_NSID)) == 0);
+    free(info.nsid_payload);
+
+    /* every truncation should fail, copy so overreads are noticed */
+    for ( i = 0; i < length; i++ ) {
+        copy = malloc(i + 1);
+        memcpy(copy, packet, i);
+        memset(&info, 0, sizeof(info));
+        assert(amp_test_dns_process_records(copy, i, &info) == -1);
+        free(info.nsid_payload);
+        free(copy);
+    }
+
+    /* an option claiming to be longer than the OPT RR should fail */
+    packet[length - strlen(TEST_NSID) - 1] = 0x40;
+    memset(&info, 0, sizeof(info));
+    assert(amp_test_dns_process_records(packet, length, &info) == -1);
+    assert(info.nsid_payload == NULL);
+
+    /* options that don't fill the record exactly should also fail */
+    memset(&info, 0, sizeof(info));
+    assert(amp_test_dns_process_opt_rr(packet, 3, &info) == -1);
+    assert(amp_test_dns_process_opt_rr(packet, 0, &info) == 0);
+
+    return 0;
+}
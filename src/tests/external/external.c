@@ -366,6 +366,9 @@ test_t *register_test() {
     /* don't give the external test a SIGINT warning */
     new_test->sigint = 0;
 
+    /* keeps global state between runs, always run it in a new process */
+    new_test->reentrant = 0;
+
     return new_test;
 }
 
@@ -42,6 +42,7 @@
 #include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
+#include <stddef.h>
 #include <arpa/inet.h>
 #include <getopt.h>
 #include <stdlib.h>
@@ -67,11 +68,10 @@
 #include "fastping.h"
 #include "usage.h"
 #include "dscp.h"
-#include "checksum.h"
+#include "probe.h"
+#include "histogram.h"
 
 
-/* time till next packet after which select will sleep rather than spin */
-const struct timeval THRESHOLD = {0, 1000};
 /* percentile values of interest */
 const float PERCENTILES[] = {0.0, 0.1, 1.0, 5.0, 10.0, 20.0, 30.0, 40.0, 50.0,
     60.0, 70.0, 80.0, 90.0, 95.0, 99.0, 99.9, 100};
@@ -82,6 +82,7 @@ static struct option long_options[] = {
     {"size", required_argument, 0, 's'},
     {"rate", required_argument, 0, 'r'},
     {"preemptive", no_argument, 0, 'p'},
+    {"txtime", no_argument, 0, 't'},
     {"interface", required_argument, 0, 'I'},
     {"ipv4", required_argument, 0, '4'},
     {"ipv6", required_argument, 0, '6'},
@@ -100,7 +101,7 @@ static struct option long_options[] = {
  */
 static void usage(void) {
     fprintf(stderr,
-            "Usage: amp-fastping [-hpvx] [-c count] [-r rate] [-s size] "
+            "Usage: amp-fastping [-hptvx] [-c count] [-r rate] [-s size] "
             "-- destination\n\n");
     fprintf(stderr, "  -c, --count          <packets> "
             "Number of packets to be sent during the test\n");
@@ -110,6 +111,8 @@ static void usage(void) {
             "Packet size to use for the test\n");
     fprintf(stderr, "  -r, --rate           <pps>     "
             "Number of packets per second to send\n");
+    fprintf(stderr, "  -t, --txtime                   "
+            "Let the kernel pace packets (needs fq qdisc)\n");
 
     print_probe_usage();
     print_interface_usage();
@@ -119,10 +122,39 @@ static void usage(void) {
 
 
 /*
- * Sort function used to order packets for percentile calculations
+ * Fold the timing information for a single packet into the running RTT and
+ * jitter statistics. Packets must be added in the order they were sent, so
+ * that jitter is calculated between consecutive responses.
  */
-static int cmp (const void *a, const void *b) {
-    return ( *(int32_t*)a - *(int32_t*)b );
+static void update_stats(struct stream_stats_t *stats, struct info_t *info) {
+    struct timeval latency;
+    int64_t current;
+    double delta, delta2;
+
+    if ( !timerisset(&info->time_received) ) {
+        return;
+    }
+
+    timersub(&info->time_received, &info->time_sent, &latency);
+    current = (latency.tv_sec * 1000000) + latency.tv_usec;
+
+    histogram_add(&stats->rtt_histogram, current);
+    delta = (double)current - stats->rtt.mean;
+    stats->rtt.samples++;
+    stats->rtt.mean += delta / stats->rtt.samples;
+    delta2 = (double)current - stats->rtt.mean;
+    stats->rtt_squares += (delta * delta2);
+
+    if ( stats->rtt.samples > 1 ) {
+        histogram_add(&stats->jitter_histogram, current - stats->prev);
+        delta = (double)current - (double)stats->prev - stats->jitter.mean;
+        stats->jitter.samples++;
+        stats->jitter.mean += delta / stats->jitter.samples;
+        delta2 = (double)current - (double)stats->prev - stats->jitter.mean;
+        stats->jitter_squares += (delta * delta2);
+    }
+
+    stats->prev = current;
 }
 
 
@@ -132,11 +164,12 @@ static int cmp (const void *a, const void *b) {
  * the RTT or jitter measurements.
  */
 static Amplet2__Fastping__SummaryStats* report_summary(
-        struct summary_t *summary, int32_t *ipv) {
+        struct summary_t *summary, double squares,
+        struct histogram_t *histogram) {
     Amplet2__Fastping__SummaryStats *stats;
     int i;
 
-    if ( !summary || !ipv ) {
+    if ( !summary || !histogram || summary->samples == 0 ) {
         return NULL;
     }
 
@@ -144,26 +177,28 @@ static Amplet2__Fastping__SummaryStats* report_summary(
     amplet2__fastping__summary_stats__init(stats);
 
     stats->has_maximum = 1;
-    stats->maximum = summary->maximum;
+    stats->maximum = histogram->maximum;
     stats->has_minimum = 1;
-    stats->minimum = summary->minimum;
+    stats->minimum = histogram->minimum;
     stats->has_mean = 1;
     stats->mean = (uint32_t)round(summary->mean);
     stats->has_sd = 1;
-    stats->sd = summary->sd;
+    stats->sd = sqrt(squares / summary->samples);
     stats->has_samples = 1;
     stats->samples = summary->samples;
 
     stats->n_percentiles = PERCENTILE_COUNT;
     stats->percentiles = calloc(stats->n_percentiles, sizeof(int32_t));
 
+    /* estimate the value that would be at this index if samples were sorted */
     for ( i = 0; i < PERCENTILE_COUNT; i++ ) {
         uint32_t index = PERCENTILES[i] / 100 * summary->samples;
         if ( index >= summary->samples ) {
             index--;
         }
-        stats->percentiles[i] = ipv[index];
-        Log(LOG_DEBUG, "Percentile %.02f: %d\n", PERCENTILES[i], ipv[index]);
+        stats->percentiles[i] = histogram_value_at_rank(histogram, index);
+        Log(LOG_DEBUG, "Percentile %.02f: %d\n", PERCENTILES[i],
+                stats->percentiles[i]);
     }
 
     return stats;
@@ -176,86 +211,28 @@ static Amplet2__Fastping__SummaryStats* report_summary(
  * a single test flow, including packet interarrivals, RTT measurements,
  * etc.
  */
-static Amplet2__Fastping__Item* report_destination(struct info_t *timing,
-        struct opt_t *options, struct timeval *runtime) {
+static Amplet2__Fastping__Item* report_destination(
+        struct stream_stats_t *stats, struct timeval *runtime) {
 
     Amplet2__Fastping__Item *item =
         (Amplet2__Fastping__Item*)malloc(sizeof(Amplet2__Fastping__Item));
-    uint64_t i;
-    uint64_t current = 0, prev = 0;
-    struct timeval latency;
-    double delta, delta2;
-    double rtt_squares, jitter_squares;
-    int32_t *ipv;
-    int32_t *ipdv;
-    struct summary_t rtt, jitter;
 
     amplet2__fastping__item__init(item);
 
-    if ( timing == NULL ) {
+    if ( stats == NULL ) {
         return item;
     }
 
-    memset(&rtt, 0, sizeof(rtt));
-    memset(&jitter, 0, sizeof(jitter));
-
-    ipv = calloc(options->count, sizeof(int32_t));
-    ipdv = calloc(options->count, sizeof(int32_t));
-
-    rtt_squares = 0;
-    jitter_squares = 0;
-
-    for ( i = 0; i < options->count; i++ ) {
-        if ( !timerisset(&timing[i].time_received) ) {
-            continue;
-        }
-
-        timersub(&timing[i].time_received, &timing[i].time_sent, &latency);
-        current = (latency.tv_sec * 1000000) + latency.tv_usec;
-
-        ipv[rtt.samples] = current;
-        delta = (double)current - rtt.mean;
-        rtt.samples++;
-        rtt.mean += delta / rtt.samples;
-        delta2 = (double)current - rtt.mean;
-        rtt_squares += (delta * delta2);
-
-        if ( rtt.samples > 1 ) {
-            ipdv[jitter.samples] = current - prev;
-            delta = (double)current - (double)prev - jitter.mean;
-            jitter.samples++;
-            jitter.mean += delta / jitter.samples;
-            delta2 = (double)current - (double)prev - jitter.mean;
-            jitter_squares += (delta * delta2);
-        }
-
-        prev = current;
-    }
-
-    if ( rtt.samples > 0 ) {
-        qsort(ipv, rtt.samples, sizeof(int32_t), cmp);
-        rtt.maximum = ipv[rtt.samples - 1];
-        rtt.minimum = ipv[0];
-        rtt.sd = sqrt(rtt_squares / rtt.samples);
-        item->rtt = report_summary(&rtt, ipv);
-    }
-
-    if ( jitter.samples > 0 ) {
-        qsort(ipdv, jitter.samples, sizeof(int32_t), cmp);
-        jitter.maximum = ipdv[jitter.samples - 1];
-        jitter.minimum = ipdv[0];
-        jitter.sd = sqrt(jitter_squares / jitter.samples);
-        item->jitter = report_summary(&jitter, ipdv);
-    }
+    item->rtt = report_summary(&stats->rtt, stats->rtt_squares,
+            &stats->rtt_histogram);
+    item->jitter = report_summary(&stats->jitter, stats->jitter_squares,
+            &stats->jitter_histogram);
 
     if ( runtime ) {
         item->has_runtime = 1;
         item->runtime = runtime->tv_sec * 1000000 + runtime->tv_usec;
     }
 
-    free(ipv);
-    free(ipdv);
-
     return item;
 }
 
@@ -265,8 +242,8 @@ static Amplet2__Fastping__Item* report_destination(struct info_t *timing,
  * Build the protocol buffer message containing the result.
  */
 static amp_test_result_t* report_result(struct timeval *start_time,
-        struct addrinfo *dest, struct opt_t *options, struct info_t *timing,
-        struct timeval *runtime) {
+        struct addrinfo *dest, struct opt_t *options,
+        struct stream_stats_t *stats, struct timeval *runtime) {
 
     int count = 1;
 
@@ -293,7 +270,7 @@ static amp_test_result_t* report_result(struct timeval *start_time,
     header.dscp = options->dscp;
 
     reports = malloc(sizeof(Amplet2__Fastping__Item*) * count);
-    reports[0] = report_destination(timing, options, runtime);
+    reports[0] = report_destination(stats, runtime);
 
     msg.header = &header;
     msg.reports = reports;
@@ -456,40 +433,57 @@ static int set_socket_filter(int sock, int family, int ident) {
 
 
 /*
- * Create the packet and fill in the required fields. The ICMP header only
- * has 16 bits for sequence numbers, so include a 64 bit field to track
- * the actual value for use once the sequence wraps. The two fields are
- * separate arguments so that they can be set to different values if desired
- * (to cause the response packets to fail sanity checking and be ignored).
+ * Create the probe packet template and fill in the fields that stay the same
+ * for the whole stream. The ICMP header only has 16 bits for sequence
+ * numbers, so include a 64 bit field to track the actual value for use once
+ * the sequence wraps, which update_packet() sets for each packet.
  */
-static int build_packet(uint8_t family, void *packet, uint16_t size,
-        uint16_t seq, uint16_t ident, uint64_t magic) {
+static struct probe_template_t *build_packet(uint8_t family, uint16_t size,
+        uint16_t ident) {
 
+    struct probe_template_t *probe;
     struct icmphdr *icmp;
-    int hlen;
 
-    assert(packet);
     assert(size >= MINIMUM_FASTPING_PACKET_SIZE);
 
-    memset(packet, 0, size);
+    if ( family == AF_INET ) {
+        probe = new_probe_template(size - sizeof(struct iphdr),
+                offsetof(struct icmphdr, checksum));
+    } else {
+        /* icmp6 checksum will be calculated for us */
+        probe = new_probe_template(size - sizeof(struct ip6_hdr),
+                PROBE_NO_CHECKSUM);
+    }
 
-    icmp = (struct icmphdr*)packet;
+    icmp = (struct icmphdr*)probe->packet;
     icmp->type = (family == AF_INET) ? ICMP_ECHO : ICMP6_ECHO_REQUEST;
     icmp->code = 0;
-    icmp->checksum = 0;
     icmp->un.echo.id = htons(ident);
-    icmp->un.echo.sequence = htons(seq);
-    memcpy((uint8_t *)packet + sizeof(struct icmphdr), &magic, sizeof(magic));
 
-    if ( family == AF_INET ) {
-        hlen = sizeof(struct iphdr);
-        icmp->checksum = checksum((uint16_t*)packet, size - hlen);
-    } else {
-        hlen = sizeof(struct ip6_hdr);
-        /* icmp6 checksum will be calculated for us */
-    }
+    probe_template_checksum(probe);
+
+    return probe;
+}
+
+
+
+/*
+ * Set the sequence number and magic value for the next packet, patching the
+ * checksum rather than recalculating it. The two fields are separate
+ * arguments so that they can be set to different values if desired (to cause
+ * the response packets to fail sanity checking and be ignored). Returns the
+ * length of the ICMP part of the packet.
+ */
+static int update_packet(struct probe_template_t *probe, uint16_t seq,
+        uint64_t magic) {
+
+    assert(probe);
+
+    probe_template_set16(probe, offsetof(struct icmphdr, un.echo.sequence),
+            seq);
+    probe_template_set(probe, sizeof(struct icmphdr), &magic, sizeof(magic));
 
-    return size - hlen;
+    return probe->length;
 }
 
 
@@ -587,25 +581,30 @@ static int64_t extract_data(struct addrinfo *dest, char *packet, size_t length,
 static amp_test_result_t* send_icmp_stream(struct addrinfo *dest,
         struct socket_t *sockets, struct opt_t *options) {
 
-    char *packet;
+    struct probe_template_t *probe;
     int length;
-    char response[RESPONSE_BUFFER_LEN];
     struct info_t *timing;
+    struct stream_stats_t stats;
+    struct packet_batch_t *batch;
+    struct send_queue_t *queue;
+    struct socket_t poll_sockets;
 
     struct timeval run_time;
     struct timeval start_time;
     struct timeval stop_time;
-    struct timeval next_packet;
-    struct timeval interpacket_gap;
     struct timeval loss_timeout;
 
-    struct sockaddr from;
     amp_test_result_t *results;
 
     uint64_t sent = 0;
     uint64_t received = 0;
+    uint64_t window;
     uint16_t pid = getpid();
     int sock;
+    int epfd;
+    int burst;
+    int i;
+    uint64_t seq;
 
     memset(&stop_time, 0, sizeof(struct timeval));
     memset(&loss_timeout, 0, sizeof(struct timeval));
@@ -635,31 +634,61 @@ static amp_test_result_t* send_icmp_stream(struct addrinfo *dest,
         return report_result(&start_time, dest, options, NULL, NULL);
     }
 
-    /* packet rate is an integer above zero, so longest gap is only 1 second */
-    interpacket_gap.tv_sec = options->rate <= 1 ? 1 : 0;
-    interpacket_gap.tv_usec = options->rate > 1 ? (1000000 / options->rate) : 0;
+    /* only watch the socket that responses from this destination will use */
+    poll_sockets.socket = (dest->ai_family == AF_INET) ? sock : -1;
+    poll_sockets.socket6 = (dest->ai_family == AF_INET6) ? sock : -1;
 
-    timing = calloc(options->count, sizeof(struct info_t));
-    packet = calloc(1, options->size);
+    if ( (epfd = create_packet_poll(&poll_sockets)) < 0 ) {
+        return report_result(&start_time, dest, options, NULL, NULL);
+    }
+
+    /*
+     * Only keep timing information for recently sent packets rather than
+     * for the whole stream, anything older has been folded into the stats.
+     */
+    window = options->rate * FASTPING_OUTSTANDING_WINDOW;
+    if ( window < SEND_QUEUE_PENDING ) {
+        window = SEND_QUEUE_PENDING;
+    }
+    if ( window > options->count ) {
+        window = options->count;
+    }
+
+    timing = calloc(window, sizeof(struct info_t));
+    probe = build_packet(dest->ai_family, options->size, pid);
+
+    memset(&stats, 0, sizeof(stats));
+    histogram_init(&stats.rtt_histogram);
+    histogram_init(&stats.jitter_histogram);
+    batch = new_packet_batch(PACKET_BATCH_SIZE, RESPONSE_BUFFER_LEN);
+
+    /*
+     * If the kernel is pacing packets then hand over a queue full at a time,
+     * otherwise they are given one at a time to be sent at the right moment.
+     */
+    burst = options->txtime ? SEND_QUEUE_SIZE : 1;
+    queue = new_send_queue(sock, burst, options->size, 0,
+            options->txtime ? SEND_QUEUE_TXTIME : 0);
 
     /* try to prime any stateful devices that might be in the path */
     if ( options->preemptive ) {
         Log(LOG_DEBUG, "Sending 3 packets to prime devices in the path");
         /* sequence and magic fields are different so we can filter these out */
-        length = build_packet(dest->ai_family, packet, options->size,
-                UINT16_MAX, pid, 0);
+        length = update_packet(probe, UINT16_MAX, 0);
         /* arbitrarily, send 3 packets in the hopes at least one will arrive */
-        delay_send_packet(sock, packet, length, dest, 0, NULL);
-        delay_send_packet(sock, packet, length, dest, 0, NULL);
-        delay_send_packet(sock, packet, length, dest, 0, NULL);
+        for ( i = 0; i < 3; i++ ) {
+            queue_packet(queue, (char*)probe->packet, length, dest, NULL);
+            flush_send_queue(queue);
+        }
         /* arbitrarily, sleep briefly to allow creation of state in devices */
         usleep(500000);
     }
 
-    Log(LOG_DEBUG, "Starting packet stream");
+    /* packet rate is an integer above zero, so longest gap is only 1 second */
+    queue->inter_packet_delay = options->rate > 1 ?
+        (1000000 / options->rate) : 1000000;
 
-    /* generate the first packet of the run before we are ready to send it */
-    length = build_packet(dest->ai_family, packet, options->size, 0, pid, 0);
+    Log(LOG_DEBUG, "Starting packet stream");
 
     /* set the actual start time now after doing all the setup */
     if ( gettimeofday(&start_time, NULL) != 0 ) {
@@ -667,68 +696,47 @@ static amp_test_result_t* send_icmp_stream(struct addrinfo *dest,
 	exit(EXIT_FAILURE);
     }
 
-    timeradd(&start_time, &interpacket_gap, &next_packet);
-
     while ( sent < options->count || received < options->count ) {
-        struct timeval timeout = {0, 0};
         struct timeval now;
-        fd_set readfds, writefds;
+        int wait;
+        int ready;
 
         if ( sent < options->count ) {
-            struct timeval towait;
             /*
-             * Still sending data, but it seems wasteful to spin on this loop
-             * if we know there is a long time to wait till the next packet.
-             * Sleep for some portion of the time till the next packet if it
-             * is further away than the threshold. Don't sleep too long or
-             * we won't send the next packet on time, or we won't service this
-             * loop often enough and incoming packets could fill up buffers.
+             * Still sending data, so wait for responses until it is nearly
+             * time for the next packet. The transmit queue holds the packet
+             * for the final part of the gap so that it is sent on time.
              */
-            gettimeofday(&now, NULL);
-            timersub(&next_packet, &now, &towait);
-            if ( timercmp(&towait, &THRESHOLD, >) ) {
-                usleep(towait.tv_usec * 0.30);
-            }
+            wait = send_queue_delay(queue);
+            wait = (wait > SEND_QUEUE_SPIN_US) ? wait - SEND_QUEUE_SPIN_US : 0;
         } else {
             /* otherwise we'll wait for a bit after the last packet we saw */
-            timeout.tv_sec = FASTPING_PACKET_LOSS_TIMEOUT;
-            timeout.tv_usec = 0;
+            wait = FASTPING_PACKET_LOSS_TIMEOUT * 1000000;
         }
 
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
+        /* sleep until a response arrives or it is time to do something */
+        ready = (wait_for_packets(epfd, &wait) > 0);
 
-        FD_SET(sock, &writefds);
-        FD_SET(sock, &readfds);
+        if ( sent < options->count &&
+                send_queue_delay(queue) <= SEND_QUEUE_SPIN_US ) {
+            for ( i = 0; i < burst && sent + i < options->count; i++ ) {
+                struct info_t *slot = &timing[(sent + i) % window];
+                /* the oldest packet has had its chance, so finish with it */
+                update_stats(&stats, slot);
+                memset(slot, 0, sizeof(struct info_t));
 
-        if ( select(sock+1, &readfds, &writefds, NULL, &timeout) < 0 ) {
-            if ( errno == EINTR ) {
-                continue;
+                length = update_packet(probe, sent + i, sent + i);
+                queue_packet(queue, (char*)probe->packet, length, dest,
+                        &slot->time_sent);
             }
-            Log(LOG_ERR, "Select failed");
-            return NULL;
+
+            /* anything that failed to send will be tried again next time */
+            sent += flush_send_queue(queue);
         }
 
-        /* get the current time to use to see if a packet should be sent */
+        /* get the current time to use to see if we should stop waiting */
         gettimeofday(&now, NULL);
 
-        if ( sent < options->count && !timercmp(&now, &next_packet, <) ) {
-            if ( FD_ISSET(sock, &writefds) ) {
-                delay_send_packet(sock, packet, length, dest, 0,
-                        &(timing[sent].time_sent));
-
-                timeradd(&next_packet, &interpacket_gap, &next_packet);
-                sent++;
-
-                /* generate the next packet so it is ready when the socket is */
-                build_packet(dest->ai_family, packet, options->size, sent, pid,
-                        sent);
-            } else {
-                /* if it's time to send but the socket was busy, try again */
-                continue;
-            }
-        }
-
         /* if all the packets have been sent, start the timer to wait */
         if ( sent >= options->count ) {
             if ( stop_time.tv_sec == 0 && stop_time.tv_usec == 0 ) {
@@ -747,55 +755,66 @@ static amp_test_result_t* send_icmp_stream(struct addrinfo *dest,
             }
         }
 
-        /* check to see if there is data in the socket waiting to be read */
-        if ( FD_ISSET(sock, &readfds) ) {
-            int wait = 0;
-            int bytes;
-            struct timeval receive_time;
+        if ( !ready ) {
+            continue;
+        }
 
-            /*
-             * Only one packet is read here to try to limit any delay to
-             * sending the next packet. If lots of packets arrive all at
-             * once then they won't get processed quickly, which could fill
-             * buffers. Filtering as many unwanted packets as possible helps,
-             * as does making sure we hit this loop regularly.
-             */
-            bytes = get_packet(sockets, response, RESPONSE_BUFFER_LEN, &from,
-                    &wait, &receive_time);
-
-            if ( bytes > 0 ) {
-                /* extract the sequence number from the icmp packet */
-                int64_t sequence;
-                sequence = extract_data(dest, response, bytes, pid, &from);
-                if ( sequence >= 0 && sequence < (int64_t)sent ) {
-                    if ( !timerisset(&timing[sequence].time_received) ) {
-                        memcpy(&(timing[sequence].time_received),
-                                &receive_time, sizeof(struct timeval));
-                        received++;
-                        if ( received >= options->count ) {
-                            Log(LOG_DEBUG, "Received all responses");
-                            break;
-                        }
-                    } else {
-                        Log(LOG_DEBUG, "Ignoring duplicate sequence number %d",
-                                sequence);
-                    }
+        /* make sure sent times are as accurate as possible before using them */
+        harvest_tx_timestamps(queue);
+
+        /*
+         * Read every response that is currently queued in a single call,
+         * so that bursts of responses are cleared from the socket buffer
+         * without waiting for another pass through this loop.
+         */
+        get_packet_batch(sock, batch);
+
+        for ( i = 0; i < batch->count; i++ ) {
+            struct packet_t *response = &batch->packets[i];
+            /* extract the sequence number from the icmp packet */
+            int64_t sequence;
+            sequence = extract_data(dest, response->data, response->length,
+                    pid, (struct sockaddr*)&response->from);
+            if ( sequence >= 0 && sequence < (int64_t)sent &&
+                    sequence + window >= sent ) {
+                struct info_t *slot = &timing[sequence % window];
+                if ( !timerisset(&slot->time_received) ) {
+                    memcpy(&slot->time_received, &response->time,
+                            sizeof(struct timeval));
+                    received++;
                 } else {
-                    Log(LOG_DEBUG, "Ignoring out of range sequence number %d",
+                    Log(LOG_DEBUG, "Ignoring duplicate sequence number %d",
                             sequence);
                 }
+            } else {
+                Log(LOG_DEBUG, "Ignoring out of range sequence number %d",
+                        sequence);
             }
         }
+
+        if ( received >= options->count ) {
+            Log(LOG_DEBUG, "Received all responses");
+            break;
+        }
     }
 
+    close(epfd);
+    free_packet_batch(batch);
+    free_send_queue(queue);
+
     Log(LOG_DEBUG, "Calculating fastping results");
 
+    /* fold in everything still in the window, in the order it was sent */
+    for ( seq = (sent > window) ? sent - window : 0; seq < sent; seq++ ) {
+        update_stats(&stats, &timing[seq % window]);
+    }
+
     timersub(&stop_time, &start_time, &run_time);
 
-    results = report_result(&start_time, dest, options, timing, &run_time);
+    results = report_result(&start_time, dest, options, &stats, &run_time);
 
     free(timing);
-    free(packet);
+    free_probe_template(probe);
 
     return results;
 }
@@ -820,12 +839,13 @@ amp_test_result_t* run_fastping(int argc, char *argv[], int count,
     options.rate = DEFAULT_FASTPING_PACKET_RATE;
     options.size = DEFAULT_FASTPING_PACKET_SIZE;
     options.preemptive = 0;
+    options.txtime = 0;
     options.dscp = DEFAULT_DSCP_VALUE;
     sourcev4 = NULL;
     sourcev6 = NULL;
     device = NULL;
 
-    while ( (opt = getopt_long(argc, argv, "c:s:r:phxv4::6::I:Q:Z:",
+    while ( (opt = getopt_long(argc, argv, "c:s:r:ptxhv4::6::I:Q:Z:",
              long_options, NULL)) != -1 ) {
         switch ( opt ) {
             case '4': address_string = parse_optional_argument(argv);
@@ -851,6 +871,7 @@ amp_test_result_t* run_fastping(int argc, char *argv[], int count,
             case 's': options.size = atoi(optarg); break;
             case 'r': options.rate = atoi(optarg); break;
             case 'p': options.preemptive = 1; break;
+            case 't': options.txtime = 1; break;
             case 'v': print_package_version(argv[0]); exit(EXIT_SUCCESS);
             case 'x': log_level = LOG_DEBUG;
                       log_level_override = 1;
@@ -1051,5 +1072,8 @@ test_t *register_test() {
     /* don't give the fastping test a SIGINT warning */
     new_test->sigint = 0;
 
+    /* keeps global state between runs, always run it in a new process */
+    new_test->reentrant = 0;
+
     return new_test;
 }
@@ -49,6 +49,7 @@
 
 #include "tests.h"
 #include "testlib.h"
+#include "histogram.h"
 
 #define DEFAULT_FASTPING_PACKET_COUNT 60
 #define DEFAULT_FASTPING_PACKET_RATE 1
@@ -64,8 +65,16 @@
 #define RESPONSE_BUFFER_LEN ( \
         sizeof(struct iphdr) + 60 + sizeof(struct icmphdr) + 8)
 
-/* TODO investigate the time vs space tradeoff of writing the timestamp to
- * the outgoing packet and only keeping the RTT value once it returns
+/*
+ * Number of seconds worth of sent packets to keep timing information for.
+ * Responses that arrive later than this are treated as lost.
+ */
+#define FASTPING_OUTSTANDING_WINDOW (FASTPING_PACKET_LOSS_TIMEOUT * 2)
+
+/*
+ * Timing information for a recently sent packet. These are kept in a ring
+ * covering FASTPING_OUTSTANDING_WINDOW seconds and are folded into the
+ * running statistics when their slot is reused.
  */
 struct info_t {
     struct timeval time_sent;
@@ -73,19 +82,31 @@ struct info_t {
 };
 
 struct summary_t {
-    uint32_t maximum;
-    uint32_t minimum;
     double mean;
-    double sd;
     uint32_t samples;
 };
 
+/*
+ * Running RTT and jitter statistics for the stream, so that individual
+ * samples don't need to be kept and sorted to report on them.
+ */
+struct stream_stats_t {
+    struct summary_t rtt;
+    struct summary_t jitter;
+    double rtt_squares;
+    double jitter_squares;
+    int64_t prev;
+    struct histogram_t rtt_histogram;
+    struct histogram_t jitter_histogram;
+};
+
 struct opt_t {
     uint64_t count;
     uint64_t rate;
     uint64_t gap;
     uint16_t size;
     uint16_t preemptive;
+    uint16_t txtime;
     uint8_t dscp;
 };
 
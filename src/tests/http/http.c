@@ -49,6 +49,7 @@
 #include <assert.h>
 #include <string.h>
 #include <curl/curl.h>
+#include <event2/event.h>
 
 #include "config.h"
 #include "testlib.h"
@@ -69,6 +70,11 @@ int total_pipelines;
 int total_requests;
 struct opt_t options;
 
+/* event loop driving the curl multi handle, and number of active transfers */
+static struct event_base *base = NULL;
+static struct event *timer_event = NULL;
+static int running_handles = 0;
+
 
 
 static struct option long_options[] = {
@@ -624,24 +630,6 @@ static struct curl_slist *config_request_headers(char *url, int caching) {
 
 
 
-/*
- * Check if a given object is in the given queue.
- */
-static int is_object_in_queue(char *object, struct object_stats_t *queue) {
-
-    if ( object == NULL || queue == NULL ) {
-        return 0;
-    }
-
-    if ( strcmp(object, queue->path) == 0 ) {
-        return 1;
-    }
-
-    return is_object_in_queue(object, queue->next);
-}
-
-
-
 /*
  * Add an object to the given queue, returning the modified queue.
  */
@@ -663,67 +651,51 @@ static struct object_stats_t *add_object_to_queue(struct object_stats_t *object,
 
 
 /*
- * Remove an object from a queue, returning the modified queue with the
- * object we removed in the result variable.
+ * Remove an object from a queue, returning the modified queue.
  */
-static struct object_stats_t *pop_object_from_queue(char *object,
-        struct object_stats_t *queue, struct object_stats_t **result) {
+static struct object_stats_t *remove_object_from_queue(
+        struct object_stats_t *object, struct object_stats_t *queue) {
 
-    if ( object == NULL ) {
-        *result = NULL;
-        return queue;
-    }
+    struct object_stats_t *prev;
 
-    if ( queue == NULL ) {
-        *result = NULL;
-        return NULL;
+    if ( queue == object ) {
+        return queue->next;
     }
 
-    assert(queue->path);
-    if ( strcmp(object, queue->path) == 0 ) {
-        *result = queue;
-        return queue->next;
+    for ( prev = queue; prev != NULL; prev = prev->next ) {
+        if ( prev->next == object ) {
+            prev->next = object->next;
+            break;
+        }
     }
 
-    queue->next = pop_object_from_queue(object, queue->next, result);
     return queue;
 }
 
 
 
 /*
- * Create a new object on a given queue and return the modified queue. If
- * the object already exists then return the queue unmodified.
+ * Create a new object to be fetched from the given host.
  */
 static struct object_stats_t *create_object(char *host, char *path,
-        struct object_stats_t *queue, int parse) {
-
-    if ( queue == NULL ) {
-        struct object_stats_t *object =
-            (struct object_stats_t *)malloc(sizeof(struct object_stats_t));
-        memset(object, 0, sizeof(struct object_stats_t));
+        int parse) {
 
-        strncpy(object->server_name, host, MAX_DNS_NAME_LEN);
-        strncpy(object->path, path, MAX_PATH_LEN);
+    struct object_stats_t *object =
+        (struct object_stats_t *)malloc(sizeof(struct object_stats_t));
+    memset(object, 0, sizeof(struct object_stats_t));
 
-        object->parse = parse;
+    strncpy(object->server_name, host, MAX_DNS_NAME_LEN);
+    strncpy(object->path, path, MAX_PATH_LEN);
 
-        /* some counters dont default to zero */
-        object->headers.max_age = -1;
-        object->headers.s_maxage = -1;
-        object->headers.x_cache = -1;
-        object->headers.x_cache_lookup = -1;
-        return object;
-    }
+    object->parse = parse;
 
-    if(strcmp(queue->server_name, host) == 0) {
-        if(strcmp(queue->path, path) == 0) {
-            return queue;
-        }
-    }
+    /* some counters dont default to zero */
+    object->headers.max_age = -1;
+    object->headers.s_maxage = -1;
+    object->headers.x_cache = -1;
+    object->headers.x_cache_lookup = -1;
 
-    queue->next = create_object(host, path, queue->next, parse);
-    return queue;
+    return object;
 }
 
 
@@ -735,7 +707,7 @@ static struct object_stats_t *create_object(char *host, char *path,
 struct server_stats_t *add_object(char *url, int parse) {
 
     struct server_stats_t *server;
-    int i;
+    struct object_stats_t *object;
     char host[MAX_DNS_NAME_LEN];
     char path[MAX_PATH_LEN];
 
@@ -751,20 +723,15 @@ struct server_stats_t *add_object(char *url, int parse) {
     /* find the server that this object is being fetched from */
     server_list = get_server(host, server_list, &server);
 
-    /* check the finished queue to make sure we don't already have the object */
-    if ( is_object_in_queue(path, server->finished) ) {
+    /* make sure the object isn't already finished, in progress or queued */
+    if ( find_object(server, path) != NULL ) {
         return server;
     }
 
-    /* check the current pipelines as well to make sure it's not in progress */
-    for ( i=0; i<server->num_pipelines; i++ ) {
-        if ( is_object_in_queue(path, server->pipelines[i]) ) {
-            return server;
-        }
-    }
-
-    /* not finished and not in progress, try to add to the pending queue */
-    server->pending = create_object(host, path, server->pending, parse);
+    /* not seen before, add it to the pending queue */
+    object = create_object(host, path, parse);
+    index_object(server, object);
+    server->pending = add_object_to_queue(object, server->pending);
 
     return server;
 }
@@ -875,6 +842,7 @@ CURL *pipeline_next_object(CURLM *multi, struct server_stats_t *server) {
     object = server->pending;
     server->pending = server->pending->next;
     object->next = NULL;
+    object->pipeline = pipeline;
     server->pipelines[pipeline] =
         add_object_to_queue(object, server->pipelines[pipeline]);
 
@@ -960,6 +928,9 @@ CURL *pipeline_next_object(CURLM *multi, struct server_stats_t *server) {
     curl_easy_setopt(object->handle, CURLOPT_USERAGENT, options.useragent);
     curl_easy_setopt(object->handle, CURLOPT_SSLVERSION, options.sslversion);
 
+    /* keep a pointer to the object so it can be found when finished */
+    curl_easy_setopt(object->handle, CURLOPT_PRIVATE, object);
+
     /* save the time that fetching started for this object */
     gettimeofday(&object->start, NULL);
 
@@ -989,23 +960,19 @@ CURL *pipeline_next_object(CURLM *multi, struct server_stats_t *server) {
  * Save the statistics about an object that has been fetched.
  */
 static struct object_stats_t *save_stats(CURL *handle) {
-    char *url;
     struct timeval end;
-    struct object_stats_t *object;
+    struct object_stats_t *object = NULL;
     struct server_stats_t *server;
     double lookup, connect, start_transfer, total_time;
     double bytes;
     long connect_count;
     long code;
-    char host[MAX_DNS_NAME_LEN];
-    char path[MAX_PATH_LEN];
-    int i;
 
     gettimeofday(&end, NULL);
 
-    curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url);
-    split_url(url, host, path, 0);
-    get_server(host, server_list, &server);
+    curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char**)&object);
+    assert(object);
+    get_server(object->server_name, server_list, &server);
 
     /* CURLINFO_PRIMARY_IP was added in 7.19.0 */
 #if LIBCURL_VERSION_NUM >= 0x071300
@@ -1055,17 +1022,11 @@ static struct object_stats_t *save_stats(CURL *handle) {
         server->failed_objects++;
     }
 
-    /* find object in queue */
-    for ( i = 0; i < server->num_pipelines; i++ ) {
-        server->pipelines[i] =
-            pop_object_from_queue(path, server->pipelines[i], &object);
-        if ( object != NULL ) {
-            object->next = NULL;
-            break;
-        }
-    }
+    /* take the object off the pipeline that it was fetched on */
+    server->pipelines[object->pipeline] =
+        remove_object_from_queue(object, server->pipelines[object->pipeline]);
+    object->next = NULL;
 
-    assert(object);
     object->end.tv_sec = end.tv_sec;
     object->end.tv_usec = end.tv_usec;
     object->lookup = lookup;
@@ -1075,7 +1036,6 @@ static struct object_stats_t *save_stats(CURL *handle) {
     object->size = bytes;
     object->connect_count = connect_count;
     object->code = code;
-    object->pipeline = i;
     server->finished = add_object_to_queue(object, server->finished);
 
     curl_slist_free_all(object->slist);
@@ -1097,8 +1057,6 @@ static void check_messages(CURLM *multi, int *running_handles) {
     char *url;
     double bytes;
     CURL *handle;
-    char host[MAX_DNS_NAME_LEN];
-    char path[MAX_PATH_LEN];
     struct server_stats_t *redirect = NULL;
 
     /* check for messages from the transfers - errors or completed transfers */
@@ -1136,9 +1094,6 @@ static void check_messages(CURLM *multi, int *running_handles) {
         object = save_stats(msg->easy_handle);
         curl_multi_remove_handle(multi, handle);
 
-        /* split the url before we cleanup the handle (and lose the pointer) */
-        split_url(url, (char*)&host, (char*)&path, 0);
-
         /* no longer participate in the shared dns cache with this handle */
         curl_easy_setopt(handle, CURLOPT_SHARE, NULL);
         curl_easy_cleanup(handle);
@@ -1154,9 +1109,10 @@ static void check_messages(CURLM *multi, int *running_handles) {
             redirect = add_object(object->location, object->parse);
         }
 
-        get_server(host, server_list, &server);
+        get_server(object->server_name, server_list, &server);
         if ( server == NULL ) {
-            Log(LOG_ERR, "getServer() failed for '%s'\n", host);
+            Log(LOG_ERR, "getServer() failed for '%s'\n",
+                    object->server_name);
             exit(EXIT_FAILURE);
         }
 
@@ -1177,107 +1133,189 @@ static void check_messages(CURLM *multi, int *running_handles) {
 
 
 /*
- * Ask curl how long we should wait before trying again, or use a fixed wait
- * time if curl is unable to tell us.
+ * Start fetching the next pending object from every server, if there is
+ * room for it. Objects found while parsing are added to the pending queues
+ * and need to be started here.
+ */
+static void start_pending_objects(CURLM *multi) {
+    struct server_stats_t *server;
+
+    for ( server = server_list; server != NULL; server = server->next ) {
+        if ( server->pending != NULL &&
+                pipeline_next_object(multi, server) != NULL ) {
+            running_handles++;
+        }
+    }
+}
+
+
+
+/*
+ * Tell curl about activity on a socket (or a timeout), then deal with any
+ * transfers that finished and start anything new. Stops the event loop once
+ * there is nothing left to fetch.
  */
-static long get_wait_timeout(CURLM *multi) {
-    long wait;
+static void socket_action(CURLM *multi, curl_socket_t sock, int action) {
 
-#if HAVE_CURL_MULTI_TIMEOUT
-    if ( curl_multi_timeout(multi, &wait) ) {
-        Log(LOG_ERR, "error calling curl_multi_timeout!\n");
+    if ( curl_multi_socket_action(multi, sock, action, &running_handles) !=
+            CURLM_OK ) {
+        Log(LOG_ERR, "error calling curl_multi_socket_action!\n");
         exit(EXIT_FAILURE);
     }
 
-    /* it's polite to wait at least a short time */
-    if ( wait < 0 ) {
-        wait = 100;
+    /* check if there are any completed transfers */
+    check_messages(multi, &running_handles);
+
+    start_pending_objects(multi);
+
+    if ( running_handles <= 0 ) {
+        evtimer_del(timer_event);
+        event_base_loopbreak(base);
     }
-#else
-    wait = 100;
-#endif
+}
 
-    return wait;
+
+
+/*
+ * Callback used when a socket that curl is interested in is ready.
+ */
+static void socket_event_callback(evutil_socket_t evsock, short flags,
+        void *evdata) {
+
+    int action = 0;
+
+    if ( flags & EV_READ ) {
+        action |= CURL_CSELECT_IN;
+    }
+
+    if ( flags & EV_WRITE ) {
+        action |= CURL_CSELECT_OUT;
+    }
+
+    socket_action((CURLM*)evdata, evsock, action);
 }
 
 
 
 /*
- * Fetch the given URL.
+ * Callback used when the timeout that curl asked for expires.
  */
-static int fetch(char *url) {
-    struct server_stats_t *server;
-    int running_handles = -1;
-    int max_fd;
-    struct timeval timeout;
-    fd_set read_fdset, write_fdset, except_fdset;
-    int result = 0;
-    long wait;
+static void timer_event_callback(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        void *evdata) {
 
-    /* add the primary server/path that is being fetched */
-    add_object(url, 1);
+    socket_action((CURLM*)evdata, CURL_SOCKET_TIMEOUT, 0);
+}
 
-    while ( running_handles ) {
-        /* force start any connections that need it */
-        for ( server = server_list; server != NULL; server = server->next ) {
-            pipeline_next_object(multi, server);
-        }
 
-        /* call curl_multi_perform() until it no longer wants to be run */
-        while ( curl_multi_perform(multi, &running_handles) ==
-                CURLM_CALL_MULTI_PERFORM ) {
-            /* keep calling curl_multi_perform() */
+
+/*
+ * Called by curl to tell us which events it is interested in on a socket.
+ * Each socket has a persistent event that is updated as this changes, and
+ * is stored with the socket in curl so that no lookup is required.
+ */
+static int update_socket(__attribute__((unused))CURL *handle,
+        curl_socket_t sock, int what, void *userp, void *socketp) {
+
+    CURLM *multi = (CURLM*)userp;
+    struct event *event = (struct event*)socketp;
+    short flags = 0;
+
+    if ( what == CURL_POLL_REMOVE ) {
+        if ( event ) {
+            event_free(event);
+            curl_multi_assign(multi, sock, NULL);
         }
+        return 0;
+    }
 
-        /*
-         * If there are any running handles then determine which file handles
-         * involved are ready for reading/writing
-         */
-        if ( running_handles ) {
-            do {
-                FD_ZERO(&read_fdset);
-                FD_ZERO(&write_fdset);
-                FD_ZERO(&except_fdset);
-                max_fd = -1;
-
-                /* add any running file descriptors to the lists */
-                if ( curl_multi_fdset(multi, &read_fdset, &write_fdset,
-                            &except_fdset, &max_fd)) {
-                    Log(LOG_ERR, "error calling curl_multi_fdset!\n");
-                    exit(EXIT_FAILURE);
-                }
+    if ( what & CURL_POLL_IN ) {
+        flags |= EV_READ;
+    }
 
-                /* check how long we should be waiting for before timing out */
-                wait = get_wait_timeout(multi);
+    if ( what & CURL_POLL_OUT ) {
+        flags |= EV_WRITE;
+    }
 
-                /* if there are no descriptors, sleep and skip the select */
-                if ( max_fd < 0 ) {
-                    usleep(wait / 1000);
-                    break;
-                }
+    if ( event == NULL ) {
+        event = event_new(base, sock, flags | EV_PERSIST,
+                socket_event_callback, multi);
+        curl_multi_assign(multi, sock, event);
+    } else {
+        event_del(event);
+        event_assign(event, base, sock, flags | EV_PERSIST,
+                socket_event_callback, multi);
+    }
 
-                /* TODO update timeout values if interrupted */
-                timeout.tv_sec = wait / 1000;
-                timeout.tv_usec = (wait % 1000) * 1000;
+    event_add(event, NULL);
 
-                result = select(max_fd + 1, &read_fdset, &write_fdset,
-                        &except_fdset, &timeout);
+    return 0;
+}
 
-            } while ( result < 0 && errno == EINTR );
 
-            if ( result < 0 ) {
-                Log(LOG_ERR, "error calling select(): %s", strerror(errno));
-                exit(EXIT_FAILURE);
-            }
-        }
 
-        /* check if there are any completed transfers */
-        check_messages(multi, &running_handles);
+/*
+ * Called by curl to update the single timeout it wants for the multi handle.
+ */
+static int update_timer(__attribute__((unused))CURLM *multi, long timeout_ms,
+        __attribute__((unused))void *userp) {
+
+    struct timeval timeout;
+
+    if ( timeout_ms < 0 ) {
+        evtimer_del(timer_event);
+        return 0;
+    }
+
+    /* a zero timeout means act now, which the next loop iteration will do */
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    evtimer_add(timer_event, &timeout);
+
+    return 0;
+}
+
+
+
+/*
+ * Fetch the given URL. Curl tells us which sockets and timeouts it cares
+ * about and libevent wakes us only when one of them needs attention, rather
+ * than polling every socket after every change.
+ */
+static int fetch(char *url) {
+
+    if ( (base = event_base_new()) == NULL ) {
+        Log(LOG_ERR, "Failed to create event base for HTTP test");
+        exit(EXIT_FAILURE);
+    }
+
+    timer_event = evtimer_new(base, timer_event_callback, multi);
+
+    curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, update_socket);
+    curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, multi);
+    curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, update_timer);
+    curl_multi_setopt(multi, CURLMOPT_TIMERDATA, NULL);
+
+    /* add the primary server/path that is being fetched */
+    add_object(url, 1);
+    start_pending_objects(multi);
+
+    /* kick off the first transfer, everything after that is event driven */
+    socket_action(multi, CURL_SOCKET_TIMEOUT, 0);
+
+    if ( running_handles > 0 ) {
+        event_base_dispatch(base);
     }
 
     curl_multi_cleanup(multi);
 
-    return result;
+    event_free(timer_event);
+    event_base_free(base);
+    timer_event = NULL;
+    base = NULL;
+
+    return 0;
 }
 
 
@@ -1400,6 +1438,10 @@ amp_test_result_t* run_http(int argc, char *argv[],
 
     Log(LOG_DEBUG, "Starting HTTP test");
 
+    /* start with an empty server list, nothing is shared between runs */
+    server_list = NULL;
+    clear_server_index();
+
     /* set some sensible defaults */
     options.url[0] = '\0';
     options.keep_alive = 1;
@@ -1550,6 +1592,9 @@ test_t *register_test() {
     /* don't give the http test a SIGINT warning */
     new_test->sigint = 0;
 
+    /* keeps global state between runs, always run it in a new process */
+    new_test->reentrant = 0;
+
     return new_test;
 }
 
@@ -128,6 +128,8 @@ struct server_stats_t {
     struct object_stats_t **pipelines;
     struct object_stats_t *pending;
     struct object_stats_t *finished;
+    struct object_stats_t **object_index;   /* all objects, by path */
+    struct server_stats_t *hash_next;   /* next server in the same bucket */
     struct server_stats_t *next;
 };
 
@@ -150,6 +152,7 @@ struct object_stats_t {
     uint8_t pipeline;
     char *location;
     int parse;
+    struct object_stats_t *hash_next;   /* next object in the same bucket */
     struct object_stats_t *next;
 };
 
@@ -46,6 +46,25 @@
 
 extern int total_pipelines;
 
+/* every server in the server list, indexed by name */
+static struct server_stats_t *server_index[SERVER_HASH_SIZE];
+
+
+
+/*
+ * FNV-1a hash of a server name or object path.
+ */
+static uint32_t hash_string(char *str) {
+    uint32_t hash = 2166136261u;
+
+    while ( *str != '\0' ) {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
 
 
 /*
@@ -61,6 +80,8 @@ static struct server_stats_t *create_server(char *name, int pipelines) {
     strcpy(server->address, "0.0.0.0");
 
     server->pipelining_maxrequests = 1;
+    server->object_index =
+        calloc(OBJECT_HASH_SIZE, sizeof(struct object_stats_t*));
     server->pipelines = malloc(pipelines * sizeof(struct object_stats_t*));
     server->pipelen = malloc(pipelines * sizeof(int));
     server->num_pipelines = pipelines;
@@ -77,30 +98,101 @@ static struct server_stats_t *create_server(char *name, int pipelines) {
 
 
 
+/*
+ * Forget every server in the index, ready to start a new server list. This
+ * must be done at the start of every test run, the index would otherwise
+ * still point at servers from an earlier run in the same process.
+ */
+void clear_server_index(void) {
+    memset(server_index, 0, sizeof(server_index));
+}
+
+
+
 /*
  * Try to find the given server name in the server list. If it is not found
  * then it should be created. Regardless, the (possibly updated) server list
  * is returned and a reference to the particular server is stored in result.
+ * Servers are found through the index rather than walking the list, which
+ * is only walked to append a new server so that they stay in order.
  */
 struct server_stats_t *get_server(char *name,
         struct server_stats_t *server, struct server_stats_t **result) {
 
+    struct server_stats_t *tail;
+    uint32_t bucket;
+
     assert(name);
     assert(result);
 
-    /* the server list is empty, create the server and return it as the list */
+    bucket = hash_string(name) % SERVER_HASH_SIZE;
+
+    for ( *result = server_index[bucket]; *result != NULL;
+            *result = (*result)->hash_next ) {
+        /* this is the server we were after */
+        if ( strcmp(name, (*result)->server_name) == 0 ) {
+            return server;
+        }
+    }
+
+    *result = create_server(name, total_pipelines);
+    (*result)->hash_next = server_index[bucket];
+    server_index[bucket] = *result;
+
+    /* the server list is empty, return the new server as the list */
     if ( server == NULL ) {
-        *result = create_server(name, total_pipelines);
         return *result;
     }
 
-    /* this is the server we were after */
-    if ( strcmp(name, server->server_name) == 0 ) {
-        *result = server;
-        return server;
+    for ( tail = server; tail->next != NULL; tail = tail->next ) {
+        /* nothing */
     }
 
-    /* keep looking down the list */
-    server->next = get_server(name, server->next, result);
+    tail->next = *result;
     return server;
 }
+
+
+
+/*
+ * Find an object that has already been added to a server, regardless of
+ * whether it is pending, in progress or finished.
+ */
+struct object_stats_t *find_object(struct server_stats_t *server,
+        char *path) {
+
+    struct object_stats_t *object;
+    uint32_t bucket;
+
+    assert(server);
+    assert(path);
+
+    bucket = hash_string(path) % OBJECT_HASH_SIZE;
+
+    for ( object = server->object_index[bucket]; object != NULL;
+            object = object->hash_next ) {
+        if ( strcmp(path, object->path) == 0 ) {
+            return object;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Add an object to the index for the server it is fetched from.
+ */
+void index_object(struct server_stats_t *server,
+        struct object_stats_t *object) {
+
+    uint32_t bucket;
+
+    assert(server);
+    assert(object);
+
+    bucket = hash_string(object->path) % OBJECT_HASH_SIZE;
+    object->hash_next = server->object_index[bucket];
+    server->object_index[bucket] = object;
+}
@@ -42,7 +42,15 @@
 
 #include "http.h"
 
+/* number of buckets in the server name and per server object path indexes */
+#define SERVER_HASH_SIZE 64
+#define OBJECT_HASH_SIZE 256
+
+void clear_server_index(void);
 struct server_stats_t *get_server(char *name,
         struct server_stats_t *server, struct server_stats_t **result);
+struct object_stats_t *find_object(struct server_stats_t *server, char *path);
+void index_object(struct server_stats_t *server,
+        struct object_stats_t *object);
 
 #endif
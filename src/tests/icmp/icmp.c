@@ -52,6 +52,7 @@
 #include <assert.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <stddef.h>
 #include <signal.h>
 #include <event2/event.h>
 
@@ -64,7 +65,7 @@
 #include "icmpcode.h"
 #include "dscp.h"
 #include "usage.h"
-#include "checksum.h"
+#include "probe.h"
 
 
 /*
@@ -73,6 +74,7 @@
  */
 
 static struct option long_options[] = {
+    {"census", no_argument, 0, 'C'},
     {"perturbate", required_argument, 0, 'p'},
     {"random", no_argument, 0, 'r'},
     {"size", required_argument, 0, 's'},
@@ -117,25 +119,102 @@ static void halt_test(
     struct icmpglobals_t *globals = (struct icmpglobals_t *)evdata;
 
     Log(LOG_DEBUG, "Halting ICMP test due to timeout");
-    if ( globals->losstimer ) {
-        event_free(globals->losstimer);
-        globals->losstimer = NULL;
-    }
     event_base_loopbreak(globals->base);
 }
 
 
 
+/*
+ * Probes are numbered by the index of their destination. The low 16 bits are
+ * sent as the sequence number and the rest are added to the ident, so that a
+ * test can have more than 65536 destinations. Returns the index, or -1 if the
+ * ident and sequence number don't belong to one of our probes.
+ */
+static int get_probe_index(struct icmpglobals_t *globals, uint16_t ident,
+        uint16_t seq) {
+    uint32_t index;
+
+    index = ((uint32_t)(uint16_t)(ident - globals->ident) << 16) | seq;
+
+    if ( globals->count < 0 || index >= (uint32_t)globals->count ) {
+        return -1;
+    }
+
+    return index;
+}
+
+
+
+/*
+ * Update the smoothed round trip time and variation (as per RFC 6298) and
+ * the maximum round trip time with a new measurement.
+ */
+static void update_rtt_estimate(struct icmpglobals_t *globals, uint32_t rtt) {
+    uint32_t diff;
+
+    if ( globals->replies == 0 ) {
+        globals->srtt = rtt;
+        globals->rttvar = rtt / 2;
+        globals->max_rtt = rtt;
+    } else {
+        diff = (rtt > globals->srtt) ? rtt - globals->srtt :
+            globals->srtt - rtt;
+        globals->rttvar = (3 * globals->rttvar + diff) / 4;
+        globals->srtt = (7 * globals->srtt + rtt) / 8;
+        if ( rtt > globals->max_rtt ) {
+            globals->max_rtt = rtt;
+        }
+    }
+
+    globals->replies++;
+}
+
+
+
+/*
+ * Determine how long to wait for responses after the last probe is sent.
+ * Census mode waits for twice the longest of the observed round trip times
+ * and the retransmission timeout they suggest, so that large lists of
+ * targets can finish quickly. Otherwise, or if nothing has responded yet,
+ * wait the full LOSS_TIMEOUT.
+ */
+static void get_loss_timeout(struct icmpglobals_t *globals,
+        struct timeval *timeout) {
+    uint64_t wait;
+
+    if ( !globals->options.census || globals->replies == 0 ) {
+        wait = LOSS_TIMEOUT * (uint64_t)1000000;
+    } else {
+        wait = (uint64_t)globals->srtt + 4 * (uint64_t)globals->rttvar;
+        if ( globals->max_rtt > wait ) {
+            wait = globals->max_rtt;
+        }
+        wait *= 2;
+
+        if ( wait < ICMP_CENSUS_MIN_LOSS_TIMEOUT ) {
+            wait = ICMP_CENSUS_MIN_LOSS_TIMEOUT;
+        } else if ( wait > LOSS_TIMEOUT * (uint64_t)1000000 ) {
+            wait = LOSS_TIMEOUT * (uint64_t)1000000;
+        }
+    }
+
+    timeout->tv_sec = S_FROM_US(wait);
+    timeout->tv_usec = US_FROM_US(wait);
+}
+
+
+
 /*
  * Check an icmp error to determine if it is in response to a packet we have
  * sent. If it is then the error needs to be recorded.
  */
-static int icmp_error(char *packet, int bytes, uint16_t ident,
-        struct info_t info[]) {
+static int icmp_error(struct icmpglobals_t *globals, char *packet,
+        int bytes) {
     struct iphdr *ip, *embed_ip;
     struct icmphdr *icmp, *embed_icmp;
-    uint16_t seq;
+    struct info_t *info = globals->info;
     int required_bytes;
+    int seq;
 
     ip = (struct iphdr *)packet;
 
@@ -174,12 +253,12 @@ static int icmp_error(char *packet, int bytes, uint16_t ident,
     /* make sure the embedded header looks like one of ours */
     if ( embed_icmp->type > NR_ICMP_TYPES ||
 	    embed_icmp->type != ICMP_ECHO || embed_icmp->code != 0 ||
-	    ntohs(embed_icmp->un.echo.id) != ident) {
+	    (seq = get_probe_index(globals, ntohs(embed_icmp->un.echo.id),
+                ntohs(embed_icmp->un.echo.sequence))) < 0 ) {
         Log(LOG_DEBUG, "Embedded packet ICMP ECHO, or not our ECHO\n");
 	return -1;
     }
 
-    seq = ntohs(embed_icmp->un.echo.sequence);
     /*
      * TODO it's possible for this to be clobbered by the most recent error
      * (though unlikely except in the case of redirects). Do we care?
@@ -211,7 +290,7 @@ static int process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
 
     struct iphdr *ip;
     struct icmphdr *icmp;
-    uint16_t seq;
+    int seq;
     int64_t delay;
 
     /* make sure that we read enough data to have a valid response */
@@ -237,20 +316,14 @@ static int process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
 
     /* if it isn't an echo reply it could still be an error for us */
     if ( icmp->type != ICMP_ECHOREPLY ) {
-	return icmp_error(packet, bytes, globals->ident, globals->info);
-    }
-
-    /* if it is an echo reply but the id doesn't match then it's not ours */
-    if ( ntohs(icmp->un.echo.id ) != globals->ident ) {
-        Log(LOG_DEBUG, "Bad ident (got %d, expected %d)",
-                ntohs(icmp->un.echo.id), globals->ident);
-	return -1;
+	return icmp_error(globals, packet, bytes);
     }
 
-    /* check the sequence number is less than the maximum number of requests */
-    seq = ntohs(icmp->un.echo.sequence);
-    if ( seq > globals->count ) {
-        Log(LOG_DEBUG, "Bad sequence number\n");
+    /* if it is an echo reply but the id/sequence don't match it's not ours */
+    if ( (seq = get_probe_index(globals, ntohs(icmp->un.echo.id),
+                    ntohs(icmp->un.echo.sequence))) < 0 ) {
+        Log(LOG_DEBUG, "Bad ident or sequence number (got %d/%d)",
+                ntohs(icmp->un.echo.id), ntohs(icmp->un.echo.sequence));
 	return -1;
     }
 
@@ -261,6 +334,12 @@ static int process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
 	return -1;
     }
 
+    /* ignore duplicates, they would throw off the outstanding count */
+    if ( globals->info[seq].reply ) {
+        Log(LOG_DEBUG, "Duplicate reply for probe %d", seq);
+        return -1;
+    }
+
     /* reply is good, record the round trip time */
     globals->info[seq].reply = 1;
     globals->outstanding--;
@@ -272,6 +351,8 @@ static int process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
         globals->info[seq].delay = 0;
     }
 
+    update_rtt_estimate(globals, globals->info[seq].delay);
+
     Log(LOG_DEBUG, "Good ICMP ECHOREPLY");
     return 0;
 }
@@ -287,21 +368,20 @@ static int process_ipv6_packet(struct icmpglobals_t *globals, char *packet,
         uint32_t bytes, struct timeval *now) {
 
     struct icmp6_hdr *icmp;
-    uint16_t seq;
+    int seq;
     int64_t delay;
 
-    if ( bytes < sizeof(struct icmp6_hdr) ) {
+    if ( bytes < sizeof(struct icmp6_hdr) + sizeof(uint16_t) ) {
         return -1;
     }
 
     /* any icmpv6 packets we get have the outer ipv6 header stripped */
     icmp = (struct icmp6_hdr *)packet;
-    seq = ntohs(icmp->icmp6_seq);
 
     /* sanity check the various fields of the icmp header */
     if ( icmp->icmp6_type != ICMP6_ECHO_REPLY ||
-	    ntohs(icmp->icmp6_id) != globals->ident ||
-	    seq > globals->count ) {
+	    (seq = get_probe_index(globals, ntohs(icmp->icmp6_id),
+                ntohs(icmp->icmp6_seq))) < 0 ) {
 	return -1;
     }
 
@@ -311,6 +391,12 @@ static int process_ipv6_packet(struct icmpglobals_t *globals, char *packet,
 	return -1;
     }
 
+    /* ignore duplicates, they would throw off the outstanding count */
+    if ( globals->info[seq].reply ) {
+        Log(LOG_DEBUG, "Duplicate reply for probe %d", seq);
+        return -1;
+    }
+
     /* reply is good, record the round trip time */
     globals->info[seq].reply = 1;
     globals->outstanding--;
@@ -322,6 +408,8 @@ static int process_ipv6_packet(struct icmpglobals_t *globals, char *packet,
         globals->info[seq].delay = 0;
     }
 
+    update_rtt_estimate(globals, globals->info[seq].delay);
+
     Log(LOG_DEBUG, "Good ICMP6 ECHOREPLY");
     return 0;
 }
@@ -335,36 +423,36 @@ static int process_ipv6_packet(struct icmpglobals_t *globals, char *packet,
 static void receive_probe_callback(evutil_socket_t evsock,
         short flags, void *evdata) {
 
-    char packet[RESPONSE_BUFFER_LEN];
-    struct timeval now;
     struct iphdr *ip;
-    ssize_t bytes;
-    int wait;
-    struct socket_t sockets;
+    struct packet_t *packet;
     struct icmpglobals_t *globals = (struct icmpglobals_t*)evdata;
+    int i;
 
     assert(evsock > 0);
     assert(flags == EV_READ);
 
-    wait = 0;
+    /* make sure sent times are as accurate as possible before using them */
+    harvest_tx_timestamps(globals->queue);
+    harvest_tx_timestamps(globals->queue6);
 
-    /* the socket used here doesn't matter as the family isn't used anywhere */
-    sockets.socket = evsock;
-    sockets.socket6 = -1;
+    /* read every response that has arrived so far, not just the first */
+    get_packet_batch(evsock, globals->batch);
 
-    if ( (bytes=get_packet(&sockets, packet, RESPONSE_BUFFER_LEN, NULL, &wait,
-                    &now)) > 0 ) {
+    for ( i = 0; i < globals->batch->count; i++ ) {
+        packet = &globals->batch->packets[i];
 	/*
 	 * this check isn't as nice as it could be - should we explicitly ask
 	 * for the icmp6 header to be returned so we can be sure we are
 	 * checking the right things?
 	 */
-        ip = (struct iphdr*)packet;
+        ip = (struct iphdr*)packet->data;
         switch ( ip->version ) {
-	    case 4: process_ipv4_packet(globals, packet, bytes, &now);
+	    case 4: process_ipv4_packet(globals, packet->data, packet->length,
+                            &packet->time);
 		    break;
 	    default: /* unless we ask we don't have an ipv6 header here */
-		    process_ipv6_packet(globals, packet, bytes, &now);
+		    process_ipv6_packet(globals, packet->data, packet->length,
+                            &packet->time);
 		    break;
 	};
     }
@@ -379,142 +467,193 @@ static void receive_probe_callback(evutil_socket_t evsock,
 
 
 /*
- * Build the ICMP packet and data that we send as a probe.
+ * Build the ICMP packet that we send as a probe. This is only done once per
+ * address family, then update_probe() fills in the values for each target.
  */
-static int build_probe(uint8_t family, void *packet, uint16_t packet_size,
-        int seq, uint16_t ident, uint16_t magic) {
-
+static struct probe_template_t *build_probe(uint8_t family,
+        uint16_t packet_size) {
+    struct probe_template_t *probe;
     struct icmphdr *icmp;
-    int hlen;
 
-    assert(packet);
     assert(packet_size >= MIN_PACKET_LEN);
 
-    memset(packet, 0, packet_size);
-
-    icmp = (struct icmphdr*)packet;
-    icmp->type = (family == AF_INET) ? ICMP_ECHO : ICMP6_ECHO_REQUEST;
-    icmp->code = 0;
-    icmp->checksum = 0;
-    icmp->un.echo.id = htons(ident);
-    icmp->un.echo.sequence = htons(seq);
-    memcpy((uint8_t *)packet + sizeof(struct icmphdr), &magic, sizeof(magic));
-
     if ( family == AF_INET ) {
-        hlen = sizeof(struct iphdr);
-        icmp->checksum = checksum((uint16_t*)packet, packet_size - hlen);
+        probe = new_probe_template(packet_size - sizeof(struct iphdr),
+                offsetof(struct icmphdr, checksum));
     } else {
-        hlen = sizeof(struct ip6_hdr);
         /* icmp6 checksum will be calculated for us */
+        probe = new_probe_template(packet_size - sizeof(struct ip6_hdr),
+                PROBE_NO_CHECKSUM);
     }
 
+    icmp = (struct icmphdr*)probe->packet;
+    icmp->type = (family == AF_INET) ? ICMP_ECHO : ICMP6_ECHO_REQUEST;
+    icmp->code = 0;
 
-    return packet_size - hlen;
+    probe_template_checksum(probe);
+
+    return probe;
 }
 
 
 
 /*
- * Construct and send an icmp echo request packet.
+ * Set the ident, sequence number and magic value in a probe template ready to
+ * be sent to a particular target. Only the changed fields are included in the
+ * checksum update. Returns the length of the ICMP part of the packet.
  */
-static void send_packet(
-        __attribute__((unused))evutil_socket_t evsock,
-        __attribute__((unused))short flags,
-        void *evdata) {
+static int update_probe(struct probe_template_t *probe, int index,
+        uint16_t ident, uint16_t magic) {
 
-    char *packet;
-    int sock;
-    int length;
-    int delay;
-    int seq;
-    uint16_t ident;
+    assert(probe);
+
+    probe_template_set16(probe, offsetof(struct icmphdr, un.echo.id),
+            ident + (index >> 16));
+    probe_template_set16(probe, offsetof(struct icmphdr, un.echo.sequence),
+            index & 0xffff);
+    probe_template_set(probe, sizeof(struct icmphdr), &magic, sizeof(magic));
+
+    return probe->length;
+}
+
+
+
+/*
+ * Queue an icmp echo request packet to the next destination. Returns 0 if the
+ * probe was queued, -1 if the destination can't be tested.
+ */
+static int queue_probe(struct icmpglobals_t *globals, int seq) {
+    struct send_queue_t *queue;
     struct addrinfo *dest;
-    struct opt_t *opt;
-    struct icmpglobals_t *globals;
     struct info_t *info;
-    struct timeval timeout;
+    struct probe_template_t *probe;
+    int length;
 
-    globals = (struct icmpglobals_t *)evdata;
-    info = globals->info;
-    seq = globals->index;
-    ident = globals->ident;
+    info = &globals->info[seq];
     dest = globals->dests[seq];
-    opt = &globals->options;
-    packet = NULL;
 
     /* save information about this packet so we can track the response */
-    memset(&info[seq], 0, sizeof(info[seq]));
-    info[seq].addr = dest;
-    info[seq].magic = rand();
+    memset(info, 0, sizeof(struct info_t));
+    info->addr = dest;
+    info->magic = rand();
 
-    /* TODO should we try to send the next packet in this time slot? */
     if ( !dest->ai_addr ) {
         Log(LOG_INFO, "No address for target %s, skipping", dest->ai_canonname);
-        goto next;
+        return -1;
     }
 
     /* determine which socket we should use, ipv4 or ipv6 */
     switch ( dest->ai_family ) {
-	case AF_INET: sock = globals->sockets.socket; break;
-	case AF_INET6: sock = globals->sockets.socket6; break;
+	case AF_INET: queue = globals->queue; probe = globals->probe; break;
+	case AF_INET6: queue = globals->queue6; probe = globals->probe6; break;
 	default: Log(LOG_WARNING, "Unknown address family: %d",dest->ai_family);
-                 goto next;
+                 return -1;
     };
 
-    if ( sock < 0 ) {
+    if ( queue == NULL ) {
 	Log(LOG_WARNING, "Unable to test to %s, socket wasn't opened",
                 dest->ai_canonname);
-        goto next;
+        return -1;
+    }
+
+    length = update_probe(probe, seq, globals->ident, info->magic);
+
+    return queue_packet(queue, (char*)probe->packet, length, dest,
+            &info->time_sent);
+}
+
+
+
+/*
+ * Send the next probe, or the next burst of probes in census mode. This is
+ * called by a single repeating timer until every destination has been sent
+ * a probe, then the loss timer is started to wait for the last responses.
+ */
+static void send_packet(
+        __attribute__((unused))evutil_socket_t evsock,
+        __attribute__((unused))short flags,
+        void *evdata) {
+
+    struct icmpglobals_t *globals = (struct icmpglobals_t *)evdata;
+    int queued[ICMP_CENSUS_BURST];
+    struct timeval timeout;
+    int first = globals->index;
+    int burst = 1;
+    int i;
+
+    if ( globals->options.census ) {
+        /* send however many probes are due, in case the timer ran late */
+        struct timeval now;
+        int64_t due;
+
+        gettimeofday(&now, NULL);
+        if ( globals->index == 0 ) {
+            globals->census_start = now;
+        }
+
+        if ( globals->options.inter_packet_delay > 0 ) {
+            due = DIFF_TV_US(now, globals->census_start) /
+                globals->options.inter_packet_delay + 1;
+        } else {
+            due = globals->index + ICMP_CENSUS_BURST;
+        }
+
+        if ( due - globals->index > ICMP_CENSUS_BURST ) {
+            burst = ICMP_CENSUS_BURST;
+        } else if ( due > globals->index ) {
+            burst = due - globals->index;
+        }
     }
 
-    /* build the probe packet */
-    packet = calloc(1, opt->packet_size);
-    length = build_probe(dest->ai_family, packet, opt->packet_size, seq, ident,
-            info[seq].magic);
+    for ( i = 0; i < burst && globals->index < globals->count; i++ ) {
+        queued[i] = (queue_probe(globals, globals->index++) == 0);
+    }
 
-    /* send packet with appropriate inter packet delay */
-    while ( (delay = delay_send_packet(sock, packet, length, dest,
-                    opt->inter_packet_delay, &(info[seq].time_sent))) > 0 ) {
-        usleep(delay);
+    if ( globals->queue ) {
+        flush_send_queue(globals->queue);
     }
 
-    if ( delay < 0 ) {
-        /* mark this as done if the packet failed to send properly */
-        info[seq].reply = 1;
-        memset(&(info[seq].time_sent), 0, sizeof(struct timeval));
-    } else {
-        globals->outstanding++;
+    if ( globals->queue6 ) {
+        flush_send_queue(globals->queue6);
     }
 
-next:
-    globals->index++;
-    if ( globals->nextpackettimer ) {
-        event_free(globals->nextpackettimer);
-        globals->nextpackettimer = NULL;
-    }
-    /* create timer for sending the next packet if there are still more to go */
-    if ( globals->index == globals->count ) {
-        Log(LOG_DEBUG, "Reached final target: %d", globals->index);
-        if ( globals->outstanding == 0 ) {
-            /* avoid waiting for LOSS_TIMEOUT if no packets are outstanding */
-            event_base_loopbreak(globals->base);
+    /* the send time is cleared for anything that was queued but not sent */
+    for ( i = 0; i < globals->index - first; i++ ) {
+        if ( !queued[i] ) {
+            continue;
+        }
+
+        if ( globals->info[first + i].time_sent.tv_sec == 0 &&
+                globals->info[first + i].time_sent.tv_usec == 0 ) {
+            /* mark this as done if the packet failed to send properly */
+            globals->info[first + i].reply = 1;
         } else {
-            globals->losstimer = event_new(globals->base, -1, 0,
-                    halt_test, globals);
-            timeout.tv_sec = LOSS_TIMEOUT;
+            globals->outstanding++;
+        }
+    }
+
+    if ( globals->index < globals->count ) {
+        /* libevent won't repeat a timer with no delay, so do it here */
+        if ( globals->options.inter_packet_delay == 0 ) {
+            timeout.tv_sec = 0;
             timeout.tv_usec = 0;
-            event_add(globals->losstimer, &timeout);
+            event_add(globals->nextpackettimer, &timeout);
         }
-    } else {
-        globals->nextpackettimer = event_new(globals->base, -1, 0,
-                send_packet, globals);
-        timeout.tv_sec = (int)(globals->options.inter_packet_delay / 1000000);
-        timeout.tv_usec = globals->options.inter_packet_delay % 1000000;
-        event_add(globals->nextpackettimer, &timeout);
+        return;
     }
 
-    if ( packet ) {
-        free(packet);
+    /* every probe has been sent, wait for the responses to arrive */
+    Log(LOG_DEBUG, "Reached final target: %d", globals->index);
+    event_del(globals->nextpackettimer);
+
+    if ( globals->outstanding == 0 ) {
+        /* avoid waiting for the loss timeout if no packets are outstanding */
+        event_base_loopbreak(globals->base);
+    } else {
+        get_loss_timeout(globals, &timeout);
+        Log(LOG_DEBUG, "Waiting %d.%06ds for remaining responses",
+                (int)timeout.tv_sec, (int)timeout.tv_usec);
+        event_add(globals->losstimer, &timeout);
     }
 }
 
@@ -552,6 +691,27 @@ static int open_sockets(struct socket_t *sockets) {
 
 
 
+/*
+ * Ask for larger receive buffers in census mode, as responses to bursts of
+ * probes will arrive faster than we read them. The kernel will limit this to
+ * the system maximum, so failing isn't fatal.
+ */
+static void set_census_socket_options(struct socket_t *sockets) {
+    int size = ICMP_CENSUS_RCVBUF;
+
+    if ( sockets->socket > 0 && setsockopt(sockets->socket, SOL_SOCKET,
+                SO_RCVBUF, &size, sizeof(size)) < 0 ) {
+        Log(LOG_WARNING, "Failed to set receive buffer size for ICMP");
+    }
+
+    if ( sockets->socket6 > 0 && setsockopt(sockets->socket6, SOL_SOCKET,
+                SO_RCVBUF, &size, sizeof(size)) < 0 ) {
+        Log(LOG_WARNING, "Failed to set receive buffer size for ICMPv6");
+    }
+}
+
+
+
 /*
  * Construct a protocol buffer message containing the results for a single
  * destination address.
@@ -661,7 +821,7 @@ static amp_test_result_t* report_results(struct timeval *start_time, int count,
  */
 static void usage(void) {
     fprintf(stderr,
-            "Usage: amp-icmp [-hrvx] [-p perturbate] [-s packetsize]\n"
+            "Usage: amp-icmp [-Chrvx] [-p perturbate] [-s packetsize]\n"
             "                [-Q codepoint] [-Z interpacketgap]\n"
             "                [-I interface] [-4 [sourcev4]] [-6 [sourcev6]]\n"
             "                -- destination1 [destination2 ... destinationN]"
@@ -669,6 +829,8 @@ static void usage(void) {
 
     /* test specific options */
     fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -C, --census                   "
+            "Probe many targets in bursts, adapting the loss timeout\n");
     fprintf(stderr, "  -p, --perturbate     <msec>    "
             "Maximum number of milliseconds to delay test\n");
     fprintf(stderr, "  -r, --random                   "
@@ -698,11 +860,13 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
     struct event *signal_int;
     struct event *socket;
     struct event *socket6;
+    struct timeval interval;
+    uint64_t delay;
     amp_test_result_t *result;
 
     Log(LOG_DEBUG, "Starting ICMP test");
 
-    globals = (struct icmpglobals_t *)malloc(sizeof(struct icmpglobals_t));
+    globals = (struct icmpglobals_t *)calloc(1, sizeof(struct icmpglobals_t));
 
     globals->base = event_base_new();
 
@@ -712,11 +876,12 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
     globals->options.packet_size = DEFAULT_ICMP_ECHO_REQUEST_LEN;
     globals->options.random = 0;
     globals->options.perturbate = 0;
+    globals->options.census = 0;
     sourcev4 = NULL;
     sourcev6 = NULL;
     device = NULL;
 
-    while ( (opt = getopt_long(argc, argv, "p:rs:I:Q:Z:4::6::hvx",
+    while ( (opt = getopt_long(argc, argv, "Cp:rs:I:Q:Z:4::6::hvx",
                     long_options, NULL)) != -1 ) {
 	switch ( opt ) {
             case '4': address_string = parse_optional_argument(argv);
@@ -731,6 +896,7 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
                           sourcev6 = get_numeric_address(address_string, NULL);
                       };
                       break;
+            case 'C': globals->options.census = 1; break;
             case 'I': device = optarg; break;
             case 'Q': if ( parse_dscp_value(optarg,
                                   &globals->options.dscp) < 0 ) {
@@ -795,6 +961,10 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
 	exit(EXIT_FAILURE);
     }
 
+    if ( globals->options.census ) {
+        set_census_socket_options(&globals->sockets);
+    }
+
     if ( device && bind_sockets_to_device(&globals->sockets, device) < 0 ) {
         Log(LOG_ERR, "Unable to bind raw ICMP socket to device, aborting test");
 	exit(EXIT_FAILURE);
@@ -818,11 +988,37 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
     /* allocate space to store information about each request sent */
     globals->info = (struct info_t *)malloc(sizeof(struct info_t) * count);
 
+    /* allocate space to receive multiple responses at once */
+    globals->batch = new_packet_batch(PACKET_BATCH_SIZE, RESPONSE_BUFFER_LEN);
+
+    /*
+     * Pace probes on each socket independently of the other. In census mode
+     * each burst is sent back to back, with the timer only sending as many
+     * as are due to keep the average rate to one per inter packet delay.
+     */
+    globals->queue = globals->queue6 = NULL;
+    if ( globals->sockets.socket > 0 ) {
+        globals->queue = new_send_queue(globals->sockets.socket,
+                globals->options.census ? ICMP_CENSUS_BURST : 1,
+                globals->options.packet_size,
+                globals->options.census ? 0 :
+                globals->options.inter_packet_delay, 0);
+        globals->probe = build_probe(AF_INET, globals->options.packet_size);
+    }
+    if ( globals->sockets.socket6 > 0 ) {
+        globals->queue6 = new_send_queue(globals->sockets.socket6,
+                globals->options.census ? ICMP_CENSUS_BURST : 1,
+                globals->options.packet_size,
+                globals->options.census ? 0 :
+                globals->options.inter_packet_delay, 0);
+        globals->probe6 = build_probe(AF_INET6, globals->options.packet_size);
+    }
+
     globals->index = 0;
     globals->outstanding = 0;
     globals->count = count;
     globals->dests = dests;
-    globals->losstimer = NULL;
+    globals->losstimer = event_new(globals->base, -1, 0, halt_test, globals);
 
     /* catch a SIGINT and end the test early */
     signal_int = event_new(globals->base, SIGINT,
@@ -838,9 +1034,19 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
             EV_READ|EV_PERSIST, receive_probe_callback, globals);
     event_add(socket6, NULL);
 
-    /* schedule the first probe packet to be sent immediately */
+    /*
+     * Send probes on a repeating timer, starting immediately. In census mode
+     * it fires twice per burst so it can catch up if it runs late.
+     */
+    delay = globals->options.inter_packet_delay;
+    if ( globals->options.census ) {
+        delay = delay * ICMP_CENSUS_BURST / 2;
+    }
+    interval.tv_sec = S_FROM_US(delay);
+    interval.tv_usec = US_FROM_US(delay);
     globals->nextpackettimer = event_new(globals->base, -1,
             EV_PERSIST, send_packet, globals);
+    event_add(globals->nextpackettimer, &interval);
     event_active(globals->nextpackettimer, 0, 0);
 
     /* run the event loop till told to stop or all tests performed */
@@ -889,6 +1095,11 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
     result = report_results(&start_time, count, globals->info,
             &globals->options);
 
+    free_send_queue(globals->queue);
+    free_send_queue(globals->queue6);
+    free_packet_batch(globals->batch);
+    free_probe_template(globals->probe);
+    free_probe_template(globals->probe6);
     free(globals->info);
     free(globals);
 
@@ -999,6 +1210,9 @@ test_t *register_test() {
     /* don't give the icmp test a SIGINT warning, it should not take long! */
     new_test->sigint = 0;
 
+    /* no state is kept between runs, so it can run in a pooled worker */
+    new_test->reentrant = 1;
+
     return new_test;
 }
 
@@ -1014,4 +1228,19 @@ amp_test_result_t* amp_test_report_results(struct timeval *start_time,
         int count, struct info_t info[], struct opt_t *opt) {
     return report_results(start_time, count, info, opt);
 }
+
+void amp_test_update_rtt_estimate(struct icmpglobals_t *globals,
+        uint32_t rtt) {
+    update_rtt_estimate(globals, rtt);
+}
+
+void amp_test_get_loss_timeout(struct icmpglobals_t *globals,
+        struct timeval *timeout) {
+    get_loss_timeout(globals, timeout);
+}
+
+int amp_test_get_probe_index(struct icmpglobals_t *globals, uint16_t ident,
+        uint16_t seq) {
+    return get_probe_index(globals, ident, seq);
+}
 #endif
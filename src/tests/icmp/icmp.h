@@ -50,6 +50,7 @@
 #include <sys/time.h>
 
 #include "testlib.h"
+#include "probe.h"
 
 
 
@@ -74,6 +75,15 @@
 /* timeout (seconds) to wait after the last probe packet, currently 10s */
 #define LOSS_TIMEOUT 10
 
+/* number of probes sent together each time the send timer fires in census */
+#define ICMP_CENSUS_BURST 64
+
+/* shortest time (usec) to wait for responses in census mode */
+#define ICMP_CENSUS_MIN_LOSS_TIMEOUT 250000
+
+/* receive buffer size to ask for, so bursts of responses aren't dropped */
+#define ICMP_CENSUS_RCVBUF (4 * 1024 * 1024)
+
 
 
 /*
@@ -82,6 +92,7 @@
 struct opt_t {
     int random;			/* use random packet sizes (bytes) */
     int perturbate;		/* delay sending by up to this time (usec) */
+    int census;                 /* probe many targets in bursts, quickly */
     uint8_t dscp;               /* diffserv codepoint to set */
     uint16_t packet_size;	/* use this packet size (bytes) */
     uint32_t inter_packet_delay;/* minimum gap between packets (usec) */
@@ -114,11 +125,25 @@ struct icmpglobals_t {
     struct socket_t sockets;
     struct addrinfo **dests;
     struct info_t *info;
+    struct packet_batch_t *batch;
+    struct send_queue_t *queue;
+    struct send_queue_t *queue6;
+    struct probe_template_t *probe; /* probe templates, updated per target */
+    struct probe_template_t *probe6;
     uint16_t ident;
     int index;
     int count;
     int outstanding;
 
+    /* when census mode started sending, to keep to the right rate */
+    struct timeval census_start;
+
+    /* round trip time estimates (usec) used to set the loss timeout */
+    int replies;
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t max_rtt;
+
     struct event_base *base;
     struct event *nextpackettimer;
     struct event *losstimer;
@@ -135,6 +160,12 @@ int amp_test_process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
         uint32_t bytes, struct timeval *now);
 amp_test_result_t* amp_test_report_results(struct timeval *start_time,
         int count, struct info_t info[], struct opt_t *opt);
+void amp_test_update_rtt_estimate(struct icmpglobals_t *globals,
+        uint32_t rtt);
+void amp_test_get_loss_timeout(struct icmpglobals_t *globals,
+        struct timeval *timeout);
+int amp_test_get_probe_index(struct icmpglobals_t *globals, uint16_t ident,
+        uint16_t seq);
 #endif
 
 
@@ -0,0 +1,108 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "tests.h"
+#include "icmp.h"
+
+/*
+ * Check that probes can be matched to destinations beyond the 16 bit
+ * sequence number, and that census mode waits for a loss timeout based on
+ * the response times seen rather than the full LOSS_TIMEOUT.
+ */
+int main(void) {
+    struct icmpglobals_t globals;
+    struct timeval timeout;
+    int i;
+
+    memset(&globals, 0, sizeof(globals));
+
+    /* probes past the sequence number space carry on in the next ident */
+    globals.ident = 0xfffe;
+    globals.count = 70000;
+    assert(amp_test_get_probe_index(&globals, 0xfffe, 0) == 0);
+    assert(amp_test_get_probe_index(&globals, 0xfffe, 0xffff) == 0xffff);
+    assert(amp_test_get_probe_index(&globals, 0xffff, 0) == 0x10000);
+    assert(amp_test_get_probe_index(&globals, 0xffff, 69999 - 0x10000) ==
+            69999);
+    assert(amp_test_get_probe_index(&globals, 0xffff, 70000 - 0x10000) < 0);
+    assert(amp_test_get_probe_index(&globals, 0x0000, 0) < 0);
+    assert(amp_test_get_probe_index(&globals, 0xfffd, 0) < 0);
+
+    globals.count = 10;
+    assert(amp_test_get_probe_index(&globals, 0xfffe, 9) == 9);
+    assert(amp_test_get_probe_index(&globals, 0xfffe, 10) < 0);
+
+    /* without census mode, always wait the full loss timeout */
+    amp_test_update_rtt_estimate(&globals, 20000);
+    amp_test_get_loss_timeout(&globals, &timeout);
+    assert(timeout.tv_sec == LOSS_TIMEOUT && timeout.tv_usec == 0);
+
+    /* with census mode but no responses, also wait the full loss timeout */
+    memset(&globals, 0, sizeof(globals));
+    globals.options.census = 1;
+    amp_test_get_loss_timeout(&globals, &timeout);
+    assert(timeout.tv_sec == LOSS_TIMEOUT && timeout.tv_usec == 0);
+
+    /* fast, consistent responses wait for the minimum timeout */
+    for ( i = 0; i < 100; i++ ) {
+        amp_test_update_rtt_estimate(&globals, 10000);
+    }
+    assert(globals.srtt == 10000 && globals.max_rtt == 10000);
+    amp_test_get_loss_timeout(&globals, &timeout);
+    assert(timeout.tv_sec * 1000000 + timeout.tv_usec ==
+            ICMP_CENSUS_MIN_LOSS_TIMEOUT);
+
+    /* slower responses wait for at least twice the slowest seen */
+    amp_test_update_rtt_estimate(&globals, 900000);
+    amp_test_get_loss_timeout(&globals, &timeout);
+    assert(timeout.tv_sec * 1000000 + timeout.tv_usec >= 1800000);
+    assert(timeout.tv_sec < LOSS_TIMEOUT);
+
+    /* but never longer than the usual loss timeout */
+    amp_test_update_rtt_estimate(&globals, 8000000);
+    amp_test_get_loss_timeout(&globals, &timeout);
+    assert(timeout.tv_sec == LOSS_TIMEOUT && timeout.tv_usec == 0);
+
+    return 0;
+}
@@ -103,6 +103,7 @@ int main(void) {
     assert(sizeof(icmps) / sizeof(struct icmphdr) ==
             (sizeof(length) / sizeof(int)));
 
+    memset(&globals, 0, sizeof(globals));
     globals.count = sizeof(icmps) / sizeof(struct icmphdr);
 
     globals.info = (struct info_t *)malloc(sizeof(struct info_t)*globals.count);
@@ -78,6 +78,32 @@ def protocol_to_string(protocol):
         return "http"
     return "default"
 
+def data_path_to_string(path):
+    """
+    Convert data path enum into a human readable string
+    """
+    if path == ampsave.tests.throughput_pb2.COPY:
+        return "copy"
+    if path == ampsave.tests.throughput_pb2.ZEROCOPY:
+        return "zerocopy"
+    if path == ampsave.tests.throughput_pb2.DISCARD:
+        return "discard"
+    return None
+
+def get_streams(item):
+    """
+    Extract the results of each individual connection in a parallel test
+    """
+    streams = []
+    for stream in item.streams:
+        streams.append({
+            "runtime": stream.duration/1000/1000 if stream.HasField("duration") else None,
+            "bytes": stream.bytes if stream.HasField("bytes") else None,
+            "send_path": data_path_to_string(stream.send_path),
+            "receive_path": data_path_to_string(stream.receive_path),
+        })
+    return streams
+
 def get_data(data):
     """
     Extract the throughput test results from the protocol buffer data.
@@ -97,6 +123,9 @@ def get_data(data):
             "bytes": i.bytes if i.HasField("bytes") else None,
             "direction": direction_to_string(i.direction),
             "tcpreused": params["tcpreused"],
+            "send_path": data_path_to_string(i.send_path),
+            "receive_path": data_path_to_string(i.receive_path),
+            "streams": get_streams(i),
         })
 
     # TODO confirm what happens if the test fails to connect
@@ -107,6 +136,8 @@ def get_data(data):
         "write_size": msg.header.write_size,
         "dscp": getPrintableDscp(msg.header.dscp),
         "protocol": protocol_to_string(msg.header.protocol),
+        "zerocopy": msg.header.zerocopy,
+        "streams": msg.header.streams,
         "results": results,
     }
 
@@ -109,6 +109,7 @@ def get_data(data):
                 "loss_periods": build_loss_periods(i.loss_periods),
                 "loss_percent": i.loss_percent if i.HasField("loss_percent") else None,
                 "voip": build_voip(i.voip) if i.HasField("voip") else None,
+                "rate": i.rate if i.HasField("rate") else None,
             }
         )
 
@@ -121,6 +122,7 @@ def get_data(data):
         "packet_count": msg.header.packet_count,
         "dscp": getPrintableDscp(msg.header.dscp),
         "rtt_samples": msg.header.rtt_samples,
+        "rate": msg.header.rate,
         "results": results,
     }
 
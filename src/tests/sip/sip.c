@@ -214,5 +214,8 @@ test_t *register_test() {
     /* don't give the sip test a SIGINT warning, it should not take long! */
     new_test->sigint = 0;
 
+    /* keeps global state between runs, always run it in a new process */
+    new_test->reentrant = 0;
+
     return new_test;
 }
@@ -39,11 +39,17 @@
  */
 
 #include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <ifaddrs.h>
 #include <event2/event.h>
 #include <arpa/inet.h>
@@ -51,10 +57,10 @@
 #include <pcap.h>
 #include <unistd.h>
 #include <errno.h>
-#include <pcap/sll.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <assert.h>
 
 #include "config.h"
 #include "testlib.h"
@@ -143,79 +149,191 @@ static char *find_address_interface(struct sockaddr *sin) {
 
 
 /*
- * Create a pcap filter that will match only traffic between the ports we
- * are using for this test.
+ * Work out what the captured frames will look like on this interface.
+ * Ethernet-like devices deliver the whole frame, for anything else (ppp,
+ * tunnels) ask the kernel to remove the link layer and start at IP.
  */
-static int create_pcap_filter(struct pcapdevice *p, uint16_t srcportv4,
+static enum capture_linktype get_capture_linktype(char *device) {
+    struct ifreq ifr;
+    int sock;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, device, IFNAMSIZ - 1);
+
+    if ( (sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) {
+        return CAPTURE_LINK_NETWORK;
+    }
+
+    if ( ioctl(sock, SIOCGIFHWADDR, &ifr) < 0 ) {
+        close(sock);
+        return CAPTURE_LINK_NETWORK;
+    }
+
+    close(sock);
+
+    switch ( ifr.ifr_hwaddr.sa_family ) {
+        case ARPHRD_ETHER:
+        case ARPHRD_LOOPBACK: return CAPTURE_LINK_ETHERNET;
+        default: return CAPTURE_LINK_NETWORK;
+    };
+}
+
+
+
+/*
+ * Compile a filter that will match only traffic between the ports we are
+ * using for this test, and attach it to the capture socket so that the
+ * kernel only puts interesting packets into the ring. Frames with vlan tags
+ * still in them need the filter repeated after the tag.
+ */
+static int attach_capture_filter(struct pcapdevice *p, uint16_t srcportv4,
         uint16_t srcportv6, uint16_t destport, char *device) {
 
     struct bpf_program fcode;
-    char pcaperr[PCAP_ERRBUF_SIZE];
+    struct sock_fprog prog;
+    pcap_t *dead;
+    char filter[512];
     char filterstring[1024];
 
-#if HAVE_PCAP_IMMEDIATE_MODE
-    p->pcap = pcap_create(device, pcaperr);
-#else
-    /* XXX Hard-coded snaplen -- be wary if repurposing for other tests */
-    p->pcap = pcap_open_live(device, 200, 0, 10, pcaperr);
-#endif
+    snprintf(filter, sizeof(filter) - 1,
+            "(tcp and (dst port %d or dst port %d) and src port %d) or (icmp[0] == 11 or icmp[0] == 3) or (icmp6)",
+            srcportv4, srcportv6, destport);
 
-    if ( p->pcap == NULL ) {
-        Log(LOG_ERR, "Failed to open live pcap: %s", pcaperr);
-        return 0;
+    if ( p->linktype == CAPTURE_LINK_ETHERNET ) {
+        snprintf(filterstring, sizeof(filterstring) - 1,
+                "(%s) or (vlan and (%s))", filter, filter);
+        dead = pcap_open_dead(DLT_EN10MB, CAPTURE_SNAPLEN);
+    } else {
+        snprintf(filterstring, sizeof(filterstring) - 1, "%s", filter);
+        dead = pcap_open_dead(DLT_RAW, CAPTURE_SNAPLEN);
     }
 
-#if HAVE_PCAP_IMMEDIATE_MODE
-    if ( pcap_set_immediate_mode(p->pcap, 1) != 0 ) {
-        Log(LOG_ERR, "Failed to set pcap immediate mode");
-        return 0;
+    if ( dead == NULL ) {
+        Log(LOG_ERR, "Failed to create pcap handle to compile filter");
+        return -1;
     }
-    /* XXX Hard-coded snaplen -- be wary if repurposing for other tests */
-    if ( pcap_set_snaplen(p->pcap, 200) != 0 ) {
-        Log(LOG_ERR, "Failed to set pcap snaplen");
-        return 0;
+
+    Log(LOG_DEBUG, "Compiling filter string %s for device %s", filterstring,
+        device);
+
+    if ( pcap_compile(dead, &fcode, filterstring, 1,
+                PCAP_NETMASK_UNKNOWN) < 0 ) {
+        Log(LOG_ERR, "Failed to compile BPF filter for device %s: %s", device,
+                pcap_geterr(dead));
+        pcap_close(dead);
+        return -1;
     }
 
-    if ( pcap_set_promisc(p->pcap, 0) != 0 ) {
-        Log(LOG_ERR, "Failed to disable promiscuous mode");
-        return 0;
+    pcap_close(dead);
+
+    /* the classic BPF instructions are the same as the kernel uses */
+    prog.len = fcode.bf_len;
+    prog.filter = (struct sock_filter *)fcode.bf_insns;
+
+    if ( setsockopt(p->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+                sizeof(prog)) < 0 ) {
+        Log(LOG_ERR, "Failed to set BPF filter for device %s: %s", device,
+                strerror(errno));
+        pcap_freecode(&fcode);
+        return -1;
     }
 
-    if ( pcap_set_timeout(p->pcap, 10) != 0 ) {
-        Log(LOG_ERR, "Failed to set pcap read timeout");
-        return 0;
+    /* once it has been installed then the filter program can be freed */
+    pcap_freecode(&fcode);
+
+    return 0;
+}
+
+
+
+/*
+ * Open a packet socket on the device with a TPACKET_V3 receive ring, so
+ * that the kernel can fill whole blocks of frames for us to process at
+ * once, and only with the packets that match our filter.
+ */
+static int create_pcap_filter(struct pcapdevice *p, uint16_t srcportv4,
+        uint16_t srcportv6, uint16_t destport, char *device) {
+
+    struct tpacket_req3 req;
+    struct sockaddr_ll addr;
+    int version = TPACKET_V3;
+    int type;
+
+    p->linktype = get_capture_linktype(device);
+    type = (p->linktype == CAPTURE_LINK_ETHERNET) ? SOCK_RAW : SOCK_DGRAM;
+
+    /* no protocol yet, nothing is queued until the filter is attached */
+    if ( (p->fd = socket(AF_PACKET, type, 0)) < 0 ) {
+        Log(LOG_ERR, "Failed to open packet socket: %s", strerror(errno));
+        return -1;
     }
 
-    if ( pcap_activate(p->pcap) != 0 ) {
-        Log(LOG_ERR, "Failed to activate pcap handle:%s", pcap_geterr(p->pcap));
-        return 0;
+    if ( attach_capture_filter(p, srcportv4, srcportv6, destport,
+                device) < 0 ) {
+        return -1;
     }
-#endif
 
-    snprintf(filterstring, 1024-1,
-            //"(tcp and (dst port %d or dst port %d) and src port %d)",
-            "(tcp and (dst port %d or dst port %d) and src port %d) or (icmp[0] == 11 or icmp[0] == 3) or (icmp6)",
-            srcportv4, srcportv6, destport);
+    if ( setsockopt(p->fd, SOL_PACKET, PACKET_VERSION, &version,
+                sizeof(version)) < 0 ) {
+        Log(LOG_ERR, "Failed to set TPACKET_V3 on packet socket: %s",
+                strerror(errno));
+        return -1;
+    }
 
-    Log(LOG_DEBUG, "Compiling filter string %s for device %s", filterstring,
-        device);
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = CAPTURE_BLOCK_SIZE;
+    req.tp_block_nr = CAPTURE_BLOCK_COUNT;
+    req.tp_frame_size = CAPTURE_FRAME_SIZE;
+    req.tp_frame_nr = (CAPTURE_BLOCK_SIZE * CAPTURE_BLOCK_COUNT) /
+        CAPTURE_FRAME_SIZE;
+    req.tp_retire_blk_tov = CAPTURE_BLOCK_TIMEOUT;
+
+    if ( setsockopt(p->fd, SOL_PACKET, PACKET_RX_RING, &req,
+                sizeof(req)) < 0 ) {
+        Log(LOG_ERR, "Failed to create packet ring: %s", strerror(errno));
+        return -1;
+    }
 
-    if ( pcap_compile(p->pcap, &fcode, filterstring, 1,
-                PCAP_NETMASK_UNKNOWN) < 0 ) {
-        Log(LOG_ERR, "Failed to compile BPF filter for device %s", device);
-        return 0;
+    p->ring_size = req.tp_block_size * req.tp_block_nr;
+    p->ring = mmap(NULL, p->ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_LOCKED, p->fd, 0);
+    if ( p->ring == MAP_FAILED ) {
+        /* locking the pages is nice to have, but not required */
+        p->ring = mmap(NULL, p->ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, p->fd, 0);
     }
 
-    if ( pcap_setfilter(p->pcap, &fcode) < 0 ) {
-        Log(LOG_ERR, "Failed to set BPF filter for device %s", device);
-        return 0;
+    if ( p->ring == MAP_FAILED ) {
+        Log(LOG_ERR, "Failed to map packet ring: %s", strerror(errno));
+        p->ring = NULL;
+        return -1;
     }
 
-    /* once it has been installed then the filter program can be freed */
-    pcap_freecode(&fcode);
+    p->block = 0;
+
+#ifdef PACKET_IGNORE_OUTGOING
+    {
+        /* we only care about the responses, not the probes we send */
+        int ignore = 1;
+        setsockopt(p->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &ignore,
+                sizeof(ignore));
+    }
+#endif
+
+    /* now start capturing everything that the filter lets through */
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = if_nametoindex(device);
 
-    p->pcap_fd = pcap_fileno(p->pcap);
-    return p->pcap_fd;
+    if ( addr.sll_ifindex == 0 ||
+            bind(p->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ) {
+        Log(LOG_ERR, "Failed to bind packet socket to %s: %s", device,
+                strerror(errno));
+        return -1;
+    }
+
+    return p->fd;
 }
 
 
@@ -303,14 +421,94 @@ int find_source_address(char *device, struct addrinfo *dest,
 
 
 /*
- * Start the pcap filter running and install the callback for when it receives
+ * Release any resources held by a capture device that has been only
+ * partially set up, or that is being removed.
+ */
+static void free_capture_device(struct pcapdevice *p) {
+    if ( p->event ) {
+        event_free(p->event);
+    }
+
+    if ( p->ring ) {
+        munmap(p->ring, p->ring_size);
+    }
+
+    if ( p->fd >= 0 ) {
+        close(p->fd);
+    }
+
+    if ( p->if_name ) {
+        free(p->if_name);
+    }
+
+    free(p);
+}
+
+
+
+/*
+ * Process every block that the kernel has finished filling and handed back
+ * to us, passing each frame to the test callback and then returning the
+ * block to the kernel. A single wakeup can now deal with many packets.
+ */
+static void capture_ring_callback(evutil_socket_t evsock,
+        __attribute__((unused))short flags, void *evdata) {
+
+    struct pcapdevice *p = (struct pcapdevice *)evdata;
+    struct tpacket_block_desc *block;
+    struct tpacket3_hdr *hdr;
+    struct pcaptransport transport;
+    unsigned int count;
+    uint32_t i;
+
+    assert(evsock == p->fd);
+
+    for ( count = 0; count < CAPTURE_BLOCK_COUNT; count++ ) {
+        block = (struct tpacket_block_desc *)
+            (p->ring + (p->block * CAPTURE_BLOCK_SIZE));
+
+        /* stop at the first block the kernel still owns */
+        if ( !(block->hdr.bh1.block_status & TP_STATUS_USER) ) {
+            break;
+        }
+
+        hdr = (struct tpacket3_hdr *)
+            ((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+
+        for ( i = 0; i < block->hdr.bh1.num_pkts; i++ ) {
+            uint16_t offset = (p->linktype == CAPTURE_LINK_ETHERNET) ?
+                hdr->tp_mac : hdr->tp_net;
+
+            transport = pcap_transport_header((char *)hdr + offset,
+                    hdr->tp_snaplen, p->linktype);
+            transport.ts.tv_sec = hdr->tp_sec;
+            transport.ts.tv_usec = hdr->tp_nsec / 1000;
+
+            if ( transport.header != NULL && p->callback ) {
+                p->callback(&transport, p->callbackdata);
+            }
+
+            hdr = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+        }
+
+        /* give the block back to the kernel so it can be refilled */
+        __sync_synchronize();
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        p->block = (p->block + 1) % CAPTURE_BLOCK_COUNT;
+    }
+}
+
+
+
+/*
+ * Start the capture running and install the callback for when it receives
  * a packet.
  */
 int pcap_listen(struct sockaddr *address, uint16_t srcportv4,
         uint16_t srcportv6, uint16_t destport, char *device,
         struct event_base *base,
         void *callbackdata,
-        void(*callback)(evutil_socket_t evsock, short flags, void *evdata)) {
+        void(*callback)(struct pcaptransport *transport, void *callbackdata)) {
 
     struct pcapdevice *p;
 
@@ -340,49 +538,53 @@ int pcap_listen(struct sockaddr *address, uint16_t srcportv4,
         return 1;
     }
 
-    /* If not, create a new pcap device with the appropriate filter */
-    p = (struct pcapdevice *)malloc(sizeof(struct pcapdevice));
+    /* If not, create a new capture ring with the appropriate filter */
+    p = (struct pcapdevice *)calloc(1, sizeof(struct pcapdevice));
+    p->fd = -1;
 
-    if ( create_pcap_filter(p, srcportv4, srcportv6, destport, device) == 0 ) {
-        Log(LOG_ERR, "Failed to create bpf filter for device %s", device);
+    if ( create_pcap_filter(p, srcportv4, srcportv6, destport, device) < 0 ) {
+        Log(LOG_ERR, "Failed to create capture ring for device %s", device);
+        free_capture_device(p);
         return 0;
     }
 
     p->callbackdata = callbackdata;
+    p->callback = callback;
     p->if_name = strdup(device);
-    p->next = pcaps;
-    pcaps = p;
 
     /* Add the fd for the new device to our event handler so that our
-     * callback will fire whenever a packet arrives */
-    p->event = event_new(base, p->pcap_fd, EV_READ|EV_PERSIST, callback, p);
+     * callback will fire whenever a block of packets is ready */
+    p->event = event_new(base, p->fd, EV_READ|EV_PERSIST,
+            capture_ring_callback, p);
     if ( event_add(p->event, NULL) != 0 ) {
         Log(LOG_ERR, "Failed to add fd event for new pcap device %s", device);
+        free_capture_device(p);
         return 0;
     }
 
+    p->next = pcaps;
+    pcaps = p;
+
     return 1;
 }
 
 
 
 /*
- * Naive code to read the next pcap packet and find a TCP header.
- * Assumes the packet is the standard Ethernet:IP:TCP header layout.
- * Doesn't deal with anything like extra link layer headers, IPv6 extension
- * headers, fragmentation etc.
- * TODO libtrace would do a much nicer job of finding the TCP header for us
+ * Find the transport header within a captured frame. Understands ethernet
+ * with any number of vlan tags, IPv6 extension headers and skips anything
+ * that isn't the first fragment of a packet (there is no transport header
+ * to look at).
  */
-struct pcaptransport pcap_transport_header(struct pcapdevice *p) {
+struct pcaptransport pcap_transport_header(char *packet, int remaining,
+        enum capture_linktype linktype) {
 
-    char *packet = NULL;
-    struct pcap_pkthdr header;
     struct iphdr *ip;
     struct ip6_hdr *ip6;
     struct pcaptransport transport;
-    int remaining;
-    int datalink;
     int ethertype;
+    uint8_t nexthdr;
+    int extlen;
 
     transport.header = NULL;
     transport.protocol = 0;
@@ -390,20 +592,12 @@ struct pcaptransport pcap_transport_header(struct pcapdevice *p) {
     transport.ts.tv_sec = 0;
     transport.ts.tv_usec = 0;
 
-    packet = (char *)pcap_next(p->pcap, &header);
-    if ( packet == NULL ) {
-        Log(LOG_DEBUG,
-                "Null result from pcap_next() -- packet was probably filtered");
+    if ( packet == NULL || remaining <= 0 ) {
         return transport;
     }
 
-    transport.ts = header.ts;
-    remaining = header.len;
-
-    datalink = pcap_datalink(p->pcap);
-
     /* find the start of the packet, which depends on the link layer */
-    if ( datalink == DLT_EN10MB ) {
+    if ( linktype == CAPTURE_LINK_ETHERNET ) {
         struct ether_header *eth;
         /* this is an ethernet interface, expect an ethernet header */
         if ( remaining < (int)sizeof(struct ether_header) ) {
@@ -416,22 +610,21 @@ struct pcaptransport pcap_transport_header(struct pcapdevice *p) {
         packet += sizeof(struct ether_header);
         ethertype = ntohs(eth->ether_type);
 
-    } else if ( datalink == DLT_LINUX_SLL ) {
-        struct sll_header *sll;
-        /* this is a linux sll interface (probably ppp), expect sll header */
-        if ( remaining < (int)sizeof(struct sll_header) ) {
-            Log(LOG_WARNING, "Too few bytes captured for SLL header");
-            return transport;
+        /* step over any 802.1Q or 802.1ad tags to get to the payload */
+        while ( ethertype == ETHERTYPE_VLAN || ethertype == 0x88a8 ) {
+            if ( remaining < 4 ) {
+                Log(LOG_WARNING, "Too few bytes captured for VLAN header");
+                return transport;
+            }
+            ethertype = ntohs(*(uint16_t *)(packet + 2));
+            remaining -= 4;
+            packet += 4;
         }
 
-        sll = (struct sll_header *)packet;
-        remaining -= sizeof(struct sll_header);
-        packet += sizeof(struct sll_header);
-        ethertype = ntohs(sll->sll_protocol);
-
     } else {
-        Log(LOG_DEBUG, "Unknown PCAP link layer %u", datalink);
-        return transport;
+        /* no link layer, the IP version tells us what the packet is */
+        ethertype = ((*(uint8_t *)packet >> 4) == 6) ?
+            ETHERTYPE_IPV6 : ETHERTYPE_IP;
     }
 
     /* process any ipv4 or ipv6 packets, ignore everything else */
@@ -442,11 +635,16 @@ struct pcaptransport pcap_transport_header(struct pcapdevice *p) {
             return transport;
         }
 
-        if ( remaining < ip->ihl * 4 ) {
+        if ( ip->ihl < 5 || remaining < ip->ihl * 4 ) {
             Log(LOG_WARNING, "Too few bytes captured for IPv4 header");
             return transport;
         }
 
+        /* later fragments don't carry the transport header */
+        if ( ntohs(ip->frag_off) & IP_OFFMASK ) {
+            return transport;
+        }
+
         packet += (ip->ihl * 4);
         remaining -= (ip->ihl * 4);
 
@@ -464,17 +662,53 @@ struct pcaptransport pcap_transport_header(struct pcapdevice *p) {
 
         packet += sizeof(struct ip6_hdr);
         remaining -= sizeof(struct ip6_hdr);
+        nexthdr = ip6->ip6_nxt;
+
+        /* walk the chain of extension headers to find the transport */
+        for ( ;; ) {
+            if ( nexthdr == IPPROTO_HOPOPTS || nexthdr == IPPROTO_ROUTING ||
+                    nexthdr == IPPROTO_DSTOPTS ) {
+                if ( remaining < 8 ) {
+                    return transport;
+                }
+                extlen = (((uint8_t *)packet)[1] + 1) * 8;
+
+            } else if ( nexthdr == IPPROTO_FRAGMENT ) {
+                struct ip6_frag *frag = (struct ip6_frag *)packet;
+                if ( remaining < (int)sizeof(struct ip6_frag) ) {
+                    return transport;
+                }
+                /* IP6F_OFF_MASK is already in network byte order */
+                if ( frag->ip6f_offlg & IP6F_OFF_MASK ) {
+                    return transport;
+                }
+                extlen = sizeof(struct ip6_frag);
+
+            } else if ( nexthdr == IPPROTO_AH ) {
+                if ( remaining < 8 ) {
+                    return transport;
+                }
+                extlen = (((uint8_t *)packet)[1] + 2) * 4;
+
+            } else {
+                break;
+            }
+
+            if ( remaining < extlen ) {
+                Log(LOG_WARNING, "Too few bytes captured for IPv6 extension");
+                return transport;
+            }
+
+            nexthdr = ((uint8_t *)packet)[0];
+            packet += extlen;
+            remaining -= extlen;
+        }
 
         transport.header = packet;
         transport.remaining = remaining;
-        transport.protocol = ip6->ip6_nxt;
+        transport.protocol = nexthdr;
 
     } else {
-        /*
-         * We can sometimes catch other, non-IP traffic before the filter
-         * gets applied (e.g. for some reason we are frequently seeing
-         * packets with ethertype 0x100 (vlans).
-         */
         Log(LOG_DEBUG, "Captured a non IP packet: %u", ethertype);
     }
 
@@ -491,20 +725,19 @@ void pcap_cleanup(void) {
     struct pcapdevice *tmp;
 
     while ( p != NULL ) {
-        /* Remove each pcap device fd from the event handler */
-        event_free(p->event);
-
-        /* Close the pcap device */
-        pcap_close(p->pcap);
-
-        /* Free the pcapdevice structure */
-        free(p->if_name);
+        /* Remove the event, unmap the ring and close the socket */
         tmp = p;
         p = p->next;
-        free(tmp);
+        free_capture_device(tmp);
     }
 
-    freeifaddrs(ifaddrorig);
+    pcaps = NULL;
+
+    if ( ifaddrorig ) {
+        freeifaddrs(ifaddrorig);
+        ifaddrorig = NULL;
+        ifaddrlist = NULL;
+    }
 }
 
 /* vim: set sw=4 tabstop=4 softtabstop=4 expandtab : */
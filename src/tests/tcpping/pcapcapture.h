@@ -41,7 +41,6 @@
 #ifndef _TCPPING_PCAPCAPTURE_H_
 #define _TCPPING_PCAPCAPTURE_H_
 
-#include <pcap.h>
 #include <event2/event.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -55,13 +54,21 @@
 #define PCAP_NETMASK_UNKNOWN    0xffffffff
 #endif
 
-struct pcapdevice {
-    pcap_t *pcap;
-    int pcap_fd;
-    char *if_name;
-    void *callbackdata;
-    struct event *event;
-    struct pcapdevice *next;
+/* only the headers are needed -- be wary if repurposing for other tests */
+#define CAPTURE_SNAPLEN 200
+
+/* size and number of blocks in the capture ring shared with the kernel */
+#define CAPTURE_BLOCK_SIZE (1 << 18)
+#define CAPTURE_BLOCK_COUNT 8
+#define CAPTURE_FRAME_SIZE 2048
+
+/* hand over partially filled blocks after this many milliseconds */
+#define CAPTURE_BLOCK_TIMEOUT 10
+
+/* how the captured frames start, mirrors the pcap link types we used */
+enum capture_linktype {
+    CAPTURE_LINK_ETHERNET,      /* full ethernet header (maybe vlan tags) */
+    CAPTURE_LINK_NETWORK,       /* link layer removed, starts at IP header */
 };
 
 struct pcaptransport {
@@ -71,17 +78,31 @@ struct pcaptransport {
     struct timeval ts;
 };
 
+struct pcapdevice {
+    int fd;                     /* AF_PACKET socket with the rx ring */
+    uint8_t *ring;              /* memory mapped ring of blocks */
+    size_t ring_size;
+    unsigned int block;         /* next block to read from the ring */
+    enum capture_linktype linktype;
+    char *if_name;
+    void *callbackdata;
+    void (*callback)(struct pcaptransport *transport, void *callbackdata);
+    struct event *event;
+    struct pcapdevice *next;
+};
+
 void pcap_cleanup(void);
 
 int pcap_listen(struct sockaddr *address, uint16_t srcportv4,
         uint16_t srcportv6, uint16_t destport, char *device,
         struct event_base *base,
         void *callbackdata,
-        void(*callback)(evutil_socket_t evsock, short flags, void *evdata));
+        void(*callback)(struct pcaptransport *transport, void *callbackdata));
 
 int find_source_address(char *device, struct addrinfo *dest,
         struct sockaddr *saddr);
-struct pcaptransport pcap_transport_header(struct pcapdevice *p);
+struct pcaptransport pcap_transport_header(char *packet, int remaining,
+        enum capture_linktype linktype);
 
 #endif
 
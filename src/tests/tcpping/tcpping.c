@@ -55,6 +55,7 @@
 #include <assert.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <signal.h>
 #include <event2/event.h>
@@ -68,7 +69,7 @@
 #include "icmpcode.h"
 #include "dscp.h"
 #include "usage.h"
-#include "checksum.h"
+#include "probe.h"
 
 
 static struct option long_options[] = {
@@ -335,49 +336,25 @@ static void process_options(struct tcppingglobals *tcpping) {
 
 
 /*
- * Append the tcp packet to the ip pseudoheader and checksum the whole buffer.
+ * Set the IP pseudoheader for a given source and destination in a TCP probe.
+ * Only the sum of the pseudoheader contributes to the checksum, so it is
+ * patched with the difference from the previous destination.
  */
-static uint16_t tcp_checksum(uint16_t *packet, uint16_t *pseudo,
-        int packetlen, int pseudolen) {
-
-    char *buffer;
-    uint16_t sum;
-
-    buffer = calloc(1, pseudolen + packetlen);
-    memcpy(buffer, pseudo, pseudolen);
-    memcpy(buffer + pseudolen, packet, packetlen);
-
-    sum = checksum((uint16_t*)buffer, pseudolen + packetlen);
-
-    free(buffer);
-
-    return sum;
-}
-
-
-
-/*
- * Calculate and set the checksum in a given TCP header.
- */
-static int set_tcp_checksum(struct tcphdr *tcp, int packet_size,
+static int set_tcp_pseudo_header(struct probe_template_t *probe,
         struct sockaddr *srcaddr, struct addrinfo *destaddr) {
 
     struct pseudotcp_ipv4 pseudov4;
     struct pseudotcp_ipv6 pseudov6;
 
-    char *pseudo;
-    int pseudolen;
-
     if ( srcaddr->sa_family == AF_INET ) {
         pseudov4.saddr = ((struct sockaddr_in *)srcaddr)->sin_addr.s_addr;
         pseudov4.daddr = ((struct sockaddr_in *)destaddr->ai_addr)->sin_addr.s_addr;
 
         pseudov4.zero = 0;
         pseudov4.protocol = 6;
-        pseudov4.length = htons(packet_size);
+        pseudov4.length = htons(probe->length);
 
-        pseudo = (char *)&pseudov4;
-        pseudolen = sizeof(pseudov4);
+        probe_template_set_pseudo_header(probe, &pseudov4, sizeof(pseudov4));
     } else if ( srcaddr->sa_family == AF_INET6 ) {
         memcpy(pseudov6.saddr,
                 ((struct sockaddr_in6 *)srcaddr)->sin6_addr.s6_addr,
@@ -385,49 +362,49 @@ static int set_tcp_checksum(struct tcphdr *tcp, int packet_size,
         memcpy(pseudov6.daddr,
                 ((struct sockaddr_in6 *)destaddr->ai_addr)->sin6_addr.s6_addr,
                 sizeof(struct in6_addr));
-        pseudov6.length = htonl(packet_size);
+        pseudov6.length = htonl(probe->length);
         pseudov6.zero_1 = 0;
         pseudov6.zero_2 = 0;
         pseudov6.next = 6;
 
-        pseudo = (char *)&pseudov6;
-        pseudolen = sizeof(pseudov6);
+        probe_template_set_pseudo_header(probe, &pseudov6, sizeof(pseudov6));
     } else {
         Log(LOG_ERR, "Unexpected family for source address: %d",
                 srcaddr->sa_family);
         return 0;
     }
 
-    tcp->check = tcp_checksum((uint16_t *)tcp, (uint16_t *)pseudo, packet_size,
-            pseudolen);
-
     return 1;
 }
 
 
 
 /*
- * Create a TCP SYN packet for a given destination.
+ * Create a template TCP SYN packet for an address family. Everything except
+ * the sequence number and the pseudoheader addresses is the same for every
+ * destination, and those are set by update_tcp_syn() for each probe.
  */
-static int craft_tcp_syn(struct tcppingglobals *tp, char *packet,
-        uint16_t srcport, int packet_size, struct sockaddr *srcaddr,
-        struct addrinfo *destaddr) {
+static struct probe_template_t *craft_tcp_syn(struct tcppingglobals *tp,
+        int family, uint16_t srcport, int packet_size) {
 
+    struct probe_template_t *probe;
     struct tcphdr *tcp;
     struct tcpmssoption *mss;
     int headerremaining = 0;
     uint32_t *noop = NULL;
 
-    tcp = (struct tcphdr *)packet;
+    probe = new_probe_template(packet_size, offsetof(struct tcphdr, check));
+
+    tcp = (struct tcphdr *)probe->packet;
     tcp->source = htons(srcport);
     tcp->dest = htons(tp->options.port);
-    tcp->seq = htonl(tp->seqindex + (tp->destindex * 100));
+    tcp->seq = 0;
     tcp->ack_seq = 0;
 
     /* Pad IPv4 packets out to match the length of a IPv6 packet with
      * the same amount of payload.
      */
-    if ( srcaddr->sa_family == AF_INET ) {
+    if ( family == AF_INET ) {
         tcp->doff = 11;
         headerremaining = 5;
     } else {
@@ -441,16 +418,15 @@ static int craft_tcp_syn(struct tcppingglobals *tp, char *packet,
     tcp->syn = 1;
     tcp->fin = 0;
     tcp->window = htons(6666);
-    tcp->check = 0;
     tcp->urg_ptr = 0;
 
-    mss = (struct tcpmssoption *)(packet + sizeof(struct tcphdr));
+    mss = (struct tcpmssoption *)(probe->packet + sizeof(struct tcphdr));
     mss->mssopt = 2;
     mss->msssize = 4;
     mss->mssvalue = htons(536);
 
     /* Fill any remaining header space with NOOP options */
-    noop = (uint32_t *)(packet + sizeof(struct tcphdr) +
+    noop = (uint32_t *)(probe->packet + sizeof(struct tcphdr) +
             sizeof(struct tcpmssoption));
     while (headerremaining > 0) {
         *noop = 0x01010101;
@@ -458,7 +434,24 @@ static int craft_tcp_syn(struct tcppingglobals *tp, char *packet,
         headerremaining --;
     }
 
-    return set_tcp_checksum(tcp, packet_size, srcaddr, destaddr);
+    probe_template_checksum(probe);
+
+    return probe;
+}
+
+
+
+/*
+ * Update the template TCP SYN packet for the current destination.
+ */
+static int update_tcp_syn(struct tcppingglobals *tp,
+        struct probe_template_t *probe, struct sockaddr *srcaddr,
+        struct addrinfo *destaddr) {
+
+    probe_template_set32(probe, offsetof(struct tcphdr, seq),
+            tp->seqindex + (tp->destindex * 100));
+
+    return set_tcp_pseudo_header(probe, srcaddr, destaddr);
 }
 
 
@@ -695,38 +688,34 @@ static void process_icmp6_response(struct tcppingglobals *tp,
 
 
 /*
- * Callback used when a packet is received by the pcap filter. This will
+ * Callback used when a packet is received by the capture ring. This will
  * determine the protocol of the packet and pass it to the appropriate function
  * for processing.
  */
-static void receive_packet(evutil_socket_t evsock, short flags, void *evdata) {
+static void receive_packet(struct pcaptransport *transport, void *data) {
 
-    struct pcapdevice *p = (struct pcapdevice *)evdata;
-    struct tcppingglobals *tp = (struct tcppingglobals *)p->callbackdata;
-    struct pcaptransport transport;
+    struct tcppingglobals *tp = (struct tcppingglobals *)data;
 
-    assert(evsock > 0);
-    assert(flags == EV_READ);
+    assert(transport);
 
-    transport = pcap_transport_header(p);
-    if ( transport.header == NULL || transport.remaining <= 0 ) {
+    if ( transport->header == NULL || transport->remaining <= 0 ) {
         return;
     }
 
-    if ( transport.protocol == 6 ) {
+    if ( transport->protocol == 6 ) {
         Log(LOG_DEBUG, "Received TCP packet on pcap device");
-        process_tcp_response(tp, (struct tcphdr *)transport.header,
-                transport.remaining, transport.ts);
+        process_tcp_response(tp, (struct tcphdr *)transport->header,
+                transport->remaining, transport->ts);
     }
 
-    if ( transport.protocol == 1 ) {
-        process_icmp4_response(tp, (struct icmphdr *)transport.header,
-                transport.remaining, transport.ts);
+    if ( transport->protocol == 1 ) {
+        process_icmp4_response(tp, (struct icmphdr *)transport->header,
+                transport->remaining, transport->ts);
     }
 
-    if ( transport.protocol == 58 ) {
-        process_icmp6_response(tp, (struct icmp6_hdr *)transport.header,
-                transport.remaining, transport.ts);
+    if ( transport->protocol == 58 ) {
+        process_icmp6_response(tp, (struct icmp6_hdr *)transport->header,
+                transport->remaining, transport->ts);
     }
 
     if ( tp->outstanding == 0 && tp->destindex == tp->destcount ) {
@@ -752,9 +741,7 @@ static void send_packet(
 
     struct tcppingglobals *tp = (struct tcppingglobals *)evdata;
     struct addrinfo *dest = NULL;
-    uint16_t srcport;
-    int packet_size;
-    char *packet = NULL;
+    struct probe_template_t *probe;
     int sock;
     struct sockaddr *srcaddr;
     int delay;
@@ -779,13 +766,11 @@ static void send_packet(
     }
 
     if ( dest->ai_family == AF_INET ) {
-        srcport = tp->sourceportv4;
         sock = tp->raw_sockets.socket;
-        packet_size = tp->options.packet_size - sizeof(struct iphdr);
+        probe = tp->probe;
     } else if ( dest->ai_family == AF_INET6 ) {
-        srcport = tp->sourceportv6;
         sock = tp->raw_sockets.socket6;
-        packet_size = tp->options.packet_size - sizeof(struct ip6_hdr);
+        probe = tp->probe6;
     } else {
         Log(LOG_WARNING, "Unknown address family: %d", dest->ai_family);
         goto nextdest;
@@ -811,17 +796,15 @@ static void send_packet(
         goto nextdest;
     }
 
-    packet = calloc(1, packet_size);
-
-    /* Form a TCP SYN packet */
-    if ( craft_tcp_syn(tp, packet, srcport, packet_size, srcaddr, dest) < 0 ) {
+    /* Update the TCP SYN packet for this destination */
+    if ( !update_tcp_syn(tp, probe, srcaddr, dest) ) {
         Log(LOG_WARNING, "Error while crafting TCP packet for TCPPing test");
         goto nextdest;
     }
 
     /* send packet with appropriate inter packet delay */
-    while ( (delay = delay_send_packet(sock, packet, packet_size, dest,
-                    tp->options.inter_packet_delay,
+    while ( (delay = delay_send_packet(sock, (char*)probe->packet,
+                    probe->length, dest, tp->options.inter_packet_delay,
                     &(tp->info[tp->destindex].time_sent))) > 0 ) {
         usleep(delay);
     }
@@ -856,10 +839,6 @@ nextdest:
         timeout.tv_usec = tp->options.inter_packet_delay % 1000000;
         event_add(tp->nextpackettimer, &timeout);
     }
-
-    if ( packet ) {
-        free(packet);
-    }
 }
 
 
@@ -1125,6 +1104,12 @@ amp_test_result_t* run_tcpping(int argc, char *argv[], int count,
         return NULL;
     }
 
+    /* Build the SYN packets once, only a few fields change per destination */
+    globals->probe = craft_tcp_syn(globals, AF_INET, globals->sourceportv4,
+            globals->options.packet_size - sizeof(struct iphdr));
+    globals->probe6 = craft_tcp_syn(globals, AF_INET6, globals->sourceportv6,
+            globals->options.packet_size - sizeof(struct ip6_hdr));
+
     /* Start our sequence numbers from a random value and increment */
     globals->seqindex = rand();
     globals->info = (struct info_t *)malloc(sizeof(struct info_t) * count);
@@ -1170,6 +1155,8 @@ amp_test_result_t* run_tcpping(int argc, char *argv[], int count,
     result = report_results(&start_time, globals->destcount, globals->info,
             &globals->options);
 
+    free_probe_template(globals->probe);
+    free_probe_template(globals->probe6);
     free(globals->device);
     free(globals->info);
     free(globals);
@@ -1280,6 +1267,7 @@ test_t *register_test() {
     new_test->print_callback = print_tcpping;
     new_test->server_callback = NULL;
     new_test->sigint = 1;
+    new_test->reentrant = 0;
     return new_test;
 }
 
@@ -52,6 +52,7 @@
 
 #include "tests.h"
 #include "testlib.h"
+#include "probe.h"
 
 
 /* The extra 4 bytes allows us to at least include an MSS option in the SYN */
@@ -101,6 +102,8 @@ struct tcppingglobals {
     struct socket_t raw_sockets;
     struct socket_t tcp_sockets;
     struct info_t *info;
+    struct probe_template_t *probe;     /* SYN templates, updated per dest */
+    struct probe_template_t *probe6;
     int destindex;
     int destcount;
     char *device;
@@ -0,0 +1,216 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+
+#include "pcapcapture.h"
+
+#define TEST_TCP_LEN 20
+
+/*
+ * Build an ethernet header with the given number of vlan tags, returning
+ * the length added to the frame.
+ */
+static int build_ethernet(uint8_t *frame, int tags, uint16_t ethertype) {
+    struct ether_header *eth = (struct ether_header *)frame;
+    int i;
+    int offset = sizeof(struct ether_header);
+
+    memset(eth, 0, sizeof(struct ether_header));
+
+    if ( tags == 0 ) {
+        eth->ether_type = htons(ethertype);
+        return offset;
+    }
+
+    /* outer tag is 802.1ad when stacking multiple tags */
+    eth->ether_type = htons(tags > 1 ? 0x88a8 : ETHERTYPE_VLAN);
+
+    for ( i = 0; i < tags; i++ ) {
+        uint16_t *tag = (uint16_t *)(frame + offset);
+        tag[0] = htons(100 + i);
+        tag[1] = htons(i == tags - 1 ? ethertype : ETHERTYPE_VLAN);
+        offset += 4;
+    }
+
+    return offset;
+}
+
+
+
+/*
+ * Check that the transport header is found after the expected offset.
+ */
+static void check_transport(uint8_t *frame, int length,
+        enum capture_linktype linktype, int expected, uint8_t protocol) {
+    struct pcaptransport transport;
+
+    transport = pcap_transport_header((char *)frame, length, linktype);
+
+    if ( expected < 0 ) {
+        assert(transport.header == NULL);
+        return;
+    }
+
+    assert(transport.header == (char *)frame + expected);
+    assert(transport.protocol == protocol);
+    assert(transport.remaining == length - expected);
+}
+
+
+
+/*
+ * Check that IPv4 packets with and without vlan tags are parsed correctly.
+ */
+static void test_ipv4(void) {
+    uint8_t frame[256];
+    struct iphdr *ip;
+    int offset;
+    int tags;
+
+    for ( tags = 0; tags < 3; tags++ ) {
+        memset(frame, 0, sizeof(frame));
+        offset = build_ethernet(frame, tags, ETHERTYPE_IP);
+        ip = (struct iphdr *)(frame + offset);
+        ip->version = 4;
+        ip->ihl = 6;
+        ip->protocol = IPPROTO_TCP;
+        offset += 24;
+
+        check_transport(frame, offset + TEST_TCP_LEN, CAPTURE_LINK_ETHERNET,
+                offset, IPPROTO_TCP);
+
+        /* non-first fragments have no transport header to look at */
+        ip->frag_off = htons(185);
+        check_transport(frame, offset + TEST_TCP_LEN, CAPTURE_LINK_ETHERNET,
+                -1, 0);
+    }
+
+    /* without the link layer it should start straight at the IP header */
+    memset(frame, 0, sizeof(frame));
+    ip = (struct iphdr *)frame;
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->protocol = IPPROTO_ICMP;
+    check_transport(frame, 20 + 8, CAPTURE_LINK_NETWORK, 20, IPPROTO_ICMP);
+
+    /* truncated header */
+    check_transport(frame, 12, CAPTURE_LINK_NETWORK, -1, 0);
+}
+
+
+
+/*
+ * Check that IPv6 extension headers are skipped to find the transport.
+ */
+static void test_ipv6(void) {
+    uint8_t frame[256];
+    struct ip6_hdr *ip6;
+    uint8_t *ext;
+    int offset;
+
+    memset(frame, 0, sizeof(frame));
+    offset = build_ethernet(frame, 1, ETHERTYPE_IPV6);
+    ip6 = (struct ip6_hdr *)(frame + offset);
+    ip6->ip6_vfc = 0x60;
+    ip6->ip6_nxt = IPPROTO_HOPOPTS;
+    offset += sizeof(struct ip6_hdr);
+
+    /* hop-by-hop options, 16 bytes long */
+    ext = frame + offset;
+    ext[0] = IPPROTO_DSTOPTS;
+    ext[1] = 1;
+    offset += 16;
+
+    /* destination options, 8 bytes long */
+    ext = frame + offset;
+    ext[0] = IPPROTO_FRAGMENT;
+    ext[1] = 0;
+    offset += 8;
+
+    /* first fragment, offset zero */
+    ext = frame + offset;
+    ext[0] = IPPROTO_AH;
+    offset += 8;
+
+    /* authentication header with 12 bytes of icv, 24 bytes long */
+    ext = frame + offset;
+    ext[0] = IPPROTO_TCP;
+    ext[1] = 4;
+    offset += 24;
+
+    check_transport(frame, offset + TEST_TCP_LEN, CAPTURE_LINK_ETHERNET,
+            offset, IPPROTO_TCP);
+
+    /* truncated within the extension headers */
+    check_transport(frame, offset - 4, CAPTURE_LINK_ETHERNET, -1, 0);
+
+    /* later fragment should be ignored */
+    ((struct ip6_frag *)(frame + offset - 32))->ip6f_offlg = htons(0x100);
+    check_transport(frame, offset + TEST_TCP_LEN, CAPTURE_LINK_ETHERNET,
+            -1, 0);
+
+    /* plain ipv6 with no link layer */
+    memset(frame, 0, sizeof(frame));
+    ip6 = (struct ip6_hdr *)frame;
+    ip6->ip6_vfc = 0x60;
+    ip6->ip6_nxt = IPPROTO_ICMPV6;
+    check_transport(frame, sizeof(struct ip6_hdr) + 8, CAPTURE_LINK_NETWORK,
+            sizeof(struct ip6_hdr), IPPROTO_ICMPV6);
+}
+
+
+
+/*
+ * Check that the transport headers can be found in captured frames.
+ */
+int main(void) {
+    test_ipv4();
+    test_ipv6();
+
+    return 0;
+}
@@ -52,20 +52,23 @@
 int main(void) {
     int pipefd[2];
     BIO *sendctrl, *recvctrl;
-    /* proto X tport wsize mss nagle rand web10g reuse rcv snd dscp X X X X X */
+    /*
+     * proto X tport wsize mss nagle rand web10g reuse rcv snd dscp X X X X X
+     * zerocopy streams
+     */
     struct opt_t optionsA[] = {
         { TPUT_PROTOCOL_NONE, 0, 12345, 0, 1460, 0, 0, 1, 0,
-            0, 0, 0, 0,0,0,0,0},
+            0, 0, 0, 0,0,0,0,0, 0, 1},
         { TPUT_PROTOCOL_HTTP_POST, 0, 1, DEFAULT_WRITE_SIZE, 536, 0, 1, 0, 1,
-            4096, 0, 0x20, 0,0,0,0,0},
+            4096, 0, 0x20, 0,0,0,0,0, 1, 4},
         { TPUT_PROTOCOL_NONE, 0, DEFAULT_CONTROL_PORT, 65535, 1220, 0, 1, 1, 0,
-            0, 4096, 0xe0, 0,0,0,0,0},
+            0, 4096, 0xe0, 0,0,0,0,0, 0, 1},
         { TPUT_PROTOCOL_HTTP_POST, 0, DEFAULT_TEST_PORT, 65536, 5960, 1, 0, 0,1,
-            4096, 4096, 0x38, 0,0,0,0,0},
+            4096, 4096, 0x38, 0,0,0,0,0, 1, 64},
         { TPUT_PROTOCOL_NONE, 0, 65535, 2147483648U, 8960, 1, 1, 1, 0,
-            1234, 5678, 0x88, 0,0,0,0,0},
+            1234, 5678, 0x88, 0,0,0,0,0, 1, 2},
         { TPUT_PROTOCOL_HTTP_POST, 0, 65535, 4294967295U, 8960, 0, 0, 0, 1,
-            98765, 54321, 0xb8, 0,0,0,0,0},
+            98765, 54321, 0xb8, 0,0,0,0,0, 0, 1},
     };
     struct opt_t *optionsB;
     int count;
@@ -107,6 +110,8 @@ int main(void) {
         assert(optionsA[i].reuse_addr == optionsB->reuse_addr);
         assert(optionsA[i].write_size == optionsB->write_size);
         assert(optionsA[i].protocol == optionsB->protocol);
+        assert(optionsA[i].zerocopy == optionsB->zerocopy);
+        assert(optionsA[i].streams == optionsB->streams);
     }
 
     BIO_free_all(sendctrl);
@@ -69,11 +69,7 @@ static void free_info(void) {
         info = info->next;
 
         if ( tmp->result ) {
-            if ( tmp->result->tcpinfo ) {
-                free(tmp->result->tcpinfo);
-                tmp->result->tcpinfo = NULL;
-            }
-            free(tmp->result);
+            free_test_result(tmp->result);
             tmp->result = NULL;
         }
 
@@ -103,6 +99,33 @@ static struct test_request_t* build_info(struct test_request_t *next,
     result->bytes = bytes;
     /* TODO add tcpinfo */
     result->tcpinfo = NULL;
+    /* split every third result across a couple of parallel streams */
+    if ( bytes % 3 == 0 ) {
+        result->n_streams = 2;
+        result->streams = calloc(2, sizeof(struct test_result_t));
+        result->streams[0].start_ns = result->start_ns;
+        result->streams[0].end_ns = result->end_ns;
+        result->streams[0].bytes = bytes / 2;
+        result->streams[1].start_ns = result->start_ns;
+        result->streams[1].end_ns = result->end_ns;
+        result->streams[1].bytes = bytes - bytes / 2;
+        result->streams[1].tcpinfo = calloc(1, sizeof(struct tcpinfo_result_t));
+        result->streams[1].tcpinfo->total_retrans = bytes % 7;
+    } else {
+        result->n_streams = 0;
+        result->streams = NULL;
+    }
+
+    /* each end only knows how it moved its own data */
+    if ( direction == TPUT_2_CLIENT ) {
+        result->send_path = TPUT_DATA_PATH_UNKNOWN;
+        result->receive_path = (bytes % 2) ?
+            TPUT_DATA_PATH_DISCARD : TPUT_DATA_PATH_COPY;
+    } else {
+        result->send_path = (bytes % 2) ?
+            TPUT_DATA_PATH_ZEROCOPY : TPUT_DATA_PATH_COPY;
+        result->receive_path = TPUT_DATA_PATH_UNKNOWN;
+    }
 
     item->result = result;
 
@@ -165,6 +188,8 @@ static void verify_address(struct addrinfo *a, Amplet2__Throughput__Header *b) {
  */
 static void verify_response(struct test_request_t *a,
         Amplet2__Throughput__Item *b) {
+    struct test_result_t *stream;
+    unsigned int i;
 
     assert(b->has_direction);
     assert((int)a->type == (int)b->direction);
@@ -172,6 +197,26 @@ static void verify_response(struct test_request_t *a,
     assert(a->result->end_ns - a->result->start_ns == b->duration);
     assert(b->has_bytes);
     assert(a->result->bytes == b->bytes);
+    assert(b->has_send_path ==
+            (a->result->send_path != TPUT_DATA_PATH_UNKNOWN));
+    assert((int)a->result->send_path == (int)b->send_path);
+    assert(b->has_receive_path ==
+            (a->result->receive_path != TPUT_DATA_PATH_UNKNOWN));
+    assert((int)a->result->receive_path == (int)b->receive_path);
+
+    assert(a->result->n_streams == b->n_streams);
+    for ( i = 0; i < b->n_streams; i++ ) {
+        stream = &a->result->streams[i];
+        assert(b->streams[i]->has_bytes);
+        assert(stream->bytes == b->streams[i]->bytes);
+        assert(b->streams[i]->has_duration);
+        assert(stream->end_ns - stream->start_ns == b->streams[i]->duration);
+        assert((stream->tcpinfo == NULL) == (b->streams[i]->tcpinfo == NULL));
+        if ( stream->tcpinfo ) {
+            assert(stream->tcpinfo->total_retrans ==
+                    b->streams[i]->tcpinfo->total_retrans);
+        }
+    }
 }
 
 
@@ -0,0 +1,195 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "tests.h"
+#include "throughput.h"
+
+#define STREAM_COUNT 4
+#define STREAM_BYTES (1024 * 1024)
+
+struct receiver_t {
+    int *sockets;
+    struct test_result_t result;
+    int status;
+};
+
+
+
+/*
+ * Receive the test data in another thread so the main thread can send it.
+ */
+static void *receiver(void *data) {
+    struct receiver_t *receiver = (struct receiver_t*)data;
+    receiver->status = incomingStreams(receiver->sockets, STREAM_COUNT,
+            &receiver->result, 0);
+    return NULL;
+}
+
+
+
+/*
+ * Return the local or remote port of a connected socket.
+ */
+static uint16_t get_port(int sock, int peer) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    if ( peer ) {
+        assert(getpeername(sock, (struct sockaddr*)&addr, &len) == 0);
+    } else {
+        assert(getsockname(sock, (struct sockaddr*)&addr, &len) == 0);
+    }
+
+    return ntohs(addr.sin_port);
+}
+
+
+
+/*
+ * Check that parallel streams are run in full and that the per-stream and
+ * aggregate results add up.
+ */
+int main(void) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listener;
+    int clients[STREAM_COUNT];
+    int servers[STREAM_COUNT];
+    struct test_request_t request;
+    struct test_result_t result;
+    struct receiver_t receive;
+    pthread_t thread;
+    uint64_t total;
+    int i;
+
+    /* open a number of connections over the loopback interface */
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    assert(listener >= 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    assert(listen(listener, STREAM_COUNT) == 0);
+    assert(getsockname(listener, (struct sockaddr*)&addr, &len) == 0);
+
+    for ( i = 0; i < STREAM_COUNT; i++ ) {
+        clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+        assert(clients[i] >= 0);
+        assert(connect(clients[i], (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    }
+
+    /* accept them in reverse order so they need sorting to match up */
+    for ( i = STREAM_COUNT - 1; i >= 0; i-- ) {
+        servers[i] = accept(listener, NULL, NULL);
+        assert(servers[i] >= 0);
+    }
+    close(listener);
+
+    sortStreams(clients, STREAM_COUNT, 0);
+    sortStreams(servers, STREAM_COUNT, 1);
+
+    for ( i = 0; i < STREAM_COUNT; i++ ) {
+        assert(get_port(clients[i], 0) == get_port(servers[i], 1));
+        if ( i > 0 ) {
+            assert(get_port(clients[i - 1], 0) < get_port(clients[i], 0));
+        }
+    }
+
+    /* receive in another thread */
+    memset(&receive, 0, sizeof(receive));
+    receive.sockets = servers;
+    assert(pthread_create(&thread, NULL, receiver, &receive) == 0);
+
+    /* send a fixed amount of data on every stream */
+    memset(&request, 0, sizeof(request));
+    memset(&result, 0, sizeof(result));
+    request.type = TPUT_2_SERVER;
+    request.bytes = STREAM_BYTES;
+    request.write_size = DEFAULT_WRITE_SIZE;
+
+    assert(sendStreams(clients, STREAM_COUNT, &request, &result) == 0);
+
+    /* closing the connections will end the test for the receiver */
+    closeStreams(clients, STREAM_COUNT);
+    for ( i = 0; i < STREAM_COUNT; i++ ) {
+        assert(clients[i] == -1);
+    }
+
+    pthread_join(thread, NULL);
+    closeStreams(servers, STREAM_COUNT);
+
+    /* check the sender results */
+    assert(result.n_streams == STREAM_COUNT);
+    assert(result.bytes == (uint64_t)STREAM_COUNT * STREAM_BYTES);
+    assert(result.send_path == TPUT_DATA_PATH_COPY);
+    for ( i = 0; i < STREAM_COUNT; i++ ) {
+        assert(result.streams[i].bytes == STREAM_BYTES);
+        assert(result.streams[i].start_ns >= result.start_ns);
+        assert(result.streams[i].end_ns <= result.end_ns);
+    }
+
+    /* check the receiver results */
+    assert(receive.status == 0);
+    assert(receive.result.n_streams == STREAM_COUNT);
+    assert(receive.result.receive_path == TPUT_DATA_PATH_COPY);
+    total = 0;
+    for ( i = 0; i < STREAM_COUNT; i++ ) {
+        assert(receive.result.streams[i].bytes == STREAM_BYTES);
+        total += receive.result.streams[i].bytes;
+    }
+    assert(receive.result.bytes == total);
+
+    for ( i = 0; i < STREAM_COUNT; i++ ) {
+        free(result.streams[i].tcpinfo);
+    }
+    free(result.streams);
+    free(receive.result.streams);
+
+    return 0;
+}
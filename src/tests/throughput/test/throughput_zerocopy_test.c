@@ -0,0 +1,114 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "config.h"
+#include "tests.h"
+#include "throughput.h"
+
+#define BUFFER_LEN 4096
+
+static int zerocopy_sends = 0;
+
+
+
+/*
+ * Replace send() so that every zero-copy send fails as though there were too
+ * many notifications outstanding. Ordinary sends are passed through.
+ */
+ssize_t send(int sockfd, const void *buf, size_t len, int flags) {
+#ifdef HAVE_MSG_ZEROCOPY
+    if ( flags & MSG_ZEROCOPY ) {
+        zerocopy_sends++;
+        errno = ENOBUFS;
+        return -1;
+    }
+#endif
+    return write(sockfd, buf, len);
+}
+
+
+
+/*
+ * Check that when zero-copy sends fail with ENOBUFS the buffer is still
+ * sent in full by copying it, and that the copy is reported.
+ */
+int main(void) {
+#ifdef HAVE_MSG_ZEROCOPY
+    char out[BUFFER_LEN], in[BUFFER_LEN];
+    uint32_t pending = 0;
+    int copied = 0;
+    int sockets[2];
+    ssize_t bytes;
+    size_t total = 0;
+    int i;
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+
+    for ( i = 0; i < BUFFER_LEN; i++ ) {
+        out[i] = i & 0xff;
+    }
+
+    assert(amp_test_write_buffer_zerocopy(sockets[0], out, BUFFER_LEN,
+                &pending, &copied) == BUFFER_LEN);
+    assert(zerocopy_sends == 1);
+    assert(pending == 0);
+    assert(copied == 1);
+
+    while ( total < BUFFER_LEN ) {
+        bytes = read(sockets[1], in + total, BUFFER_LEN - total);
+        assert(bytes > 0);
+        total += bytes;
+    }
+
+    assert(memcmp(in, out, BUFFER_LEN) == 0);
+
+    close(sockets[0]);
+    close(sockets[1]);
+#endif
+
+    return 0;
+}
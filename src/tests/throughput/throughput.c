@@ -51,9 +51,11 @@
 struct option long_options[] =
     {
         {"client", required_argument, 0, 'c'},
+        {"zerocopy", no_argument, 0, 'C'},
         {"direction", required_argument, 0, 'd'},
         {"rcvbuf", required_argument, 0, 'i'},
         {"mss", required_argument, 0, 'M'},
+        {"streams", required_argument, 0, 'n'},
         {"nodelay", no_argument, 0, 'N'},
         {"sndbuf", required_argument, 0, 'o'},
         {"port", required_argument, 0, 'p'},
@@ -96,10 +98,14 @@ void usage(void) {
     fprintf(stderr, "Client specific options:\n");
     fprintf(stderr, "  -c, --client         <host>    "
             "Run in client mode, connecting to <host>\n");
+    fprintf(stderr, "  -C, --zerocopy                 "
+            "Avoid copying test data to/from userspace\n");
     fprintf(stderr, "  -i, --rcvbuf         <bytes>   "
             "Maximum size of the receive (input) buffer\n");
     fprintf(stderr, "  -M, --mss            <bytes>   "
             "Set TCP maximum segment size\n");
+    fprintf(stderr, "  -n, --streams        <num>     "
+            "Number of parallel connections to use (default 1)\n");
     fprintf(stderr, "  -N, --nodelay                  "
             "Disable Nagle's Algorithm (set TCP_NODELAY)\n");
     fprintf(stderr, "  -o, --sndbuf         <bytes>   "
@@ -216,5 +222,8 @@ test_t *register_test() {
     /* don't give the throughput test a SIGINT warning */
     new_test->sigint = 0;
 
+    /* keeps global state between runs, always run it in a new process */
+    new_test->reentrant = 0;
+
     return new_test;
 }
@@ -60,6 +60,18 @@
 #define DEFAULT_TEST_DURATION 10 /* iperf default: 10s */
 #define MAX_MALLOC 20e6
 
+/* number of random number generators to interleave when filling payloads */
+#define RANDOM_LANES 8
+
+/* maximum number of parallel connections that a test can use */
+#define MAX_STREAMS 64
+
+/* how long to wait for outstanding zero-copy completions after a test */
+#define ZEROCOPY_DRAIN_TIMEOUT_MS 1000
+
+/* how much data to try to discard at once when not copying to userspace */
+#define DISCARD_READ_SIZE (4 * DEFAULT_WRITE_SIZE)
+
 
 /*
  * Used as shortcuts for scheduling common tests through the web interface.
@@ -88,6 +100,14 @@ enum tput_protocol {
     TPUT_PROTOCOL_HTTP_POST = 1,
 };
 
+/* values match the DataPath enum in the protocol buffer definition */
+enum tput_data_path {
+    TPUT_DATA_PATH_UNKNOWN = 0,
+    TPUT_DATA_PATH_COPY = 1,
+    TPUT_DATA_PATH_ZEROCOPY = 2,
+    TPUT_DATA_PATH_DISCARD = 3,
+};
+
 
 amp_test_result_t* run_throughput(int argc, char *argv[], int count,
         struct addrinfo **dests);
@@ -120,6 +140,10 @@ struct test_result_t {
     uint64_t start_ns; /* Start time in nanoseconds */
     uint64_t end_ns; /* End time in nanoseconds */
     struct tcpinfo_result_t *tcpinfo;
+    enum tput_data_path send_path; /* How the sender wrote data */
+    enum tput_data_path receive_path; /* How the receiver read data */
+    uint32_t n_streams; /* Number of per-stream results, if more than one */
+    struct test_result_t *streams; /* Per-stream results, summed above */
 };
 
 
@@ -131,6 +155,7 @@ struct test_request_t {
     uint32_t duration;
     uint32_t write_size;
     uint32_t randomise;
+    uint32_t zerocopy;
     struct test_result_t *result;
     struct test_request_t *next;
 };
@@ -157,6 +182,8 @@ struct opt_t {
     char *device;
     struct addrinfo *sourcev4;
     struct addrinfo *sourcev6;
+    uint8_t zerocopy; /* Try to avoid copying test data to/from userspace */
+    uint32_t streams; /* Number of parallel test connections to use */
 };
 
 /* All of our packet types */
@@ -173,15 +200,26 @@ enum TPUT_PKT {
 
 /* Shared common functions from throughput_common.c */
 Amplet2__Throughput__Item* report_schedule(struct test_request_t *info);
+void free_report_schedule(Amplet2__Throughput__Item *item);
+void free_test_result(struct test_result_t *result);
 
 /* do outgoing test */
 int sendStream(int sock_fd, struct test_request_t *test_opts,
         struct test_result_t *res);
 
 /* Receive incoming test */
-int incomingTest(int sock_fd, struct test_result_t *result);
+int incomingTest(int sock_fd, struct test_result_t *result, int zerocopy);
+
+/* Run either of the above across several connections in parallel */
+int sendStreams(int *sockets, uint32_t count, struct test_request_t *test_opts,
+        struct test_result_t *res);
+int incomingStreams(int *sockets, uint32_t count, struct test_result_t *result,
+        int zerocopy);
+void sortStreams(int *sockets, uint32_t count, int peer);
+void closeStreams(int *sockets, uint32_t count);
 int writeBuffer(int sock_fd, void *packet, size_t length);
 int readBuffer(int test_socket);
+int discardBuffer(int test_socket);
 
 uint64_t timeNanoseconds(void);
 ProtobufCBinaryData* build_hello(struct opt_t *options);
@@ -192,6 +230,8 @@ void* parse_send(ProtobufCBinaryData *data);
 #if UNIT_TEST
 amp_test_result_t* amp_test_report_results(uint64_t start_time,
         struct addrinfo *dest, struct opt_t *options);
+int amp_test_write_buffer_zerocopy(int sock_fd, void *data, size_t length,
+        uint32_t *pending, int *copied);
 #endif
 
 #endif /* _TESTS_THROUGHPUT_H */
@@ -136,6 +136,7 @@ static void parseSchedule(struct opt_t *options, char *request) {
         (*current)->write_size = options->write_size;
         (*current)->randomise = options->randomise;
         (*current)->protocol = options->protocol;
+        (*current)->zerocopy = options->zerocopy;
         (*current)->result = NULL;
         (*current)->next = NULL;
 
@@ -203,12 +204,7 @@ static void freeSchedule(struct opt_t *options){
         item = item->next;
 
         if ( tmp->result ) {
-            if ( tmp->result->tcpinfo ) {
-                free(tmp->result->tcpinfo);
-                tmp->result->tcpinfo = NULL;
-            }
-
-            free(tmp->result);
+            free_test_result(tmp->result);
             tmp->result = NULL;
         }
 
@@ -246,6 +242,10 @@ static amp_test_result_t* report_results(uint64_t start_time,
     header.dscp = options->dscp;
     header.has_protocol = 1;
     header.protocol = options->protocol;
+    header.has_zerocopy = 1;
+    header.zerocopy = options->zerocopy;
+    header.has_streams = 1;
+    header.streams = options->streams;
 
     /* build up the repeated reports section with each of the results */
     for ( i = 0, item = options->schedule; item != NULL; item = item->next ) {
@@ -272,10 +272,7 @@ static amp_test_result_t* report_results(uint64_t start_time,
 
     /* free up all the memory we had to allocate to report items */
     for ( i = 0; i < msg.n_reports; i++ ) {
-        if ( reports[i]->tcpinfo ) {
-            free(reports[i]->tcpinfo);
-        }
-        free(reports[i]);
+        free_report_schedule(reports[i]);
     }
 
     free(reports);
@@ -285,28 +282,115 @@ static amp_test_result_t* report_results(uint64_t start_time,
 
 
 
-static struct tcpinfo_result_t *extract_tcpinfo(ProtobufCBinaryData *data) {
-    struct tcpinfo_result_t *tcpinfo = NULL;
+/*
+ * Copy the tcpinfo from a protocol buffer message into our internal format.
+ */
+static struct tcpinfo_result_t *extract_tcpinfo(
+        Amplet2__Throughput__TCPInfo *item) {
+    struct tcpinfo_result_t *tcpinfo;
+
+    if ( item == NULL ) {
+        return NULL;
+    }
+
+    tcpinfo = malloc(sizeof(struct tcpinfo_result_t));
+    tcpinfo->delivery_rate = item->delivery_rate;
+    tcpinfo->total_retrans = item->total_retrans;
+    tcpinfo->rtt = item->rtt;
+    tcpinfo->rttvar = item->rttvar;
+    tcpinfo->min_rtt = item->min_rtt;
+    tcpinfo->busy_time = item->busy_time;
+    tcpinfo->rwnd_limited = item->rwnd_limited;
+    tcpinfo->sndbuf_limited = item->sndbuf_limited;
+
+    return tcpinfo;
+}
+
+
+
+/*
+ * Add the information that only the remote sender knows (tcpinfo and the
+ * data path used) to the result of a test that we received.
+ */
+static void extract_sender_result(ProtobufCBinaryData *data,
+        struct test_result_t *result) {
     Amplet2__Throughput__Item *item = amplet2__throughput__item__unpack(
             NULL, data->len, data->data);
+    unsigned int i;
 
     Log(LOG_DEBUG, "Extracting tcpinfo information from results");
 
-    if ( item->tcpinfo ) {
-        tcpinfo = malloc(sizeof(struct tcpinfo_result_t));
-        tcpinfo->delivery_rate = item->tcpinfo->delivery_rate;
-        tcpinfo->total_retrans = item->tcpinfo->total_retrans;
-        tcpinfo->rtt = item->tcpinfo->rtt;
-        tcpinfo->rttvar = item->tcpinfo->rttvar;
-        tcpinfo->min_rtt = item->tcpinfo->min_rtt;
-        tcpinfo->busy_time = item->tcpinfo->busy_time;
-        tcpinfo->rwnd_limited = item->tcpinfo->rwnd_limited;
-        tcpinfo->sndbuf_limited = item->tcpinfo->sndbuf_limited;
+    result->tcpinfo = extract_tcpinfo(item->tcpinfo);
+    result->send_path = item->send_path;
+
+    /* both ends sorted the streams the same way, so the order matches */
+    for ( i = 0; i < item->n_streams && i < result->n_streams; i++ ) {
+        result->streams[i].tcpinfo = extract_tcpinfo(item->streams[i]->tcpinfo);
+        result->streams[i].send_path = item->streams[i]->send_path;
+    }
+
+    if ( item->n_streams != result->n_streams ) {
+        Log(LOG_WARNING, "Server reported %d streams, expected %d",
+                item->n_streams, result->n_streams);
     }
 
     amplet2__throughput__item__free_unpacked(item, NULL);
+}
 
-    return tcpinfo;
+
+
+/*
+ * Replace the result of a test that we sent with what the remote receiver
+ * saw, which is a more accurate measure of the data transferred.
+ */
+static void extract_receiver_result(ProtobufCBinaryData *data,
+        struct test_result_t *result) {
+    Amplet2__Throughput__Item *item = amplet2__throughput__item__unpack(
+            NULL, data->len, data->data);
+    unsigned int i;
+
+    /* XXX extracting this now cause it's easier :( */
+    result->start_ns = 0;
+    result->end_ns = item->duration;
+    result->bytes = item->bytes;
+    result->receive_path = item->receive_path;
+
+    for ( i = 0; i < item->n_streams && i < result->n_streams; i++ ) {
+        result->streams[i].start_ns = 0;
+        result->streams[i].end_ns = item->streams[i]->duration;
+        result->streams[i].bytes = item->streams[i]->bytes;
+        result->streams[i].receive_path = item->streams[i]->receive_path;
+    }
+
+    if ( item->n_streams != result->n_streams ) {
+        Log(LOG_WARNING, "Server reported %d streams, expected %d",
+                item->n_streams, result->n_streams);
+    }
+
+    amplet2__throughput__item__free_unpacked(item, NULL);
+}
+
+
+
+/*
+ * Open a test connection for each of the parallel streams, then sort them
+ * into the same order that the server will use.
+ */
+static int connectStreams(struct addrinfo *serv_addr, uint16_t port,
+        struct sockopt_t *sockopts, int *sockets, uint32_t count) {
+    uint32_t i;
+
+    for ( i = 0; i < count; i++ ) {
+        sockets[i] = connect_to_server(serv_addr, port, sockopts);
+        if ( sockets[i] == -1 ) {
+            closeStreams(sockets, count);
+            return -1;
+        }
+    }
+
+    sortStreams(sockets, count, 0);
+
+    return 0;
 }
 
 
@@ -321,10 +405,9 @@ static struct tcpinfo_result_t *extract_tcpinfo(ProtobufCBinaryData *data) {
  */
 static amp_test_result_t* runSchedule(struct addrinfo *serv_addr,
         struct opt_t *options, struct sockopt_t *sockopts, BIO *ctrl) {
-    int test_socket = -1;
+    int *test_sockets;
     uint64_t start_time_ns;
     ProtobufCBinaryData data;
-    Amplet2__Throughput__Item *remote_results = NULL;
     amp_test_result_t *result;
     int sent_result;
 
@@ -340,6 +423,9 @@ static amp_test_result_t* runSchedule(struct addrinfo *serv_addr,
 
     start_time_ns = timeNanoseconds();
 
+    test_sockets = malloc(sizeof(int) * options->streams);
+    memset(test_sockets, -1, sizeof(int) * options->streams);
+
     if ( send_control_hello(AMP_TEST_THROUGHPUT, ctrl,
                 build_hello(options)) < 0 ) {
         Log(LOG_WARNING, "Failed to send HELLO packet, aborting");
@@ -350,12 +436,13 @@ static amp_test_result_t* runSchedule(struct addrinfo *serv_addr,
     if ( read_control_ready(AMP_TEST_THROUGHPUT, ctrl,
                 &options->tport) < 0 ) {
         Log(LOG_WARNING, "Failed to read READY packet, aborting");
+        free(test_sockets);
         return NULL;
     }
 
-    /* Connect the test socket */
-    test_socket = connect_to_server(serv_addr, options->tport, sockopts);
-    if ( test_socket == -1 ) {
+    /* Connect the test sockets */
+    if ( connectStreams(serv_addr, options->tport, sockopts, test_sockets,
+                options->streams) < 0 ) {
         Log(LOG_ERR, "Cannot connect to the server testsocket");
         goto end;
     }
@@ -365,7 +452,7 @@ static amp_test_result_t* runSchedule(struct addrinfo *serv_addr,
 
         /* TODO rather than renew, just start with a HELLO every time */
         /* reset the test connection between tests */
-        if ( test_socket < 0 ) {
+        if ( test_sockets[0] < 0 ) {
             Log(LOG_DEBUG, "Asking the Server to renew the connection");
             if ( send_control_renew(AMP_TEST_THROUGHPUT, ctrl) < 0 ) {
                 Log(LOG_ERR, "Failed to send reset packet");
@@ -375,12 +462,12 @@ static amp_test_result_t* runSchedule(struct addrinfo *serv_addr,
             if ( read_control_ready(AMP_TEST_THROUGHPUT, ctrl,
                         &options->tport) < 0 ) {
                 Log(LOG_WARNING, "Failed to read READY packet, aborting");
+                free(test_sockets);
                 return NULL;
             }
-            /* Open up a new one */
-            test_socket = connect_to_server(serv_addr, options->tport,
-                    sockopts);
-            if ( test_socket == -1 ) {
+            /* Open up new ones */
+            if ( connectStreams(serv_addr, options->tport, sockopts,
+                        test_sockets, options->streams) < 0 ) {
                 Log(LOG_ERR, "Failed to open a new connection");
                 goto end;
             }
@@ -402,21 +489,22 @@ static amp_test_result_t* runSchedule(struct addrinfo *serv_addr,
                 cur->result = calloc(1, sizeof(struct test_result_t));
 
                 /* Receive the test */
-                if ( incomingTest(test_socket, cur->result) != 0 ) {
+                if ( incomingStreams(test_sockets, options->streams,
+                            cur->result, options->zerocopy) != 0 ) {
                     Log(LOG_ERR, "Something went wrong when receiving an "
                             "incoming test from the server");
                     goto end;
                 }
-                close(test_socket);
-                test_socket = -1;
+                closeStreams(test_sockets, options->streams);
 
                 /* Get server result to get the tcpinfo from the sender */
                 if ( read_control_result(AMP_TEST_THROUGHPUT,ctrl,&data) < 0 ) {
                     Log(LOG_WARNING, "Failed to read RESULT packet, aborting");
+                    free(test_sockets);
                     return NULL;
                 }
                 /* main result is already filled locally, add server tcpinfo */
-                cur->result->tcpinfo = extract_tcpinfo(&data);
+                extract_sender_result(&data, cur->result);
                 free(data.data);
                 Log(LOG_DEBUG, "Received results of test from server");
                 continue;
@@ -431,12 +519,14 @@ static amp_test_result_t* runSchedule(struct addrinfo *serv_addr,
                 if ( read_control_ready(AMP_TEST_THROUGHPUT, ctrl,
                             &options->tport) < 0 ) {
                     Log(LOG_WARNING, "Failed to read READY packet, aborting");
+                    closeStreams(test_sockets, options->streams);
+                    free(test_sockets);
                     return NULL;
                 }
 
-                sent_result = sendStream(test_socket, cur, cur->result);
-                close(test_socket);
-                test_socket = -1;
+                sent_result = sendStreams(test_sockets, options->streams, cur,
+                        cur->result);
+                closeStreams(test_sockets, options->streams);
 
                 if ( sent_result == 0 ) {
                     Log(LOG_DEBUG, "Finished sending - now getting results");
@@ -444,17 +534,11 @@ static amp_test_result_t* runSchedule(struct addrinfo *serv_addr,
                     if ( read_control_result(AMP_TEST_THROUGHPUT, ctrl,
                                 &data) < 0 ) {
                         Log(LOG_WARNING, "Failed to read RESULT packet, aborting");
+                        free(test_sockets);
                         return NULL;
                     }
-                    remote_results = amplet2__throughput__item__unpack(NULL,
-                            data.len, data.data);
-                    /* XXX extracting this now cause it's easier :( */
-                    cur->result->start_ns = 0;
-                    cur->result->end_ns = remote_results->duration;
-                    cur->result->bytes = remote_results->bytes;
+                    extract_receiver_result(&data, cur->result);
                     free(data.data);
-                    amplet2__throughput__item__free_unpacked(remote_results,
-                            NULL);
 /*
                     Log(LOG_DEBUG, "Got results from server %" PRIu32
                             " %" PRIu32 " %" PRIu64 " %" PRIu64,
@@ -476,9 +560,8 @@ static amp_test_result_t* runSchedule(struct addrinfo *serv_addr,
 end:
     result = report_results(start_time_ns / 1000000000, serv_addr, options);
 
-    if ( test_socket != -1 ) {
-        close(test_socket);
-    }
+    closeStreams(test_sockets, options->streams);
+    free(test_sockets);
 
     return result;
 }
@@ -521,13 +604,15 @@ amp_test_result_t* run_throughput_client(int argc, char *argv[], int count,
     test_options.schedule = NULL;
     test_options.textual_schedule = NULL;
     test_options.reuse_addr = 0;
+    test_options.zerocopy = 0;
+    test_options.streams = 1;
 
     /* TODO free these when done? */
     memset(&sockopts, 0, sizeof(sockopts));
     client = NULL;
 
     while ( (opt = getopt_long(argc, argv,
-                    "c:d:i:M:No:p:P:rS:t:u:z:I:Q:Z:4::6::hx",
+                    "c:Cd:i:M:n:No:p:P:rS:t:u:z:I:Q:Z:4::6::hx",
                     long_options, NULL)) != -1 ) {
 
         switch ( opt ) {
@@ -553,9 +638,11 @@ amp_test_result_t* run_throughput_client(int argc, char *argv[], int count,
                       break;
             case 'Z': /* option does nothing for this test */ break;
             case 'c': client = optarg; break;
+            case 'C': test_options.zerocopy = 1; break;
             case 'd': direction = atoi(optarg); break;
             case 'i': test_options.sock_rcvbuf = atoi(optarg); break;
             case 'M': test_options.sock_mss = atoi(optarg); break;
+            case 'n': test_options.streams = atoi(optarg); break;
             case 'N': test_options.sock_disable_nagle = 1; break;
             case 'o': test_options.sock_sndbuf = atoi(optarg); break;
             case 'p': test_options.cport = atoi(optarg); break;
@@ -644,6 +731,13 @@ amp_test_result_t* run_throughput_client(int argc, char *argv[], int count,
         exit(EXIT_FAILURE);
     }
 
+    /* make sure the number of parallel streams is sensible */
+    if ( test_options.streams < 1 || test_options.streams > MAX_STREAMS ) {
+        Log(LOG_ERR, "Stream count invalid, should be 0 < x <= %d, got %d",
+                MAX_STREAMS, test_options.streams);
+        exit(EXIT_FAILURE);
+    }
+
     /* schedule can't be set if direction and duration are also set */
     if ( duration > 0 && direction != DIRECTION_NOT_SET &&
             test_options.schedule ) {
@@ -837,6 +931,20 @@ static void printSpeed(uint64_t bytes, uint64_t time_ns) {
 
 
 
+/*
+ * Describe how test data was moved between the test and the kernel.
+ */
+static char *data_path_to_string(Amplet2__Throughput__DataPath path) {
+    switch ( path ) {
+        case AMPLET2__THROUGHPUT__DATA_PATH__COPY: return "copy";
+        case AMPLET2__THROUGHPUT__DATA_PATH__ZEROCOPY: return "zero-copy";
+        case AMPLET2__THROUGHPUT__DATA_PATH__DISCARD: return "discard";
+        default: return "unknown";
+    };
+}
+
+
+
 /**
  * Print throughput test results to stdout, nicely formatted for the
  * standalone test.
@@ -846,7 +954,8 @@ static void printSpeed(uint64_t bytes, uint64_t time_ns) {
 void print_throughput(amp_test_result_t *result) {
     Amplet2__Throughput__Report *msg;
     Amplet2__Throughput__Item *item;
-    unsigned int i;
+    Amplet2__Throughput__Stream *stream;
+    unsigned int i, j;
     char addrstr[INET6_ADDRSTRLEN];
 
     assert(result);
@@ -879,6 +988,14 @@ void print_throughput(amp_test_result_t *result) {
         default: break;
     };
 
+    if ( msg->header->zerocopy ) {
+        printf(" zero-copy");
+    }
+
+    if ( msg->header->streams > 1 ) {
+        printf(" streams:%" PRIu32, msg->header->streams);
+    }
+
     printf("\n\n");
 
     for ( i=0; i < msg->n_reports; i++ ) {
@@ -898,6 +1015,12 @@ void print_throughput(amp_test_result_t *result) {
         printSpeed(item->bytes, item->duration);
         printf("\n");
 
+        if ( item->has_send_path || item->has_receive_path ) {
+            printf("\tData path: send %s, receive %s\n",
+                    data_path_to_string(item->send_path),
+                    data_path_to_string(item->receive_path));
+        }
+
         if ( item->tcpinfo ) {
             printf("\tTotal retransmits: %d\n",
                     item->tcpinfo->total_retrans);
@@ -922,10 +1045,24 @@ void print_throughput(amp_test_result_t *result) {
                         100.0 * item->tcpinfo->sndbuf_limited /
                         item->tcpinfo->busy_time);
             }
-        } else {
+        } else if ( item->n_streams == 0 ) {
             printf("\tNo further TCP information available from sender\n");
         }
 
+        for ( j = 0; j < item->n_streams; j++ ) {
+            stream = item->streams[j];
+            printf("\tstream %u:", j);
+            printSize(stream->bytes);
+            printDuration(stream->duration);
+            printSpeed(stream->bytes, stream->duration);
+            if ( stream->tcpinfo ) {
+                printf(" retransmits:%" PRIu32 " rtt:%.02fms",
+                        stream->tcpinfo->total_retrans,
+                        stream->tcpinfo->rtt / 1000.0);
+            }
+            printf("\n");
+        }
+
         printf("\n");
     }
 
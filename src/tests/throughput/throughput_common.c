@@ -47,10 +47,13 @@
  */
 #include <sys/types.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <poll.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
@@ -58,6 +61,10 @@
 #include <inttypes.h>
 
 #include "config.h"
+
+#ifdef HAVE_MSG_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
 #include "throughput.h"
 #include "serverlib.h"
 #include "debug.h"
@@ -93,6 +100,10 @@ ProtobufCBinaryData* build_hello(struct opt_t *options) {
     hello.dscp = options->dscp;
     hello.has_protocol = 1;
     hello.protocol = options->protocol;
+    hello.has_zerocopy = 1;
+    hello.zerocopy = options->zerocopy;
+    hello.has_streams = 1;
+    hello.streams = options->streams;
 
     data->len = amplet2__throughput__hello__get_packed_size(&hello);
     data->data = malloc(data->len);
@@ -125,6 +136,14 @@ void* parse_hello(ProtobufCBinaryData *data) {
     options->write_size = hello->write_size;
     options->dscp = hello->dscp;
     options->protocol = hello->protocol;
+    options->zerocopy = hello->zerocopy;
+    /* older clients don't send this and only ever use a single connection */
+    options->streams = hello->has_streams ? hello->streams : 1;
+    if ( options->streams < 1 || options->streams > MAX_STREAMS ) {
+        Log(LOG_WARNING, "Invalid stream count %" PRIu32 ", using 1",
+                options->streams);
+        options->streams = 1;
+    }
 
     amplet2__throughput__hello__free_unpacked(hello, NULL);
 
@@ -179,6 +198,73 @@ void* parse_send(ProtobufCBinaryData *data) {
 
 
 
+/*
+ * Construct a protocol buffer message containing extra TCP information.
+ */
+static Amplet2__Throughput__TCPInfo* report_tcpinfo(
+        struct tcpinfo_result_t *tcpinfo) {
+
+    Amplet2__Throughput__TCPInfo *item;
+
+    if ( tcpinfo == NULL ) {
+        return NULL;
+    }
+
+    item = calloc(1, sizeof(Amplet2__Throughput__TCPInfo));
+    amplet2__throughput__tcpinfo__init(item);
+    item->has_delivery_rate = 1;
+    item->delivery_rate = tcpinfo->delivery_rate;
+    item->has_total_retrans = 1;
+    item->total_retrans = tcpinfo->total_retrans;
+    item->has_rtt = 1;
+    item->rtt = tcpinfo->rtt;
+    item->has_rttvar = 1;
+    item->rttvar = tcpinfo->rttvar;
+    item->has_min_rtt = 1;
+    item->min_rtt = tcpinfo->min_rtt;
+    item->has_busy_time = 1;
+    item->busy_time = tcpinfo->busy_time;
+    item->has_rwnd_limited = 1;
+    item->rwnd_limited = tcpinfo->rwnd_limited;
+    item->has_sndbuf_limited = 1;
+    item->sndbuf_limited = tcpinfo->sndbuf_limited;
+
+    return item;
+}
+
+
+
+/*
+ * Construct a protocol buffer message containing the results for a single
+ * connection within a test that used parallel streams.
+ */
+static Amplet2__Throughput__Stream* report_stream(
+        struct test_result_t *result) {
+
+    Amplet2__Throughput__Stream *stream =
+        calloc(1, sizeof(Amplet2__Throughput__Stream));
+
+    amplet2__throughput__stream__init(stream);
+    stream->has_duration = 1;
+    stream->duration = result->end_ns - result->start_ns;
+    stream->has_bytes = 1;
+    stream->bytes = result->bytes;
+    stream->tcpinfo = report_tcpinfo(result->tcpinfo);
+
+    if ( result->send_path != TPUT_DATA_PATH_UNKNOWN ) {
+        stream->has_send_path = 1;
+        stream->send_path = result->send_path;
+    }
+    if ( result->receive_path != TPUT_DATA_PATH_UNKNOWN ) {
+        stream->has_receive_path = 1;
+        stream->receive_path = result->receive_path;
+    }
+
+    return stream;
+}
+
+
+
 /*
  * Construct a protocol buffer message containing the results for a single
  * element in the test schedule.
@@ -187,6 +273,7 @@ Amplet2__Throughput__Item* report_schedule(struct test_request_t *info) {
 
     Amplet2__Throughput__Item *item =
         (Amplet2__Throughput__Item*)malloc(sizeof(Amplet2__Throughput__Item));
+    unsigned int i;
 
     /* fill the report item with results of a test */
     amplet2__throughput__item__init(item);
@@ -206,26 +293,27 @@ Amplet2__Throughput__Item* report_schedule(struct test_request_t *info) {
     item->has_bytes = 1;
     item->bytes = info->result->bytes;
 
+    /* only one end of the connection knows each of the data paths */
+    if ( info->result->send_path != TPUT_DATA_PATH_UNKNOWN ) {
+        item->has_send_path = 1;
+        item->send_path = info->result->send_path;
+    }
+    if ( info->result->receive_path != TPUT_DATA_PATH_UNKNOWN ) {
+        item->has_receive_path = 1;
+        item->receive_path = info->result->receive_path;
+    }
+
     /* add the tcpinfo block if there is one */
-    if ( info->result->tcpinfo ) {
-        item->tcpinfo = calloc(1, sizeof(Amplet2__Throughput__TCPInfo));
-        amplet2__throughput__tcpinfo__init(item->tcpinfo);
-        item->tcpinfo->has_delivery_rate = 1;
-        item->tcpinfo->delivery_rate = info->result->tcpinfo->delivery_rate;
-        item->tcpinfo->has_total_retrans = 1;
-        item->tcpinfo->total_retrans = info->result->tcpinfo->total_retrans;
-        item->tcpinfo->has_rtt = 1;
-        item->tcpinfo->rtt = info->result->tcpinfo->rtt;
-        item->tcpinfo->has_rttvar = 1;
-        item->tcpinfo->rttvar = info->result->tcpinfo->rttvar;
-        item->tcpinfo->has_min_rtt = 1;
-        item->tcpinfo->min_rtt = info->result->tcpinfo->min_rtt;
-        item->tcpinfo->has_busy_time = 1;
-        item->tcpinfo->busy_time = info->result->tcpinfo->busy_time;
-        item->tcpinfo->has_rwnd_limited = 1;
-        item->tcpinfo->rwnd_limited = info->result->tcpinfo->rwnd_limited;
-        item->tcpinfo->has_sndbuf_limited = 1;
-        item->tcpinfo->sndbuf_limited = info->result->tcpinfo->sndbuf_limited;
+    item->tcpinfo = report_tcpinfo(info->result->tcpinfo);
+
+    /* add the individual results if the test used parallel connections */
+    if ( info->result->n_streams > 1 ) {
+        item->n_streams = info->result->n_streams;
+        item->streams = calloc(item->n_streams,
+                sizeof(Amplet2__Throughput__Stream*));
+        for ( i = 0; i < item->n_streams; i++ ) {
+            item->streams[i] = report_stream(&info->result->streams[i]);
+        }
     }
 
     Log(LOG_DEBUG, "tput result: %" PRIu64 " bytes in %" PRIu64 "ms to %s",
@@ -239,6 +327,104 @@ Amplet2__Throughput__Item* report_schedule(struct test_request_t *info) {
 
 
 
+/*
+ * Free a protocol buffer message created by report_schedule().
+ */
+void free_report_schedule(Amplet2__Throughput__Item *item) {
+    unsigned int i;
+
+    if ( item == NULL ) {
+        return;
+    }
+
+    for ( i = 0; i < item->n_streams; i++ ) {
+        free(item->streams[i]->tcpinfo);
+        free(item->streams[i]);
+    }
+
+    free(item->streams);
+    free(item->tcpinfo);
+    free(item);
+}
+
+
+
+/*
+ * Free all the memory used by a test result, including per-stream results.
+ */
+void free_test_result(struct test_result_t *result) {
+    unsigned int i;
+
+    if ( result == NULL ) {
+        return;
+    }
+
+    for ( i = 0; i < result->n_streams; i++ ) {
+        free(result->streams[i].tcpinfo);
+    }
+
+    free(result->streams);
+    free(result->tcpinfo);
+    free(result);
+}
+
+
+
+/*
+ * State for the random number generator used to fill payloads. Several
+ * independent xorshift128+ generators are run side by side so that the
+ * compiler can vectorise the fill loop. Each parallel stream runs in its
+ * own thread and gets its own generators.
+ */
+static __thread struct {
+    uint64_t s0[RANDOM_LANES];
+    uint64_t s1[RANDOM_LANES];
+    int seeded;
+} random_state;
+
+
+
+/**
+ * Seed the payload random number generators. This is the only time that
+ * /dev/urandom is read, after that all random data is generated in
+ * userspace without any system calls.
+ */
+static void seedRandom(void) {
+    int fd;
+    int i;
+    ssize_t bytes = -1;
+
+    if ( (fd = open("/dev/urandom", O_RDONLY)) < 0 ) {
+        Log(LOG_WARNING, "Failed to open /dev/urandom: %s", strerror(errno));
+    } else {
+        bytes = read(fd, &random_state, sizeof(random_state.s0) +
+                sizeof(random_state.s1));
+        close(fd);
+    }
+
+    /* payloads only need to look random, so fall back to a weak seed */
+    if ( bytes != sizeof(random_state.s0) + sizeof(random_state.s1) ) {
+        /* the state address differs per thread, so mix that in as well */
+        uint64_t seed = timeNanoseconds() ^ ((uint64_t)getpid() << 32) ^
+            (uintptr_t)&random_state;
+        for ( i = 0; i < RANDOM_LANES; i++ ) {
+            random_state.s0[i] = seed ^ (0x9e3779b97f4a7c15ULL * (i + 1));
+            random_state.s1[i] = ~seed ^ (0xbf58476d1ce4e5b9ULL * (i + 1));
+        }
+    }
+
+    /* xorshift128+ can't have an all zero state */
+    for ( i = 0; i < RANDOM_LANES; i++ ) {
+        if ( random_state.s0[i] == 0 && random_state.s1[i] == 0 ) {
+            random_state.s1[i] = 1;
+        }
+    }
+
+    random_state.seeded = 1;
+}
+
+
+
 /**
  * Fills memory with random data, much like memset()
  *
@@ -248,16 +434,40 @@ Amplet2__Throughput__Item* report_schedule(struct test_request_t *info) {
  *          The number of bytes (chars) to fill
  */
 static void randomMemset(void *data, unsigned int size) {
-    int fd;
+    uint64_t block[RANDOM_LANES];
+    uint8_t *current = data;
+    unsigned int remaining = size;
+    int i;
 
-    if ( (fd = open("/dev/urandom", O_RDONLY)) < 0 ) {
-        /* TODO do we want to shut the test down if this fails? */
-        Log(LOG_WARNING, "Failed to open /dev/urandom: %s", strerror(errno));
-        return;
+    if ( !random_state.seeded ) {
+        seedRandom();
     }
 
-    read(fd, data, size);
-    close(fd);
+    while ( remaining > 0 ) {
+        unsigned int length;
+
+        /* step every lane once, producing a block of random words */
+        for ( i = 0; i < RANDOM_LANES; i++ ) {
+            uint64_t x = random_state.s0[i];
+            uint64_t y = random_state.s1[i];
+            random_state.s0[i] = y;
+            x ^= x << 23;
+            random_state.s1[i] = x ^ y ^ (x >> 17) ^ (y >> 26);
+            block[i] = random_state.s1[i] + y;
+        }
+
+        /* fixed size copies of full blocks can be inlined by the compiler */
+        if ( remaining >= sizeof(block) ) {
+            memcpy(current, block, sizeof(block));
+            length = sizeof(block);
+        } else {
+            memcpy(current, block, remaining);
+            length = remaining;
+        }
+
+        current += length;
+        remaining -= length;
+    }
 }
 
 
@@ -402,6 +612,155 @@ static struct tcpinfo_result_t *get_tcp_info(int sock_fd) {
 }
 
 
+#ifdef HAVE_MSG_ZEROCOPY
+/*
+ * Collect any zero-copy completion notifications waiting on the socket error
+ * queue and return how many sends they cover. If the kernel had to fall back
+ * to copying the data (e.g. the device doesn't support scatter-gather or the
+ * destination is local) then copied will be set.
+ */
+static uint32_t reapZerocopy(int sock_fd, int *copied) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct sock_extended_err *serr;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    uint32_t completed = 0;
+
+    while ( 1 ) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if ( recvmsg(sock_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0 ) {
+            break;
+        }
+
+        for ( cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+                cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+            if ( !(cmsg->cmsg_level == SOL_IP &&
+                        cmsg->cmsg_type == IP_RECVERR) &&
+                    !(cmsg->cmsg_level == SOL_IPV6 &&
+                        cmsg->cmsg_type == IPV6_RECVERR) ) {
+                continue;
+            }
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if ( serr->ee_errno != 0 ||
+                    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ) {
+                continue;
+            }
+
+            /* ee_info to ee_data is an inclusive range of completed sends */
+            completed += serr->ee_data - serr->ee_info + 1;
+
+            if ( serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED ) {
+                *copied = 1;
+            }
+        }
+    }
+
+    return completed;
+}
+
+
+
+/*
+ * Send the buffer using MSG_ZEROCOPY, which pins the pages rather than
+ * copying them into the kernel. The buffer must not be modified until the
+ * completion notification for the send arrives, so this is only used when
+ * the same payload is being sent repeatedly. Each send that queues data
+ * increments the number of completions we are waiting on.
+ */
+static int writeBufferZerocopy(int sock_fd, void *data, size_t length,
+        uint32_t *pending, int *copied) {
+    int result;
+    int flags = MSG_ZEROCOPY;
+    int retry;
+    size_t total_written = 0;
+
+    do {
+        retry = 0;
+        result = send(sock_fd, data + total_written, length - total_written,
+                flags);
+
+        if ( result > 0 ) {
+            total_written += result;
+            if ( flags & MSG_ZEROCOPY ) {
+                (*pending)++;
+            }
+        } else if ( result < 0 && errno == ENOBUFS &&
+                (flags & MSG_ZEROCOPY) ) {
+            /*
+             * Too many outstanding notifications are consuming the socket
+             * option memory. Collect what we can and copy the rest of this
+             * buffer rather than fail the test, which means this transfer
+             * is no longer entirely zerocopy. Reaping the error queue
+             * clobbers errno, so decide to retry before doing it.
+             */
+            retry = 1;
+            flags = 0;
+            *copied = 1;
+            *pending -= reapZerocopy(sock_fd, copied);
+        }
+    } while ( retry || (result > 0 && total_written < length) ||
+                    (result < 0 && errno == EINTR) );
+
+    if ( total_written != length ) {
+        Log(LOG_WARNING, "send return %d, total %d (not %d): %s\n", result,
+                total_written, length, strerror(errno));
+        return -1;
+    }
+
+    *pending -= reapZerocopy(sock_fd, copied);
+
+    return total_written;
+}
+
+
+
+#if UNIT_TEST
+int amp_test_write_buffer_zerocopy(int sock_fd, void *data, size_t length,
+        uint32_t *pending, int *copied) {
+    return writeBufferZerocopy(sock_fd, data, length, pending, copied);
+}
+#endif
+
+
+
+/*
+ * Wait a short while for the kernel to finish with all the buffers we have
+ * given it, so that the payload isn't freed while still in use and so we
+ * know whether any of the data ended up being copied.
+ */
+static void drainZerocopy(int sock_fd, uint32_t pending, int *copied) {
+    struct pollfd pfd;
+    uint64_t deadline;
+    int64_t remaining;
+
+    deadline = timeNanoseconds() + ZEROCOPY_DRAIN_TIMEOUT_MS * 1000000ULL;
+
+    while ( pending > 0 ) {
+        remaining = (int64_t)(deadline - timeNanoseconds()) / 1000000;
+        if ( remaining <= 0 ) {
+            Log(LOG_DEBUG, "Gave up waiting for %" PRIu32
+                    " zero-copy completions", pending);
+            break;
+        }
+
+        /* a non-empty error queue is signalled with POLLERR */
+        pfd.fd = sock_fd;
+        pfd.events = 0;
+        if ( poll(&pfd, 1, remaining) < 0 && errno != EINTR ) {
+            break;
+        }
+
+        pending -= reapZerocopy(sock_fd, copied);
+    }
+}
+#endif
+
+
+
 /**
  * Do the actual write and ensure the entire buffer is written.
  *
@@ -449,6 +808,28 @@ int writeBuffer(int sock_fd, void *data, size_t length) {
 
 
 
+/*
+ * Discard some test data without copying it to userspace. TCP sockets will
+ * drop the data in the kernel when given MSG_TRUNC.
+ */
+int discardBuffer(int test_socket) {
+    int result;
+
+    do {
+        result = recv(test_socket, NULL, DISCARD_READ_SIZE, MSG_TRUNC);
+    } while ( result < 0 && errno == EINTR );
+
+    /* EINVAL means the kernel won't discard TCP data, caller can fall back */
+    if ( result < 0 && errno != EINVAL ) {
+        Log(LOG_WARNING, "Error discarding TCP throughput data: %s\n",
+                strerror(errno));
+    }
+
+    return result;
+}
+
+
+
 /*
  * Read and discard some test data.
  */
@@ -496,6 +877,11 @@ int sendStream(int sock_fd, struct test_request_t *test_opts,
     struct timeval timeout;
     int result;
     fd_set write_set;
+    int zerocopy = 0;
+#ifdef HAVE_MSG_ZEROCOPY
+    uint32_t pending = 0;
+    int copied = 0;
+#endif
 
     /* Make sure the test is valid */
     if ( test_opts->bytes == 0 && test_opts->duration == 0 ) {
@@ -518,6 +904,29 @@ int sendStream(int sock_fd, struct test_request_t *test_opts,
         return -1;
     }
 
+    /*
+     * Zero-copy sending requires the buffer to stay unchanged until the
+     * kernel is done with it, so only use it when the payload is reused.
+     */
+    res->send_path = TPUT_DATA_PATH_COPY;
+#ifdef HAVE_MSG_ZEROCOPY
+    if ( test_opts->zerocopy && !test_opts->randomise &&
+            test_opts->protocol == TPUT_PROTOCOL_NONE ) {
+        int one = 1;
+        if ( setsockopt(sock_fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+                    sizeof(one)) < 0 ) {
+            Log(LOG_DEBUG, "Failed to set SO_ZEROCOPY, copying data: %s",
+                    strerror(errno));
+        } else {
+            zerocopy = 1;
+        }
+    }
+#endif
+
+    if ( test_opts->zerocopy && !zerocopy ) {
+        Log(LOG_DEBUG, "Zero-copy send unavailable, copying data");
+    }
+
     /* Note starting time */
     run_time_ms = 0;
     res->start_ns = timeNanoseconds();
@@ -586,8 +995,18 @@ int sendStream(int sock_fd, struct test_request_t *test_opts,
             }
 
             /* send the data */
-            if ( (bytes_sent = writeBuffer(sock_fd, packet_out,
-                            bytes_to_send)) < 0 ) {
+#ifdef HAVE_MSG_ZEROCOPY
+            if ( zerocopy ) {
+                bytes_sent = writeBufferZerocopy(sock_fd, packet_out,
+                        bytes_to_send, &pending, &copied);
+            } else {
+                bytes_sent = writeBuffer(sock_fd, packet_out, bytes_to_send);
+            }
+#else
+            bytes_sent = writeBuffer(sock_fd, packet_out, bytes_to_send);
+#endif
+
+            if ( bytes_sent < 0 ) {
                 Log(LOG_ERR, "sendStream() could not send data packet\n");
                 break;
             }
@@ -597,6 +1016,15 @@ int sendStream(int sock_fd, struct test_request_t *test_opts,
     } while ( more );
 
     res->end_ns = timeNanoseconds();
+
+#ifdef HAVE_MSG_ZEROCOPY
+    if ( zerocopy ) {
+        drainZerocopy(sock_fd, pending, &copied);
+        /* report it honestly if the kernel ended up copying anyway */
+        res->send_path = copied ? TPUT_DATA_PATH_COPY : TPUT_DATA_PATH_ZEROCOPY;
+    }
+#endif
+
     free(packet_out);
 
     res->tcpinfo = get_tcp_info(sock_fd);
@@ -611,25 +1039,44 @@ int sendStream(int sock_fd, struct test_request_t *test_opts,
  *
  * @param sock_fd
  *          The socket we expect to see the DATA packets on
- * @param req
- *          The test request to log results against
- * @param options
- *          The global test options
+ * @param result
+ *          The test result to record bytes and timing in
+ * @param zerocopy
+ *          Discard data in the kernel rather than copying it to userspace
  *
  * @return 0 upon success otherwise -1
  */
-int incomingTest(int sock_fd, struct test_result_t *result) {
+int incomingTest(int sock_fd, struct test_result_t *result, int zerocopy) {
     int bytes_read;
 
     memset(result, 0, sizeof(struct test_result_t));
 
-    while ( (bytes_read = readBuffer(sock_fd)) > 0 ) {
+    if ( zerocopy ) {
+        result->receive_path = TPUT_DATA_PATH_DISCARD;
+        bytes_read = discardBuffer(sock_fd);
+        if ( bytes_read < 0 && errno == EINVAL ) {
+            Log(LOG_DEBUG, "Kernel can't discard data, copying instead");
+            result->receive_path = TPUT_DATA_PATH_COPY;
+            bytes_read = readBuffer(sock_fd);
+        }
+    } else {
+        result->receive_path = TPUT_DATA_PATH_COPY;
+        bytes_read = readBuffer(sock_fd);
+    }
+
+    while ( bytes_read > 0 ) {
         /* The first data packet is the indicator the test has started */
         if ( result->bytes == 0 ) {
             Log(LOG_DEBUG, "Received first packet from incoming test");
             result->start_ns = timeNanoseconds();
         }
         result->bytes += bytes_read;
+
+        if ( result->receive_path == TPUT_DATA_PATH_DISCARD ) {
+            bytes_read = discardBuffer(sock_fd);
+        } else {
+            bytes_read = readBuffer(sock_fd);
+        }
     }
 
     /* No more packets to be received means we should send our results */
@@ -642,6 +1089,325 @@ int incomingTest(int sock_fd, struct test_result_t *result) {
 
 
 
+/*
+ * A single connection within a test using parallel streams, run by its own
+ * worker thread.
+ */
+struct stream_worker_t {
+    pthread_t thread;
+    int sock_fd;
+    int zerocopy;
+    int status;
+    struct test_request_t *test_opts;
+    struct test_result_t *result;
+};
+
+
+
+static void *sendStreamWorker(void *data) {
+    struct stream_worker_t *worker = (struct stream_worker_t*)data;
+    worker->status = sendStream(worker->sock_fd, worker->test_opts,
+            worker->result);
+    return NULL;
+}
+
+
+
+static void *incomingStreamWorker(void *data) {
+    struct stream_worker_t *worker = (struct stream_worker_t*)data;
+    worker->status = incomingTest(worker->sock_fd, worker->result,
+            worker->zerocopy);
+    return NULL;
+}
+
+
+
+/*
+ * Combine the data paths used by two streams. If they differ then at least
+ * one of them copied data, so report the whole test as copying.
+ */
+static enum tput_data_path combineDataPath(enum tput_data_path a,
+        enum tput_data_path b) {
+    if ( a == b || b == TPUT_DATA_PATH_UNKNOWN ) {
+        return a;
+    }
+
+    if ( a == TPUT_DATA_PATH_UNKNOWN ) {
+        return b;
+    }
+
+    return TPUT_DATA_PATH_COPY;
+}
+
+
+
+/*
+ * Sum the per-stream results into the overall result for the test. The test
+ * runs from when the first stream started to when the last stream finished.
+ */
+static void aggregateStreams(struct test_result_t *result) {
+    struct test_result_t *stream;
+    unsigned int i;
+
+    result->bytes = 0;
+    result->start_ns = 0;
+    result->end_ns = 0;
+    result->send_path = TPUT_DATA_PATH_UNKNOWN;
+    result->receive_path = TPUT_DATA_PATH_UNKNOWN;
+
+    for ( i = 0; i < result->n_streams; i++ ) {
+        stream = &result->streams[i];
+
+        result->send_path = combineDataPath(result->send_path,
+                stream->send_path);
+        result->receive_path = combineDataPath(result->receive_path,
+                stream->receive_path);
+
+        /* receivers only set times for streams that saw data */
+        if ( stream->start_ns == 0 && stream->end_ns == 0 ) {
+            continue;
+        }
+
+        result->bytes += stream->bytes;
+        if ( result->start_ns == 0 || stream->start_ns < result->start_ns ) {
+            result->start_ns = stream->start_ns;
+        }
+        if ( stream->end_ns > result->end_ns ) {
+            result->end_ns = stream->end_ns;
+        }
+    }
+}
+
+
+
+/*
+ * Run a worker thread for each of the test connections and wait for them all
+ * to complete. Each thread is pinned to a different CPU (where there are
+ * enough available to us) so that the streams don't compete with each other
+ * and a single core doesn't limit the total throughput.
+ */
+static int runStreams(int *sockets, uint32_t count,
+        struct test_request_t *test_opts, struct test_result_t *result,
+        int zerocopy, void *(*worker_func)(void*)) {
+
+    struct stream_worker_t *workers;
+    pthread_attr_t attr;
+    cpu_set_t available, pinned;
+    int cpus, cpu;
+    uint32_t started;
+    uint32_t i;
+    int status = 0;
+
+    result->n_streams = count;
+    result->streams = calloc(count, sizeof(struct test_result_t));
+    workers = calloc(count, sizeof(struct stream_worker_t));
+
+    /* find the CPUs that we are allowed to run on */
+    CPU_ZERO(&available);
+    if ( sched_getaffinity(0, sizeof(available), &available) < 0 ) {
+        Log(LOG_DEBUG, "Failed to get CPU affinity, not pinning streams: %s",
+                strerror(errno));
+        CPU_ZERO(&available);
+    }
+    cpus = CPU_COUNT(&available);
+    cpu = -1;
+
+    for ( started = 0; started < count; started++ ) {
+        workers[started].sock_fd = sockets[started];
+        workers[started].zerocopy = zerocopy;
+        workers[started].test_opts = test_opts;
+        workers[started].result = &result->streams[started];
+
+        pthread_attr_init(&attr);
+
+        /* take the next available CPU, wrapping around if we run out */
+        if ( cpus > 0 ) {
+            do {
+                cpu = (cpu + 1) % CPU_SETSIZE;
+            } while ( !CPU_ISSET(cpu, &available) );
+
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+            if ( pthread_attr_setaffinity_np(&attr, sizeof(pinned),
+                        &pinned) != 0 ) {
+                Log(LOG_DEBUG, "Failed to pin stream %" PRIu32 " to CPU %d",
+                        started, cpu);
+            }
+        }
+
+        errno = pthread_create(&workers[started].thread, &attr, worker_func,
+                &workers[started]);
+        pthread_attr_destroy(&attr);
+
+        if ( errno != 0 ) {
+            Log(LOG_WARNING, "Failed to start thread for stream %" PRIu32
+                    ": %s", started, strerror(errno));
+            status = -1;
+            break;
+        }
+    }
+
+    /* closing the remaining sockets will let the other end finish up */
+    if ( started < count ) {
+        closeStreams(sockets + started, count - started);
+    }
+
+    for ( i = 0; i < started; i++ ) {
+        pthread_join(workers[i].thread, NULL);
+        if ( workers[i].status < 0 ) {
+            status = -1;
+        }
+    }
+
+    free(workers);
+
+    aggregateStreams(result);
+
+    return status;
+}
+
+
+
+/**
+ * Send data over each of the given sockets at the same time.
+ *
+ * @param sockets
+ *          The sockets to send data across
+ * @param count
+ *          The number of sockets
+ * @param test_opts
+ *          A item from the test schedule with all the details for this test
+ * @param res
+ *          The result of this test, cannot be NULL. If there is more than
+ *          one socket then the individual results are also stored here.
+ *
+ * @return 0 success, -1 if any of the streams failed
+ */
+int sendStreams(int *sockets, uint32_t count, struct test_request_t *test_opts,
+        struct test_result_t *res) {
+
+    if ( count <= 1 ) {
+        return sendStream(sockets[0], test_opts, res);
+    }
+
+    Log(LOG_DEBUG, "Sending on %" PRIu32 " parallel streams", count);
+
+    return runStreams(sockets, count, test_opts, res, 0, sendStreamWorker);
+}
+
+
+
+/**
+ * Receive an incoming test over each of the given sockets at the same time.
+ *
+ * @param sockets
+ *          The sockets we expect to see data on
+ * @param count
+ *          The number of sockets
+ * @param result
+ *          The test result to record bytes and timing in. If there is more
+ *          than one socket then the individual results are also stored here.
+ * @param zerocopy
+ *          Discard data in the kernel rather than copying it to userspace
+ *
+ * @return 0 upon success otherwise -1
+ */
+int incomingStreams(int *sockets, uint32_t count, struct test_result_t *result,
+        int zerocopy) {
+
+    if ( count <= 1 ) {
+        return incomingTest(sockets[0], result, zerocopy);
+    }
+
+    Log(LOG_DEBUG, "Receiving on %" PRIu32 " parallel streams", count);
+
+    memset(result, 0, sizeof(struct test_result_t));
+
+    return runStreams(sockets, count, NULL, result, zerocopy,
+            incomingStreamWorker);
+}
+
+
+
+/*
+ * Get the port used by the client end of a test connection.
+ */
+static uint16_t getClientPort(int sock_fd, int peer) {
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    int res;
+
+    if ( peer ) {
+        res = getpeername(sock_fd, (struct sockaddr*)&ss, &len);
+    } else {
+        res = getsockname(sock_fd, (struct sockaddr*)&ss, &len);
+    }
+
+    if ( res < 0 ) {
+        return 0;
+    }
+
+    if ( ss.ss_family == AF_INET6 ) {
+        return ntohs(((struct sockaddr_in6*)&ss)->sin6_port);
+    }
+
+    return ntohs(((struct sockaddr_in*)&ss)->sin_port);
+}
+
+
+
+/*
+ * Put the test connections into a consistent order on both ends so that
+ * per-stream results from the client and server can be matched up. The
+ * server can accept connections in a different order to which the client
+ * opened them, but both ends agree on the client port of each connection.
+ * The server should set peer so it looks at the remote port.
+ */
+void sortStreams(int *sockets, uint32_t count, int peer) {
+    uint16_t ports[MAX_STREAMS];
+    uint16_t port;
+    uint32_t i, j;
+    int sock;
+
+    if ( count > MAX_STREAMS ) {
+        return;
+    }
+
+    for ( i = 0; i < count; i++ ) {
+        ports[i] = getClientPort(sockets[i], peer);
+    }
+
+    /* there are only ever a handful of streams, insertion sort is fine */
+    for ( i = 1; i < count; i++ ) {
+        port = ports[i];
+        sock = sockets[i];
+        for ( j = i; j > 0 && ports[j - 1] > port; j-- ) {
+            ports[j] = ports[j - 1];
+            sockets[j] = sockets[j - 1];
+        }
+        ports[j] = port;
+        sockets[j] = sock;
+    }
+}
+
+
+
+/*
+ * Close all the test connections that are open.
+ */
+void closeStreams(int *sockets, uint32_t count) {
+    uint32_t i;
+
+    for ( i = 0; i < count; i++ ) {
+        if ( sockets[i] != -1 ) {
+            close(sockets[i]);
+            sockets[i] = -1;
+        }
+    }
+}
+
+
+
 /**
  * Currently not nanosecond resolution but will give a resulting time in
  * mutiplied to nanoseconds.
@@ -53,6 +53,7 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <inttypes.h>
 
 #include "ssl.h"
 #include "serverlib.h"
@@ -86,11 +87,46 @@ static uint16_t getSocketPort(int sock_fd) {
 
 
 
+/*
+ * Accept a test connection for each of the parallel streams the client has
+ * asked for, then close the listening socket.
+ */
+static int acceptStreams(int t_listen, int *test_socks, uint32_t count) {
+    uint32_t i;
+
+    //XXX this can block forever!
+    for ( i = 0; i < count; i++ ) {
+        do {
+            test_socks[i] = accept(t_listen, NULL, NULL);
+        } while ( test_socks[i] == -1 && errno == EINTR );
+
+        if ( test_socks[i] == -1 ) {
+            Log(LOG_WARNING,
+                    "Failed to accept() upon our test listening socket: %s",
+                    strerror(errno));
+            closeStreams(test_socks, count);
+            close(t_listen);
+            return -1;
+        }
+    }
+
+    /* For security best to close this here and re-open later if reconnecting */
+    close(t_listen);
+
+    /* match the order the client uses so per-stream results line up */
+    sortStreams(test_socks, count, 1);
+
+    return 0;
+}
+
+
+
 /*
  * Notify the remote end that we are ready to receive test data, receive the
  * stream of test data, then send back results from our side of the connection.
  */
-static int do_receive(BIO *ctrl, int test_sock) {
+static int do_receive(BIO *ctrl, int *test_socks, uint32_t count,
+        int zerocopy) {
     Amplet2__Throughput__Item *item;
     ProtobufCBinaryData packed;
     struct test_result_t result;
@@ -102,7 +138,7 @@ static int do_receive(BIO *ctrl, int test_sock) {
     /* Send READY here so timestamp is accurate */
     send_control_ready(AMP_TEST_THROUGHPUT, ctrl, 0);
 
-    if ( incomingTest(test_sock, &result) != 0 ) {
+    if ( incomingStreams(test_socks, count, &result, zerocopy) != 0 ) {
         return -1;
     }
 
@@ -116,7 +152,11 @@ static int do_receive(BIO *ctrl, int test_sock) {
     packed.len = amplet2__throughput__item__get_packed_size(item);
     packed.data = malloc(packed.len);
     amplet2__throughput__item__pack(item, packed.data);
-    free(item);
+    free_report_schedule(item);
+
+    if ( result.n_streams > 0 ) {
+        free(result.streams);
+    }
 
     if ( send_control_result(AMP_TEST_THROUGHPUT, ctrl, &packed) < 0 ) {
         free(packed.data);
@@ -134,24 +174,26 @@ static int do_receive(BIO *ctrl, int test_sock) {
  * Send a stream of test data, then send back results from our side of the
  * test connection.
  */
-static int do_send(BIO *ctrl, int test_sock, struct opt_t *options,
+static int do_send(BIO *ctrl, int *test_socks, struct opt_t *options,
         struct test_request_t *request) {
 
     Amplet2__Throughput__Item *item;
     ProtobufCBinaryData packed;
     struct test_result_t result;
+    unsigned int i;
 
     memset(&result, 0, sizeof(result));
 
     request->randomise = options->randomise;
     request->protocol = options->protocol;
+    request->zerocopy = options->zerocopy;
 
     Log(LOG_DEBUG,"Got send request, dur:%d bytes:%d writes:%d",
             request->duration, request->bytes,
             request->write_size);
 
     /* Send the actual packets */
-    if ( sendStream(test_sock, request, &result) < 0 ) {
+    if ( sendStreams(test_socks, options->streams, request, &result) < 0 ) {
         return -1;
     }
 
@@ -169,10 +211,11 @@ static int do_send(BIO *ctrl, int test_sock, struct opt_t *options,
     if ( result.tcpinfo ) {
         free(result.tcpinfo);
     }
-    if ( item->tcpinfo ) {
-        free(item->tcpinfo);
+    for ( i = 0; i < result.n_streams; i++ ) {
+        free(result.streams[i].tcpinfo);
     }
-    free(item);
+    free(result.streams);
+    free_report_schedule(item);
 
     /* send result to the client for reporting */
     if ( send_control_result(AMP_TEST_THROUGHPUT, ctrl, &packed) < 0 ) {
@@ -191,8 +234,8 @@ static int do_send(BIO *ctrl, int test_sock, struct opt_t *options,
  * effect of resetting various TCP congestion variables, though this is
  * perhaps becoming less common.
  */
-static int do_renew(BIO *ctrl, int test_sock, uint16_t port, uint16_t portmax,
-        struct sockopt_t *sockopts) {
+static int do_renew(BIO *ctrl, int *test_socks, uint32_t count, uint16_t port,
+        uint16_t portmax, struct sockopt_t *sockopts) {
 
     struct socket_t sockets;
     int t_listen;
@@ -217,19 +260,13 @@ static int do_renew(BIO *ctrl, int test_sock, uint16_t port, uint16_t portmax,
     }
 
     send_control_ready(AMP_TEST_THROUGHPUT, ctrl, getSocketPort(t_listen));
-    do {
-        test_sock = accept(t_listen, NULL, NULL);
-    } while (test_sock == -1 && errno == EINTR);
 
-    if ( test_sock == -1 ) {
+    if ( acceptStreams(t_listen, test_socks, count) < 0 ) {
         Log(LOG_ERR, "Failed to accept after connection reset");
         return -1;
     }
 
-    /* Close the listening socket again */
-    close(t_listen);
-
-    return test_sock;
+    return 0;
 }
 
 
@@ -245,7 +282,7 @@ static int do_renew(BIO *ctrl, int test_sock, uint16_t port, uint16_t portmax,
 static int serveTest(BIO *ctrl, struct sockopt_t *sockopts) {
     int bytes;
     int t_listen = -1;
-    int test_sock = -1;
+    int *test_socks = NULL;
     struct socket_t sockets;
     uint16_t portmax;
     int res;
@@ -262,6 +299,9 @@ static int serveTest(BIO *ctrl, struct sockopt_t *sockopts) {
     /* set the options that we don't know until the remote end tells us */
     sockopts->dscp = options->dscp;//XXX
 
+    test_socks = malloc(sizeof(int) * options->streams);
+    memset(test_socks, -1, sizeof(int) * options->streams);
+
     /* If test port has been manually set, only try that port. If it is
      * still the default, try a few ports till we hopefully find a free one.
      */
@@ -298,21 +338,15 @@ static int serveTest(BIO *ctrl, struct sockopt_t *sockopts) {
 
     /* send a packet over the control connection containing the test port */
     send_control_ready(AMP_TEST_THROUGHPUT, ctrl, getSocketPort(t_listen));
-    Log(LOG_DEBUG, "Waiting for connection on test socket");
+    Log(LOG_DEBUG, "Waiting for %" PRIu32 " connections on test socket",
+            options->streams);
 
-    //XXX this can block forever!
-    do {
-        test_sock = accept(t_listen, NULL, NULL);
-    } while (test_sock == -1 && errno == EINTR ); /* Repeat if interrupted */
-
-    /* For security best to close this here and re-open later if reconnecting */
-    close(t_listen);
+    /* this closes the listening socket once all streams have connected */
+    res = acceptStreams(t_listen, test_socks, options->streams);
     t_listen = -1;
 
-    if ( test_sock == -1 ) {
-        Log(LOG_WARNING,
-                "Failed to connect() upon our test listening socket: %s",
-                strerror(errno));
+    if ( res < 0 ) {
+        goto errorCleanup;
     }
 
     /* Wait for something to do from the client */
@@ -327,12 +361,12 @@ static int serveTest(BIO *ctrl, struct sockopt_t *sockopts) {
                     goto errorCleanup;
                 }
 
-                if ( do_receive(ctrl, test_sock) < 0 ) {
+                if ( do_receive(ctrl, test_socks, options->streams,
+                            options->zerocopy) < 0 ) {
                     goto errorCleanup;
                 }
 
-                close(test_sock);
-                test_sock = -1;
+                closeStreams(test_socks, options->streams);
 
                 break;
             }
@@ -344,12 +378,11 @@ static int serveTest(BIO *ctrl, struct sockopt_t *sockopts) {
                     goto errorCleanup;
                 }
 
-                if ( do_send(ctrl, test_sock, options, request) < 0 ) {
+                if ( do_send(ctrl, test_socks, options, request) < 0 ) {
                     goto errorCleanup;
                 }
 
-                close(test_sock);
-                test_sock = -1;
+                closeStreams(test_socks, options->streams);
                 free(request);
 
                 break;
@@ -357,8 +390,8 @@ static int serveTest(BIO *ctrl, struct sockopt_t *sockopts) {
 
             case AMPLET2__CONTROLMSG__CONTROL__TYPE__RENEW: {
 
-                if ( (test_sock = do_renew(ctrl, test_sock, options->tport,
-                            portmax, sockopts)) < 0 ) {
+                if ( do_renew(ctrl, test_socks, options->streams,
+                            options->tport, portmax, sockopts) < 0 ) {
                     goto errorCleanup;
                 }
 
@@ -377,11 +410,10 @@ static int serveTest(BIO *ctrl, struct sockopt_t *sockopts) {
         amplet2__controlmsg__control__free_unpacked(msg, NULL);
     }
 
+    closeStreams(test_socks, options->streams);
+    free(test_socks);
     free(options);
 
-    if ( test_sock != -1 ) {
-        close(test_sock);
-    }
     return 0;
 
 errorCleanup:
@@ -389,8 +421,9 @@ errorCleanup:
      * This should kick off the client - we assume they are waiting for us
      * somewhere
      */
-    if ( test_sock != -1 ) {
-        close(test_sock);
+    if ( test_socks != NULL ) {
+        closeStreams(test_socks, options->streams);
+        free(test_socks);
     }
     if ( t_listen != -1 ) {
         close(t_listen);
@@ -105,7 +105,9 @@ static int is_private_address(struct sockaddr *addr) {
  */
 int set_as_numbers(struct dest_info_t *donelist) {
     struct iptrie trie = { NULL, NULL };
+    struct iptrie results = { NULL, NULL };
     struct dest_info_t *item;
+    int64_t as;
     int masklen;
     int asn_fd;
     int i;
@@ -167,9 +169,13 @@ int set_as_numbers(struct dest_info_t *donelist) {
         goto end;
     }
 
-    /* fetch all the results into the same trie we queried from, setting ASNs */
+    /*
+     * Fetch the results into their own trie. They can cover more than the
+     * /24 or /64 that was asked about, so keeping them apart from the queries
+     * lets the longest match find the most specific answer.
+     */
     Log(LOG_DEBUG, "Fetching results of ASN resolution");
-    if ( amp_asn_fetch_results(asn_fd, &trie) == NULL ) {
+    if ( amp_asn_fetch_results(asn_fd, &results) == NULL ) {
         goto end;
     }
 
@@ -181,8 +187,9 @@ int set_as_numbers(struct dest_info_t *donelist) {
                 if ( is_private_address(item->hop[i].addr->ai_addr) ) {
                     item->hop[i].as = AS_PRIVATE;
                 } else {
-                    item->hop[i].as = iptrie_lookup_as(&trie,
+                    as = iptrie_lookup_as(&results,
                             item->hop[i].addr->ai_addr);
+                    item->hop[i].as = (as < 0) ? AS_UNKNOWN : as;
                 }
             } else {
                 item->hop[i].as = AS_NULL;
@@ -193,6 +200,7 @@ int set_as_numbers(struct dest_info_t *donelist) {
 end:
     close(asn_fd);
     iptrie_clear(&trie);
+    iptrie_clear(&results);
 
     return 0;
 }
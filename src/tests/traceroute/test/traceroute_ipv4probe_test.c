@@ -135,7 +135,7 @@ int main(void) {
         ((struct sockaddr_in *)addr.ai_addr)->sin_addr.s_addr = dests[dest];
 
         /* actual id in packet also includes ttl */
-        coded_id = (ttls[ttl] << 10) + ids[id];
+        coded_id = (ttls[ttl] << TRACEROUTE_INDEX_BITS) + ids[id];
 
         /* construct the probe packet */
         length = amp_traceroute_build_ipv4_probe(packet, packet_sizes[size],
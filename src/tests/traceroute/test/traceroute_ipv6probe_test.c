@@ -112,7 +112,7 @@ int main(void) {
                 for ( size = 0; size < SIZE_COUNT; size++ ) {
 
                     /* actual id in packet also includes ttl */
-                    coded_id = (ttls[ttl] << 10) + ids[id];
+                    coded_id = (ttls[ttl] << TRACEROUTE_INDEX_BITS) + ids[id];
 
                     /* construct the probe packet */
                     length = amp_traceroute_build_ipv6_probe(packet,
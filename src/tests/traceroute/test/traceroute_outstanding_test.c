@@ -0,0 +1,149 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "tests.h"
+#include "traceroute.h"
+
+#define ITEM_COUNT (MAX_TRACEROUTE_WINDOW * 2 + 16)
+
+/*
+ * Check that responses are matched to outstanding probes using the index
+ * carried in the probe, and that destinations sharing an index are never
+ * probed at the same time.
+ */
+int main(void) {
+    struct probe_list_t probelist;
+    struct dest_info_t *items;
+    struct dest_info_t *item;
+    int i;
+
+    memset(&probelist, 0, sizeof(probelist));
+    probelist.count = ITEM_COUNT;
+    probelist.outstanding_index = calloc(MAX_TRACEROUTE_WINDOW,
+            sizeof(struct dest_info_t*));
+    probelist.active_index = calloc(MAX_TRACEROUTE_WINDOW,
+            sizeof(struct dest_info_t*));
+    items = calloc(ITEM_COUNT, sizeof(struct dest_info_t));
+
+    for ( i = 0; i < ITEM_COUNT; i++ ) {
+        items[i].id = i;
+        items[i].ttl = 1 + (i % MAX_HOPS_IN_PATH);
+    }
+
+    /* add some probes, they should be kept in the order they were sent */
+    for ( i = 0; i < 10; i++ ) {
+        amp_traceroute_append_outstanding_item(&probelist, &items[i]);
+    }
+    assert(probelist.outstanding == &items[0]);
+    assert(probelist.outstanding_end == &items[9]);
+
+    /* a response with the wrong ttl or an unused index doesn't match */
+    assert(amp_traceroute_find_outstanding_item(&probelist, 3,
+                items[3].ttl + 1) == NULL);
+    assert(amp_traceroute_find_outstanding_item(&probelist, 10,
+                items[10].ttl) == NULL);
+    assert(amp_traceroute_find_outstanding_item(&probelist,
+                TRACEROUTE_INDEX_MASK + 1, 1) == NULL);
+
+    /* a match is removed from the middle of the list */
+    assert(amp_traceroute_find_outstanding_item(&probelist, 3,
+                items[3].ttl) == &items[3]);
+    assert(items[2].next == &items[4]);
+    assert(items[4].prev == &items[2]);
+
+    /* duplicate responses don't match again */
+    assert(amp_traceroute_find_outstanding_item(&probelist, 3,
+                items[3].ttl) == NULL);
+
+    /* removing the ends updates the head and tail */
+    amp_traceroute_remove_outstanding_item(&probelist, &items[0]);
+    amp_traceroute_remove_outstanding_item(&probelist, &items[9]);
+    assert(probelist.outstanding == &items[1]);
+    assert(probelist.outstanding_end == &items[8]);
+    assert(items[1].prev == NULL);
+    assert(items[8].next == NULL);
+
+    /* a destination with a larger id reuses the index once it is free */
+    item = &items[MAX_TRACEROUTE_WINDOW + 3];
+    amp_traceroute_append_outstanding_item(&probelist, item);
+    assert(probelist.outstanding_end == item);
+    assert(amp_traceroute_find_outstanding_item(&probelist, 3,
+                item->ttl) == item);
+
+    for ( i = 1; i < 9; i++ ) {
+        if ( i != 3 ) {
+            assert(amp_traceroute_find_outstanding_item(&probelist, i,
+                        items[i].ttl) == &items[i]);
+        }
+    }
+    assert(probelist.outstanding == NULL);
+    assert(probelist.outstanding_end == NULL);
+
+    /*
+     * Pending destinations that would share an index with one already being
+     * probed are skipped until that destination is done.
+     */
+    amp_traceroute_start_item(&probelist, &items[5]);
+    items[7].next = NULL;
+    items[MAX_TRACEROUTE_WINDOW + 5].next = &items[7];
+    probelist.pending = &items[MAX_TRACEROUTE_WINDOW + 5];
+
+    amp_traceroute_enqueue_next_pending(&probelist);
+    assert(probelist.ready_end == &items[7]);
+    assert(probelist.pending == &items[MAX_TRACEROUTE_WINDOW + 5]);
+    assert(probelist.pending->next == NULL);
+
+    assert(amp_traceroute_enqueue_next_pending(&probelist) == 0);
+    assert(probelist.pending == &items[MAX_TRACEROUTE_WINDOW + 5]);
+
+    amp_traceroute_set_done_item(&probelist, &items[5]);
+    amp_traceroute_enqueue_next_pending(&probelist);
+    assert(probelist.pending == NULL);
+    assert(probelist.ready_end == &items[MAX_TRACEROUTE_WINDOW + 5]);
+    assert(probelist.active_index[5] == &items[MAX_TRACEROUTE_WINDOW + 5]);
+
+    free(items);
+    free(probelist.outstanding_index);
+    free(probelist.active_index);
+
+    return 0;
+}
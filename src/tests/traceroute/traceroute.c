@@ -55,6 +55,7 @@
 #include <assert.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <stddef.h>
 #include <signal.h>
 #include <inttypes.h>
 #include <event2/event.h>
@@ -91,55 +92,93 @@ static struct option long_options[] = {
 
 
 /*
- * Fill out the IP and UDP header in the given data blob with the appropriate
- * values for our probes.
+ * Build a template IPv4 probe, filling out the IP and UDP header fields that
+ * are the same for every probe. The kernel fills in the IP checksum and the
+ * UDP checksum is left empty, so there is no checksum to maintain.
  */
-static int build_ipv4_probe(void *packet, uint16_t packet_size, uint8_t dscp,
-        int id, int ttl, uint16_t ident, struct addrinfo *dest) {
+static struct probe_template_t *build_ipv4_probe(uint16_t packet_size,
+        uint8_t dscp, uint16_t ident) {
 
+    struct probe_template_t *probe;
     struct iphdr *ip;
     struct udphdr *udp;
 
-    assert(packet);
     assert(packet_size >= MIN_TRACEROUTE_PROBE_LEN);
 
-    ip = (struct iphdr *)packet;
-    memset(ip, 0, sizeof(struct iphdr));
+    probe = new_probe_template(packet_size, PROBE_NO_CHECKSUM);
 
+    ip = (struct iphdr *)probe->packet;
     ip->version = 4;
     ip->ihl = 5;
     ip->tos = dscp;
     ip->tot_len = htons(packet_size);
-    ip->id = htons(id);
-    ip->ttl = ttl;
     ip->protocol = IPPROTO_UDP;
-    ip->daddr = ((struct sockaddr_in *)dest->ai_addr)->sin_addr.s_addr;
 
-    udp = (struct udphdr *)((uint8_t *)packet + (ip->ihl << 2));
+    udp = (struct udphdr *)(probe->packet + (ip->ihl << 2));
     udp->source = htons(ident);
     udp->dest = htons(TRACEROUTE_DEST_PORT);
     udp->len = htons(packet_size - ((ip->ihl << 2)));
 
-    return packet_size;
+    return probe;
 }
 
 
 
 /*
- * Fill out the body of the UDP packet in the given data blob with the
- * appropriate values for our probes.
+ * Set the fields in the IPv4 probe template that change with each probe.
  */
-static int build_ipv6_probe(void *packet, uint16_t packet_size, int id,
-        uint16_t ident, struct addrinfo *dest) {
+static int update_ipv4_probe(struct probe_template_t *probe, int id, int ttl,
+        struct addrinfo *dest) {
+
+    uint8_t hops = ttl;
+
+    assert(probe);
+
+    probe_template_set16(probe, offsetof(struct iphdr, id), id);
+    probe_template_set(probe, offsetof(struct iphdr, ttl), &hops,
+            sizeof(hops));
+    probe_template_set(probe, offsetof(struct iphdr, daddr),
+            &((struct sockaddr_in *)dest->ai_addr)->sin_addr.s_addr,
+            sizeof(uint32_t));
+
+    return probe->length;
+}
+
 
+
+/*
+ * Build a template for the body of the UDP packet, the operating system
+ * constructs the IPv6 and UDP headers for us.
+ */
+static struct probe_template_t *build_ipv6_probe(uint16_t packet_size,
+        uint16_t ident) {
+
+    struct probe_template_t *probe;
     struct ipv6_body_t *ipv6_body;
-    ipv6_body = (struct ipv6_body_t *)packet;
-    ipv6_body->index = htons(id);
+
+    probe = new_probe_template(packet_size, PROBE_NO_CHECKSUM);
+
+    ipv6_body = (struct ipv6_body_t *)probe->packet;
     ipv6_body->ident = htons(ident);
+
+    return probe;
+}
+
+
+
+/*
+ * Set the fields in the IPv6 probe template that change with each probe.
+ */
+static int update_ipv6_probe(struct probe_template_t *probe, int id,
+        struct addrinfo *dest) {
+
+    assert(probe);
+
+    probe_template_set16(probe, offsetof(struct ipv6_body_t, index), id);
     ((struct sockaddr_in6 *)dest->ai_addr)->sin6_port =
         htons(TRACEROUTE_DEST_PORT);
 
-    return packet_size;
+    return probe->length;
 }
 
 
@@ -147,17 +186,16 @@ static int build_ipv6_probe(void *packet, uint16_t packet_size, int id,
 /*
  * Send the next probe packet towards a given destination.
  */
-static int send_probe(struct socket_t *ip_sockets, uint16_t ident,
-        uint16_t packet_size, uint32_t inter_packet_delay, uint8_t dscp,
+static int send_probe(struct probe_list_t *probelist,
         struct dest_info_t *info) {
 
-    char packet[packet_size];
-    long int delay;
+    struct probe_template_t *probe;
+    struct send_queue_t *queue;
     uint16_t id;
-    int sock;
+    int sent;
     int length;
 
-    assert(ip_sockets);
+    assert(probelist);
     assert(info);
 
     if ( info->addr->ai_addr == NULL ) {
@@ -166,27 +204,26 @@ static int send_probe(struct socket_t *ip_sockets, uint16_t ident,
         return -1;
     }
 
-    memset(packet, 0, sizeof(packet));
-    id = (info->ttl << 10) + info->id;
+    id = (info->ttl << TRACEROUTE_INDEX_BITS) +
+        (info->id & TRACEROUTE_INDEX_MASK);
 
     switch ( info->addr->ai_family ) {
         case AF_INET: {
-            sock = ip_sockets->socket;
-            length = build_ipv4_probe(packet, packet_size, dscp, id,
-                    info->ttl, ident, info->addr);
+            queue = probelist->queue;
+            probe = probelist->probe;
         } break;
 
         case AF_INET6: {
             int ttl = info->ttl;
-            sock = ip_sockets->socket6;
-            if ( setsockopt(sock, SOL_IPV6, IPV6_UNICAST_HOPS, &ttl,
-                    sizeof(ttl)) < 0 ) {
+            queue = probelist->queue6;
+            /* TTL is set per socket, so each probe must be sent on its own */
+            if ( setsockopt(probelist->sockets->socket6, SOL_IPV6,
+                        IPV6_UNICAST_HOPS, &ttl, sizeof(ttl)) < 0 ) {
                 Log(LOG_WARNING, "Failed to set IPv6_UNICAST_HOPS: %s",
                         strerror(errno));
                 return -1;
             }
-            length = build_ipv6_probe(packet, packet_size, id,
-                    ident, info->addr);
+            probe = probelist->probe6;
         } break;
 
         default:
@@ -195,19 +232,31 @@ static int send_probe(struct socket_t *ip_sockets, uint16_t ident,
 	    return -1;
     };
 
+    if ( queue == NULL ) {
+        Log(LOG_WARNING, "Unable to test to %s, socket wasn't opened",
+                info->addr->ai_canonname);
+        return -1;
+    }
+
+    if ( info->addr->ai_family == AF_INET ) {
+        length = update_ipv4_probe(probe, id, info->ttl, info->addr);
+    } else {
+        length = update_ipv6_probe(probe, id, info->addr);
+    }
+
     /* send packet with appropriate inter packet delay */
-    while ( (delay = delay_send_packet(sock, packet, length, info->addr,
-                    inter_packet_delay,
-                    &(info->hop[info->ttl - 1].time_sent))) > 0 ) {
-        Log(LOG_DEBUG, "Sleeping for %ldus - send event triggered early",delay);
-        usleep(delay);
+    if ( queue_packet(queue, (char*)probe->packet, length, info->addr,
+                &(info->hop[info->ttl - 1].time_sent)) < 0 ) {
+        sent = 0;
+    } else {
+        sent = flush_send_queue(queue);
     }
 
     info->probes++;
     Log(LOG_DEBUG, "Sending probe to destination %d (ttl %d, attempt %d)\n",
             info->id, info->ttl, info->attempts);
 
-    if ( delay < 0 ) {
+    if ( sent < 1 ) {
         /*
          * Mark this as done if the packet failed to send properly, we
          * don't want to wait for a response that will never arrive. We
@@ -236,6 +285,7 @@ static int get_index(int family, char *embedded,
         struct probe_list_t *probelist) {
 
     uint16_t index, ident;
+    uint32_t limit;
 
     switch ( family ) {
         case AF_INET: {
@@ -293,17 +343,25 @@ static int get_index(int family, char *embedded,
         return -1;
     }
 
-    if ( (index & 0x3FF) >= probelist->count ) {
+    /* only the low bits of the destination id are in the probe */
+    if ( probelist->count < MAX_TRACEROUTE_WINDOW ) {
+        limit = probelist->count;
+    } else {
+        limit = MAX_TRACEROUTE_WINDOW;
+    }
+
+    if ( (index & TRACEROUTE_INDEX_MASK) >= limit ) {
         /*
          * Some boxes are broken and byteswap the ip id field but
          * don't put it back before putting it into the end of the
          * icmp error. Check if swapping the byte order makes the
          * ip id match what we were expecting...
          */
-        if ( (ntohs(index) & 0x3FF) < probelist->count ) {
+        if ( (ntohs(index) & TRACEROUTE_INDEX_MASK) < limit ) {
             return ntohs(index);
         }
-        Log(LOG_DEBUG, "Bad index %d in embedded packet ignored", index&0x3FF);
+        Log(LOG_DEBUG, "Bad index %d in embedded packet ignored",
+                index & TRACEROUTE_INDEX_MASK);
         return -1;
     }
 
@@ -397,6 +455,66 @@ static int inc_attempt_counter(struct dest_info_t *info) {
 
 
 
+/*
+ * Append a probe destination to the end of the outstanding list. Every probe
+ * has the same timeout, so the outstanding list is always sorted by the time
+ * the probe will expire and the head is the next one to time out. Targets are
+ * also indexed by the low bits of their id (the index carried in the probe)
+ * so responses can be matched without walking the list.
+ */
+static void append_outstanding_item(struct probe_list_t *probelist,
+        struct dest_info_t *item) {
+
+    assert(probelist);
+    assert(item);
+    assert(probelist->outstanding_index[
+            item->id & TRACEROUTE_INDEX_MASK] == NULL);
+
+    item->next = NULL;
+    item->prev = probelist->outstanding_end;
+
+    if ( probelist->outstanding_end == NULL ) {
+        probelist->outstanding = item;
+    } else {
+        probelist->outstanding_end->next = item;
+    }
+
+    probelist->outstanding_end = item;
+    probelist->outstanding_index[item->id & TRACEROUTE_INDEX_MASK] = item;
+}
+
+
+
+/*
+ * Remove a probe destination from anywhere in the outstanding list.
+ */
+static void remove_outstanding_item(struct probe_list_t *probelist,
+        struct dest_info_t *item) {
+
+    assert(probelist);
+    assert(item);
+    assert(probelist->outstanding_index[
+            item->id & TRACEROUTE_INDEX_MASK] == item);
+
+    if ( item->prev == NULL ) {
+        probelist->outstanding = item->next;
+    } else {
+        item->prev->next = item->next;
+    }
+
+    if ( item->next == NULL ) {
+        probelist->outstanding_end = item->prev;
+    } else {
+        item->next->prev = item->prev;
+    }
+
+    item->next = NULL;
+    item->prev = NULL;
+    probelist->outstanding_index[item->id & TRACEROUTE_INDEX_MASK] = NULL;
+}
+
+
+
 /*
  * Find the item that triggered this probe in the outstanding list. It must
  * match the index and ttl we expect, otherwise it's probably not actually a
@@ -405,28 +523,20 @@ static int inc_attempt_counter(struct dest_info_t *info) {
 static struct dest_info_t *find_outstanding_item(struct probe_list_t *probelist,
         uint32_t index, int ttl) {
 
-    struct dest_info_t *prev, *item;
+    struct dest_info_t *item;
 
-    for ( prev = NULL, item = probelist->outstanding;
-            item != NULL; prev = item, item = item->next ) {
+    if ( index > TRACEROUTE_INDEX_MASK ) {
+        return NULL;
+    }
 
-        if ( item->id == index && item->ttl == ttl ) {
-            if ( prev == NULL ) {
-                probelist->outstanding = item->next;
-                if ( probelist->outstanding == NULL ) {
-                    probelist->outstanding_end = NULL;
-                }
-            } else {
-                prev->next = item->next;
-                if ( prev->next == NULL ) {
-                    probelist->outstanding_end = prev;
-                }
-            }
-            item->next = NULL;
-            break;
-        }
+    item = probelist->outstanding_index[index];
+
+    if ( item == NULL || item->ttl != ttl ) {
+        return NULL;
     }
 
+    remove_outstanding_item(probelist, item);
+
     return item;
 }
 
@@ -523,15 +633,41 @@ static int append_ready_item(struct probe_list_t *probelist,
 
 
 
+/*
+ * Start probing a destination, claiming the probe index it will use until
+ * the path is complete.
+ */
+static int start_item(struct probe_list_t *probelist,
+        struct dest_info_t *item) {
+
+    assert(probelist->active_index[item->id & TRACEROUTE_INDEX_MASK] == NULL);
+
+    probelist->active_index[item->id & TRACEROUTE_INDEX_MASK] = item;
+    return append_ready_item(probelist, item);
+}
+
+
+
 /*
  * Add the next outstanding destination to the queue of those being actively
- * probed.
+ * probed. Destinations whose ids share the same low bits use the same probe
+ * index, so skip any that would clash with a destination still being probed
+ * (it will be started once that destination completes).
  */
 static int enqueue_next_pending(struct probe_list_t *probelist) {
-    if ( probelist->pending ) {
-        struct dest_info_t *next = probelist->pending;
-        probelist->pending = probelist->pending->next;
-        return append_ready_item(probelist, next);
+    struct dest_info_t *next, *prev = NULL;
+
+    for ( next = probelist->pending; next != NULL; next = next->next ) {
+        if ( probelist->active_index[
+                next->id & TRACEROUTE_INDEX_MASK] == NULL ) {
+            if ( prev ) {
+                prev->next = next->next;
+            } else {
+                probelist->pending = next->next;
+            }
+            return start_item(probelist, next);
+        }
+        prev = next;
     }
 
     return 0;
@@ -713,6 +849,11 @@ static int get_embedded_ttl(int family, char *packet) {
  */
 static void set_done_item(struct probe_list_t *probelist,
         struct dest_info_t *item) {
+    /* release the probe index so another destination can use it */
+    if ( probelist->active_index[item->id & TRACEROUTE_INDEX_MASK] == item ) {
+        probelist->active_index[item->id & TRACEROUTE_INDEX_MASK] = NULL;
+    }
+
     /* set the flags and move it onto the done list */
     item->done_forward = 1;
     item->next = probelist->done;
@@ -745,8 +886,8 @@ static int process_packet(struct sockaddr *addr, char *packet,
         return -1;
     }
 
-    ttl = index >> 10;
-    index &= 0x3FF;
+    ttl = index >> TRACEROUTE_INDEX_BITS;
+    index &= TRACEROUTE_INDEX_MASK;
     type = get_icmp_type(family, packet);
     code = get_icmp_code(family, packet);
 
@@ -1270,10 +1411,7 @@ static void send_probe_callback(
     item->next = NULL;
 
     /* send probe to the destination at the appropriate TTL */
-    if ( send_probe(probelist->sockets, probelist->ident,
-                probelist->opts->packet_size,
-                probelist->opts->inter_packet_delay,
-                probelist->opts->dscp, item) < 0 ) {
+    if ( send_probe(probelist, item) < 0 ) {
         /* failed to send probe, mark the whole path as done */
         set_done_item(probelist, item);
         enqueue_next_pending(probelist);
@@ -1288,16 +1426,13 @@ static void send_probe_callback(
 
         /* set a timeout if one hasn't already been set for an earlier probe */
         if ( probelist->outstanding == NULL ) {
-            probelist->outstanding = item;
-            probelist->outstanding_end = item;
             probelist->timeout = event_new(probelist->base, -1, 0,
                         probe_timeout_callback, evdata);
             timeout = (struct timeval) {LOSS_TIMEOUT, 0};
             event_add(probelist->timeout, &timeout);
-        } else {
-            probelist->outstanding_end->next = item;
-            probelist->outstanding_end = item;
         }
+
+        append_outstanding_item(probelist, item);
     }
 
     /* schedule the next probe to be sent if there are any ready to go */
@@ -1322,40 +1457,36 @@ static void send_probe_callback(
 static void recv_probe_callback(evutil_socket_t evsock,
         __attribute__((unused))short flags, void *evdata) {
 
-    char packet[2048];
-    struct timeval now;
     struct probe_list_t *probelist = (struct probe_list_t*)evdata;
-    struct sockaddr_storage addr;
-    socklen_t socklen = sizeof(addr);
     struct dest_info_t *item;
-    struct socket_t sockets;
-    int wait;
+    struct packet_t *packet;
+    int schedule = 0;
+    int i;
 
     Log(LOG_DEBUG, "Got a packet");
 
     /*
-     * determine the address family of the socket, so we can properly get
-     * the source address from the get_packet() call
+     * Read every response that has arrived so far, not just the first. The
+     * source address of each is returned with the packet, so we no longer
+     * need to check the address family of the socket.
      */
-    if ( getsockname(evsock, (struct sockaddr*)&addr, &socklen) < 0 ) {
-        Log(LOG_WARNING, "getsockname() failed in receive callback: %s",
-                strerror(errno));
-        return;
-    }
-
-    wait = 0;
-    sockets.socket = (addr.ss_family == AF_INET) ? evsock : -1;
-    sockets.socket6 = (addr.ss_family == AF_INET6) ? evsock : -1;
-
-    if ( get_packet(&sockets, packet, sizeof(packet), (struct sockaddr*)&addr,
-                &wait, &now) < 1 ) {
+    if ( get_packet_batch(evsock, probelist->batch) < 1 ) {
         Log(LOG_WARNING, "Failed to get packet data");
         return;
     }
 
     item = probelist->outstanding;
 
-    if ( process_packet((struct sockaddr*)&addr, packet, now, evdata) > 0 ) {
+    for ( i = 0; i < probelist->batch->count; i++ ) {
+        packet = &probelist->batch->packets[i];
+        if ( process_packet((struct sockaddr*)&packet->from, packet->data,
+                    packet->time, evdata) > 0 ) {
+            schedule = 1;
+        }
+    }
+
+    /* the ready list was empty before this batch, so schedule a send */
+    if ( schedule ) {
         struct timeval delay;
         assert(probelist->sendtimer == NULL);
 
@@ -1421,16 +1552,12 @@ static void probe_timeout_callback(
     probelist->timeout = NULL;
 
     item = probelist->outstanding;
-    probelist->outstanding = probelist->outstanding->next;
-    if ( probelist->outstanding == NULL ) {
-        probelist->outstanding_end = NULL;
-    }
+    remove_outstanding_item(probelist, item);
 
     /* resend this probe if it hasn't already failed too many times */
     if ( inc_attempt_counter(item) ) {
         Log(LOG_DEBUG, "Attempts %d to destination %d, will retry\n",
                 item->attempts, item->id);
-        item->next = NULL;
 
         /* add the target back to the ready list so it gets probed again */
         append_ready_item(probelist, item);
@@ -1606,6 +1733,13 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
         exit(EXIT_FAILURE);
     }
 
+    /* every target being probed at once needs its own index in the probe */
+    if ( window > MAX_TRACEROUTE_WINDOW ) {
+        Log(LOG_WARNING, "Window %d above maximum, lowering to %d", window,
+                MAX_TRACEROUTE_WINDOW);
+        window = MAX_TRACEROUTE_WINDOW;
+    }
+
     /* pick a random packet size within allowable boundaries */
     if ( options.random ) {
 	options.packet_size = MIN_TRACEROUTE_PROBE_LEN +
@@ -1683,6 +1817,15 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
     probelist.ready_end = NULL;
     probelist.outstanding = NULL;
     probelist.outstanding_end = NULL;
+    probelist.outstanding_index = calloc(MAX_TRACEROUTE_WINDOW,
+            sizeof(struct dest_info_t*));
+    probelist.active_index = calloc(MAX_TRACEROUTE_WINDOW,
+            sizeof(struct dest_info_t*));
+    if ( probelist.outstanding_index == NULL ||
+            probelist.active_index == NULL ) {
+        Log(LOG_WARNING, "Failed to allocate traceroute probe index");
+        exit(EXIT_FAILURE);
+    }
     probelist.done = NULL;
     probelist.sockets = &ip_sockets;
     probelist.timeout = NULL;
@@ -1691,6 +1834,21 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
     probelist.done_count = 0;
     probelist.last_probe = NULL;
     probelist.base = event_base_new();
+    probelist.batch = new_packet_batch(PACKET_BATCH_SIZE, 2048);
+    probelist.queue = probelist.queue6 = NULL;
+    probelist.probe = probelist.probe6 = NULL;
+    if ( ip_sockets.socket > 0 ) {
+        probelist.queue = new_send_queue(ip_sockets.socket, 1,
+                options.packet_size, options.inter_packet_delay, 0);
+        probelist.probe = build_ipv4_probe(options.packet_size,
+                options.dscp, probelist.ident);
+    }
+    if ( ip_sockets.socket6 > 0 ) {
+        probelist.queue6 = new_send_queue(ip_sockets.socket6, 1,
+                options.packet_size, options.inter_packet_delay, 0);
+        probelist.probe6 = build_ipv6_probe(options.packet_size,
+                probelist.ident);
+    }
 
     /* create all info blocks and place them in the send queue */
     for ( i = 0; i < count; i++ ) {
@@ -1708,7 +1866,7 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
          * new ones.
          */
         if ( window ) {
-            append_ready_item(&probelist, item);
+            start_item(&probelist, item);
             window--;
         } else {
             item->next = probelist.pending;
@@ -1757,6 +1915,11 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
     }
 
     event_base_free(probelist.base);
+    free_packet_batch(probelist.batch);
+    free_send_queue(probelist.queue);
+    free_send_queue(probelist.queue6);
+    free_probe_template(probelist.probe);
+    free_probe_template(probelist.probe6);
 
     /* sockets aren't needed any longer */
     if ( icmp_sockets.socket > 0 ) {
@@ -1800,6 +1963,8 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
     free_dest_info(probelist.pending);
     free_dest_info(probelist.outstanding);
     free_dest_info(probelist.done);
+    free(probelist.outstanding_index);
+    free(probelist.active_index);
 
     return result;
 }
@@ -1940,6 +2105,9 @@ test_t *register_test() {
      */
     new_test->sigint = 1;
 
+    /* keeps global state between runs, always run it in a new process */
+    new_test->reentrant = 0;
+
     return new_test;
 }
 
@@ -1948,11 +2116,56 @@ test_t *register_test() {
 #if UNIT_TEST
 int amp_traceroute_build_ipv4_probe(void *packet, uint16_t packet_size,
         uint8_t dscp, int id, int ttl, uint16_t ident, struct addrinfo *dest) {
-    return build_ipv4_probe(packet, packet_size, dscp, id, ttl, ident, dest);
+    struct probe_template_t *probe;
+    int length;
+
+    probe = build_ipv4_probe(packet_size, dscp, ident);
+    length = update_ipv4_probe(probe, id, ttl, dest);
+    memcpy(packet, probe->packet, length);
+    free_probe_template(probe);
+
+    return length;
 }
 
 int amp_traceroute_build_ipv6_probe(void *packet, uint16_t packet_size, int id,
         uint16_t ident, struct addrinfo *dest) {
-    return build_ipv6_probe(packet, packet_size, id, ident, dest);
+    struct probe_template_t *probe;
+    int length;
+
+    probe = build_ipv6_probe(packet_size, ident);
+    length = update_ipv6_probe(probe, id, dest);
+    memcpy(packet, probe->packet, length);
+    free_probe_template(probe);
+
+    return length;
+}
+
+int amp_traceroute_start_item(struct probe_list_t *probelist,
+        struct dest_info_t *item) {
+    return start_item(probelist, item);
+}
+
+int amp_traceroute_enqueue_next_pending(struct probe_list_t *probelist) {
+    return enqueue_next_pending(probelist);
+}
+
+void amp_traceroute_set_done_item(struct probe_list_t *probelist,
+        struct dest_info_t *item) {
+    set_done_item(probelist, item);
+}
+
+void amp_traceroute_append_outstanding_item(struct probe_list_t *probelist,
+        struct dest_info_t *item) {
+    append_outstanding_item(probelist, item);
+}
+
+void amp_traceroute_remove_outstanding_item(struct probe_list_t *probelist,
+        struct dest_info_t *item) {
+    remove_outstanding_item(probelist, item);
+}
+
+struct dest_info_t *amp_traceroute_find_outstanding_item(
+        struct probe_list_t *probelist, uint32_t index, int ttl) {
+    return find_outstanding_item(probelist, index, ttl);
 }
 #endif
@@ -49,6 +49,7 @@
 
 #include "tests.h"
 #include "testlib.h"
+#include "probe.h"
 
 
 #define DEFAULT_TRACEROUTE_PROBE_LEN 60
@@ -73,6 +74,16 @@
 /* Maximum number of destinations that can have probe packets outstanding */
 #define INITIAL_WINDOW 50
 
+/*
+ * The 16 bit probe id holds both the destination index and the TTL. TTLs
+ * up to MAX_HOPS_IN_PATH fit in the top 5 bits, leaving the rest for the
+ * low bits of the destination id. Only targets in the window are probed at
+ * once, so the window is limited to the number of unique probe indices.
+ */
+#define TRACEROUTE_INDEX_BITS 11
+#define TRACEROUTE_INDEX_MASK ((1 << TRACEROUTE_INDEX_BITS) - 1)
+#define MAX_TRACEROUTE_WINDOW (1 << TRACEROUTE_INDEX_BITS)
+
 /* number of times to retry at a particular TTL to elicit a response */
 #define TRACEROUTE_RETRY_LIMIT 2
 
@@ -155,6 +166,7 @@ struct dest_info_t {
     uint8_t err_code;           /* ICMP response error code */
     struct hop_info_t hop[MAX_HOPS_IN_PATH];
     struct dest_info_t *next;
+    struct dest_info_t *prev;   /* previous target in the outstanding list */
 };
 
 /*
@@ -169,10 +181,17 @@ struct probe_list_t {
     struct dest_info_t *ready_end;
     struct dest_info_t *outstanding;    /* targets with an outstanding probe */
     struct dest_info_t *outstanding_end;
+    struct dest_info_t **outstanding_index; /* outstanding, by probe index */
+    struct dest_info_t **active_index;  /* targets in the window, by index */
     struct dest_info_t *done;           /* targets with completed paths */
     struct event_base *base;
     struct event *timeout;
     struct event *sendtimer;
+    struct packet_batch_t *batch;       /* storage for received packets */
+    struct send_queue_t *queue;         /* paced transmit for ipv4 probes */
+    struct send_queue_t *queue6;        /* paced transmit for ipv6 probes */
+    struct probe_template_t *probe;     /* ipv4 probe, updated per send */
+    struct probe_template_t *probe6;    /* ipv6 probe, updated per send */
     uint32_t count;
     uint32_t done_count;
     uint16_t ident;
@@ -181,4 +200,18 @@ struct probe_list_t {
     struct timeval *last_probe;	        /* when most recent probe was sent */
 };
 
+#if UNIT_TEST
+int amp_traceroute_start_item(struct probe_list_t *probelist,
+        struct dest_info_t *item);
+int amp_traceroute_enqueue_next_pending(struct probe_list_t *probelist);
+void amp_traceroute_set_done_item(struct probe_list_t *probelist,
+        struct dest_info_t *item);
+void amp_traceroute_append_outstanding_item(struct probe_list_t *probelist,
+        struct dest_info_t *item);
+void amp_traceroute_remove_outstanding_item(struct probe_list_t *probelist,
+        struct dest_info_t *item);
+struct dest_info_t *amp_traceroute_find_outstanding_item(
+        struct probe_list_t *probelist, uint32_t index, int ttl);
+#endif
+
 #endif
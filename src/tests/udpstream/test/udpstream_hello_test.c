@@ -38,6 +38,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
@@ -52,26 +53,30 @@
 int main(void) {
     int pipefd[2];
     BIO *sendctrl, *recvctrl;
-    /* X tport size count spacing pcnt samples dscp X */
+    /* X tport size count spacing pcnt samples dscp X rate */
     struct opt_t optionsA[] = {
-        {0, 12345, 0, 0, 0, 0, 0, 0, 0},
+        {0, 12345, 0, 0, 0, 0, 0, 0, 0, 0},
 
         {0, 1, MINIMUM_UDPSTREAM_PACKET_LENGTH,
             MINIMUM_UDPSTREAM_PACKET_COUNT, MIN_INTER_PACKET_DELAY,
-            4, 2, 0x20, 0},
+            4, 2, 0x20, 0, 0},
 
         {0, DEFAULT_CONTROL_PORT, DEFAULT_UDPSTREAM_PACKET_LENGTH,
             DEFAULT_UDPSTREAM_PACKET_COUNT,DEFAULT_UDPSTREAM_INTER_PACKET_DELAY,
             DEFAULT_UDPSTREAM_PERCENTILE_COUNT, DEFAULT_UDPSTREAM_RTT_SAMPLES,
-            0xe0, 0},
+            0xe0, 0, 0},
 
-        {0, DEFAULT_TEST_PORT, 1025, 1026, 1027, 1028, 1029, 0x38, 0},
+        {0, DEFAULT_TEST_PORT, 1025, 1026, 1027, 1028, 1029, 0x38, 0, 1030},
 
         {0, 65535, MAXIMUM_UDPSTREAM_PACKET_LENGTH,
-            65535, 1000000, 1234567, 54321, 0x88, 0},
+            65535, 1000000, 1234567, 54321, 0x88, 0, 1},
 
-        {0, 65535, 65535, 65535, 65535, 4294967295, 4294967295,
-            0xb8, 0},
+        {0, DEFAULT_TEST_PORT, MAXIMUM_UDPSTREAM_PACKET_LENGTH,
+            MAXIMUM_UDPSTREAM_PACKET_COUNT, 24, DEFAULT_UDPSTREAM_PERCENTILE_COUNT,
+            DEFAULT_UDPSTREAM_RATE_RTT_SAMPLES, 0, 0, MAXIMUM_UDPSTREAM_RATE},
+
+        {0, 65535, 65535, 4294967295, 65535, 4294967295, 4294967295,
+            0xb8, 0, 4294967295},
     };
     struct opt_t *optionsB;
     int count;
@@ -103,12 +108,24 @@ int main(void) {
 
         /* check everything we received matches what we sent */
         assert(optionsA[i].tport == optionsB->tport);
-        assert(optionsA[i].packet_size == optionsB->packet_size);
-        assert(optionsA[i].packet_count == optionsB->packet_count);
         assert(optionsA[i].packet_spacing == optionsB->packet_spacing);
         assert(optionsA[i].percentile_count == optionsB->percentile_count);
         assert(optionsA[i].rtt_samples == optionsB->rtt_samples);
         assert(optionsA[i].dscp == optionsB->dscp);
+
+        /* out of range values should be clamped the same as the client */
+        if ( optionsA[i].packet_size < MINIMUM_UDPSTREAM_PACKET_LENGTH ) {
+            assert(optionsB->packet_size == MINIMUM_UDPSTREAM_PACKET_LENGTH);
+        } else {
+            assert(optionsB->packet_size == MIN(optionsA[i].packet_size,
+                        MAXIMUM_UDPSTREAM_PACKET_LENGTH));
+        }
+        assert(optionsB->packet_count == MIN(optionsA[i].packet_count,
+                    MAXIMUM_UDPSTREAM_PACKET_COUNT));
+        assert(optionsB->rate == MIN(optionsA[i].rate,
+                    MAXIMUM_UDPSTREAM_RATE));
+
+        free(optionsB);
     }
 
     BIO_free_all(sendctrl);
@@ -56,6 +56,7 @@ struct option long_options[] = {
     {"port", required_argument, 0, 'p'},
     {"test-port", required_argument, 0, 'P'},
     {"rtt-samples", required_argument, 0, 'r'},
+    {"rate", required_argument, 0, 'R'},
     {"server", no_argument, 0, 's'},
     {"size", required_argument, 0, 'z'},
     {"dscp", required_argument, 0, 'Q'},
@@ -106,6 +107,8 @@ void usage(void) {
     fprintf(stderr, "  -r, --rtt-samples    <N>       "
             "Sample every Nth probe for RTT (default %d)\n",
             DEFAULT_UDPSTREAM_RTT_SAMPLES);
+    fprintf(stderr, "  -R, --rate           <Mbps>    "
+            "Send at this rate to measure capacity (ignores -D)\n");
     fprintf(stderr, "  -z, --packet-size    <bytes>   "
             "Size of datagrams to send (default %d)\n",
             DEFAULT_UDPSTREAM_PACKET_LENGTH);
@@ -128,7 +131,7 @@ amp_test_result_t* run_udpstream(int argc, char *argv[], int count,
 
     Log(LOG_DEBUG, "Starting udpstream test");
 
-    while ( (opt = getopt_long(argc, argv, "cd:D:n:p:P:r:sz:I:Q:Z:4::6::hvx",
+    while ( (opt = getopt_long(argc, argv, "cd:D:n:p:P:r:R:sz:I:Q:Z:4::6::hvx",
                     long_options, NULL)) != -1 ) {
         switch ( opt ) {
             case 's': server_flag_index = optind - 1; break;
@@ -190,5 +193,8 @@ test_t *register_test() {
     /* don't give the test a SIGINT warning, it should not take long! */
     new_test->sigint = 0;
 
+    /* keeps global state between runs, always run it in a new process */
+    new_test->reentrant = 0;
+
     return new_test;
 }
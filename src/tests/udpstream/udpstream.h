@@ -71,6 +71,17 @@
 #define UDPSTREAM_LOSS_TIMEOUT 2000000
 /* by default reflect every packet for an RTT sample */
 #define DEFAULT_UDPSTREAM_RTT_SAMPLES 1
+/* high rate streams are much larger, but still need some sensible limits */
+#define MAXIMUM_UDPSTREAM_PACKET_COUNT 1000000
+#define MAXIMUM_UDPSTREAM_RATE 10000
+/* reflecting every packet at high rates would double the load, sample less */
+#define DEFAULT_UDPSTREAM_RATE_RTT_SAMPLES 100
+/* most packets that can be sent in a single GSO buffer or sendmmsg() call */
+#define UDPSTREAM_MAX_BURST 64
+/* largest buffer that GRO will hand us, made up of many coalesced packets */
+#define UDPSTREAM_GRO_BUFFER_LEN 65535
+/* socket buffers need to be large to absorb bursts at high rates */
+#define UDPSTREAM_RATE_SOCKET_BUFFER (8 * 1024 * 1024)
 
 
 enum udpstream_schedule_direction {
@@ -99,12 +110,13 @@ struct opt_t {
     uint16_t cport; /* The control port to connect to */
     uint16_t tport; /* The test port to connect to or create */
     uint16_t packet_size;
-    uint16_t packet_count;
+    uint32_t packet_count;
     uint32_t packet_spacing;
     uint32_t percentile_count;
     uint32_t rtt_samples;
     uint8_t dscp;
     enum udpstream_schedule_direction direction;
+    uint32_t rate; /* Mbit/s to send at, 0 to use packet_spacing */
 };
 
 
@@ -158,11 +170,13 @@ void print_udpstream(amp_test_result_t *result);
 void usage(void);
 struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
         struct opt_t *options);
-int receive_udp_stream(int sock, struct opt_t *options, struct timeval *times);
+int receive_udp_stream(int sock, struct opt_t *options, struct timeval *times,
+        uint64_t *rate);
 Amplet2__Udpstream__SummaryStats* report_summary(struct summary_t *rtt);
 Amplet2__Udpstream__Voip* report_voip(Amplet2__Udpstream__Item *item);
 Amplet2__Udpstream__Item* report_stream(enum udpstream_direction direction,
-        struct summary_t *rtt, struct timeval *times, struct opt_t *options);
+        struct summary_t *rtt, struct timeval *times, struct opt_t *options,
+        uint64_t rate);
 
 ProtobufCBinaryData* build_hello(struct opt_t *options);
 void* parse_hello(ProtobufCBinaryData *data);
@@ -92,6 +92,8 @@ static amp_test_result_t* report_results(struct timeval *start_time,
     header.dscp = options->dscp;
     header.has_rtt_samples = 1;
     header.rtt_samples = options->rtt_samples;
+    header.has_rate = 1;
+    header.rate = options->rate;
 
     /* only report the results that are available */
     if ( local_report && server_report ) {
@@ -237,6 +239,7 @@ static amp_test_result_t* run_test(struct addrinfo *server,
     struct sockaddr_storage ss;
     socklen_t socklen = sizeof(ss);
     struct timeval *in_times = NULL;
+    uint64_t in_rate = 0;
     struct test_request_t *schedule = NULL, *current;
     ProtobufCBinaryData data;
     Amplet2__Udpstream__Item *remote_results = NULL, *local_results = NULL;
@@ -309,7 +312,7 @@ static amp_test_result_t* run_test(struct addrinfo *server,
                         build_send(options));
 
                 /* wait for the data stream from the server */
-                receive_udp_stream(test_socket, options, in_times);
+                receive_udp_stream(test_socket, options, in_times, &in_rate);
 
                 /* wait for the rtt for the stream we just sent */
                 if ( read_control_result(AMP_TEST_UDPSTREAM, ctrl,
@@ -320,7 +323,7 @@ static amp_test_result_t* run_test(struct addrinfo *server,
                 Log(LOG_DEBUG, "Merging remote RTT calculations with results");
                 remote_rtt = extract_summary(&data);
                 local_results = report_stream(UDPSTREAM_TO_CLIENT, remote_rtt,
-                        in_times, options);
+                        in_times, options, in_rate);
                 free(data.data);
                 free(remote_rtt);
                 break;
@@ -361,6 +364,7 @@ amp_test_result_t* run_udpstream_client(int argc, char *argv[], int count,
     char *address_string;
     int forcev4 = 0;
     int forcev6 = 0;
+    int rtt_samples_set = 0;
 
     /* set some sensible defaults */
     memset(&sockopts, 0, sizeof(sockopts));
@@ -374,10 +378,11 @@ amp_test_result_t* run_udpstream_client(int argc, char *argv[], int count,
     //test_options.perturbate = 0;
     test_options.direction = CLIENT_THEN_SERVER;
     test_options.rtt_samples = DEFAULT_UDPSTREAM_RTT_SAMPLES;
+    test_options.rate = 0;
 
     client = NULL;
 
-    while ( (opt = getopt_long(argc, argv, "c:d:D:p:P:r:n:z:I:Q:Z:4::6::hx",
+    while ( (opt = getopt_long(argc, argv, "c:d:D:p:P:r:R:n:z:I:Q:Z:4::6::hx",
                     long_options, NULL)) != -1 ) {
         switch ( opt ) {
             case '4': forcev4 = 1;
@@ -406,7 +411,10 @@ amp_test_result_t* run_udpstream_client(int argc, char *argv[], int count,
             case 'D': test_options.packet_spacing = atoi(optarg); break;
             case 'p': test_options.cport = atoi(optarg); break;
             case 'P': test_options.tport = atoi(optarg); break;
-            case 'r': test_options.rtt_samples = atoi(optarg); break;
+            case 'r': test_options.rtt_samples = atoi(optarg);
+                      rtt_samples_set = 1;
+                      break;
+            case 'R': test_options.rate = atoi(optarg); break;
             case 'n': test_options.packet_count = atoi(optarg); break;
             case 'z': test_options.packet_size = atoi(optarg); break;
             case 'x': log_level = LOG_DEBUG;
@@ -489,6 +497,13 @@ amp_test_result_t* run_udpstream_client(int argc, char *argv[], int count,
         test_options.packet_count = MINIMUM_UDPSTREAM_PACKET_COUNT;
     }
 
+    /* make sure that the stream isn't too long to keep track of */
+    if ( test_options.packet_count > MAXIMUM_UDPSTREAM_PACKET_COUNT ) {
+        Log(LOG_WARNING, "Packet count %d above maximum, lowering to %d",
+                test_options.packet_count, MAXIMUM_UDPSTREAM_PACKET_COUNT);
+        test_options.packet_count = MAXIMUM_UDPSTREAM_PACKET_COUNT;
+    }
+
     /* make sure that the packet size is big enough for our data */
     if ( test_options.packet_size < MINIMUM_UDPSTREAM_PACKET_LENGTH ) {
 	Log(LOG_WARNING, "Packet size %d below minimum, raising to %d",
@@ -503,6 +518,25 @@ amp_test_result_t* run_udpstream_client(int argc, char *argv[], int count,
 	test_options.packet_size = MAXIMUM_UDPSTREAM_PACKET_LENGTH;
     }
 
+    /*
+     * A high rate stream ignores the packet spacing and sends as fast as
+     * needed to reach the target rate, sampling fewer rtt packets unless
+     * told otherwise so that reflections don't double the load.
+     */
+    if ( test_options.rate > 0 ) {
+        if ( test_options.rate > MAXIMUM_UDPSTREAM_RATE ) {
+            Log(LOG_WARNING, "Rate %dMbps above maximum, lowering to %dMbps",
+                    test_options.rate, MAXIMUM_UDPSTREAM_RATE);
+            test_options.rate = MAXIMUM_UDPSTREAM_RATE;
+        }
+        /* packet size in bits divided by Mbps gives microseconds */
+        test_options.packet_spacing =
+            test_options.packet_size * 8 / test_options.rate;
+        if ( !rtt_samples_set ) {
+            test_options.rtt_samples = DEFAULT_UDPSTREAM_RATE_RTT_SAMPLES;
+        }
+    }
+
     /* make sure we are sampling a vaguely sensible number of rtt packets */
     if ( test_options.rtt_samples > test_options.packet_count ) {
 	Log(LOG_WARNING, "RTT samples %d above packet count, clamping to %d",
@@ -565,9 +599,9 @@ end:
         gettimeofday(&start_time, NULL);
         /* no valid destination, report an empty result */
         local_results = report_stream(UDPSTREAM_TO_CLIENT, NULL, NULL,
-                &test_options);
+                &test_options, 0);
         remote_results = report_stream(UDPSTREAM_TO_SERVER, NULL, NULL,
-                &test_options);
+                &test_options, 0);
         result = report_results(&start_time, dests[0], &test_options,
                 local_results, remote_results);
     }
@@ -619,6 +653,10 @@ static void print_item(Amplet2__Udpstream__Item *item, uint32_t packet_count) {
             packet_count, item->packets_received,
             100 - ((double)item->packets_received / (double)packet_count*100));
 
+    if ( item->has_rate ) {
+        printf("      received at %.02f Mbps\n", item->rate / 1000000.0);
+    }
+
     if ( item->rtt && item->rtt->samples > 0 ) {
         printf("      %d rtt samples min/mean/max = %.03f/%.03f/%.03f ms\n",
                 item->rtt->samples, item->rtt->minimum/1000.0,
@@ -695,6 +733,9 @@ void print_udpstream(amp_test_result_t *result) {
             msg->header->packet_count, msg->header->packet_size,
             msg->header->packet_spacing, dscp_to_str(msg->header->dscp),
             msg->header->dscp);
+    if ( msg->header->rate > 0 ) {
+        printf("target rate:%" PRIu32 "Mbps\n", msg->header->rate);
+    }
 
     /* print the individual test runs in each direction */
     for ( i=0; i < msg->n_reports; i++ ) {
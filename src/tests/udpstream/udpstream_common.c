@@ -77,6 +77,8 @@ ProtobufCBinaryData* build_hello(struct opt_t *options) {
     hello.dscp = options->dscp;
     hello.has_rtt_samples = 1;
     hello.rtt_samples = options->rtt_samples;
+    hello.has_rate = 1;
+    hello.rate = options->rate;
 
     data->len = amplet2__udpstream__hello__get_packed_size(&hello);
     data->data = malloc(data->len);
@@ -96,18 +98,54 @@ void* parse_hello(ProtobufCBinaryData *data) {
     Amplet2__Udpstream__Hello *hello;
 
     hello = amplet2__udpstream__hello__unpack(NULL, data->len, data->data);
+    if ( hello == NULL ) {
+        Log(LOG_WARNING, "Failed to unpack udpstream HELLO options");
+        return NULL;
+    }
+
     options = calloc(1, sizeof(struct opt_t));
 
     options->tport = hello->test_port;
-    options->packet_size = hello->packet_size;
+    /* don't let oversized packets wrap around to look like a valid size */
+    options->packet_size = MIN(hello->packet_size, UINT16_MAX);
     options->packet_count = hello->packet_count;
     options->packet_spacing = hello->packet_spacing;
     options->percentile_count = hello->percentile_count;
     options->dscp = hello->dscp;
     options->rtt_samples = hello->rtt_samples;
+    options->rate = hello->rate;
 
     amplet2__udpstream__hello__free_unpacked(hello, NULL);
 
+    /*
+     * The server allocates space to track every packet in the stream, so
+     * apply the same limits as the client rather than trusting the remote
+     * end to have done so.
+     */
+    if ( options->packet_count > MAXIMUM_UDPSTREAM_PACKET_COUNT ) {
+        Log(LOG_WARNING, "Packet count %u above maximum, lowering to %d",
+                options->packet_count, MAXIMUM_UDPSTREAM_PACKET_COUNT);
+        options->packet_count = MAXIMUM_UDPSTREAM_PACKET_COUNT;
+    }
+
+    if ( options->packet_size < MINIMUM_UDPSTREAM_PACKET_LENGTH ) {
+        Log(LOG_WARNING, "Packet size %d below minimum, raising to %d",
+                options->packet_size, MINIMUM_UDPSTREAM_PACKET_LENGTH);
+        options->packet_size = MINIMUM_UDPSTREAM_PACKET_LENGTH;
+    }
+
+    if ( options->packet_size > MAXIMUM_UDPSTREAM_PACKET_LENGTH ) {
+        Log(LOG_WARNING, "Packet size %d above maximum, lowering to %d",
+                options->packet_size, MAXIMUM_UDPSTREAM_PACKET_LENGTH);
+        options->packet_size = MAXIMUM_UDPSTREAM_PACKET_LENGTH;
+    }
+
+    if ( options->rate > MAXIMUM_UDPSTREAM_RATE ) {
+        Log(LOG_WARNING, "Rate %uMbps above maximum, lowering to %dMbps",
+                options->rate, MAXIMUM_UDPSTREAM_RATE);
+        options->rate = MAXIMUM_UDPSTREAM_RATE;
+    }
+
     return options;
 }
 
@@ -158,82 +196,204 @@ void* parse_send(ProtobufCBinaryData *data) {
  * as a response to our probes. Compare the arrival timestamp with the sending
  * timestamp and update the RTT statistics.
  */
-static void receive_reflected_packets(struct socket_t *sockets, int wait,
-        uint32_t expected, struct summary_t *rtt) {
-    ssize_t bytes;
-    struct timeval now;
-    char response[MAXIMUM_UDPSTREAM_PACKET_LENGTH];
+static void receive_reflected_packets(int epfd, struct socket_t *sockets,
+        struct packet_batch_t *batch, int wait, uint32_t expected,
+        struct summary_t *rtt) {
     static double mean = 0;
+    int i;
 
     assert(sockets);
+    assert(batch);
     assert(rtt);
     assert(expected > 0);
 
     /* TODO timing won't be super accurate, but good enough for now */
     while ( expected > rtt->samples &&
-            (bytes = get_packet(sockets, response,
-                                MAXIMUM_UDPSTREAM_PACKET_LENGTH,
-                                NULL, &wait, &now)) > 0 ) {
-        struct payload_t *recv_payload;
-        struct timeval sent_time;
-        uint32_t value;
-        double delta;
-
-        //XXX check that this is actually a related packet
-
-        recv_payload = (struct payload_t*)&response;
-        /* this should cast appropriately whether 32 or 64 bit */
-        sent_time.tv_sec = (time_t)be64toh(recv_payload->sec);
-        sent_time.tv_usec = (time_t)be64toh(recv_payload->usec);
-        value = DIFF_TV_US(now, sent_time);
-        if ( value > rtt->maximum ) {
-            rtt->maximum = value;
-        }
-        if ( value < rtt->minimum ) {
-            rtt->minimum = value;
+            get_packets(epfd, sockets, batch, &wait) > 0 ) {
+        for ( i = 0; i < batch->count && expected > rtt->samples; i++ ) {
+            struct payload_t *recv_payload;
+            struct timeval sent_time;
+            uint32_t value;
+            double delta;
+
+            //XXX check that this is actually a related packet
+
+            recv_payload = (struct payload_t*)batch->packets[i].data;
+            /* this should cast appropriately whether 32 or 64 bit */
+            sent_time.tv_sec = (time_t)be64toh(recv_payload->sec);
+            sent_time.tv_usec = (time_t)be64toh(recv_payload->usec);
+            value = DIFF_TV_US(batch->packets[i].time, sent_time);
+            if ( value > rtt->maximum ) {
+                rtt->maximum = value;
+            }
+            if ( value < rtt->minimum ) {
+                rtt->minimum = value;
+            }
+            rtt->samples++;
+            delta = (double)value - mean;
+            mean += delta / rtt->samples;
         }
-        rtt->samples++;
-        delta = (double)value - mean;
-        mean += delta / rtt->samples;
     }
 
     rtt->mean = (uint32_t)round(mean);
 }
 
 
+
+/*
+ * Get the number of bytes of UDP payload in a packet of the given total size
+ * (including IP and UDP headers) sent to or received from the given address.
+ */
+static size_t get_payload_length(struct sockaddr *address,
+        uint16_t packet_size) {
+    size_t headers = sizeof(struct udphdr);
+
+    if ( address->sa_family == AF_INET6 && !IN6_IS_ADDR_V4MAPPED(
+                &((struct sockaddr_in6*)address)->sin6_addr) ) {
+        headers += sizeof(struct ip6_hdr);
+    } else {
+        headers += sizeof(struct iphdr);
+    }
+
+    if ( packet_size < headers ) {
+        return 0;
+    }
+
+    return packet_size - headers;
+}
+
+
+
+/*
+ * Send a burst of count packets, each of length bytes, that are stored one
+ * after another in the buffer. If UDP GSO is available then the whole burst
+ * is given to the kernel as a single buffer to be split into packets,
+ * otherwise the packets are sent with a single call to sendmmsg().
+ */
+static int send_burst(int sock, struct addrinfo *remote, char *buffer,
+        size_t length, int count, int *gso) {
+    struct mmsghdr msgs[UDPSTREAM_MAX_BURST];
+    struct iovec iov[UDPSTREAM_MAX_BURST];
+    int sent, result, i;
+
+    assert(count > 0 && count <= UDPSTREAM_MAX_BURST);
+
+#ifdef HAVE_UDP_GSO
+    if ( *gso && count > 1 ) {
+        struct msghdr msg;
+        struct iovec gso_iov;
+        struct cmsghdr *c;
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        uint16_t segment = length;
+
+        memset(&msg, 0, sizeof(msg));
+        memset(control, 0, sizeof(control));
+
+        gso_iov.iov_base = buffer;
+        gso_iov.iov_len = length * count;
+
+        msg.msg_name = remote->ai_addr;
+        msg.msg_namelen = remote->ai_addrlen;
+        msg.msg_iov = &gso_iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_UDP;
+        c->cmsg_type = UDP_SEGMENT;
+        c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(c), &segment, sizeof(segment));
+
+        if ( sendmsg(sock, &msg, 0) >= 0 ) {
+            return count;
+        }
+
+        /* any other error is a real failure to send, not a lack of GSO */
+        if ( errno != EIO && errno != EINVAL && errno != ENOPROTOOPT &&
+                errno != EOPNOTSUPP ) {
+            return -1;
+        }
+
+        Log(LOG_DEBUG, "UDP GSO unavailable (%s), falling back to sendmmsg",
+                strerror(errno));
+        *gso = 0;
+    }
+#endif
+
+    memset(msgs, 0, sizeof(msgs));
+    for ( i = 0; i < count; i++ ) {
+        iov[i].iov_base = buffer + (i * length);
+        iov[i].iov_len = length;
+        msgs[i].msg_hdr.msg_name = remote->ai_addr;
+        msgs[i].msg_hdr.msg_namelen = remote->ai_addrlen;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for ( sent = 0; sent < count; sent += result ) {
+        if ( (result = sendmmsg(sock, msgs + sent, count - sent, 0)) < 0 ) {
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+
+
 /*
  * Send a stream of UDP packets towards the remote target, with the given
  * test options (size, spacing and count).
+ *
+ * Packets are sent at absolute deadlines on the monotonic clock, so the time
+ * spent sending and checking for reflected packets doesn't accumulate and
+ * stretch the gaps between them. A high rate stream sends a burst of
+ * packets at each deadline (using GSO where possible) rather than a single
+ * packet, which keeps the average rate exact without waking for every packet.
  */
 struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
         struct opt_t *options) {
     struct timeval now;
     struct payload_t *payload;
+    char *buffer;
     size_t payload_len;
-    uint32_t i;
+    uint32_t i, j, count, burst;
+    uint32_t expected = 0;
+    uint64_t start, interval, deadline, current;
     struct socket_t sockets;
     struct summary_t *rtt = NULL;
+    struct packet_batch_t *batch = NULL;
+    int epfd = -1;
+    int gso = 0;
 
-    Log(LOG_DEBUG, "Sending UDP stream, packets:%d size:%d spacing:%d",
+    Log(LOG_DEBUG, "Sending UDP stream, packets:%d size:%d spacing:%d rate:%d",
             options->packet_count, options->packet_size,
-            options->packet_spacing);
+            options->packet_spacing, options->rate);
 
     /* wrap the socket in a socket_t so we can call other amp functions */
     memset(&sockets, 0, sizeof(sockets));
     switch ( remote->ai_family ) {
         case AF_INET:
             sockets.socket = sock;
-            payload_len = options->packet_size - sizeof(struct iphdr);
             break;
         case AF_INET6:
             sockets.socket6 = sock;
-            payload_len = options->packet_size - sizeof(struct ip6_hdr);
             break;
         default:
             Log(LOG_ERR,"Unknown address family %d",remote->ai_family);
             return NULL;
     };
 
+    //XXX put a pattern in the payload?
+    /* the packet size option includes headers, so subtract them */
+    payload_len = get_payload_length(remote->ai_addr, options->packet_size);
+    if ( payload_len < sizeof(struct payload_t) ) {
+        Log(LOG_ERR, "Packet size %d is too small, aborting test",
+                options->packet_size);
+        return NULL;
+    }
+
     if ( options->dscp ) {
         if ( set_dscp_socket_options(&sockets, options->dscp) < 0 ) {
             Log(LOG_ERR, "Failed to set DSCP socket options, aborting test");
@@ -242,53 +402,97 @@ struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
     }
 
     if ( options->rtt_samples > 0 ) {
+        if ( (epfd = create_packet_poll(&sockets)) < 0 ) {
+            Log(LOG_ERR, "Failed to wait for reflected packets, aborting test");
+            return NULL;
+        }
+        batch = new_packet_batch(PACKET_BATCH_SIZE,
+                MAXIMUM_UDPSTREAM_PACKET_LENGTH);
         rtt = calloc(1, sizeof(struct summary_t));
         rtt->minimum = UINT32_MAX;
+        expected = options->packet_count / options->rtt_samples;
     }
 
-    //XXX put a pattern in the payload?
-    /* the packet size option includes headers, so subtract them */
-    payload_len -= sizeof(struct udphdr);
-    payload = (struct payload_t *)calloc(1, payload_len);
+    if ( options->rate > 0 ) {
+        int size = UDPSTREAM_RATE_SOCKET_BUFFER;
+
+        /* nanoseconds per packet so that packet_size bytes go at the rate */
+        interval = (uint64_t)options->packet_size * 8 * 1000 / options->rate;
+
+        /* a burst needs to fit within the largest possible UDP datagram */
+        burst = MIN(UDPSTREAM_MAX_BURST,
+                (UDPSTREAM_GRO_BUFFER_LEN - options->packet_size) /
+                payload_len);
+        gso = 1;
+
+        if ( setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size,
+                    sizeof(size)) < 0 ) {
+            Log(LOG_DEBUG, "Failed to set send buffer size: %s",
+                    strerror(errno));
+        }
+    } else {
+        interval = (uint64_t)options->packet_spacing * 1000;
+        burst = 1;
+    }
+
+    buffer = calloc(burst, payload_len);
+
+    start = monotonic_ns();
+
+    for ( i = 0; i < options->packet_count; i += count ) {
+        count = MIN(burst, options->packet_count - i);
+
+        /* a burst is due when the last packet in it should have been sent */
+        deadline = start + ((i + count - 1) * interval);
+
+        /*
+         * Check for any reflected packets while waiting, but stop a little
+         * early so that the send deadline isn't overshot by the receive.
+         */
+        if ( rtt && expected > rtt->samples ) {
+            current = monotonic_ns();
+            if ( deadline > current + (SEND_QUEUE_SPIN_US * 1000) ) {
+                receive_reflected_packets(epfd, &sockets, batch,
+                        ((deadline - current) / 1000) - SEND_QUEUE_SPIN_US,
+                        expected, rtt);
+            }
+        }
+
+        wait_until(deadline);
 
-    for ( i = 0; i < options->packet_count; i++ ) {
         gettimeofday(&now, NULL);
-        payload->index = htonl(i);
-        /* this should cast appropriately whether 32 or 64 bit*/
-        payload->sec = htobe64(now.tv_sec);
-        payload->usec = htobe64(now.tv_usec);
+        for ( j = 0; j < count; j++ ) {
+            payload = (struct payload_t *)(buffer + (j * payload_len));
+            payload->index = htonl(i + j);
+            /* this should cast appropriately whether 32 or 64 bit*/
+            payload->sec = htobe64(now.tv_sec);
+            payload->usec = htobe64(now.tv_usec);
+        }
 
-        if ( sendto(sock, payload, payload_len, 0,
-                    remote->ai_addr, remote->ai_addrlen) < 0 ) {
+        if ( send_burst(sock, remote, buffer, payload_len, count, &gso) < 0 ) {
             Log(LOG_WARNING, "Error sending udpstream packet: %s",
                     strerror(errno));
             if ( rtt ) {
+                free_packet_batch(batch);
+                close(epfd);
                 free(rtt);
             }
+            free(buffer);
             return NULL;
         }
-
-        /* XXX subtract time from the amount we wait between packets? */
-        if ( options->rtt_samples > 0 ) {
-            /*
-             * After sending the packet, check briefly for any reflected
-             * packets before sending the next one.
-             */
-             receive_reflected_packets(&sockets, options->packet_spacing,
-                     (uint32_t)(options->packet_count / options->rtt_samples),
-                     rtt);
-        } else {
-            usleep(options->packet_spacing);
-        }
     }
 
-    if ( options->rtt_samples > 0 ) {
+    if ( rtt ) {
         /* do a final wait for any packets that haven't yet arrived */
-        receive_reflected_packets(&sockets, UDPSTREAM_LOSS_TIMEOUT,
-                (uint32_t)(options->packet_count / options->rtt_samples), rtt);
+        if ( expected > rtt->samples ) {
+            receive_reflected_packets(epfd, &sockets, batch,
+                    UDPSTREAM_LOSS_TIMEOUT, expected, rtt);
+        }
+        free_packet_batch(batch);
+        close(epfd);
     }
 
-    free(payload);
+    free(buffer);
 
     return rtt;
 }
@@ -297,18 +501,26 @@ struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
 
 /*
  * Receive a stream of UDP packets, expecting the specified number of packets.
+ * If rate is not NULL then it will be set to the rate (in bits per second)
+ * that the packets arrived at.
  */
-int receive_udp_stream(int sock, struct opt_t *options, struct timeval *times) {
-    char buffer[MAXIMUM_UDPSTREAM_PACKET_LENGTH];
+int receive_udp_stream(int sock, struct opt_t *options, struct timeval *times,
+        uint64_t *rate) {
     int timeout;
     uint32_t i;
-    struct timeval sent_time, recv_time;
+    int j;
+    struct timeval sent_time, first, last;
     struct socket_t sockets;
     struct payload_t *payload;
+    struct packet_batch_t *batch;
+    struct packet_t *packet;
     struct sockaddr_storage ss;
     socklen_t socklen;
-    ssize_t bytes;
     uint32_t index;
+    uint32_t received = 0;
+    size_t payload_len, length, offset;
+    int buflen = MAXIMUM_UDPSTREAM_PACKET_LENGTH;
+    int epfd;
 
     socklen = sizeof(ss);
     getsockname(sock, (struct sockaddr *)&ss, &socklen);
@@ -316,28 +528,87 @@ int receive_udp_stream(int sock, struct opt_t *options, struct timeval *times) {
     sockets.socket = sock;
     sockets.socket6 = -1;
 
+    if ( (epfd = create_packet_poll(&sockets)) < 0 ) {
+        Log(LOG_WARNING, "Failed to wait for UDP stream packets");
+        return -1;
+    }
+
+    if ( options->rate > 0 ) {
+        int size = UDPSTREAM_RATE_SOCKET_BUFFER;
+
+        if ( setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size,
+                    sizeof(size)) < 0 ) {
+            Log(LOG_DEBUG, "Failed to set receive buffer size: %s",
+                    strerror(errno));
+        }
+
+#ifdef HAVE_UDP_GSO
+        /* let the kernel coalesce packets so each read returns many */
+        size = 1;
+        if ( setsockopt(sock, SOL_UDP, UDP_GRO, &size, sizeof(size)) < 0 ) {
+            Log(LOG_DEBUG, "Failed to enable UDP GRO: %s", strerror(errno));
+        } else {
+            buflen = UDPSTREAM_GRO_BUFFER_LEN;
+        }
+#endif
+    }
+
+    batch = new_packet_batch(PACKET_BATCH_SIZE, buflen);
+
     Log(LOG_DEBUG, "Receiving UDP stream, packets:%d", options->packet_count);
 
-    for ( i = 0; i < options->packet_count; i++ ) {
-        /* reset timeout per packet, consider some global timer also? */
+    i = 0;
+    while ( i < options->packet_count ) {
+        /* reset timeout per batch, consider some global timer also? */
         timeout = UDPSTREAM_LOSS_TIMEOUT;
 
-        if ( (bytes = get_packet(&sockets, buffer, sizeof(buffer),
-                        (struct sockaddr*)&ss, &timeout, &recv_time)) > 0 ) {
+        if ( get_packets(epfd, &sockets, batch, &timeout) <= 0 ) {
+            Log(LOG_DEBUG, "UDP stream packet didn't arrive in time");
+            /* high rate streams are over once packets stop arriving */
+            if ( options->rate > 0 ) {
+                break;
+            }
+            i++;
+            continue;
+        }
 
-            payload = (struct payload_t*)&buffer;
+        for ( j = 0; j < batch->count && i < options->packet_count; j++ ) {
+            packet = &batch->packets[j];
 
-            /* get the packet index number so we record it correctly */
-            index = ntohl(payload->index);
+            /*
+             * With GRO enabled a single buffer can hold many packets from
+             * the stream, each of the same size except possibly the last.
+             */
+            payload_len = get_payload_length(
+                    (struct sockaddr*)&packet->from, options->packet_size);
+            if ( payload_len < sizeof(struct payload_t) ) {
+                payload_len = packet->length;
+            }
+
+            for ( offset = 0; offset < (size_t)packet->length &&
+                    i < options->packet_count; offset += payload_len, i++ ) {
+                payload = (struct payload_t*)(packet->data + offset);
+                length = MIN(payload_len, packet->length - offset);
+
+                if ( length < sizeof(struct payload_t) ) {
+                    continue;
+                }
+
+                /* get the packet index number so we record it correctly */
+                index = ntohl(payload->index);
+
+                /* TODO better checks that the packet belongs to our stream? */
+                if ( index >= options->packet_count ) {
+                    continue;
+                }
 
-            /* TODO better checks that the packet belongs to our stream? */
-            if ( index < options->packet_count ) {
                 /* check if we need to reflect this packet */
                 if ( options->rtt_samples > 0 &&
                         index % options->rtt_samples == 0 ) {
                     /* reflect the packet back for rtt measurements */
-                    if ( sendto(sock, buffer, bytes, 0,
-                                (struct sockaddr*)&ss, socklen) < 0 ) {
+                    if ( sendto(sock, payload, length, 0,
+                                (struct sockaddr*)&packet->from,
+                                socklen) < 0 ) {
                         Log(LOG_DEBUG, "Error reflecting udpstream packet: %s",
                                 strerror(errno));
                     }
@@ -346,14 +617,30 @@ int receive_udp_stream(int sock, struct opt_t *options, struct timeval *times) {
                 /* this should cast appropriately whether 32 or 64 bit */
                 sent_time.tv_sec = (time_t)be64toh(payload->sec);
                 sent_time.tv_usec = (time_t)be64toh(payload->usec);
-                timersub(&recv_time, &sent_time, &times[index]);
+                timersub(&packet->time, &sent_time, &times[index]);
                 Log(LOG_DEBUG, "Got UDP stream packet %d (id:%d)", i, index);
+
+                if ( received == 0 ) {
+                    first = packet->time;
+                }
+                last = packet->time;
+                received++;
             }
-        } else {
-            Log(LOG_DEBUG, "UDP stream packet didn't arrive in time");
         }
     }
 
+    if ( rate ) {
+        *rate = 0;
+        /* the time between the first and last arrivals covers n-1 packets */
+        if ( received > 1 && timercmp(&last, &first, >) ) {
+            *rate = (uint64_t)(received - 1) * options->packet_size * 8 *
+                1000000 / DIFF_TV_US(last, first);
+        }
+    }
+
+    free_packet_batch(batch);
+    close(epfd);
+
     return 0;
 }
 
@@ -477,14 +764,15 @@ Amplet2__Udpstream__SummaryStats* report_summary(struct summary_t *summary) {
  * VoIP statistics, loss periods etc.
  */
 Amplet2__Udpstream__Item* report_stream(enum udpstream_direction direction,
-        struct summary_t *rtt, struct timeval *times, struct opt_t *options) {
+        struct summary_t *rtt, struct timeval *times, struct opt_t *options,
+        uint64_t rate) {
 
     Amplet2__Udpstream__Item *item =
         (Amplet2__Udpstream__Item*)malloc(sizeof(Amplet2__Udpstream__Item));
     uint32_t i;
     uint32_t received = 0;
     int32_t current = 0, prev = 0;
-    int32_t ipdv[options->packet_count];
+    int32_t *ipdv;
     int loss_runs = 0;
     Amplet2__Udpstream__Period *period = NULL;
     struct summary_t jitter;
@@ -506,6 +794,13 @@ Amplet2__Udpstream__Item* report_stream(enum udpstream_direction direction,
         return item;
     }
 
+    /* high rate streams can be too large to keep this on the stack */
+    if ( (ipdv = calloc(options->packet_count, sizeof(int32_t))) == NULL ) {
+        Log(LOG_WARNING, "Failed to allocate space for %u packets",
+                options->packet_count);
+        return item;
+    }
+
     for ( i = 0; i < options->packet_count; i++ ) {
         //XXX this check doesn't properly work to prevent unset timevals?
         if ( !timerisset(&times[i]) ) {
@@ -570,14 +865,19 @@ Amplet2__Udpstream__Item* report_stream(enum udpstream_direction direction,
     item->loss_percent = 100 - ((double)item->packets_received /
             (double)options->packet_count*100);
 
+    if ( rate > 0 ) {
+        item->has_rate = 1;
+        item->rate = rate;
+    }
 
     /* no useful delay variance, not enough packets arrived */
     if ( jitter.samples == 0 ) {
+        free(ipdv);
         return item;
     }
 
     /* at least two packets arrived - we have one delay variance measurement */
-    qsort(&ipdv, jitter.samples, sizeof(int32_t), cmp);
+    qsort(ipdv, jitter.samples, sizeof(int32_t), cmp);
     jitter.maximum = ipdv[jitter.samples - 1];
     jitter.minimum = ipdv[0];
     jitter.mean = mean;
@@ -601,6 +901,8 @@ Amplet2__Udpstream__Item* report_stream(enum udpstream_direction direction,
             (jitter.samples / item->n_percentiles * (i+1)) - 1];
     }
 
+    free(ipdv);
+
     /*
      * If we have an rtt then we can calculate MOS scores. This will generally
      * only happen on the client before reporting because the server doesn't
@@ -70,20 +70,26 @@ static void do_receive(BIO *ctrl, int test_sock, struct opt_t *options) {
     Amplet2__Udpstream__Item *result;
     ProtobufCBinaryData packed;
     struct timeval *times = NULL;
+    uint64_t rate;
 
     Log(LOG_DEBUG, "got RECEIVE command");
 
     /* we are going to track a timeval for every expected packet */
-    times = calloc(options->packet_count, sizeof(struct timeval));
+    if ( (times = calloc(options->packet_count,
+                    sizeof(struct timeval))) == NULL ) {
+        Log(LOG_WARNING, "Failed to allocate space for %u packets",
+                options->packet_count);
+        return;
+    }
 
     /* tell the client what port the test server is running on */
     send_control_ready(AMP_TEST_UDPSTREAM, ctrl, options->tport);
 
     /* wait for the data stream from the client */
-    receive_udp_stream(test_sock, options, times);
+    receive_udp_stream(test_sock, options, times, &rate);
 
     /* build a protobuf message containing our side of the results */
-    result = report_stream(UDPSTREAM_TO_SERVER, NULL, times, options);
+    result = report_stream(UDPSTREAM_TO_SERVER, NULL, times, options, rate);
 
     /* pack the result for sending to the client */
     packed.len = amplet2__udpstream__item__get_packed_size(result);
@@ -185,7 +191,7 @@ static int serve_test(BIO *ctrl, struct sockopt_t *sockopts) {
 
     /* the HELLO packet describes all the global test options */
     if ( read_control_hello(AMP_TEST_UDPSTREAM, ctrl, (void**)&options,
-                parse_hello) < 0 ) {
+                parse_hello) < 0 || options == NULL ) {
         Log(LOG_WARNING, "Got bad HELLO packet, shutting down test server");
         return -1;
     }
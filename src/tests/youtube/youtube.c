@@ -606,6 +606,9 @@ test_t *register_test() {
     /* don't give the test a SIGINT warning, partial data isn't useful */
     new_test->sigint = 0;
 
+    /* keeps global state between runs, always run it in a new process */
+    new_test->reentrant = 0;
+
     return new_test;
 }
 